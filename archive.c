@@ -0,0 +1,1081 @@
+// Gopher - In-process archive creation
+//
+// Writes .zip, .tar.gz and .tar.xz itself, with zlib and liblzma,
+// instead of running zip or tar, so that compression keeps every core
+// busy. The output is plain enough for unzip, tar, gzip and xz to read.
+//
+// Deflate is split up the way pigz does it. The data is cut into blocks
+// that are compressed at the same time, each one primed with the end of
+// the block before it and ended with a sync flush, so that their output
+// joins into a single stream. The CRC is put together afterwards with
+// crc32_combine(). A .tar.gz is one such stream over the whole tar, and
+// so is every big file of a zip. Small zip members are compressed whole,
+// a batch of them at a time. xz uses the threaded encoder of liblzma.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <lzma.h>
+
+#include "archive.h"
+
+#define ARCHIVE_BLOCK (1024 * 1024)           // deflate input per block
+#define ARCHIVE_DICT 32768                    // primed from the block before
+#define ARCHIVE_MAX_BLOCKS 64
+#define ARCHIVE_SMALL (1024 * 1024)           // zip files up to this are batched
+#define ARCHIVE_BATCH_BYTES (32 * 1024 * 1024)
+#define ARCHIVE_BATCH_FILES 1024
+#define ARCHIVE_XZ_MEMORY (1024ULL * 1024 * 1024)
+#define ZIP64_LIMIT 0xFFFFFFFFULL
+#define ZIP64_BIG 0xF0000000ULL               // files this big get zip64 local headers
+
+// One block of a deflate stream
+typedef struct {
+  unsigned char * in;
+  size_t len;
+  unsigned char * out;
+  size_t outlen;
+  size_t outcap;
+  uint32_t crc;
+  int last;
+} deflate_block;
+
+// A zip member, kept for the central directory
+typedef struct {
+  char * name;            // NULL if it was left out
+  int method;
+  uint32_t crc;
+  uint64_t csize;
+  uint64_t usize;
+  uint64_t offset;        // of the local header
+  mode_t mode;
+  time_t mtime;
+} zip_record;
+
+// A small zip file, read and compressed on the pool
+typedef struct {
+  char * rel;             // path from the root directory
+  int rec;
+  size_t size;
+  unsigned char * data;   // what goes in the archive
+  int err;
+} zip_small;
+
+// A file with more than one link, stored in a tar only once
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  char * name;
+} tar_link;
+
+typedef struct {
+  int fd;                 // the archive
+  archive_type type;
+  work_pool * pool;
+  op_progress * prog;
+  int rootfd;             // directory holding the tree
+  dev_t dest_dev;
+  ino_t dest_ino;
+  uint64_t offset;        // bytes written so far
+  int error;              // errno of a failed write, which ends it all
+
+  deflate_block * blocks;
+  int nblocks;            // compressed at once
+  int cur;                // being filled
+  unsigned char * dict;   // end of the last block written
+  size_t dictlen;
+  uint32_t crc;           // of the stream so far
+  uint64_t usize;
+  uint64_t csize;
+
+  lzma_stream x;
+  unsigned char * xin;
+  size_t xlen;
+  unsigned char * xout;
+
+  tar_link * links;
+  int nlinks;
+  int links_cap;
+
+  zip_record * recs;
+  int nrecs;
+  int recs_cap;
+  zip_small * batch;
+  int nbatch;
+  int batch_cap;
+  size_t batch_bytes;
+} archive_ctx;
+
+static void put16(unsigned char * p, uint16_t v){
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put32(unsigned char * p, uint32_t v){
+  put16(p, v);
+  put16(p + 2, v >> 16);
+}
+
+static void put64(unsigned char * p, uint64_t v){
+  put32(p, v);
+  put32(p + 4, v >> 32);
+}
+
+static void * xmalloc(size_t size){
+  void * p = malloc(size);
+  if (p == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  return p;
+}
+
+static char * xstrdup(const char * s){
+  char * p = strdup(s);
+  if (p == NULL){
+    perror("strdup");
+    exit(errno);
+  }
+  return p;
+}
+
+const char * archive_suffix(archive_type type){
+  switch (type){
+  case ARCHIVE_TAR_GZ:
+    return ".tar.gz";
+  case ARCHIVE_TAR_XZ:
+    return ".tar.xz";
+  default:
+    return ".zip";
+  }
+}
+
+static int out_write(archive_ctx * ctx, const void * data, size_t len){
+  const char * p = data;
+  ssize_t n;
+
+  if (ctx->error) return -1;
+  while (len){
+    if ((n = write(ctx->fd, p, len)) < 0){
+      if (errno == EINTR) continue;
+      ctx->error = errno;
+      return -1;
+    }
+    p += n;
+    len -= n;
+    ctx->offset += n;
+  }
+  return 0;
+}
+
+// Reads up to len bytes, fewer only at the end of the file
+static ssize_t read_full(int fd, void * buf, size_t len){
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len){
+    if ((n = read(fd, (char *) buf + done, len - done)) < 0){
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (n == 0) break;
+    done += n;
+  }
+  return done;
+}
+
+/////////////////////////// deflate ///////////////////////////
+
+// Compresses one block as raw deflate, primed with dict. Every block
+// but the last ends on a byte boundary without the final bit, so the
+// next one can follow it in the same stream.
+static void deflate_one(deflate_block * b, const unsigned char * dict, size_t dictlen){
+  z_stream z;
+  size_t need;
+
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+    errno = ENOMEM;
+    perror("deflateInit2");
+    exit(errno);
+  }
+  if (dictlen) deflateSetDictionary(&z, dict, dictlen);
+  // Room for the worst case plus the sync marker
+  need = deflateBound(&z, b->len) + 16;
+  if (b->outcap < need){
+    free(b->out);
+    b->out = xmalloc(need);
+    b->outcap = need;
+  }
+  z.next_in = b->in;
+  z.avail_in = b->len;
+  z.next_out = b->out;
+  z.avail_out = b->outcap;
+  deflate(&z, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+  b->outlen = b->outcap - z.avail_out;
+  b->crc = crc32(0, b->in, b->len);
+  deflateEnd(&z);
+}
+
+static void deflate_range(int begin, int end, void * arg){
+  archive_ctx * ctx = arg;
+  deflate_block * prev;
+  size_t len;
+  int i;
+
+  for (i = begin; i < end; i++){
+    if (i == 0){
+      deflate_one(&ctx->blocks[0], ctx->dict, ctx->dictlen);
+    } else {
+      prev = &ctx->blocks[i - 1];
+      len = prev->len < ARCHIVE_DICT ? prev->len : ARCHIVE_DICT;
+      deflate_one(&ctx->blocks[i], prev->in + prev->len - len, len);
+    }
+  }
+}
+
+static void deflate_begin(archive_ctx * ctx){
+  ctx->cur = 0;
+  ctx->dictlen = 0;
+  ctx->crc = 0;
+  ctx->usize = 0;
+  ctx->csize = 0;
+}
+
+// Compresses the first n blocks on the pool and writes them in order.
+// last ends the stream with block n - 1.
+static int deflate_flush(archive_ctx * ctx, int n, int last){
+  deflate_block * b;
+  int i;
+
+  ctx->blocks[n - 1].last = last;
+  pool_for(ctx->pool, n, 1, deflate_range, ctx);
+  for (i = 0; i < n; i++){
+    b = &ctx->blocks[i];
+    if (out_write(ctx, b->out, b->outlen)) return -1;
+    ctx->crc = crc32_combine(ctx->crc, b->crc, b->len);
+    ctx->usize += b->len;
+    ctx->csize += b->outlen;
+  }
+  b = &ctx->blocks[n - 1];
+  ctx->dictlen = b->len < ARCHIVE_DICT ? b->len : ARCHIVE_DICT;
+  memcpy(ctx->dict, b->in + b->len - ctx->dictlen, ctx->dictlen);
+  for (i = 0; i < n; i++){
+    ctx->blocks[i].len = 0;
+    ctx->blocks[i].last = 0;
+  }
+  ctx->cur = 0;
+  return 0;
+}
+
+/////////////////////////// xz ///////////////////////////
+
+static int xz_init(archive_ctx * ctx){
+  lzma_stream init = LZMA_STREAM_INIT;
+  lzma_mt mt;
+
+  memset(&mt, 0, sizeof(mt));
+  mt.threads = ctx->pool->nthreads + 1;
+  mt.preset = LZMA_PRESET_DEFAULT;
+  mt.check = LZMA_CHECK_CRC64;
+  // Fewer threads rather than more memory than this
+  while (mt.threads > 1 && lzma_stream_encoder_mt_memusage(&mt) > ARCHIVE_XZ_MEMORY) mt.threads--;
+
+  ctx->x = init;
+  if (lzma_stream_encoder_mt(&ctx->x, &mt) != LZMA_OK &&
+      lzma_easy_encoder(&ctx->x, LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC64) != LZMA_OK){
+    ctx->error = ENOMEM;
+    return -1;
+  }
+  ctx->xin = xmalloc(ARCHIVE_BLOCK);
+  ctx->xout = xmalloc(ARCHIVE_BLOCK);
+  ctx->xlen = 0;
+  return 0;
+}
+
+// Runs the buffered input through the encoder and writes what comes out
+static int xz_feed(archive_ctx * ctx, lzma_action action){
+  lzma_ret ret;
+
+  ctx->x.next_in = ctx->xin;
+  ctx->x.avail_in = ctx->xlen;
+  do {
+    ctx->x.next_out = ctx->xout;
+    ctx->x.avail_out = ARCHIVE_BLOCK;
+    ret = lzma_code(&ctx->x, action);
+    if (ret != LZMA_OK && ret != LZMA_STREAM_END){
+      ctx->error = ret == LZMA_MEM_ERROR ? ENOMEM : EIO;
+      return -1;
+    }
+    if (out_write(ctx, ctx->xout, ARCHIVE_BLOCK - ctx->x.avail_out)) return -1;
+  } while (ctx->x.avail_in || (action == LZMA_FINISH && ret != LZMA_STREAM_END));
+  ctx->xlen = 0;
+  return 0;
+}
+
+/////////////////////////// stream ///////////////////////////
+
+// Room for more data in the compressed stream. The caller fills some
+// of it and hands it over with stream_commit().
+static size_t stream_space(archive_ctx * ctx, unsigned char ** p){
+  deflate_block * b;
+
+  if (ctx->type == ARCHIVE_TAR_XZ){
+    *p = ctx->xin + ctx->xlen;
+    return ARCHIVE_BLOCK - ctx->xlen;
+  }
+  b = &ctx->blocks[ctx->cur];
+  *p = b->in + b->len;
+  return ARCHIVE_BLOCK - b->len;
+}
+
+static int stream_commit(archive_ctx * ctx, size_t n){
+  if (ctx->type == ARCHIVE_TAR_XZ){
+    ctx->xlen += n;
+    if (ctx->xlen == ARCHIVE_BLOCK) return xz_feed(ctx, LZMA_RUN);
+  } else {
+    ctx->blocks[ctx->cur].len += n;
+    if (ctx->blocks[ctx->cur].len == ARCHIVE_BLOCK && ++ctx->cur == ctx->nblocks){
+      return deflate_flush(ctx, ctx->nblocks, 0);
+    }
+  }
+  return ctx->error ? -1 : 0;
+}
+
+static int stream_put(archive_ctx * ctx, const void * data, size_t len){
+  const unsigned char * src = data;
+  unsigned char * p;
+  size_t n;
+
+  while (len){
+    if ((n = stream_space(ctx, &p)) > len) n = len;
+    if (src){
+      memcpy(p, src, n);
+      src += n;
+    } else {
+      memset(p, 0, n);
+    }
+    if (stream_commit(ctx, n)) return -1;
+    len -= n;
+  }
+  return 0;
+}
+
+static int stream_end(archive_ctx * ctx){
+  if (ctx->type == ARCHIVE_TAR_XZ) return xz_feed(ctx, LZMA_FINISH);
+  return deflate_flush(ctx, ctx->cur + 1, 1);
+}
+
+// Streams size bytes of fd. A file that shrank meanwhile is padded with
+// zeros if pad is set, and cut short otherwise.
+static int stream_file(archive_ctx * ctx, int fd, const char * rel, uint64_t size, int pad){
+  unsigned char * p;
+  ssize_t n;
+  size_t space;
+
+  while (size){
+    if (ctx->prog->cancel) return -1;
+    if ((space = stream_space(ctx, &p)) > size) space = size;
+    if ((n = read_full(fd, p, space)) <= 0){
+      progress_error(ctx->prog, rel, n < 0 ? errno : ENODATA);
+      return pad ? stream_put(ctx, NULL, size) : 0;
+    }
+    progress_add(ctx->prog, 0, n);
+    if (stream_commit(ctx, n)) return -1;
+    size -= n;
+  }
+  return 0;
+}
+
+/////////////////////////// tar ///////////////////////////
+
+// Octal if it fits, else the GNU base-256 form
+static void put_octal(char * field, int width, uint64_t value){
+  char digits[24];
+  int i;
+
+  if (value < 1ULL << (3 * (width - 1))){
+    snprintf(digits, sizeof(digits), "%0*llo", width - 1, (unsigned long long) value);
+    memcpy(field, digits, width);
+    return;
+  }
+  for (i = width - 1; i > 0; i--){
+    field[i] = value & 0xff;
+    value >>= 8;
+  }
+  field[0] = (char) 0x80;
+}
+
+static int tar_pad(archive_ctx * ctx, uint64_t size){
+  return size % 512 ? stream_put(ctx, NULL, 512 - size % 512) : 0;
+}
+
+static int tar_header(archive_ctx * ctx, const char * name, const struct stat * st, char type,
+		      const char * link, uint64_t size);
+
+// Writes a GNU record holding a name too long for the header
+static int tar_longname(archive_ctx * ctx, const char * name, char type){
+  struct stat st;
+  size_t len = strlen(name) + 1;
+
+  memset(&st, 0, sizeof(st));
+  if (tar_header(ctx, "././@LongLink", &st, type, NULL, len) ||
+      stream_put(ctx, name, len)) return -1;
+  return tar_pad(ctx, len);
+}
+
+// Writes the header of one member in the GNU format tar uses itself
+static int tar_header(archive_ctx * ctx, const char * name, const struct stat * st, char type,
+		      const char * link, uint64_t size){
+  char hdr[512];
+  unsigned sum = 0;
+  size_t len;
+  int i;
+
+  if (strlen(name) > 100 && tar_longname(ctx, name, 'L')) return -1;
+  if (link && strlen(link) > 100 && tar_longname(ctx, link, 'K')) return -1;
+
+  memset(hdr, 0, sizeof(hdr));
+  len = strlen(name);
+  memcpy(hdr, name, len > 100 ? 100 : len);
+  put_octal(hdr + 100, 8, st->st_mode & 07777);
+  put_octal(hdr + 108, 8, st->st_uid);
+  put_octal(hdr + 116, 8, st->st_gid);
+  put_octal(hdr + 124, 12, size);
+  put_octal(hdr + 136, 12, st->st_mtime > 0 ? st->st_mtime : 0);
+  hdr[156] = type;
+  if (link){
+    len = strlen(link);
+    memcpy(hdr + 157, link, len > 100 ? 100 : len);
+  }
+  memcpy(hdr + 257, "ustar  ", 8);
+
+  memset(hdr + 148, ' ', 8);
+  for (i = 0; i < 512; i++) sum += (unsigned char) hdr[i];
+  snprintf(hdr + 148, 7, "%06o", sum);
+  return stream_put(ctx, hdr, sizeof(hdr));
+}
+
+// Returns the name a file with more links was first stored under, or
+// remembers it under rel
+static const char * tar_linked(archive_ctx * ctx, const struct stat * st, const char * rel){
+  int i;
+
+  for (i = 0; i < ctx->nlinks; i++){
+    if (ctx->links[i].ino == st->st_ino && ctx->links[i].dev == st->st_dev) return ctx->links[i].name;
+  }
+  if (ctx->nlinks == ctx->links_cap){
+    ctx->links_cap = ctx->links_cap ? ctx->links_cap * 2 : 64;
+    if ((ctx->links = realloc(ctx->links, ctx->links_cap * sizeof(tar_link))) == NULL){
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  ctx->links[ctx->nlinks].dev = st->st_dev;
+  ctx->links[ctx->nlinks].ino = st->st_ino;
+  ctx->links[ctx->nlinks++].name = xstrdup(rel);
+  return NULL;
+}
+
+// Adds one member to the tar stream. Files that can't be read are
+// reported and left out.
+static int tar_add(archive_ctx * ctx, int dfd, const char * name, char * rel, size_t rlen, struct stat * st){
+  char target[PATH_MAX];
+  const char * first;
+  ssize_t n;
+  int fd, ret;
+
+  if (S_ISDIR(st->st_mode)){
+    rel[rlen] = '/';
+    rel[rlen + 1] = '\0';
+    ret = tar_header(ctx, rel, st, '5', NULL, 0);
+    rel[rlen] = '\0';
+    return ret;
+  }
+  if (S_ISLNK(st->st_mode)){
+    if ((n = readlinkat(dfd, name, target, sizeof(target) - 1)) < 0){
+      progress_error(ctx->prog, rel, errno);
+      return 0;
+    }
+    target[n] = '\0';
+    return tar_header(ctx, rel, st, '2', target, 0);
+  }
+  if (!S_ISREG(st->st_mode)) return 0;
+
+  if (st->st_nlink > 1 && (first = tar_linked(ctx, st, rel))){
+    return tar_header(ctx, rel, st, '1', first, 0);
+  }
+  if ((fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0){
+    progress_error(ctx->prog, rel, errno);
+    return 0;
+  }
+  // The header promises st_size bytes, so exactly that many follow
+  ret = tar_header(ctx, rel, st, '0', NULL, st->st_size) ||
+    stream_file(ctx, fd, rel, st->st_size, 1) ||
+    tar_pad(ctx, st->st_size);
+  close(fd);
+  return ret ? -1 : 0;
+}
+
+/////////////////////////// zip ///////////////////////////
+
+// MS-DOS date and time in local time, as zip keeps them
+static uint32_t dos_time(time_t t){
+  struct tm tm;
+
+  localtime_r(&t, &tm);
+  if (tm.tm_year < 80) return 1 << 21 | 1 << 16;
+  return (uint32_t) (tm.tm_year - 80) << 25 | (tm.tm_mon + 1) << 21 | tm.tm_mday << 16 |
+    tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+}
+
+static int zip_new_record(archive_ctx * ctx, const char * rel, const struct stat * st){
+  zip_record * rec;
+
+  if (ctx->nrecs == ctx->recs_cap){
+    ctx->recs_cap = ctx->recs_cap ? ctx->recs_cap * 2 : 256;
+    if ((ctx->recs = realloc(ctx->recs, ctx->recs_cap * sizeof(zip_record))) == NULL){
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  rec = &ctx->recs[ctx->nrecs];
+  memset(rec, 0, sizeof(zip_record));
+  rec->name = xstrdup(rel);
+  rec->mode = st->st_mode;
+  rec->mtime = st->st_mtime;
+  return ctx->nrecs++;
+}
+
+// Drops a member that could not be read
+static void zip_drop(zip_record * rec){
+  free(rec->name);
+  rec->name = NULL;
+}
+
+// Writes a local header. With zip64 the sizes go in an extra field,
+// where zip_patch() fills them in once they are known.
+static int zip_local(archive_ctx * ctx, zip_record * rec, int zip64){
+  unsigned char hdr[30 + 20 + 9];
+  size_t namelen = strlen(rec->name);
+  unsigned char * extra = hdr + 30;
+
+  rec->offset = ctx->offset;
+  memset(hdr, 0, sizeof(hdr));
+  put32(hdr, 0x04034b50);
+  put16(hdr + 4, zip64 ? 45 : 20);
+  put16(hdr + 8, rec->method);
+  put32(hdr + 10, dos_time(rec->mtime));
+  put32(hdr + 14, rec->crc);
+  if (zip64){
+    put32(hdr + 18, ZIP64_LIMIT);
+    put32(hdr + 22, ZIP64_LIMIT);
+    put16(extra, 1);
+    put16(extra + 2, 16);
+    put64(extra + 4, rec->usize);
+    put64(extra + 12, rec->csize);
+    extra += 20;
+  } else {
+    put32(hdr + 18, rec->csize);
+    put32(hdr + 22, rec->usize);
+  }
+  // Modification time in UTC, which unzip prefers to the DOS one
+  put16(extra, 0x5455);
+  put16(extra + 2, 5);
+  extra[4] = 1;
+  put32(extra + 5, rec->mtime);
+  extra += 9;
+  put16(hdr + 26, namelen);
+  put16(hdr + 28, extra - hdr - 30);
+
+  if (out_write(ctx, hdr, 30) || out_write(ctx, rec->name, namelen)) return -1;
+  return out_write(ctx, hdr + 30, extra - hdr - 30);
+}
+
+// Puts the CRC and sizes of a streamed member into its local header
+static int zip_patch(archive_ctx * ctx, zip_record * rec, int zip64){
+  unsigned char buf[16];
+
+  put32(buf, rec->crc);
+  if (zip64){
+    if (pwrite(ctx->fd, buf, 4, rec->offset + 14) != 4) goto fail;
+    put64(buf, rec->usize);
+    put64(buf + 8, rec->csize);
+    if (pwrite(ctx->fd, buf, 16, rec->offset + 30 + strlen(rec->name) + 4) != 16) goto fail;
+  } else {
+    put32(buf + 4, rec->csize);
+    put32(buf + 8, rec->usize);
+    if (pwrite(ctx->fd, buf, 12, rec->offset + 14) != 12) goto fail;
+  }
+  return 0;
+ fail:
+  ctx->error = errno ? errno : EIO;
+  return -1;
+}
+
+// Stores data as it is, for directories, symlinks and empty files
+static int zip_stored(archive_ctx * ctx, int r, const void * data, size_t len){
+  zip_record * rec = &ctx->recs[r];
+
+  rec->method = 0;
+  rec->crc = crc32(0, data, len);
+  rec->usize = rec->csize = len;
+  if (zip_local(ctx, rec, 0)) return -1;
+  return out_write(ctx, data, len);
+}
+
+static void zip_compress_range(int begin, int end, void * arg){
+  archive_ctx * ctx = arg;
+  zip_small * s;
+  zip_record * rec;
+  unsigned char * in, * out;
+  z_stream z;
+  ssize_t n;
+  size_t cap;
+  int i, fd;
+
+  for (i = begin; i < end; i++){
+    s = &ctx->batch[i];
+    rec = &ctx->recs[s->rec];
+    if ((fd = openat(ctx->rootfd, s->rel, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0){
+      s->err = errno;
+      continue;
+    }
+    in = xmalloc(s->size + 1);
+    if ((n = read_full(fd, in, s->size)) < 0){
+      s->err = errno;
+      close(fd);
+      free(in);
+      continue;
+    }
+    close(fd);
+    progress_add(ctx->prog, 0, n);
+    rec->crc = crc32(0, in, n);
+    rec->usize = n;
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+      errno = ENOMEM;
+      perror("deflateInit2");
+      exit(errno);
+    }
+    cap = deflateBound(&z, n);
+    out = xmalloc(cap);
+    z.next_in = in;
+    z.avail_in = n;
+    z.next_out = out;
+    z.avail_out = cap;
+    deflate(&z, Z_FINISH);
+    // Whatever doesn't shrink is stored
+    if (cap - z.avail_out < (size_t) n){
+      rec->method = 8;
+      rec->csize = cap - z.avail_out;
+      s->data = out;
+      free(in);
+    } else {
+      rec->method = 0;
+      rec->csize = n;
+      s->data = in;
+      free(out);
+    }
+    deflateEnd(&z);
+  }
+}
+
+// Compresses the batch of small files on the pool and writes them
+static int zip_flush_batch(archive_ctx * ctx){
+  zip_small * s;
+  zip_record * rec;
+  int i, ret = 0;
+
+  pool_for(ctx->pool, ctx->nbatch, 4, zip_compress_range, ctx);
+  for (i = 0; i < ctx->nbatch; i++){
+    s = &ctx->batch[i];
+    rec = &ctx->recs[s->rec];
+    if (s->err){
+      progress_error(ctx->prog, s->rel, s->err);
+      zip_drop(rec);
+    } else if (!ret && (zip_local(ctx, rec, 0) || out_write(ctx, s->data, rec->csize))){
+      ret = -1;
+    }
+    free(s->data);
+    free(s->rel);
+  }
+  ctx->nbatch = 0;
+  ctx->batch_bytes = 0;
+  return ret;
+}
+
+static int zip_queue(archive_ctx * ctx, int r, const char * rel, size_t size){
+  zip_small * s;
+
+  if (ctx->nbatch == ctx->batch_cap){
+    ctx->batch_cap = ctx->batch_cap ? ctx->batch_cap * 2 : 64;
+    if ((ctx->batch = realloc(ctx->batch, ctx->batch_cap * sizeof(zip_small))) == NULL){
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  s = &ctx->batch[ctx->nbatch++];
+  s->rel = xstrdup(rel);
+  s->rec = r;
+  s->size = size;
+  s->data = NULL;
+  s->err = 0;
+  ctx->batch_bytes += size;
+  if (ctx->nbatch >= ARCHIVE_BATCH_FILES || ctx->batch_bytes >= ARCHIVE_BATCH_BYTES){
+    return zip_flush_batch(ctx);
+  }
+  return 0;
+}
+
+// Deflates a big file in blocks across the pool, then goes back to fill
+// in its header
+static int zip_big(archive_ctx * ctx, int dfd, const char * name, int r, const struct stat * st){
+  zip_record * rec = &ctx->recs[r];
+  int zip64 = (uint64_t) st->st_size >= ZIP64_BIG;
+  int fd, ret;
+
+  if ((fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0){
+    progress_error(ctx->prog, rec->name, errno);
+    zip_drop(rec);
+    return 0;
+  }
+  rec->method = 8;
+  deflate_begin(ctx);
+  ret = zip_local(ctx, rec, zip64) ||
+    stream_file(ctx, fd, rec->name, st->st_size, 0) ||
+    stream_end(ctx);
+  close(fd);
+  if (ret) return -1;
+  rec->crc = ctx->crc;
+  rec->usize = ctx->usize;
+  rec->csize = ctx->csize;
+  return zip_patch(ctx, rec, zip64);
+}
+
+static int zip_add(archive_ctx * ctx, int dfd, const char * name, char * rel, size_t rlen, struct stat * st){
+  char target[PATH_MAX];
+  ssize_t n;
+  int r;
+
+  if (S_ISDIR(st->st_mode)){
+    rel[rlen] = '/';
+    rel[rlen + 1] = '\0';
+    r = zip_new_record(ctx, rel, st);
+    rel[rlen] = '\0';
+    return zip_stored(ctx, r, "", 0);
+  }
+  if (S_ISLNK(st->st_mode)){
+    // Stored with the target as its data, as Info-ZIP does
+    if ((n = readlinkat(dfd, name, target, sizeof(target))) < 0){
+      progress_error(ctx->prog, rel, errno);
+      return 0;
+    }
+    r = zip_new_record(ctx, rel, st);
+    return zip_stored(ctx, r, target, n);
+  }
+  if (!S_ISREG(st->st_mode)) return 0;
+
+  r = zip_new_record(ctx, rel, st);
+  if (st->st_size <= ARCHIVE_SMALL) return zip_queue(ctx, r, rel, st->st_size);
+  return zip_big(ctx, dfd, name, r, st);
+}
+
+static int zip_central(archive_ctx * ctx){
+  unsigned char hdr[46], extra[28 + 9], end[56 + 20 + 22];
+  uint64_t start = ctx->offset, count = 0, size;
+  unsigned char * e, * p = end;
+  zip_record * rec;
+  size_t namelen;
+  int i, zip64;
+
+  for (i = 0; i < ctx->nrecs; i++){
+    rec = &ctx->recs[i];
+    if (!rec->name) continue;
+    count++;
+    namelen = strlen(rec->name);
+    memset(hdr, 0, sizeof(hdr));
+    e = extra + 4;
+    if (rec->usize >= ZIP64_LIMIT){
+      put64(e, rec->usize);
+      e += 8;
+    }
+    if (rec->csize >= ZIP64_LIMIT){
+      put64(e, rec->csize);
+      e += 8;
+    }
+    if (rec->offset >= ZIP64_LIMIT){
+      put64(e, rec->offset);
+      e += 8;
+    }
+    zip64 = e > extra + 4;
+    if (zip64){
+      put16(extra, 1);
+      put16(extra + 2, e - extra - 4);
+    } else {
+      e = extra;
+    }
+    put16(e, 0x5455);
+    put16(e + 2, 5);
+    e[4] = 1;
+    put32(e + 5, rec->mtime);
+    e += 9;
+
+    put32(hdr, 0x02014b50);
+    put16(hdr + 4, 3 << 8 | (zip64 ? 45 : 20));
+    put16(hdr + 6, zip64 ? 45 : 20);
+    put16(hdr + 10, rec->method);
+    put32(hdr + 12, dos_time(rec->mtime));
+    put32(hdr + 16, rec->crc);
+    put32(hdr + 20, rec->csize >= ZIP64_LIMIT ? ZIP64_LIMIT : rec->csize);
+    put32(hdr + 24, rec->usize >= ZIP64_LIMIT ? ZIP64_LIMIT : rec->usize);
+    put16(hdr + 28, namelen);
+    put16(hdr + 30, e - extra);
+    put32(hdr + 38, (uint32_t) rec->mode << 16 | (S_ISDIR(rec->mode) ? 0x10 : 0));
+    put32(hdr + 42, rec->offset >= ZIP64_LIMIT ? ZIP64_LIMIT : rec->offset);
+    if (out_write(ctx, hdr, sizeof(hdr)) || out_write(ctx, rec->name, namelen) ||
+	out_write(ctx, extra, e - extra)) return -1;
+  }
+
+  size = ctx->offset - start;
+  memset(end, 0, sizeof(end));
+  zip64 = count >= 0xFFFF || start >= ZIP64_LIMIT || size >= ZIP64_LIMIT;
+  if (zip64){
+    put32(p, 0x06064b50);
+    put64(p + 4, 44);
+    put16(p + 12, 3 << 8 | 45);
+    put16(p + 14, 45);
+    put64(p + 24, count);
+    put64(p + 32, count);
+    put64(p + 40, size);
+    put64(p + 48, start);
+    p += 56;
+    put32(p, 0x07064b50);
+    put64(p + 8, ctx->offset);
+    put32(p + 16, 1);
+    p += 20;
+  }
+  put32(p, 0x06054b50);
+  put16(p + 8, zip64 ? 0xFFFF : count);
+  put16(p + 10, zip64 ? 0xFFFF : count);
+  put32(p + 12, zip64 ? ZIP64_LIMIT : size);
+  put32(p + 16, zip64 ? ZIP64_LIMIT : start);
+  p += 22;
+  return out_write(ctx, end, p - end);
+}
+
+/////////////////////////// walk ///////////////////////////
+
+// Adds the tree at name in dfd to the archive as rel. Entries that
+// can't be read are reported and skipped; -1 means the archive itself
+// failed or was cancelled.
+static int add_tree(archive_ctx * ctx, int dfd, const char * name, char * rel, size_t rlen){
+  struct dirent * de;
+  struct stat st;
+  size_t len;
+  DIR * dir;
+  int fd, ret;
+
+  if (ctx->prog->cancel) return -1;
+  if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW)){
+    progress_error(ctx->prog, rel, errno);
+    return 0;
+  }
+  // Never the archive into itself
+  if (st.st_dev == ctx->dest_dev && st.st_ino == ctx->dest_ino) return 0;
+  if (ctx->type == ARCHIVE_ZIP){
+    ret = zip_add(ctx, dfd, name, rel, rlen, &st);
+  } else {
+    ret = tar_add(ctx, dfd, name, rel, rlen, &st);
+  }
+  if (ret) return -1;
+  progress_add(ctx->prog, 1, 0);
+  if (!S_ISDIR(st.st_mode)) return 0;
+
+  if ((fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0 ||
+      (dir = fdopendir(fd)) == NULL){
+    progress_error(ctx->prog, rel, errno);
+    if (fd >= 0) close(fd);
+    return 0;
+  }
+  ret = 0;
+  while (!ret && (de = readdir(dir))){
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+    len = strlen(de->d_name);
+    if (rlen + 1 + len >= PATH_MAX){
+      progress_error(ctx->prog, de->d_name, ENAMETOOLONG);
+      continue;
+    }
+    rel[rlen] = '/';
+    memcpy(rel + rlen + 1, de->d_name, len + 1);
+    ret = add_tree(ctx, dirfd(dir), de->d_name, rel, rlen + 1 + len);
+  }
+  rel[rlen] = '\0';
+  closedir(dir);
+  return ret;
+}
+
+// Creates a hidden file next to dest to write the archive into, so that
+// nothing at dest is touched before the archive is whole. Its name goes
+// to tmp. Returns the fd, or -1 with errno set.
+static int open_temp(const char * dest, char * tmp){
+  const char * base = strrchr(dest, '/');
+  int dirlen = base ? (int) (base - dest + 1) : 0;
+  int i, fd;
+
+  base = base ? base + 1 : dest;
+  for (i = 0; i < 100; i++){
+    if (snprintf(tmp, PATH_MAX, "%.*s.%s.%d-%d", dirlen, dest, base, (int) getpid(), i) >= PATH_MAX){
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) >= 0 || errno != EEXIST) return fd;
+  }
+  return -1;
+}
+
+// Gives the finished archive at tmp its name, unless something took
+// the name in the meantime. A filesystem without hard links gets a
+// rename, checked first.
+static int publish(const char * tmp, const char * dest){
+  struct stat st;
+
+  if (link(tmp, dest) == 0){
+    unlink(tmp);
+    return 0;
+  }
+  if (errno == EEXIST) return -1;
+  if (lstat(dest, &st) == 0){
+    errno = EEXIST;
+    return -1;
+  }
+  return rename(tmp, dest);
+}
+
+// Writes the tree at path into a new archive at dest. The tree goes in
+// under its own name. Unreadable entries are reported through prog and
+// left out. A cancelled or failed archive is removed, and an existing
+// dest is never overwritten.
+int create_archive(const char * path, const char * dest, archive_type type, work_pool * pool, op_progress * prog){
+  static const unsigned char gzip_header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+  char parent[PATH_MAX], rel[PATH_MAX + 2], tmp[PATH_MAX];
+  unsigned char trailer[8];
+  archive_ctx ctx;
+  struct stat st;
+  char * base;
+  size_t len;
+  int i, ret = -1;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.type = type;
+  ctx.pool = pool;
+  ctx.prog = prog;
+  ctx.rootfd = ctx.fd = -1;
+
+  if ((len = strlen(path)) >= PATH_MAX){
+    progress_error(prog, path, ENAMETOOLONG);
+    return -1;
+  }
+  memcpy(parent, path, len + 1);
+  while (len > 1 && parent[len - 1] == '/') parent[--len] = '\0';
+  if ((base = strrchr(parent, '/')) == NULL){
+    base = parent;
+    ctx.rootfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  } else {
+    *base++ = '\0';
+    ctx.rootfd = open(base == parent + 1 ? "/" : parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+  if (ctx.rootfd < 0){
+    progress_error(prog, path, errno);
+    return -1;
+  }
+  if (lstat(dest, &st) == 0){
+    progress_error(prog, dest, EEXIST);
+    goto out;
+  }
+  if ((ctx.fd = open_temp(dest, tmp)) < 0 || fstat(ctx.fd, &st)){
+    progress_error(prog, dest, errno);
+    goto out;
+  }
+  ctx.dest_dev = st.st_dev;
+  ctx.dest_ino = st.st_ino;
+
+  // Two blocks for every thread, the caller's included, so none sits
+  // idle while the slowest block of a round finishes
+  ctx.nblocks = 2 * (pool->nthreads + 1);
+  if (ctx.nblocks > ARCHIVE_MAX_BLOCKS) ctx.nblocks = ARCHIVE_MAX_BLOCKS;
+  if ((ctx.blocks = calloc(ctx.nblocks, sizeof(deflate_block))) == NULL){
+    perror("calloc");
+    exit(errno);
+  }
+  for (i = 0; i < ctx.nblocks; i++) ctx.blocks[i].in = xmalloc(ARCHIVE_BLOCK);
+  ctx.dict = xmalloc(ARCHIVE_DICT);
+
+  if (type == ARCHIVE_TAR_XZ && xz_init(&ctx)) goto out;
+  if (type == ARCHIVE_TAR_GZ){
+    deflate_begin(&ctx);
+    if (out_write(&ctx, gzip_header, sizeof(gzip_header))) goto out;
+  }
+
+  strcpy(rel, base);
+  if (add_tree(&ctx, ctx.rootfd, base, rel, strlen(rel))) goto out;
+
+  if (type == ARCHIVE_ZIP){
+    if (zip_flush_batch(&ctx) || zip_central(&ctx)) goto out;
+  } else {
+    // Two empty records end a tar
+    if (stream_put(&ctx, NULL, 1024) || stream_end(&ctx)) goto out;
+    if (type == ARCHIVE_TAR_GZ){
+      put32(trailer, ctx.crc);
+      put32(trailer + 4, ctx.usize);
+      if (out_write(&ctx, trailer, sizeof(trailer))) goto out;
+    }
+  }
+  ret = 0;
+
+ out:
+  if (ctx.error) progress_error(prog, dest, ctx.error);
+  if (ctx.fd >= 0 && close(ctx.fd) && !ret){
+    progress_error(prog, dest, errno);
+    ret = -1;
+  }
+  if (!ret && publish(tmp, dest)){
+    progress_error(prog, dest, errno);
+    ret = -1;
+  }
+  if (ret && ctx.fd >= 0) unlink(tmp);
+  close(ctx.rootfd);
+
+  for (i = 0; i < ctx.nbatch; i++){
+    free(ctx.batch[i].rel);
+    free(ctx.batch[i].data);
+  }
+  free(ctx.batch);
+  for (i = 0; i < ctx.nrecs; i++) free(ctx.recs[i].name);
+  free(ctx.recs);
+  for (i = 0; i < ctx.nlinks; i++) free(ctx.links[i].name);
+  free(ctx.links);
+  for (i = 0; ctx.blocks && i < ctx.nblocks; i++){
+    free(ctx.blocks[i].in);
+    free(ctx.blocks[i].out);
+  }
+  free(ctx.blocks);
+  free(ctx.dict);
+  if (type == ARCHIVE_TAR_XZ){
+    lzma_end(&ctx.x);
+    free(ctx.xin);
+    free(ctx.xout);
+  }
+  return ret;
+}
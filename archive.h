@@ -0,0 +1,17 @@
+// Gopher - In-process archive creation
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "pool.h"
+#include "progress.h"
+
+typedef enum {
+  ARCHIVE_ZIP,
+  ARCHIVE_TAR_GZ,
+  ARCHIVE_TAR_XZ
+} archive_type;
+
+int create_archive(const char * path, const char * dest, archive_type type, work_pool * pool, op_progress * prog);
+const char * archive_suffix(archive_type type);
+
+#endif
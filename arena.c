@@ -0,0 +1,114 @@
+// Gopher - Bump allocator for directory listings
+//
+// A listing allocates its file_info structs and strings from a chain of
+// large blocks. Structs are aligned, strings are packed back to back so
+// the names of a directory end up in one contiguous blob.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdalign.h>
+
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE (256 * 1024)
+#define ARENA_ALIGN alignof(max_align_t)
+
+void arena_init(arena * a){
+  a->head = NULL;
+  a->current = NULL;
+}
+
+// Allocates a new block able to hold at least size bytes
+static arena_block * new_block(size_t size){
+  arena_block * block;
+  if (size < ARENA_BLOCK_SIZE) size = ARENA_BLOCK_SIZE;
+  if ((block = malloc(sizeof(arena_block) + size)) == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+// Returns size bytes from the arena, aligned if align is set.
+// Moves on to the next kept block, or chains a new one, when full.
+static void * bump(arena * a, size_t size, int align){
+  arena_block * block = a->current;
+  size_t start;
+
+  while (block){
+    start = block->used;
+    if (align) start = (start + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (start + size <= block->size){
+      block->used = start + size;
+      a->current = block;
+      return block->data + start;
+    }
+    if (!block->next) break;
+    block = block->next;
+    block->used = 0;
+  }
+
+  arena_block * fresh = new_block(size);
+  if (block){
+    fresh->next = block->next;
+    block->next = fresh;
+  } else {
+    a->head = fresh;
+  }
+  a->current = fresh;
+  fresh->used = size;
+  return fresh->data;
+}
+
+void * arena_alloc(arena * a, size_t size){
+  return bump(a, size, 1);
+}
+
+void * arena_calloc(arena * a, size_t size){
+  void * ptr = bump(a, size, 1);
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+// Copies at most len characters of str into the arena, null terminated
+char * arena_strndup(arena * a, const char * str, size_t len){
+  char * dst;
+  len = strnlen(str, len);
+  dst = bump(a, len + 1, 0);
+  memcpy(dst, str, len);
+  dst[len] = 0;
+  return dst;
+}
+
+// Releases every allocation but keeps the blocks for reuse
+void arena_reset(arena * a){
+  a->current = a->head;
+  if (a->head) a->head->used = 0;
+}
+
+// Frees all blocks
+void arena_destroy(arena * a){
+  arena_block * block = a->head;
+  arena_block * next;
+  while (block){
+    next = block->next;
+    free(block);
+    block = next;
+  }
+  arena_init(a);
+}
+
+// Returns the number of bytes held by the arena
+size_t arena_reserved(arena * a){
+  size_t total = 0;
+  arena_block * block;
+  for (block = a->head; block; block = block->next){
+    total += sizeof(arena_block) + block->size;
+  }
+  return total;
+}
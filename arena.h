@@ -0,0 +1,29 @@
+// Gopher - Bump allocator for directory listings
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena_block {
+  struct arena_block * next;
+  size_t size;
+  size_t used;
+  char data[];
+} arena_block;
+
+// Everything allocated from an arena is released at once by
+// arena_reset(), which keeps the blocks for the next listing.
+typedef struct {
+  arena_block * head;
+  arena_block * current;
+} arena;
+
+void arena_init(arena * a);
+void * arena_alloc(arena * a, size_t size);
+void * arena_calloc(arena * a, size_t size);
+char * arena_strndup(arena * a, const char * str, size_t len);
+void arena_reset(arena * a);
+void arena_destroy(arena * a);
+size_t arena_reserved(arena * a);
+
+#endif
@@ -0,0 +1,425 @@
+// Gopher - Benchmarks for the listing engine
+//
+// Usage: gopher-bench stat [directory] [max threads] [latency usec]
+//        gopher-bench sort [entries] [max threads]
+//        gopher-bench archive [directory] [max threads]
+//
+// Without a directory (or with "-") a temporary one with 20000 files
+// is created. Point it at an NFS or FUSE mount to see the effect of latency, or
+// give a latency to add a simulated round trip to every stat.
+//
+// The sort benchmark runs on a synthetic listing held in memory, one
+// million entries by default.
+//
+// The archive benchmark writes every archive format of a directory,
+// 64MB of generated text by default, and shows how much each added core
+// gains.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+#include "gopher.h"
+#include "scan.h"
+#include "pool.h"
+#include "uring.h"
+#include "sort.h"
+#include "archive.h"
+#include "progress.h"
+
+#define BENCH_FILES 20000
+#define BENCH_RUNS 3
+#define BENCH_ENTRIES 1000000
+#define BENCH_TEXT_FILES 64       // of 256KB, and three of 16MB
+
+int LATENCY_USEC = 0;
+
+// Returns a monotonic timestamp in seconds
+static double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Creates a temporary directory holding count empty files
+static void make_tree(char * path, int count){
+  char name[64];
+  int dfd, fd, i;
+
+  strcpy(path, "/tmp/gopher-bench-XXXXXX");
+  if (!mkdtemp(path)){
+    perror("mkdtemp");
+    exit(errno);
+  }
+  dfd = open(path, O_RDONLY | O_DIRECTORY);
+  for (i = 0; i < count; i++){
+    sprintf(name, "file_%06d.dat", i);
+    if ((fd = openat(dfd, name, O_CREAT | O_WRONLY, 0644)) >= 0) close(fd);
+  }
+  close(dfd);
+}
+
+// Removes the directory created by make_tree
+static void remove_tree(char * path){
+  dir_scan scan;
+  int i;
+  scan_init(&scan);
+  if (scan_dir(&scan, path) > 0){
+    for (i = 0; i < scan.count; i++){
+      if (strcmp(scan.entries[i].name, "..")) unlinkat(scan.dirfd, scan.entries[i].name, 0);
+    }
+  }
+  scan_destroy(&scan);
+  rmdir(path);
+}
+
+/////////////////////////// stat ///////////////////////////
+
+typedef struct {
+  dir_scan * scan;
+  struct stat * results;
+} stat_bench;
+
+static void stat_range(int begin, int end, void * arg){
+  stat_bench * b = arg;
+  int i;
+  for (i = begin; i < end; i++){
+    fstatat(b->scan->dirfd, b->scan->entries[i].name, &b->results[i], 0);
+    if (LATENCY_USEC) usleep(LATENCY_USEC);
+  }
+}
+
+static const char * statx_name(int index, void * arg){
+  return ((dir_scan *) arg)->entries[index].name;
+}
+
+static void statx_done(int index, int res, struct statx * stx, void * arg){
+}
+
+// Times a pass of batched io_uring statx over the directory
+static void bench_uring(dir_scan * scan, double serial){
+  uring ring;
+  double start, best = 0;
+  int run;
+
+  if (uring_init(&ring, 256)){
+    printf("  io_uring   unavailable\n");
+    return;
+  }
+  for (run = 0; run < BENCH_RUNS; run++){
+    start = now();
+    uring_statx(&ring, scan->dirfd, scan->count, statx_name, statx_done, scan);
+    start = now() - start;
+    if (run == 0 || start < best) best = start;
+  }
+  uring_destroy(&ring);
+  printf("  io_uring   %9.2f ms  %5.2fx\n", best * 1000, serial / best);
+}
+
+// Times the serial stat loop against the pool at growing worker counts.
+// The calling thread works alongside the pool's workers.
+static void bench_stat(char * dir, int max_threads){
+  dir_scan scan;
+  stat_bench b;
+  work_pool pool;
+  double start, best, serial = 0;
+  int threads, run;
+
+  scan_init(&scan);
+  if (scan_dir(&scan, dir) < 0){
+    perror(dir);
+    exit(errno);
+  }
+  b.scan = &scan;
+  if ((b.results = calloc(scan.count, sizeof(struct stat))) == NULL){
+    perror("calloc");
+    exit(errno);
+  }
+
+  printf("stat: %d entries in %s, %d usec added latency\n", scan.count, dir, LATENCY_USEC);
+  for (threads = 0; threads <= max_threads; threads = threads ? threads * 2 : 1){
+    pool_init(&pool, threads);
+    best = 0;
+    for (run = 0; run < BENCH_RUNS; run++){
+      start = now();
+      if (threads == 0) {
+        stat_range(0, scan.count, &b);
+      } else {
+        pool_for(&pool, scan.count, 64, stat_range, &b);
+      }
+      start = now() - start;
+      if (run == 0 || start < best) best = start;
+    }
+    pool_destroy(&pool);
+
+    if (threads == 0) {
+      serial = best;
+      printf("  serial     %9.2f ms\n", best * 1000);
+    } else {
+      printf("  %2d workers %9.2f ms  %5.2fx\n", threads, best * 1000, serial / best);
+    }
+  }
+  if (!LATENCY_USEC) bench_uring(&scan, serial);
+  free(b.results);
+  scan_destroy(&scan);
+}
+
+/////////////////////////// sort ///////////////////////////
+
+// The name comparator sortfiles() used with qsort(), with ties broken
+// by exact name
+static int qsort_name(const void * ptr1, const void * ptr2){
+  char * A = (*(file_info **) ptr1)->name;
+  char * B = (*(file_info **) ptr2)->name;
+  char * a = A, * b = B;
+
+  while (*a && *b){
+    if (tolower(*a) != tolower(*b)) return tolower(*a) > tolower(*b) ? 1 : -1;
+    a++;
+    b++;
+  }
+  if (*a != *b) return *a ? 1 : -1;
+  return strcmp(A, B);
+}
+
+static int qsort_size(const void * ptr1, const void * ptr2){
+  size_t A = (*(file_info **) ptr1)->bytes;
+  size_t B = (*(file_info **) ptr2)->bytes;
+  if (A != B) return A > B ? 1 : -1;
+  return qsort_name(ptr1, ptr2);
+}
+
+static int qsort_date(const void * ptr1, const void * ptr2){
+  time_t A = (*(file_info **) ptr1)->mod_time;
+  time_t B = (*(file_info **) ptr2)->mod_time;
+  if (A != B) return A > B ? 1 : -1;
+  return qsort_name(ptr1, ptr2);
+}
+
+// Makes count entries with mixed case names and random sizes and dates
+static file_info ** make_listing(int count){
+  static const char * words[] = {"Report", "data", "IMG", "backup", "notes", "Build", "log", "src"};
+  file_info ** list;
+  file_info * fi;
+  char name[64];
+  int i;
+
+  srand(1);
+  if ((list = malloc(count * sizeof(file_info *))) == NULL ||
+      (fi = calloc(count, sizeof(file_info))) == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  for (i = 0; i < count; i++){
+    sprintf(name, "%s_%x.%d", words[rand() % 8], rand(), i);
+    fi[i].name = strdup(name);
+    fi[i].st_mode = rand() % 20 ? S_IFREG : S_IFDIR;
+    fi[i].bytes = rand() % 4 ? (size_t) rand() * rand() : 4096;
+    fi[i].mod_time = 1500000000 + rand() % 100000000;
+    list[i] = &fi[i];
+  }
+  return list;
+}
+
+// Times one sort of list. Returns the best time of BENCH_RUNS.
+static double time_sort(sorter * s, file_info ** orig, file_info ** list, int count,
+			sort_order * order, int (*func)(const void *, const void *)){
+  double start, best = 0;
+  int run;
+
+  for (run = 0; run < BENCH_RUNS; run++){
+    memcpy(list, orig, count * sizeof(file_info *));
+    start = now();
+    if (func){
+      qsort(list, count, sizeof(file_info *), func);
+    } else {
+      sort_entries(s, list, count, order);
+    }
+    start = now() - start;
+    if (run == 0 || start < best) best = start;
+  }
+  return best;
+}
+
+// Times qsort() against the sort engine, serial and at growing worker
+// counts, and checks that every result matches the serial one
+static void bench_sort(int count, int max_threads){
+  static const char * keys[] = {"name", "size", "date"};
+  int (*funcs[])(const void *, const void *) = {qsort_name, qsort_size, qsort_date};
+  file_info ** orig = make_listing(count);
+  file_info ** list, ** serial_list;
+  sort_order order = {SORT_NAME, 0, 0};
+  work_pool pool;
+  sorter s;
+  double t, serial;
+  int key, threads;
+
+  if ((list = malloc(count * sizeof(file_info *))) == NULL ||
+      (serial_list = malloc(count * sizeof(file_info *))) == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  sorter_init(&s);
+  s.parallel_min = 0;
+
+  printf("sort: %d entries\n", count);
+  for (key = 0; key < 3; key++){
+    order.key = key;
+    t = time_sort(&s, orig, list, count, &order, funcs[key]);
+    printf("  %s\n    qsort      %9.2f ms\n", keys[key], t * 1000);
+
+    s.pool = NULL;
+    serial = time_sort(&s, orig, serial_list, count, &order, NULL);
+    printf("    serial     %9.2f ms  %5.2fx\n", serial * 1000, t / serial);
+
+    for (threads = 1; threads <= max_threads; threads *= 2){
+      pool_init(&pool, threads);
+      s.pool = &pool;
+      s.max_parts = threads + 1 > SORT_MAX_PARTS ? SORT_MAX_PARTS : threads + 1;
+      t = time_sort(&s, orig, list, count, &order, NULL);
+      pool_destroy(&pool);
+      printf("    %2d workers %9.2f ms  %5.2fx  %s\n", threads, t * 1000, serial / t,
+	     memcmp(list, serial_list, count * sizeof(file_info *)) ? "MISMATCH" : "same order");
+    }
+  }
+  sorter_destroy(&s);
+  free(list);
+  free(serial_list);
+}
+
+/////////////////////////// archive ///////////////////////////
+
+// Fills fd with size bytes of words, about as compressible as text
+static void write_text(int fd, size_t size){
+  static const char * words[] = {"the", "listing", "of", "directory", "gopher", "file",
+				 "archive", "and", "block", "thread", "compress", "to"};
+  char buf[65536];
+  size_t len, n;
+
+  while (size){
+    len = 0;
+    while (len < sizeof(buf) - 16){
+      n = sprintf(buf + len, "%s%c", words[rand() % 12], rand() % 10 ? ' ' : '\n');
+      len += n;
+    }
+    if (len > size) len = size;
+    if (write(fd, buf, len) < 0){
+      perror("write");
+      exit(errno);
+    }
+    size -= len;
+  }
+}
+
+// Creates a temporary directory of text files to archive
+static void make_text_tree(char * path){
+  char name[64];
+  int dfd, fd, i;
+
+  strcpy(path, "/tmp/gopher-bench-XXXXXX");
+  if (!mkdtemp(path)){
+    perror("mkdtemp");
+    exit(errno);
+  }
+  srand(1);
+  dfd = open(path, O_RDONLY | O_DIRECTORY);
+  for (i = 0; i < BENCH_TEXT_FILES + 3; i++){
+    sprintf(name, "file_%06d.txt", i);
+    if ((fd = openat(dfd, name, O_CREAT | O_WRONLY, 0644)) < 0){
+      perror(name);
+      exit(errno);
+    }
+    write_text(fd, i < BENCH_TEXT_FILES ? 256 * 1024 : 16 * 1024 * 1024);
+    close(fd);
+  }
+  close(dfd);
+}
+
+// Writes dir as each archive format with growing worker counts. Rates
+// are of input read, and the gain is against the row before.
+static void bench_archive(char * dir, int max_threads){
+  archive_type types[] = {ARCHIVE_TAR_GZ, ARCHIVE_ZIP, ARCHIVE_TAR_XZ};
+  char dest[64];
+  op_progress prog;
+  work_pool pool;
+  struct stat st;
+  double t, rate, prev_rate = 0;
+  int i, threads, prev_threads = 0;
+
+  printf("archive: %s\n", dir);
+  for (i = 0; i < 3; i++){
+    snprintf(dest, sizeof(dest), "/tmp/gopher-bench%s", archive_suffix(types[i]));
+    printf("  %s\n", archive_suffix(types[i]) + 1);
+    for (threads = 0; threads <= max_threads; threads = threads ? threads * 2 : 1){
+      pool_init(&pool, threads);
+      progress_init(&prog, NULL, NULL);
+      t = now();
+      if (create_archive(dir, dest, types[i], &pool, &prog)){
+	fprintf(stderr, "%s\n", prog.first_error);
+	exit(1);
+      }
+      t = now() - t;
+      pool_destroy(&pool);
+      stat(dest, &st);
+      unlink(dest);
+
+      rate = prog.bytes / t / (1024 * 1024);
+      if (threads == 0){
+	printf("    serial     %9.1f MB/s  %5.1f%% of input\n", rate, 100.0 * st.st_size / prog.bytes);
+      } else {
+	printf("    %2d workers %9.1f MB/s  %+7.1f MB/s per added core\n", threads, rate,
+	       (rate - prev_rate) / (threads - prev_threads));
+      }
+      prev_rate = rate;
+      prev_threads = threads;
+    }
+  }
+}
+
+static void usage(char * name){
+  fprintf(stderr, "usage: %s stat [directory] [max threads] [latency usec]\n", name);
+  fprintf(stderr, "       %s sort [entries] [max threads]\n", name);
+  fprintf(stderr, "       %s archive [directory] [max threads]\n", name);
+  exit(1);
+}
+
+int main(int argc, char ** argv){
+  char path[64];
+  int max_threads = 16;
+
+  if (argc < 2) usage(argv[0]);
+  if (!strcmp(argv[1], "sort")){
+    if (argc > 3) max_threads = atoi(argv[3]);
+    bench_sort(argc > 2 ? atoi(argv[2]) : BENCH_ENTRIES, max_threads);
+    return 0;
+  }
+  if (!strcmp(argv[1], "archive")){
+    if (argc > 3) max_threads = atoi(argv[3]);
+    if (argc > 2 && strcmp(argv[2], "-")){
+      bench_archive(argv[2], max_threads);
+    } else {
+      make_text_tree(path);
+      bench_archive(path, max_threads);
+      remove_tree(path);
+    }
+    return 0;
+  }
+  if (strcmp(argv[1], "stat")) usage(argv[0]);
+  if (argc > 3) max_threads = atoi(argv[3]);
+  if (argc > 4) LATENCY_USEC = atoi(argv[4]);
+
+  if (argc > 2 && strcmp(argv[2], "-")) {
+    bench_stat(argv[2], max_threads);
+  } else {
+    make_tree(path, BENCH_FILES);
+    bench_stat(path, max_threads);
+    remove_tree(path);
+  }
+  return 0;
+}
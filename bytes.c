@@ -0,0 +1,89 @@
+// Gopher - Byte scanning kernels for file contents
+//
+// With SSE2, which every x86-64 has, 16 bytes are looked at per step.
+// Elsewhere the plain loops below do the same job.
+
+#include <string.h>
+#include <ctype.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bytes.h"
+
+// How far into a file a NUL makes it binary
+#define BINARY_PEEK 8192
+
+// Counts the bytes equal to c
+size_t bytes_count(const char * buf, size_t len, char c){
+  size_t count = 0, i = 0;
+
+#ifdef __SSE2__
+  __m128i want = _mm_set1_epi8(c);
+  for (; i + 16 <= len; i += 16){
+    __m128i block = _mm_loadu_si128((const __m128i *) (buf + i));
+    count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, want)));
+  }
+#endif
+  for (; i < len; i++){
+    count += buf[i] == c;
+  }
+  return count;
+}
+
+static int same(const char * a, const char * b, size_t len, int fold){
+  size_t i;
+  if (!fold) return !memcmp(a, b, len);
+  for (i = 0; i < len; i++){
+    if (tolower((unsigned char) a[i]) != (unsigned char) b[i]) return 0;
+  }
+  return 1;
+}
+
+// Finds the first needle in hay. Folding, the needle must be lower
+// case and hay may be in any case. Candidates are the places where the
+// first and the last byte of the needle both match, which rules out
+// nearly every place before anything is compared.
+const char * bytes_find(const char * hay, size_t len, const char * needle, size_t nlen, int fold){
+  unsigned char first, last;
+  size_t i = 0;
+
+  if (!nlen) return hay;
+  if (nlen > len) return NULL;
+  first = needle[0];
+  last = needle[nlen - 1];
+  if (!fold && nlen == 1) return memchr(hay, first, len);
+
+#ifdef __SSE2__
+  {
+    __m128i first_lo = _mm_set1_epi8(first), last_lo = _mm_set1_epi8(last);
+    __m128i first_up = _mm_set1_epi8(fold ? toupper(first) : first);
+    __m128i last_up = _mm_set1_epi8(fold ? toupper(last) : last);
+    __m128i a, b;
+    unsigned mask;
+    int bit;
+
+    for (; i + nlen + 15 <= len; i += 16){
+      a = _mm_loadu_si128((const __m128i *) (hay + i));
+      b = _mm_loadu_si128((const __m128i *) (hay + i + nlen - 1));
+      mask = _mm_movemask_epi8(_mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(a, first_lo), _mm_cmpeq_epi8(a, first_up)),
+					     _mm_or_si128(_mm_cmpeq_epi8(b, last_lo), _mm_cmpeq_epi8(b, last_up))));
+      while (mask){
+	bit = __builtin_ctz(mask);
+	if (nlen < 3 || same(hay + i + bit + 1, needle + 1, nlen - 2, fold)) return hay + i + bit;
+	mask &= mask - 1;
+      }
+    }
+  }
+#endif
+  for (; i + nlen <= len; i++){
+    if (same(hay + i, needle, nlen, fold)) return hay + i;
+  }
+  return NULL;
+}
+
+// Tells whether a file looks binary, from a NUL near its start
+int bytes_binary(const char * buf, size_t len){
+  return memchr(buf, 0, len < BINARY_PEEK ? len : BINARY_PEEK) != NULL;
+}
@@ -0,0 +1,11 @@
+// Gopher - Byte scanning kernels for file contents
+#ifndef BYTES_H
+#define BYTES_H
+
+#include <stddef.h>
+
+size_t bytes_count(const char * buf, size_t len, char c);
+const char * bytes_find(const char * hay, size_t len, const char * needle, size_t nlen, int fold);
+int bytes_binary(const char * buf, size_t len);
+
+#endif
@@ -0,0 +1,141 @@
+// Gopher - Cache of scanned directories
+//
+// Listings are parked here when gopher leaves a directory and handed
+// back when it returns, as long as the directory is still the same
+// inode with the same mtime. A listing whose directory changed less
+// than two whole seconds before its scan is never trusted, since a
+// change in the same timestamp tick would not move the mtime, and the
+// scan time is rounded down to the second.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+void cache_init(dir_cache * cache, size_t max_bytes, int max_entries){
+  cache->head = NULL;
+  cache->tail = NULL;
+  cache->count = 0;
+  cache->max_entries = max_entries;
+  cache->bytes = 0;
+  cache->max_bytes = max_bytes;
+  cache->hits = 0;
+  cache->misses = 0;
+  arena_init(&cache->spare);
+}
+
+static void unlink_entry(dir_cache * cache, cache_entry * entry){
+  if (entry->prev) entry->prev->next = entry->next;
+  else cache->head = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  else cache->tail = entry->prev;
+  cache->count--;
+  cache->bytes -= entry->bytes;
+}
+
+// Releases a listing, keeping its arena as the spare if there is none
+static void drop_listing(dir_cache * cache, listing * list){
+  if (list->dirfd >= 0) close(list->dirfd);
+  list->dirfd = -1;
+  if (!cache->spare.head) {
+    cache->spare = list->mem;
+  } else {
+    arena_destroy(&list->mem);
+  }
+  arena_init(&list->mem);
+}
+
+static void evict(dir_cache * cache, cache_entry * entry){
+  unlink_entry(cache, entry);
+  drop_listing(cache, &entry->list);
+  free(entry);
+}
+
+// Is the cached listing still what is on disk?
+static int still_valid(cache_entry * entry, struct stat * st){
+  struct stat * old = &entry->list.dir_st;
+  if (st->st_dev != old->st_dev || st->st_ino != old->st_ino) return 0;
+  if (st->st_mtim.tv_sec != old->st_mtim.tv_sec || st->st_mtim.tv_nsec != old->st_mtim.tv_nsec) return 0;
+  return 1;
+}
+
+// Was the directory changed so close to the scan that a later change
+// could leave its mtime as it is?
+static int entry_racy(listing * list){
+  return list->scanned - list->dir_st.st_mtim.tv_sec < 2;
+}
+
+// Takes ownership of list and stores it under path
+void cache_put(dir_cache * cache, const char * path, listing * list){
+  cache_entry * entry;
+
+  if (list->dirfd < 0 || cache->max_entries < 1 || entry_racy(list)){
+    drop_listing(cache, list);
+    return;
+  }
+  if ((entry = calloc(1, sizeof(cache_entry))) == NULL){
+    perror("calloc");
+    exit(errno);
+  }
+  strncpy(entry->path, path, MAXLEN - 1);
+  entry->list = *list;
+  entry->bytes = arena_reserved(&list->mem);
+  arena_init(&list->mem);
+  list->dirfd = -1;
+
+  entry->next = cache->head;
+  if (cache->head) cache->head->prev = entry;
+  cache->head = entry;
+  if (!cache->tail) cache->tail = entry;
+  cache->count++;
+  cache->bytes += entry->bytes;
+
+  while (cache->tail && (cache->count > cache->max_entries || cache->bytes > cache->max_bytes)){
+    evict(cache, cache->tail);
+  }
+}
+
+// Looks up path. On a hit the listing moves out of the cache into list
+// and 1 is returned. Stale entries are dropped.
+int cache_get(dir_cache * cache, const char * path, int short_width, listing * list){
+  cache_entry * entry;
+  struct stat st;
+
+  for (entry = cache->head; entry; entry = entry->next){
+    if (!strcmp(entry->path, path)) break;
+  }
+  if (!entry){
+    cache->misses++;
+    return 0;
+  }
+  if (stat(path, &st) || !still_valid(entry, &st) || entry->list.short_width != short_width){
+    evict(cache, entry);
+    cache->misses++;
+    return 0;
+  }
+
+  unlink_entry(cache, entry);
+  *list = entry->list;
+  free(entry);
+  cache->hits++;
+  return 1;
+}
+
+// Gives an arena for a new listing, recycling an evicted one if any
+void cache_new_arena(dir_cache * cache, arena * mem){
+  *mem = cache->spare;
+  arena_init(&cache->spare);
+  arena_reset(mem);
+}
+
+// Frees every cached listing
+void cache_destroy(dir_cache * cache){
+  while (cache->head){
+    evict(cache, cache->head);
+  }
+  arena_destroy(&cache->spare);
+}
@@ -0,0 +1,36 @@
+// Gopher - Cache of scanned directories
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "gopher.h"
+
+typedef struct cache_entry {
+  struct cache_entry * prev;
+  struct cache_entry * next;
+  char path[MAXLEN];
+  size_t bytes;
+  listing list;
+} cache_entry;
+
+// Least recently used listings, bounded by memory and open fds
+typedef struct {
+  cache_entry * head;    // most recently used
+  cache_entry * tail;
+  int count;
+  int max_entries;
+  size_t bytes;
+  size_t max_bytes;
+
+  unsigned long hits;
+  unsigned long misses;
+
+  arena spare;           // arena of an evicted listing, for reuse
+} dir_cache;
+
+void cache_init(dir_cache * cache, size_t max_bytes, int max_entries);
+void cache_put(dir_cache * cache, const char * path, listing * list);
+int cache_get(dir_cache * cache, const char * path, int short_width, listing * list);
+void cache_new_arena(dir_cache * cache, arena * mem);
+void cache_destroy(dir_cache * cache);
+
+#endif
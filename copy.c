@@ -0,0 +1,333 @@
+// Gopher - In-process recursive copy
+//
+// Walks the source tree through directory fds and copies every file
+// with the cheapest method the filesystems allow: a FICLONE reflink,
+// then copy_file_range(), which lets the kernel (or an NFS or SMB
+// server) move the data, then plain read()/write() through a large
+// buffer. Modes and timestamps are carried over. A failure on one
+// entry is reported and the rest of the tree is still copied.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "copy.h"
+
+#define COPY_BUFLEN (1024 * 1024)
+#define COPY_CHUNK (16 * 1024 * 1024)
+
+typedef struct {
+  op_progress * prog;
+  char path[PATH_MAX];    // source of the entry being copied
+  char * buf;
+  int no_clone;           // FICLONE isn't supported here
+  int no_copy_range;      // copy_file_range() isn't supported at all
+  mode_t umask;
+  int exclusive;          // nothing may be overwritten or merged into
+
+  // The directory created for the copy, which must not be copied into
+  // itself when pasting a directory inside itself
+  dev_t top_dev;
+  ino_t top_ino;
+} copy_ctx;
+
+// The umask, taken once before any thread starts. Reading it means
+// setting it, and for that moment files made by other threads would
+// get every permission.
+static mode_t saved_umask = 022;
+
+static int copy_at(copy_ctx * ctx, int sfd, const char * sname, int dfd, const char * dname);
+
+// Takes the umask for copies and extractions. Call it at start, while
+// there is only the one thread.
+void copy_save_umask(){
+  saved_umask = umask(0);
+  umask(saved_umask);
+}
+
+mode_t copy_umask(){
+  return saved_umask;
+}
+
+// Reports errno for the entry being copied. Returns -1.
+static int copy_error(copy_ctx * ctx){
+  progress_error(ctx->prog, ctx->path, errno);
+  return -1;
+}
+
+// Copies data with read() and write()
+static int copy_rw(copy_ctx * ctx, int in, int out){
+  ssize_t n, w, done;
+
+  while ((n = read(in, ctx->buf, COPY_BUFLEN)) != 0){
+    if (n < 0){
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    for (done = 0; done < n; done += w){
+      if ((w = write(out, ctx->buf + done, n - done)) < 0){
+        if (errno == EINTR){
+          w = 0;
+          continue;
+        }
+        return -1;
+      }
+    }
+    progress_add(ctx->prog, 0, n);
+    progress_tick(ctx->prog);
+    if (ctx->prog->cancel){
+      errno = ECANCELED;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Copies the contents of in to out, using the fastest method that works.
+// A cancelled copy fails with ECANCELED.
+static int copy_data(copy_ctx * ctx, int in, int out, off_t size){
+  ssize_t n;
+  long long copied = 0;
+
+  if (!ctx->no_clone && size > 0){
+    if (ioctl(out, FICLONE, in) == 0){
+      progress_add(ctx->prog, 0, size);
+      return 0;
+    }
+    if (errno == EOPNOTSUPP || errno == ENOTTY || errno == ENOSYS) ctx->no_clone = 1;
+  }
+
+  if (!ctx->no_copy_range){
+    while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) != 0){
+      if (n < 0){
+        if (errno == EINTR) continue;
+        if (copied) return -1;
+        if (errno == ENOSYS) ctx->no_copy_range = 1;
+        // Other filesystems or file types: read and write instead
+        if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP) break;
+        return -1;
+      }
+      copied += n;
+      progress_add(ctx->prog, 0, n);
+      progress_tick(ctx->prog);
+      if (ctx->prog->cancel){
+        errno = ECANCELED;
+        return -1;
+      }
+    }
+    // Files in /proc and the like claim to be empty but aren't
+    if (copied) return 0;
+  }
+  return copy_rw(ctx, in, out);
+}
+
+// Sets the mode and times of a copy from its source. The mode only
+// needs fixing when the umask or an existing file got in the way.
+static void copy_attrs(copy_ctx * ctx, int fd, struct stat * st, int created){
+  struct timespec times[2] = {st->st_atim, st->st_mtim};
+  if (!created || (st->st_mode & ctx->umask)){
+    if (fchmod(fd, st->st_mode & 07777)) copy_error(ctx);
+  }
+  if (futimens(fd, times)) copy_error(ctx);
+}
+
+// Opens an existing dname in dfd for overwriting, like cp -f. One that
+// can't be written to is replaced.
+static int open_existing(int dfd, const char * dname, struct stat * st){
+  struct stat dst;
+  int out;
+
+  if ((out = openat(dfd, dname, O_WRONLY | O_CLOEXEC)) < 0){
+    if (unlinkat(dfd, dname, 0)) return -1;
+    return openat(dfd, dname, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  }
+  // Overwriting a file with itself would truncate it first
+  if (fstat(out, &dst) == 0 && dst.st_dev == st->st_dev && dst.st_ino == st->st_ino){
+    close(out);
+    errno = EEXIST;
+    return -1;
+  }
+  if (ftruncate(out, 0)){
+    close(out);
+    return -1;
+  }
+  return out;
+}
+
+static int copy_file(copy_ctx * ctx, int sfd, const char * sname, int dfd, const char * dname, struct stat * st){
+  int in, out, created = 1, ret = 0;
+
+  if ((in = openat(sfd, sname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) return copy_error(ctx);
+  // Creating the file is the common case, and needs no checks
+  out = openat(dfd, dname, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st->st_mode & 07777);
+  if (out < 0 && errno == EEXIST && !ctx->exclusive){
+    created = 0;
+    out = open_existing(dfd, dname, st);
+  }
+  if (out < 0){
+    close(in);
+    return copy_error(ctx);
+  }
+  if (copy_data(ctx, in, out, st->st_size)){
+    // Half a file is no copy, and must not look like a finished one
+    if (!ctx->prog->cancel) copy_error(ctx);
+    unlinkat(dfd, dname, 0);
+    ret = -1;
+  } else {
+    copy_attrs(ctx, out, st, created);
+  }
+  close(in);
+  close(out);
+  return ret;
+}
+
+static int copy_dir(copy_ctx * ctx, int sfd, const char * sname, int dfd, const char * dname, struct stat * st){
+  struct stat dst;
+  struct dirent * de;
+  DIR * dir;
+  int in, out, ret = 0;
+
+  if ((in = openat(sfd, sname, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) return copy_error(ctx);
+  if ((dir = fdopendir(in)) == NULL){
+    close(in);
+    return copy_error(ctx);
+  }
+  // An existing directory is merged into, like cp -r
+  if (mkdirat(dfd, dname, 0700) && (errno != EEXIST || ctx->exclusive)){
+    closedir(dir);
+    return copy_error(ctx);
+  }
+  if ((out = openat(dfd, dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0){
+    closedir(dir);
+    return copy_error(ctx);
+  }
+  if (!ctx->top_ino && fstat(out, &dst) == 0){
+    ctx->top_dev = dst.st_dev;
+    ctx->top_ino = dst.st_ino;
+  }
+
+  while ((de = readdir(dir)) != NULL && !ctx->prog->cancel){
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+    if (de->d_ino == ctx->top_ino && st->st_dev == ctx->top_dev) continue;
+    if (copy_at(ctx, dirfd(dir), de->d_name, out, de->d_name)) ret = -1;
+  }
+  closedir(dir);
+
+  // Last, as adding the entries changed the times
+  copy_attrs(ctx, out, st, 0);
+  close(out);
+  return ret;
+}
+
+static int copy_link(copy_ctx * ctx, int sfd, const char * sname, int dfd, const char * dname, struct stat * st){
+  struct timespec times[2] = {st->st_atim, st->st_mtim};
+  char target[PATH_MAX];
+  ssize_t len;
+
+  if ((len = readlinkat(sfd, sname, target, PATH_MAX - 1)) < 0) return copy_error(ctx);
+  target[len] = 0;
+  if (symlinkat(target, dfd, dname)){
+    if (errno != EEXIST || ctx->exclusive || unlinkat(dfd, dname, 0) || symlinkat(target, dfd, dname)) return copy_error(ctx);
+  }
+  utimensat(dfd, dname, times, AT_SYMLINK_NOFOLLOW);
+  return 0;
+}
+
+// Copies sname in sfd, whatever it is, to dname in dfd
+static int copy_at(copy_ctx * ctx, int sfd, const char * sname, int dfd, const char * dname){
+  size_t len = strlen(ctx->path);
+  struct stat st;
+  int ret;
+
+  if (!len){
+    snprintf(ctx->path, PATH_MAX, "%s", sname);
+  } else if (len + strlen(sname) + 2 < PATH_MAX){
+    ctx->path[len] = '/';
+    strcpy(&ctx->path[len + 1], sname);
+  }
+
+  if (fstatat(sfd, sname, &st, AT_SYMLINK_NOFOLLOW)){
+    ret = copy_error(ctx);
+  } else if (S_ISDIR(st.st_mode)){
+    ret = copy_dir(ctx, sfd, sname, dfd, dname, &st);
+  } else if (S_ISREG(st.st_mode)){
+    ret = copy_file(ctx, sfd, sname, dfd, dname, &st);
+  } else if (S_ISLNK(st.st_mode)){
+    ret = copy_link(ctx, sfd, sname, dfd, dname, &st);
+  } else if (mknodat(dfd, dname, st.st_mode, st.st_rdev)){
+    ret = copy_error(ctx);
+  } else {
+    ret = 0;
+  }
+
+  ctx->path[len] = 0;
+  progress_add(ctx->prog, 1, 0);
+  progress_tick(ctx->prog);
+  return ret;
+}
+
+// Copies src to name in dfd. With replace, an existing name is
+// overwritten, or merged into if both are directories. Without, it
+// fails with EEXIST, even when the name shows up after the check.
+// Returns 0 if everything was copied, -1 if anything failed, with the
+// errors counted in prog.
+int copy_as(const char * src, int dfd, const char * name, int replace, op_progress * prog){
+  copy_ctx ctx;
+  struct stat st, src_st;
+  int ret;
+
+  memset(&ctx, 0, sizeof(copy_ctx));
+  ctx.prog = prog;
+  ctx.umask = saved_umask;
+  ctx.exclusive = !replace;
+
+  // Nothing to do when pasting something over itself
+  if (lstat(src, &src_st) == 0 && fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+      src_st.st_dev == st.st_dev && src_st.st_ino == st.st_ino){
+    snprintf(ctx.path, PATH_MAX, "%s", src);
+    errno = EEXIST;
+    return copy_error(&ctx);
+  }
+  if (!replace && fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0){
+    progress_error(prog, name, EEXIST);
+    return -1;
+  }
+  if ((ctx.buf = malloc(COPY_BUFLEN)) == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+
+  ret = copy_at(&ctx, AT_FDCWD, src, dfd, name);
+
+  free(ctx.buf);
+  return ret;
+}
+
+// Copies src to dst like cp -rf. A dst that is a directory receives a
+// copy named after src.
+int copy_path(const char * src, const char * dst, op_progress * prog){
+  struct stat st;
+  const char * name = dst;
+  int dfd = AT_FDCWD;
+  int ret;
+
+  if (stat(dst, &st) == 0 && S_ISDIR(st.st_mode)){
+    if ((dfd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0){
+      progress_error(prog, dst, errno);
+      return -1;
+    }
+    name = strrchr(src, '/') ? strrchr(src, '/') + 1 : src;
+  }
+  ret = copy_as(src, dfd, name, 1, prog);
+  if (dfd != AT_FDCWD) close(dfd);
+  return ret;
+}
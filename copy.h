@@ -0,0 +1,14 @@
+// Gopher - In-process recursive copy
+#ifndef COPY_H
+#define COPY_H
+
+#include <sys/types.h>
+
+#include "progress.h"
+
+void copy_save_umask();
+mode_t copy_umask();
+int copy_as(const char * src, int dfd, const char * name, int replace, op_progress * prog);
+int copy_path(const char * src, const char * dst, op_progress * prog);
+
+#endif
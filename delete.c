@@ -0,0 +1,176 @@
+// Gopher - In-process parallel recursive delete
+//
+// Every directory is a task. A worker reads it, unlinks the files and
+// queues the subdirectories as new tasks of the same worker, see walk.c.
+// A directory is removed by whoever finishes its last subdirectory.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "delete.h"
+#include "walk.h"
+
+typedef struct dir_node {
+  walk_dir d;             // first, the walk works on it
+  char name[];            // name in the parent, the whole path for the top
+} dir_node;
+
+typedef struct {
+  op_progress * prog;
+  walker walk;
+  pthread_t main_thread;  // the only one that may report progress
+} delete_ctx;
+
+// Writes the path of name in node to buf, for error messages. One too
+// long for it is cut at the top, leaving the directories that fit.
+static void node_path(dir_node * node, const char * name, char * buf){
+  char tmp[PATH_MAX];
+
+  snprintf(buf, PATH_MAX, "%s", name);
+  for (; node; node = (dir_node *) node->d.parent){
+    if (snprintf(tmp, PATH_MAX, "%s/%s", node->name, buf) >= PATH_MAX) break;
+    strcpy(buf, tmp);
+  }
+}
+
+static void delete_error(delete_ctx * ctx, dir_node * node, const char * name){
+  char path[PATH_MAX];
+  int err = errno;
+  node_path(node, name, path);
+  progress_error(ctx->prog, path, err);
+}
+
+// Called when a directory has been read and all its subdirectories are
+// gone. Removes it, and then maybe its parent, opened again for that.
+static void finish(delete_ctx * ctx, dir_node * node){
+  dir_node * parent;
+  int fd, ret;
+
+  while (node && walk_dir_done(&node->d)){
+    parent = (dir_node *) node->d.parent;
+    if (parent){
+      fd = walk_dir_open(&parent->d);
+      ret = fd < 0 ? -1 : unlinkat(fd, node->name, AT_REMOVEDIR);
+      if (fd >= 0) close(fd);
+    } else {
+      close(node->d.fd);
+      ret = unlinkat(AT_FDCWD, node->name, AT_REMOVEDIR);
+    }
+    if (ret){
+      // A cancelled delete leaves directories that aren't empty
+      if (!(ctx->prog->cancel && errno == ENOTEMPTY)) delete_error(ctx, parent, node->name);
+    } else {
+      progress_add(ctx->prog, 1, 0);
+    }
+    free(node);
+    node = parent;
+  }
+}
+
+static dir_node * new_node(dir_node * parent, const char * name){
+  dir_node * node = malloc(sizeof(dir_node) + strlen(name) + 1);
+  if (node == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  node->d.parent = parent ? &parent->d : NULL;
+  node->d.fd = -1;
+  node->d.pending = 1;
+  strcpy(node->name, name);
+  node->d.name = node->name;
+  return node;
+}
+
+// Empties one directory. Files go right away, subdirectories are queued.
+// The directory is closed once read, so a deep tree runs out of no fds.
+static void empty_dir(delete_ctx * ctx, int worker, dir_node * node){
+  struct dirent * de;
+  struct stat st;
+  DIR * dir;
+  int fd, isdir;
+
+  if (ctx->prog->cancel) return;
+  fd = walk_dir_open(&node->d);
+  if (fd < 0 || (dir = fdopendir(fd)) == NULL){
+    delete_error(ctx, (dir_node *) node->d.parent, node->name);
+    if (fd >= 0) close(fd);
+    return;
+  }
+
+  while ((de = readdir(dir)) != NULL && !ctx->prog->cancel){
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+    isdir = de->d_type == DT_DIR;
+    if (de->d_type == DT_UNKNOWN){
+      isdir = !fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+    }
+    if (isdir){
+      __atomic_add_fetch(&node->d.pending, 1, __ATOMIC_RELAXED);
+      walk_push(&ctx->walk, worker, new_node(node, de->d_name));
+    } else if (unlinkat(fd, de->d_name, 0)){
+      delete_error(ctx, node, de->d_name);
+    } else {
+      progress_add(ctx->prog, 1, 0);
+    }
+    if (pthread_equal(pthread_self(), ctx->main_thread)) progress_tick(ctx->prog);
+  }
+  closedir(dir);
+}
+
+static void delete_task(walker * w, int worker, void * task){
+  empty_dir(w->arg, worker, task);
+  finish(w->arg, task);
+}
+
+// Keeps the progress moving while the main thread waits for work
+static void delete_idle(walker * w, int worker){
+  delete_ctx * ctx = w->arg;
+  (void) worker;
+  if (pthread_equal(pthread_self(), ctx->main_thread)) progress_tick(ctx->prog);
+}
+
+// Deletes path like rm -rf, spreading directories over the pool.
+// Returns 0 if everything is gone, -1 if anything failed, with the
+// errors counted in prog. Setting prog->cancel stops it early.
+int delete_path(const char * path, work_pool * pool, op_progress * prog){
+  delete_ctx ctx;
+  dir_node * top;
+  struct stat st;
+
+  if (lstat(path, &st)){
+    progress_error(prog, path, errno);
+    return -1;
+  }
+  if (!S_ISDIR(st.st_mode)){
+    if (unlink(path)){
+      progress_error(prog, path, errno);
+      return -1;
+    }
+    progress_add(prog, 1, 0);
+    return 0;
+  }
+
+  // The top stays open, everything below is opened from it
+  top = new_node(NULL, path);
+  if ((top->d.fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0){
+    progress_error(prog, path, errno);
+    free(top);
+    return -1;
+  }
+
+  ctx.prog = prog;
+  ctx.main_thread = pthread_self();
+  walk_init(&ctx.walk, pool, delete_task, delete_idle, &ctx);
+  walk_push(&ctx.walk, 0, top);
+  walk_run(&ctx.walk, pool);
+  walk_destroy(&ctx.walk);
+  return prog->errors ? -1 : 0;
+}
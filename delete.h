@@ -0,0 +1,10 @@
+// Gopher - In-process parallel recursive delete
+#ifndef DELETE_H
+#define DELETE_H
+
+#include "pool.h"
+#include "progress.h"
+
+int delete_path(const char * path, work_pool * pool, op_progress * prog);
+
+#endif
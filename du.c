@@ -0,0 +1,456 @@
+// Gopher - Background recursive directory sizes
+//
+// Counts like du -x: files by the blocks they take, a hard linked file
+// once, and without leaving the filesystem of the directory a walk
+// starts from. Every directory is a task of the walk in walk.c, and a
+// total is added to the parent by whoever finishes its last
+// subdirectory. A directory that can't be read makes the totals above
+// it partial, shown as a lower bound and never cached.
+//
+// The total of every directory walked is cached by device and inode,
+// and trusted for as long as the directory's mtime stays the same.
+// Coming back to a directory is then instant, at the price of missing
+// changes deep inside that leave the directories above alone.
+// du_forget() drops the lot.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "du.h"
+#include "walk.h"
+
+#define DU_CACHE_MAX (1 << 20)    // directories remembered before starting over
+
+typedef struct du_node {
+  walk_dir d;             // first, the walk works on it
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  uint64_t bytes;         // added to atomically
+  int partial;            // something below couldn't be read
+  int root;               // index in the request, -1 below the top
+  char name[];            // name in the parent, or in the base directory
+} du_node;
+
+typedef struct {
+  du_engine * du;
+  unsigned generation;    // of the request being walked
+  char ** names;
+  walk_dir base;          // the directory of the request, kept open
+  walker walk;
+  du_table links;         // hard linked files already counted
+} du_walk;
+
+static void table_init(du_table * t){
+  memset(t, 0, sizeof(du_table));
+  pthread_mutex_init(&t->lock, NULL);
+}
+
+static void table_clear(du_table * t){
+  free(t->slots);
+  t->slots = NULL;
+  t->cap = t->used = 0;
+}
+
+static size_t slot_hash(dev_t dev, ino_t ino){
+  return (size_t) ((ino * 0x9e3779b97f4a7c15ULL) ^ (dev * 0xc2b2ae3d27d4eb4fULL)) >> 7;
+}
+
+static void table_grow(du_table * t){
+  du_slot * old = t->slots;
+  size_t oldcap = t->cap, i, j;
+
+  t->cap = t->cap ? t->cap * 2 : 1024;
+  if ((t->slots = calloc(t->cap, sizeof(du_slot))) == NULL){
+    perror("calloc");
+    exit(errno);
+  }
+  for (i = 0; i < oldcap; i++){
+    if (!old[i].ino) continue;
+    for (j = slot_hash(old[i].dev, old[i].ino) & (t->cap - 1); t->slots[j].ino; j = (j + 1) & (t->cap - 1));
+    t->slots[j] = old[i];
+  }
+  free(old);
+}
+
+// Finds the slot of an inode, or the free one where it would go. The
+// table must be locked.
+static du_slot * table_slot(du_table * t, dev_t dev, ino_t ino){
+  size_t i;
+
+  if ((t->used + 1) * 4 >= t->cap * 3) table_grow(t);
+  for (i = slot_hash(dev, ino) & (t->cap - 1); t->slots[i].ino; i = (i + 1) & (t->cap - 1)){
+    if (t->slots[i].ino == ino && t->slots[i].dev == dev) break;
+  }
+  return &t->slots[i];
+}
+
+// Looks up the cached total of a directory, if it hasn't changed since
+static int cache_get(du_engine * du, struct stat * st, uint64_t * bytes){
+  du_slot * s;
+  int hit;
+
+  pthread_mutex_lock(&du->cache.lock);
+  s = table_slot(&du->cache, st->st_dev, st->st_ino);
+  hit = s->ino && s->mtime.tv_sec == st->st_mtim.tv_sec && s->mtime.tv_nsec == st->st_mtim.tv_nsec;
+  if (hit) *bytes = s->bytes;
+  pthread_mutex_unlock(&du->cache.lock);
+  return hit;
+}
+
+static void cache_put(du_engine * du, du_node * node){
+  du_slot * s;
+
+  pthread_mutex_lock(&du->cache.lock);
+  if (du->cache.used >= DU_CACHE_MAX) table_clear(&du->cache);
+  s = table_slot(&du->cache, node->dev, node->ino);
+  if (!s->ino){
+    s->dev = node->dev;
+    s->ino = node->ino;
+    du->cache.used++;
+  }
+  s->mtime = node->mtime;
+  s->bytes = node->bytes;
+  pthread_mutex_unlock(&du->cache.lock);
+}
+
+// Tells whether this is the first link of a file seen in the walk
+static int first_link(du_walk * w, struct stat * st){
+  du_slot * s;
+  int first;
+
+  pthread_mutex_lock(&w->links.lock);
+  s = table_slot(&w->links, st->st_dev, st->st_ino);
+  if ((first = !s->ino)){
+    s->dev = st->st_dev;
+    s->ino = st->st_ino;
+    w->links.used++;
+  }
+  pthread_mutex_unlock(&w->links.lock);
+  return first;
+}
+
+// Hands the total of a requested directory to the UI, unless a newer
+// request came in meanwhile
+static void add_result(du_walk * w, int root, uint64_t bytes, int partial){
+  du_engine * du = w->du;
+  du_result * r;
+
+  pthread_mutex_lock(&du->lock);
+  if (w->generation == du->generation){
+    if (du->nresults == du->results_cap){
+      du->results_cap = du->results_cap ? du->results_cap * 2 : 64;
+      if ((du->results = realloc(du->results, du->results_cap * sizeof(du_result))) == NULL){
+        perror("realloc");
+        exit(errno);
+      }
+    }
+    r = &du->results[du->nresults++];
+    if ((r->name = strdup(w->names[root])) == NULL){
+      perror("strdup");
+      exit(errno);
+    }
+    r->bytes = bytes;
+    r->partial = partial;
+    if (write(du->notify[1], "d", 1) < 0 && errno != EAGAIN) perror("du: write");
+  }
+  pthread_mutex_unlock(&du->lock);
+}
+
+static du_node * new_node(du_node * parent, const char * name, struct stat * st, int root){
+  du_node * node = malloc(sizeof(du_node) + strlen(name) + 1);
+  if (node == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  node->d.parent = parent ? &parent->d : NULL;
+  node->d.fd = -1;
+  node->d.pending = 1;
+  node->dev = st->st_dev;
+  node->ino = st->st_ino;
+  node->mtime = st->st_mtim;
+  node->bytes = (uint64_t) st->st_blocks * 512;
+  node->partial = 0;
+  node->root = root;
+  strcpy(node->name, name);
+  node->d.name = node->name;
+  return node;
+}
+
+// Called when a directory has been read and all its subdirectories
+// are counted. Its total is cached and goes to its parent, and then
+// maybe the parent is done too. A cancelled walk only frees.
+static void finish(du_walk * w, du_node * node){
+  du_node * parent;
+
+  while (node && walk_dir_done(&node->d)){
+    parent = node->root < 0 ? (du_node *) node->d.parent : NULL;
+    if (node->d.fd >= 0) close(node->d.fd);
+    if (!w->du->cancel){
+      if (!node->partial) cache_put(w->du, node);
+      if (parent){
+        __atomic_add_fetch(&parent->bytes, node->bytes, __ATOMIC_RELAXED);
+        if (node->partial) __atomic_store_n(&parent->partial, 1, __ATOMIC_RELAXED);
+      } else {
+        add_result(w, node->root, node->bytes, node->partial);
+      }
+    }
+    free(node);
+    node = parent;
+  }
+}
+
+// Counts the files of one directory and queues its subdirectories,
+// except those whose total is cached. The directory is closed once
+// read, so a deep tree runs out of no fds.
+static void read_dir(du_walk * w, int worker, du_node * node){
+  struct dirent * de;
+  struct stat st;
+  uint64_t bytes;
+  DIR * dir;
+  int fd;
+
+  if (w->du->cancel) return;
+  // A requested symlink is followed, and stays open for those below
+  if (!node->d.parent) node->d.fd = openat(w->base.fd, node->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  fd = node->d.parent || node->d.fd >= 0 ? walk_dir_open(&node->d) : -1;
+  if (fd < 0 || (dir = fdopendir(fd)) == NULL){
+    // One deleted meanwhile is simply gone
+    if (errno != ENOENT) node->partial = 1;
+    if (fd >= 0) close(fd);
+    return;
+  }
+
+  while ((de = readdir(dir)) != NULL && !w->du->cancel){
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+    if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)){
+      if (errno != ENOENT) node->partial = 1;
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)){
+      if (st.st_dev != node->dev) continue;
+      if (cache_get(w->du, &st, &bytes)){
+        __atomic_add_fetch(&node->bytes, bytes, __ATOMIC_RELAXED);
+        continue;
+      }
+      __atomic_add_fetch(&node->d.pending, 1, __ATOMIC_RELAXED);
+      walk_push(&w->walk, worker, new_node(node, de->d_name, &st, -1));
+    } else if (st.st_nlink < 2 || first_link(w, &st)){
+      __atomic_add_fetch(&node->bytes, (uint64_t) st.st_blocks * 512, __ATOMIC_RELAXED);
+    }
+  }
+  closedir(dir);
+}
+
+static void du_task(walker * walk, int worker, void * task){
+  read_dir(walk->arg, worker, task);
+  finish(walk->arg, task);
+}
+
+// Sizes the named directories of base. Cached ones are answered right
+// away, the rest are walked together on the pool.
+static void walk(du_engine * du, const char * base, char ** names, int count, unsigned generation){
+  du_walk w;
+  struct stat st;
+  uint64_t bytes;
+  du_node * node;
+  int i, queued = 0;
+
+  memset(&w, 0, sizeof(du_walk));
+  w.du = du;
+  w.generation = generation;
+  w.names = names;
+  if ((w.base.fd = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) return;
+  w.base.name = base;
+  walk_init(&w.walk, &du->pool, du_task, NULL, &w);
+  table_init(&w.links);
+
+  for (i = 0; i < count && !du->cancel; i++){
+    // The listing shows symlinks to directories as directories, so
+    // they are sized too, though nothing below them is followed
+    if (fstatat(w.base.fd, names[i], &st, 0) || !S_ISDIR(st.st_mode)) continue;
+    if (cache_get(du, &st, &bytes)){
+      add_result(&w, i, bytes, 0);
+      continue;
+    }
+    // Directories are opened from base, symlinks to them on their own
+    node = new_node(NULL, names[i], &st, i);
+    if (!fstatat(w.base.fd, names[i], &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode)) node->d.parent = &w.base;
+    walk_push(&w.walk, i % w.walk.nqueues, node);
+    queued = 1;
+  }
+  if (queued) walk_run(&w.walk, &du->pool);
+
+  walk_destroy(&w.walk);
+  table_clear(&w.links);
+  pthread_mutex_destroy(&w.links.lock);
+  close(w.base.fd);
+}
+
+static void free_names(char ** names, int count){
+  int i;
+  for (i = 0; i < count; i++){
+    free(names[i]);
+  }
+  free(names);
+}
+
+// Takes requests one at a time, the latest only
+static void * du_main(void * arg){
+  du_engine * du = arg;
+  char base[MAXLEN];
+  char ** names;
+  unsigned generation;
+  int count;
+
+  pthread_mutex_lock(&du->lock);
+  while (1){
+    while (!du->shutdown && !du->requested){
+      pthread_cond_wait(&du->wake, &du->lock);
+    }
+    if (du->shutdown) break;
+    strcpy(base, du->base);
+    names = du->names;
+    count = du->count;
+    generation = du->generation;
+    du->names = NULL;
+    du->count = 0;
+    du->requested = 0;
+    du->cancel = 0;
+    pthread_mutex_unlock(&du->lock);
+
+    walk(du, base, names, count, generation);
+    free_names(names, count);
+
+    pthread_mutex_lock(&du->lock);
+  }
+  pthread_mutex_unlock(&du->lock);
+  return NULL;
+}
+
+int du_init(du_engine * du, int pool_threads){
+  sigset_t all, old;
+  int ret = 0;
+
+  memset(du, 0, sizeof(du_engine));
+  pthread_mutex_init(&du->lock, NULL);
+  pthread_cond_init(&du->wake, NULL);
+  table_init(&du->cache);
+  if (pipe2(du->notify, O_NONBLOCK | O_CLOEXEC)){
+    perror("pipe");
+    exit(errno);
+  }
+
+  // Signals must keep landing on the UI thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pool_init(&du->pool, pool_threads);
+  if (pthread_create(&du->thread, NULL, du_main, du)){
+    fprintf(stderr, "du: can't start the walker\n");
+    ret = -1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return ret;
+}
+
+// Drops the pending request and the results not yet taken, and stops
+// the running walk. The lock must be held.
+static void drop_request(du_engine * du){
+  int i;
+
+  free_names(du->names, du->count);
+  du->names = NULL;
+  du->count = 0;
+  du->requested = 0;
+  du->generation++;
+  du->cancel = 1;
+  for (i = 0; i < du->nresults; i++){
+    free(du->results[i].name);
+  }
+  du->nresults = 0;
+}
+
+// Asks for the totals of the named directories of base, in place of
+// whatever was asked before
+void du_request(du_engine * du, const char * base, char ** names, int count){
+  int i;
+
+  pthread_mutex_lock(&du->lock);
+  drop_request(du);
+  snprintf(du->base, MAXLEN, "%s", base);
+  if ((du->names = malloc((count ? count : 1) * sizeof(char *))) == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  for (i = 0; i < count; i++){
+    if ((du->names[i] = strdup(names[i])) == NULL){
+      perror("strdup");
+      exit(errno);
+    }
+  }
+  du->count = count;
+  du->requested = 1;
+  pthread_cond_signal(&du->wake);
+  pthread_mutex_unlock(&du->lock);
+}
+
+void du_cancel(du_engine * du){
+  pthread_mutex_lock(&du->lock);
+  drop_request(du);
+  pthread_mutex_unlock(&du->lock);
+}
+
+// Takes the totals found since the last call. Returns how many there
+// are. The caller frees them with du_free_results().
+int du_results(du_engine * du, du_result ** results){
+  char buf[64];
+  int count;
+
+  while (read(du->notify[0], buf, sizeof(buf)) > 0);
+  pthread_mutex_lock(&du->lock);
+  *results = du->results;
+  count = du->nresults;
+  du->results = NULL;
+  du->nresults = du->results_cap = 0;
+  pthread_mutex_unlock(&du->lock);
+  return count;
+}
+
+void du_free_results(du_result * results, int count){
+  int i;
+  for (i = 0; i < count; i++){
+    free(results[i].name);
+  }
+  free(results);
+}
+
+// Forgets every cached total, so the next request walks everything
+void du_forget(du_engine * du){
+  pthread_mutex_lock(&du->cache.lock);
+  table_clear(&du->cache);
+  pthread_mutex_unlock(&du->cache.lock);
+}
+
+void du_destroy(du_engine * du){
+  pthread_mutex_lock(&du->lock);
+  drop_request(du);
+  du->shutdown = 1;
+  pthread_cond_signal(&du->wake);
+  pthread_mutex_unlock(&du->lock);
+  pthread_join(du->thread, NULL);
+
+  free(du->results);
+  pool_destroy(&du->pool);
+  table_clear(&du->cache);
+  pthread_mutex_destroy(&du->cache.lock);
+  close(du->notify[0]);
+  close(du->notify[1]);
+}
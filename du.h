@@ -0,0 +1,69 @@
+// Gopher - Background recursive directory sizes
+#ifndef DU_H
+#define DU_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "gopher.h"
+#include "pool.h"
+
+// Total disk use of one directory of the request
+typedef struct {
+  char * name;
+  uint64_t bytes;
+  int partial;            // some of it couldn't be read, bytes is a floor
+} du_result;
+
+// A directory seen before, or a hard linked file already counted
+typedef struct {
+  dev_t dev;
+  ino_t ino;              // 0 for a free slot
+  struct timespec mtime;
+  uint64_t bytes;
+} du_slot;
+
+typedef struct {
+  du_slot * slots;
+  size_t cap;             // power of two
+  size_t used;
+  pthread_mutex_t lock;
+} du_table;
+
+// Sizes the directories of one listing at a time on a thread of its
+// own. A new request replaces the one before, which stops early.
+// Totals are kept by inode and reused while the directory's mtime is
+// the same.
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int shutdown;
+
+  char base[MAXLEN];      // the request: names in directory base
+  char ** names;
+  int count;
+  int requested;          // a request waits for the thread
+  unsigned generation;    // bumped by every request and cancel
+  volatile int cancel;    // the running walk is stale
+
+  du_result * results;    // done and not yet taken
+  int nresults;
+  int results_cap;
+  int notify[2];          // readable whenever results came in
+
+  du_table cache;
+  work_pool pool;
+} du_engine;
+
+int du_init(du_engine * du, int pool_threads);
+void du_request(du_engine * du, const char * base, char ** names, int count);
+void du_cancel(du_engine * du);
+int du_results(du_engine * du, du_result ** results);
+void du_free_results(du_result * results, int count);
+void du_forget(du_engine * du);
+void du_destroy(du_engine * du);
+
+#endif
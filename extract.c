@@ -0,0 +1,1479 @@
+// Gopher - In-process archive extraction
+//
+// Reads .zip, .tar, .tar.gz and .tar.xz itself, with zlib and liblzma,
+// instead of running unzip or tar. The format is told by the first
+// bytes of the file, not by its name. Entry names are cleaned so that
+// nothing lands outside the destination: leading slashes are dropped,
+// ".." is refused, and parent directories are walked one component at
+// a time without following symlinks. Symlinks whose target is absolute
+// or climbs out of the destination aren't made.
+//
+// A tar stream has to be decompressed in order, on one thread. Small
+// files are collected into batches that the worker pool creates and
+// writes in parallel, and big ones are streamed straight to disk. Zip
+// has a central directory, so all of its entries are inflated in
+// parallel. Progress counts entries written and archive bytes read.
+//
+// The same readers list an archive without writing anything, for
+// browsing it as a directory, and take out just some of its members.
+// Plain tar and zip are read only where the wanted members are, while
+// a compressed tar stream is read from the start up to the last one.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <lzma.h>
+
+#include "extract.h"
+#include "copy.h"
+
+#define EXTRACT_BUFLEN (1024 * 1024)
+#define EXTRACT_SMALL (256 * 1024)            // tar files up to this are batched
+#define EXTRACT_BATCH_BYTES (16 * 1024 * 1024)
+#define EXTRACT_BATCH_FILES 1024
+#define EXTRACT_MAX_META (1024 * 1024)        // longest pax or GNU name record
+#define ZIP_BUFLEN (256 * 1024)
+
+typedef enum {
+  FORMAT_TAR,
+  FORMAT_GZIP,
+  FORMAT_XZ,
+  FORMAT_ZIP
+} archive_format;
+
+// A tar file small enough to be held until its batch is written
+typedef struct {
+  char * path;
+  mode_t mode;
+  time_t mtime;
+  char * data;
+  size_t size;
+} small_file;
+
+// A directory, whose times are set once everything inside is written
+typedef struct {
+  char * path;
+  time_t mtime;
+} dir_time;
+
+// One member of a zip archive, from the central directory
+typedef struct {
+  char * path;
+  int method;
+  uint32_t crc;
+  uint64_t csize;
+  uint64_t usize;
+  uint64_t offset;        // of the local header
+  mode_t mode;
+  time_t mtime;
+} zip_entry;
+
+typedef struct {
+  const char * archive;
+  int afd;                // the archive
+  int dfd;                // destination directory
+  op_progress * prog;
+  work_pool * pool;
+  mode_t umask;
+  char * buf;             // EXTRACT_BUFLEN, for the reading thread
+
+  dir_time * dirs;
+  int ndirs;
+  int dirs_cap;
+
+  small_file * batch;
+  int nbatch;
+  int batch_cap;
+  size_t batch_bytes;
+
+  zip_entry * entries;
+  int nentries;
+
+  archive_index * index;  // only list the members into this
+  archive_pick * only;    // only extract these, sorted by member
+  int nonly;
+  uint64_t stop_at;       // tar stream position past the last of them
+} extract_ctx;
+
+// Decompressed view of a tar archive
+typedef struct {
+  int fd;
+  archive_format format;
+  z_stream z;
+  lzma_stream x;
+  unsigned char * in;
+  int eof;                // all of the file was read
+  int end;                // the decompressor saw the end of its data
+  uint64_t pos;           // in the tar stream
+  op_progress * prog;
+} in_stream;
+
+static uint16_t le16(const unsigned char * p){
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char * p){
+  return (uint32_t) le16(p) | (uint32_t) le16(p + 2) << 16;
+}
+
+static uint64_t le64(const unsigned char * p){
+  return (uint64_t) le32(p) | (uint64_t) le32(p + 4) << 32;
+}
+
+static void * xmalloc(size_t size){
+  void * p = malloc(size);
+  if (p == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  return p;
+}
+
+static char * xstrndup(const char * s, size_t len){
+  char * p = strndup(s, len);
+  if (p == NULL){
+    perror("strndup");
+    exit(errno);
+  }
+  return p;
+}
+
+// Cleans an entry name in place: drops leading slashes, empty and "."
+// components. Returns -1 if the name has a ".." or nothing is left.
+static int clean_path(char * path){
+  char * src = path, * dst = path;
+  size_t len;
+
+  while (*src){
+    len = strcspn(src, "/");
+    if (len == 2 && src[0] == '.' && src[1] == '.') return -1;
+    if (len && !(len == 1 && src[0] == '.')){
+      if (dst != path) *dst++ = '/';
+      memmove(dst, src, len);
+      dst += len;
+    }
+    src += len;
+    if (*src == '/') src++;
+  }
+  *dst = 0;
+  return path[0] ? 0 : -1;
+}
+
+// Opens the directory that holds path, creating missing parents. Each
+// component is opened with O_NOFOLLOW, so a symlink from the archive
+// can't lead outside the destination. Points *name at the last
+// component. Returns the fd, which may be the destination's own.
+static int open_parent(extract_ctx * ctx, const char * path, const char ** name){
+  char comp[NAME_MAX + 1];
+  const char * p = path, * slash;
+  int fd = ctx->dfd, next;
+  size_t len;
+
+  while ((slash = strchr(p, '/')) != NULL){
+    if ((len = slash - p) > NAME_MAX){
+      errno = ENAMETOOLONG;
+      next = -1;
+    } else {
+      memcpy(comp, p, len);
+      comp[len] = 0;
+      next = openat(fd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (next < 0 && errno == ENOENT && (mkdirat(fd, comp, 0777) == 0 || errno == EEXIST)){
+        next = openat(fd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      }
+    }
+    if (fd != ctx->dfd) close(fd);
+    if (next < 0) return -1;
+    fd = next;
+    p = slash + 1;
+  }
+  *name = p;
+  return fd;
+}
+
+static void close_parent(extract_ctx * ctx, int fd){
+  if (fd != ctx->dfd) close(fd);
+}
+
+// Creates path for writing. Whatever is there is replaced, and a
+// symlink is removed rather than followed.
+static int open_output(extract_ctx * ctx, const char * path, mode_t mode){
+  const char * name;
+  int pfd, fd;
+
+  if ((pfd = open_parent(ctx, path, &name)) < 0) return -1;
+  fd = openat(pfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode & 0777);
+  if (fd < 0 && errno == EEXIST){
+    fd = openat(pfd, name, O_WRONLY | O_TRUNC | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0 && errno == ELOOP && unlinkat(pfd, name, 0) == 0){
+      fd = openat(pfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode & 0777);
+    } else if (fd >= 0){
+      fchmod(fd, mode & 0777 & ~ctx->umask);
+    }
+  }
+  close_parent(ctx, pfd);
+  return fd;
+}
+
+static int write_all(int fd, const char * buf, size_t len){
+  ssize_t w;
+  while (len){
+    if ((w = write(fd, buf, len)) < 0){
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += w;
+    len -= w;
+  }
+  return 0;
+}
+
+// Sets the times of a written file, closes it and counts it
+static int finish_output(extract_ctx * ctx, int fd, time_t mtime){
+  struct timespec ts[2] = {{mtime, 0}, {mtime, 0}};
+  futimens(fd, ts);
+  if (close(fd)) return -1;
+  progress_add(ctx->prog, 1, 0);
+  return 0;
+}
+
+// Writes a whole file held in memory
+static void write_file(extract_ctx * ctx, const char * path, mode_t mode, time_t mtime, const char * data, size_t size){
+  int fd;
+
+  if ((fd = open_output(ctx, path, mode)) < 0 || write_all(fd, data, size)){
+    progress_error(ctx->prog, path, errno);
+    if (fd >= 0) close(fd);
+    return;
+  }
+  if (finish_output(ctx, fd, mtime)) progress_error(ctx->prog, path, errno);
+}
+
+static void make_dir(extract_ctx * ctx, const char * path, mode_t mode, time_t mtime){
+  const char * name;
+  int pfd;
+
+  if ((pfd = open_parent(ctx, path, &name)) < 0 ||
+      (mkdirat(pfd, name, mode & 0777) && errno != EEXIST)){
+    progress_error(ctx->prog, path, errno);
+    if (pfd >= 0) close_parent(ctx, pfd);
+    return;
+  }
+  close_parent(ctx, pfd);
+  progress_add(ctx->prog, 1, 0);
+
+  if (ctx->ndirs == ctx->dirs_cap){
+    ctx->dirs_cap = ctx->dirs_cap ? ctx->dirs_cap * 2 : 64;
+    if ((ctx->dirs = realloc(ctx->dirs, ctx->dirs_cap * sizeof(dir_time))) == NULL){
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  ctx->dirs[ctx->ndirs].path = xstrndup(path, strlen(path));
+  ctx->dirs[ctx->ndirs++].mtime = mtime;
+}
+
+// Returns 1 if a symlink at path would point outside the destination.
+// ".." may only lead the target, and no further up than path is deep:
+// the directories above path are real ones, while one further down may
+// be a symlink itself, to a place whose ".." is elsewhere.
+static int link_escapes(const char * path, const char * target){
+  const char * p;
+  size_t len;
+  int depth = 0, down = 0;
+
+  if (target[0] == '/') return 1;
+  for (p = path; (p = strchr(p, '/')) != NULL; p++) depth++;
+  for (p = target; *p; p += len + (p[len] == '/')){
+    len = strcspn(p, "/");
+    if (len == 2 && p[0] == '.' && p[1] == '.'){
+      if (down || --depth < 0) return 1;
+    } else if (len && !(len == 1 && p[0] == '.')){
+      down = 1;
+    }
+  }
+  return 0;
+}
+
+// Makes path a symlink to target, or with hard set a hard link to the
+// entry target of the same archive
+static void make_link(extract_ctx * ctx, const char * path, char * target, int hard){
+  const char * name, * tname;
+  int pfd, tfd = -1, ret;
+
+  if (!hard && link_escapes(path, target)){
+    progress_error(ctx->prog, path, EPERM);
+    return;
+  }
+  if ((pfd = open_parent(ctx, path, &name)) < 0){
+    progress_error(ctx->prog, path, errno);
+    return;
+  }
+  if (hard && clean_path(target)) errno = EPERM;
+  else if (hard) tfd = open_parent(ctx, target, &tname);
+  if (hard && tfd < 0){
+    progress_error(ctx->prog, path, errno);
+    close_parent(ctx, pfd);
+    return;
+  }
+  unlinkat(pfd, name, 0);
+  ret = hard ? linkat(tfd, tname, pfd, name, 0) : symlinkat(target, pfd, name);
+  if (ret) progress_error(ctx->prog, path, errno);
+  else progress_add(ctx->prog, 1, 0);
+  if (hard) close_parent(ctx, tfd);
+  close_parent(ctx, pfd);
+}
+
+// Sets directory times, deepest last written first
+static void set_dir_times(extract_ctx * ctx){
+  struct timespec ts[2];
+  const char * name;
+  int i, pfd;
+
+  for (i = ctx->ndirs - 1; i >= 0; i--){
+    if ((pfd = open_parent(ctx, ctx->dirs[i].path, &name)) >= 0){
+      ts[0].tv_sec = ts[1].tv_sec = ctx->dirs[i].mtime;
+      ts[0].tv_nsec = ts[1].tv_nsec = 0;
+      utimensat(pfd, name, ts, AT_SYMLINK_NOFOLLOW);
+      close_parent(ctx, pfd);
+    }
+    free(ctx->dirs[i].path);
+  }
+  free(ctx->dirs);
+}
+
+// Reads up to len decompressed bytes. Returns the number read, 0 at
+// the end of the archive and -1 on errors. Concatenated gzip members,
+// as written by parallel compressors, are read as one stream.
+static ssize_t stream_read(in_stream * s, void * buf, size_t len){
+  ssize_t n;
+  int ret;
+
+  if (s->format == FORMAT_TAR){
+    while ((n = read(s->fd, buf, len)) < 0 && errno == EINTR);
+    if (n > 0){
+      s->pos += n;
+      progress_add(s->prog, 0, n);
+    }
+    return n;
+  }
+
+  s->z.next_out = buf;
+  s->z.avail_out = len;
+  s->x.next_out = buf;
+  s->x.avail_out = len;
+  while ((s->format == FORMAT_GZIP ? s->z.avail_out : s->x.avail_out) == len){
+    if ((s->format == FORMAT_GZIP ? s->z.avail_in : s->x.avail_in) == 0 && !s->eof){
+      while ((n = read(s->fd, s->in, EXTRACT_BUFLEN)) < 0 && errno == EINTR);
+      if (n < 0) return -1;
+      if (n == 0) s->eof = 1;
+      progress_add(s->prog, 0, n);
+      s->z.next_in = s->in;
+      s->z.avail_in = n;
+      s->x.next_in = s->in;
+      s->x.avail_in = n;
+    }
+
+    if (s->format == FORMAT_XZ){
+      if (s->end) return 0;
+      ret = lzma_code(&s->x, s->eof ? LZMA_FINISH : LZMA_RUN);
+      if (ret == LZMA_STREAM_END){
+        s->end = 1;
+      } else if (ret != LZMA_OK){
+        errno = EBADMSG;
+        return -1;
+      }
+      continue;
+    }
+
+    if (s->end){
+      // Another gzip member may follow. Anything else is the end.
+      if (s->z.avail_in == 0 && s->eof) return 0;
+      if (s->z.avail_in == 0) continue;
+      if (s->z.next_in[0] != 0x1f) return 0;
+      inflateReset(&s->z);
+      s->end = 0;
+    }
+    ret = inflate(&s->z, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END){
+      s->end = 1;
+    } else if (ret != Z_OK && !(ret == Z_BUF_ERROR && !s->eof)){
+      errno = EBADMSG;
+      return -1;
+    }
+  }
+  n = len - (s->format == FORMAT_GZIP ? s->z.avail_out : s->x.avail_out);
+  s->pos += n;
+  return n;
+}
+
+// Reads exactly len bytes. Returns 1, 0 at a clean end or -1.
+static int read_full(in_stream * s, void * buf, size_t len){
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len){
+    if ((n = stream_read(s, (char *) buf + done, len - done)) < 0) return -1;
+    if (n == 0){
+      if (done == 0) return 0;
+      errno = EBADMSG;
+      return -1;
+    }
+    done += n;
+  }
+  return 1;
+}
+
+// Skips data of the tar stream. A plain tar file is seeked through.
+static int skip_bytes(extract_ctx * ctx, in_stream * s, uint64_t len){
+  size_t n;
+  if (s->format == FORMAT_TAR && len){
+    if (lseek(s->fd, len, SEEK_CUR) < 0) return -1;
+    s->pos += len;
+    progress_add(s->prog, 0, len);
+    return 0;
+  }
+  while (len){
+    n = len > EXTRACT_BUFLEN ? EXTRACT_BUFLEN : len;
+    if (read_full(s, ctx->buf, n) != 1) return -1;
+    len -= n;
+  }
+  return 0;
+}
+
+static void write_batch(int begin, int end, void * arg){
+  extract_ctx * ctx = arg;
+  small_file * f;
+  int i;
+
+  for (i = begin; i < end && !ctx->prog->cancel; i++){
+    f = &ctx->batch[i];
+    write_file(ctx, f->path, f->mode, f->mtime, f->data, f->size);
+  }
+}
+
+// Writes the waiting small files on the pool
+static void flush_batch(extract_ctx * ctx){
+  int i;
+
+  pool_for(ctx->pool, ctx->nbatch, 8, write_batch, ctx);
+  for (i = 0; i < ctx->nbatch; i++){
+    free(ctx->batch[i].path);
+    free(ctx->batch[i].data);
+  }
+  ctx->nbatch = 0;
+  ctx->batch_bytes = 0;
+}
+
+static void add_small(extract_ctx * ctx, const char * path, mode_t mode, time_t mtime, char * data, size_t size){
+  small_file * f;
+
+  if (ctx->nbatch == ctx->batch_cap){
+    ctx->batch_cap = ctx->batch_cap ? ctx->batch_cap * 2 : 64;
+    if ((ctx->batch = realloc(ctx->batch, ctx->batch_cap * sizeof(small_file))) == NULL){
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  f = &ctx->batch[ctx->nbatch++];
+  f->path = xstrndup(path, strlen(path));
+  f->mode = mode;
+  f->mtime = mtime;
+  f->data = data;
+  f->size = size;
+  ctx->batch_bytes += size;
+  if (ctx->nbatch >= EXTRACT_BATCH_FILES || ctx->batch_bytes >= EXTRACT_BATCH_BYTES) flush_batch(ctx);
+}
+
+// Streams a big file from the archive to disk
+static int stream_file(extract_ctx * ctx, in_stream * s, const char * path, mode_t mode, time_t mtime, uint64_t size){
+  size_t n;
+  int fd;
+
+  if ((fd = open_output(ctx, path, mode)) < 0){
+    progress_error(ctx->prog, path, errno);
+    return skip_bytes(ctx, s, size);
+  }
+  while (size){
+    n = size > EXTRACT_BUFLEN ? EXTRACT_BUFLEN : size;
+    if (read_full(s, ctx->buf, n) != 1){
+      close(fd);
+      return -1;
+    }
+    if (write_all(fd, ctx->buf, n)){
+      progress_error(ctx->prog, path, errno);
+      close(fd);
+      return skip_bytes(ctx, s, size - n);
+    }
+    size -= n;
+  }
+  if (finish_output(ctx, fd, mtime)) progress_error(ctx->prog, path, errno);
+  return 0;
+}
+
+// A tar number field: octal, or base 256 if the top bit is set
+static uint64_t tar_number(const unsigned char * field, int len){
+  uint64_t val = 0;
+  int i;
+
+  if (field[0] & 0x80){
+    val = field[0] & 0x7f;
+    for (i = 1; i < len; i++) val = val << 8 | field[i];
+    return val;
+  }
+  for (i = 0; i < len && (field[i] == ' ' || field[i] == 0); i++);
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) val = val << 3 | (field[i] - '0');
+  return val;
+}
+
+static int tar_checksum_ok(const unsigned char * hdr){
+  unsigned sum = 0;
+  int i;
+  for (i = 0; i < 512; i++) sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
+  return sum == tar_number(hdr + 148, 8);
+}
+
+// Finds the wanted member named by the first len bytes of path
+static archive_pick * find_pick(extract_ctx * ctx, const char * path, size_t len){
+  int lo = 0, hi = ctx->nonly, mid, c;
+
+  while (lo < hi){
+    mid = (lo + hi) / 2;
+    if ((c = strncmp(ctx->only[mid].member, path, len)) == 0) c = ctx->only[mid].member[len] ? 1 : 0;
+    if (c == 0) return &ctx->only[mid];
+    if (c < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return NULL;
+}
+
+// Tells whether an entry is a wanted member or inside one, and writes
+// the path it gets under the destination to out. Returns 1 if wanted,
+// 0 if not, or -1 if the new path doesn't fit.
+static int pick_path(extract_ctx * ctx, const char * path, char * out, size_t cap){
+  archive_pick * pick;
+  size_t len = strlen(path);
+
+  for (;;){
+    if ((pick = find_pick(ctx, path, len)) != NULL){
+      if ((size_t) snprintf(out, cap, "%s%s", pick->name, path + len) >= cap){
+        errno = ENAMETOOLONG;
+        return -1;
+      }
+      return 1;
+    }
+    while (len && path[len - 1] != '/') len--;
+    if (len-- == 0) return 0;
+  }
+}
+
+// Adds a member to the index being built
+static void index_add(archive_index * idx, const char * path, mode_t mode, time_t mtime, uint64_t size, uint64_t pos){
+  archive_member * m;
+  const char * slash;
+
+  if (idx->count == idx->cap){
+    idx->cap = idx->cap ? idx->cap * 2 : 256;
+    if ((idx->members = realloc(idx->members, idx->cap * sizeof(archive_member))) == NULL){
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  m = &idx->members[idx->count++];
+  m->path = xstrndup(path, strlen(path));
+  m->name = (slash = strrchr(path, '/')) ? slash + 1 - path : 0;
+  m->mode = mode;
+  m->mtime = mtime;
+  m->size = size;
+  m->pos = pos;
+}
+
+// Lists a tar entry. Hard links are shown as the files they are.
+static void index_tar(archive_index * idx, const char * path, int type, mode_t mode, time_t mtime, uint64_t size, uint64_t pos){
+  switch (type){
+  case '0':
+  case '\0':
+  case '7':
+  case '1':
+    mode = S_IFREG | (mode & 07777);
+    break;
+  case '5':
+    mode = S_IFDIR | (mode & 07777);
+    size = 0;
+    break;
+  case '2':
+    mode = S_IFLNK | 0777;
+    break;
+  default:
+    return;
+  }
+  index_add(idx, path, mode, mtime, type == '1' ? 0 : size, pos);
+}
+
+// Reads a name or pax record of size bytes, NUL terminated
+static char * read_meta(in_stream * s, uint64_t size){
+  uint64_t padded = (size + 511) & ~511ULL;
+  char * data;
+
+  if (size > EXTRACT_MAX_META){
+    errno = EFBIG;
+    return NULL;
+  }
+  data = xmalloc(padded + 1);
+  if (read_full(s, data, padded) != 1){
+    free(data);
+    return NULL;
+  }
+  data[size] = 0;
+  return data;
+}
+
+// Extended pax header values that matter here
+typedef struct {
+  char * path;
+  char * link;
+  uint64_t size;
+  int has_size;
+  time_t mtime;
+  int has_mtime;
+} pax_header;
+
+static void parse_pax(char * data, size_t len, pax_header * pax){
+  char * p = data, * end = data + len, * key, * eq, * val, * sp;
+  long rec;
+
+  while (p < end){
+    rec = strtol(p, &sp, 10);
+    if (rec <= 0 || rec > end - p || *sp != ' ') break;
+    key = sp + 1;
+    if ((eq = memchr(key, '=', p + rec - key)) == NULL) break;
+    val = eq + 1;
+    if (eq - key == 4 && !memcmp(key, "path", 4)){
+      free(pax->path);
+      pax->path = xstrndup(val, p + rec - 1 - val);
+    } else if (eq - key == 8 && !memcmp(key, "linkpath", 8)){
+      free(pax->link);
+      pax->link = xstrndup(val, p + rec - 1 - val);
+    } else if (eq - key == 4 && !memcmp(key, "size", 4)){
+      pax->size = strtoull(val, NULL, 10);
+      pax->has_size = 1;
+    } else if (eq - key == 5 && !memcmp(key, "mtime", 5)){
+      pax->mtime = strtoll(val, NULL, 10);
+      pax->has_mtime = 1;
+    }
+    p += rec;
+  }
+}
+
+static int extract_tar(extract_ctx * ctx, in_stream * s){
+  unsigned char hdr[512];
+  char path[PATH_MAX + 256], link[PATH_MAX + 256], picked[PATH_MAX + 256];
+  char * long_name = NULL, * long_link = NULL, * meta, * data;
+  pax_header pax;
+  uint64_t size, padding;
+  time_t mtime;
+  mode_t mode;
+  int type, i, ret = 0, r;
+
+  memset(&pax, 0, sizeof(pax_header));
+  while (!ctx->prog->cancel && !(ctx->stop_at && s->pos >= ctx->stop_at)){
+    if ((r = read_full(s, hdr, 512)) <= 0){
+      if (r < 0) ret = -1;
+      break;
+    }
+    for (i = 0; i < 512 && !hdr[i]; i++);
+    if (i == 512) break;
+    if (!tar_checksum_ok(hdr)){
+      errno = EBADMSG;
+      ret = -1;
+      break;
+    }
+
+    type = hdr[156];
+    size = tar_number(hdr + 124, 12);
+    padding = (512 - size % 512) % 512;
+
+    // Headers that describe the next entry
+    if (type == 'L' || type == 'K' || type == 'x'){
+      if ((meta = read_meta(s, size)) == NULL){
+        ret = -1;
+        break;
+      }
+      if (type == 'L'){
+        free(long_name);
+        long_name = meta;
+      } else if (type == 'K'){
+        free(long_link);
+        long_link = meta;
+      } else {
+        parse_pax(meta, size, &pax);
+        free(meta);
+      }
+      continue;
+    }
+
+    if (pax.has_size){
+      size = pax.size;
+      padding = (512 - size % 512) % 512;
+    }
+    mtime = pax.has_mtime ? pax.mtime : (time_t) tar_number(hdr + 136, 12);
+    mode = tar_number(hdr + 100, 8);
+
+    if (long_name || pax.path){
+      snprintf(path, sizeof(path), "%s", long_name ? long_name : pax.path);
+    } else if (!memcmp(hdr + 257, "ustar", 5) && hdr[345]){
+      snprintf(path, sizeof(path), "%.155s/%.100s", hdr + 345, hdr + 0);
+    } else {
+      snprintf(path, sizeof(path), "%.100s", hdr + 0);
+    }
+    if (long_link || pax.link){
+      snprintf(link, sizeof(link), "%s", long_link ? long_link : pax.link);
+    } else {
+      snprintf(link, sizeof(link), "%.100s", hdr + 157);
+    }
+    free(long_name);
+    free(long_link);
+    free(pax.path);
+    free(pax.link);
+    long_name = long_link = NULL;
+    memset(&pax, 0, sizeof(pax_header));
+
+    if (clean_path(path)){
+      // "./", as tar writes for the top, is no error
+      if (path[0]) progress_error(ctx->prog, path, EPERM);
+      type = 'g';
+    } else if (ctx->index){
+      index_tar(ctx->index, path, type, mode, mtime, size, s->pos + size + padding);
+      type = 'g';
+    } else if (ctx->only){
+      if ((r = pick_path(ctx, path, picked, sizeof(picked))) < 0) progress_error(ctx->prog, path, errno);
+      if (r <= 0) type = 'g';
+      else strcpy(path, picked);
+
+      // A hard link goes to where its target was taken out to, and
+      // fails if that wasn't taken
+      if (r > 0 && type == '1'){
+        if (clean_path(link) == 0 && pick_path(ctx, link, picked, sizeof(picked)) > 0){
+          strcpy(link, picked);
+        } else {
+          progress_error(ctx->prog, path, ENOENT);
+          type = 'g';
+        }
+      }
+    }
+
+    switch (type){
+    case '0':
+    case '\0':
+    case '7':
+      if (size <= EXTRACT_SMALL){
+        data = xmalloc(size + padding + 1);
+        if (read_full(s, data, size + padding) != 1){
+          free(data);
+          ret = -1;
+          break;
+        }
+        add_small(ctx, path, mode, mtime, data, size);
+        padding = 0;
+      } else if (stream_file(ctx, s, path, mode, mtime, size)){
+        ret = -1;
+      }
+      size = 0;
+      break;
+    case '5':
+      make_dir(ctx, path, mode, mtime);
+      break;
+    case '1':
+    case '2':
+      // Links may point at files still waiting in the batch
+      flush_batch(ctx);
+      make_link(ctx, path, link, type == '1');
+      break;
+    default:
+      // Devices, fifos and unknown types are skipped
+      break;
+    }
+    if (ret || skip_bytes(ctx, s, size + padding)){
+      ret = -1;
+      break;
+    }
+  }
+  flush_batch(ctx);
+  free(long_name);
+  free(long_link);
+  free(pax.path);
+  free(pax.link);
+  free(ctx->batch);
+  return ret;
+}
+
+// Runs a tar stream through zlib or liblzma as its format needs
+static int extract_stream(extract_ctx * ctx, archive_format format){
+  in_stream s;
+  lzma_mt mt;
+  int ret;
+
+  memset(&s, 0, sizeof(in_stream));
+  s.fd = ctx->afd;
+  s.format = format;
+  s.prog = ctx->prog;
+  s.x = (lzma_stream) LZMA_STREAM_INIT;
+  s.in = xmalloc(EXTRACT_BUFLEN);
+
+  if (format == FORMAT_GZIP && inflateInit2(&s.z, 15 + 16) != Z_OK){
+    errno = ENOMEM;
+    free(s.in);
+    return -1;
+  }
+  if (format == FORMAT_XZ){
+    // Archives written in blocks, as xz -T does, decode in parallel
+    memset(&mt, 0, sizeof(lzma_mt));
+    mt.flags = LZMA_CONCATENATED;
+    mt.threads = lzma_cputhreads();
+    mt.memlimit_threading = 256 * 1024 * 1024;
+    mt.memlimit_stop = UINT64_MAX;
+    if (mt.threads < 1) mt.threads = 1;
+    if (lzma_stream_decoder_mt(&s.x, &mt) != LZMA_OK &&
+        lzma_stream_decoder(&s.x, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK){
+      errno = ENOMEM;
+      free(s.in);
+      return -1;
+    }
+  }
+
+  ret = extract_tar(ctx, &s);
+
+  if (format == FORMAT_GZIP) inflateEnd(&s.z);
+  if (format == FORMAT_XZ) lzma_end(&s.x);
+  free(s.in);
+  return ret;
+}
+
+// Where the data of a zip member goes
+typedef int (*zip_sink)(void * arg, const unsigned char * data, size_t len);
+
+static int sink_fd(void * arg, const unsigned char * data, size_t len){
+  return write_all(*(int *) arg, (const char *) data, len);
+}
+
+// Collects a symlink target, which must fit in PATH_MAX
+static int sink_link(void * arg, const unsigned char * data, size_t len){
+  char * target = arg;
+  size_t used = strlen(target);
+  if (used + len >= PATH_MAX){
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memcpy(target + used, data, len);
+  target[used + len] = 0;
+  return 0;
+}
+
+// Inflates or copies the data of one zip member into sink, and checks
+// its CRC. Returns 0, or -1 with errno set.
+static int zip_read(extract_ctx * ctx, zip_entry * e, unsigned char * in, unsigned char * out, zip_sink sink, void * arg){
+  unsigned char local[30];
+  uint64_t pos, left;
+  uint32_t crc = crc32(0L, Z_NULL, 0);
+  z_stream z;
+  ssize_t n;
+  int ret = Z_OK;
+
+  if (pread(ctx->afd, local, 30, e->offset) != 30 || le32(local) != 0x04034b50){
+    errno = EBADMSG;
+    return -1;
+  }
+  if (e->method != 0 && e->method != 8){
+    errno = ENOTSUP;
+    return -1;
+  }
+  memset(&z, 0, sizeof(z_stream));
+  if (e->method == 8 && inflateInit2(&z, -MAX_WBITS) != Z_OK){
+    errno = ENOMEM;
+    return -1;
+  }
+
+  pos = e->offset + 30 + le16(local + 26) + le16(local + 28);
+  left = e->csize;
+  while (ret == Z_OK && !ctx->prog->cancel){
+    n = 0;
+    if (left){
+      if ((n = pread(ctx->afd, in, left > ZIP_BUFLEN ? ZIP_BUFLEN : left, pos)) <= 0){
+        if (n == 0) errno = EBADMSG;
+        ret = Z_ERRNO;
+        break;
+      }
+      pos += n;
+      left -= n;
+      progress_add(ctx->prog, 0, n);
+    }
+
+    if (e->method == 0){
+      crc = crc32(crc, in, n);
+      if (sink(arg, in, n)) ret = Z_ERRNO;
+      else if (!left) ret = Z_STREAM_END;
+      continue;
+    }
+
+    z.next_in = in;
+    z.avail_in = n;
+    do {
+      z.next_out = out;
+      z.avail_out = ZIP_BUFLEN;
+      ret = inflate(&z, Z_NO_FLUSH);
+      if (ret == Z_BUF_ERROR && left) ret = Z_OK;
+      if (ret != Z_OK && ret != Z_STREAM_END){
+        errno = EBADMSG;
+        break;
+      }
+      crc = crc32(crc, out, ZIP_BUFLEN - z.avail_out);
+      if (sink(arg, out, ZIP_BUFLEN - z.avail_out)){
+        ret = Z_ERRNO;
+        break;
+      }
+    } while (z.avail_out == 0 && ret == Z_OK);
+
+    // All input used without reaching the end of the deflate stream
+    if (ret == Z_OK && !left){
+      errno = EBADMSG;
+      ret = Z_DATA_ERROR;
+    }
+  }
+  if (e->method == 8) inflateEnd(&z);
+
+  if (ctx->prog->cancel) return 0;
+  if (ret != Z_STREAM_END) return -1;
+  if (crc != e->crc){
+    errno = EBADMSG;
+    return -1;
+  }
+  return 0;
+}
+
+// Writes one zip member to disk
+static void extract_zip_entry(extract_ctx * ctx, zip_entry * e, unsigned char * in, unsigned char * out){
+  int fd;
+
+  if ((fd = open_output(ctx, e->path, e->mode)) < 0){
+    progress_error(ctx->prog, e->path, errno);
+    return;
+  }
+  if (zip_read(ctx, e, in, out, sink_fd, &fd)){
+    progress_error(ctx->prog, e->path, errno);
+    close(fd);
+  } else if (ctx->prog->cancel){
+    close(fd);
+  } else if (finish_output(ctx, fd, e->mtime)){
+    progress_error(ctx->prog, e->path, errno);
+  }
+}
+
+static void extract_zip_range(int begin, int end, void * arg){
+  extract_ctx * ctx = arg;
+  unsigned char * in = xmalloc(ZIP_BUFLEN);
+  unsigned char * out = xmalloc(ZIP_BUFLEN);
+  int i;
+
+  // Symlinks come later, devices and fifos are skipped as in a tar
+  for (i = begin; i < end && !ctx->prog->cancel; i++){
+    if (ctx->entries[i].path && S_ISREG(ctx->entries[i].mode)) extract_zip_entry(ctx, &ctx->entries[i], in, out);
+  }
+  free(in);
+  free(out);
+}
+
+// Converts an MS-DOS date and time to local time
+static time_t dos_time(unsigned date, unsigned time){
+  struct tm tm;
+  memset(&tm, 0, sizeof(struct tm));
+  tm.tm_year = ((date >> 9) & 0x7f) + 80;
+  tm.tm_mon = ((date >> 5) & 0x0f) - 1;
+  tm.tm_mday = date & 0x1f;
+  tm.tm_hour = (time >> 11) & 0x1f;
+  tm.tm_min = (time >> 5) & 0x3f;
+  tm.tm_sec = (time & 0x1f) * 2;
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+// Finds the central directory through the end records, zip64 included
+static int zip_directory(extract_ctx * ctx, uint64_t * offset, uint64_t * size, uint64_t * count){
+  unsigned char * tail, rec[56];
+  struct stat st;
+  off_t start;
+  ssize_t len;
+  int i;
+
+  if (fstat(ctx->afd, &st)) return -1;
+  start = st.st_size > 65557 ? st.st_size - 65557 : 0;
+  tail = xmalloc(65557);
+  if ((len = pread(ctx->afd, tail, st.st_size - start, start)) < 22){
+    free(tail);
+    errno = EBADMSG;
+    return -1;
+  }
+  for (i = len - 22; i >= 0 && le32(tail + i) != 0x06054b50; i--);
+  if (i < 0){
+    free(tail);
+    errno = EBADMSG;
+    return -1;
+  }
+  *count = le16(tail + i + 10);
+  *size = le32(tail + i + 12);
+  *offset = le32(tail + i + 16);
+
+  // Zip64 keeps the real values in records just before
+  if (*count == 0xffff || *size == 0xffffffff || *offset == 0xffffffff){
+    if (start + i < 20 || pread(ctx->afd, rec, 20, start + i - 20) != 20 || le32(rec) != 0x07064b50 ||
+        pread(ctx->afd, rec, 56, le64(rec + 8)) != 56 || le32(rec) != 0x06064b50){
+      free(tail);
+      errno = EBADMSG;
+      return -1;
+    }
+    *count = le64(rec + 32);
+    *size = le64(rec + 40);
+    *offset = le64(rec + 48);
+  }
+  free(tail);
+  return 0;
+}
+
+// Reads the central directory into ctx->entries and makes the
+// directories it lists. When listing, the entries go to the index.
+static int zip_entries(extract_ctx * ctx){
+  uint64_t offset, size, count, i;
+  unsigned char * cd, * p, * x, * v, * extra_end;
+  unsigned name_len, extra_len, flags;
+  char picked[PATH_MAX + 256];
+  uint32_t attr;
+  zip_entry * e;
+  int ret;
+
+  if (zip_directory(ctx, &offset, &size, &count)) return -1;
+  if (size > (1ULL << 32) || count > size / 46){
+    errno = EBADMSG;
+    return -1;
+  }
+  cd = xmalloc(size ? size : 1);
+  if (pread(ctx->afd, cd, size, offset) != (ssize_t) size){
+    free(cd);
+    errno = EBADMSG;
+    return -1;
+  }
+  if ((ctx->entries = calloc(count ? count : 1, sizeof(zip_entry))) == NULL){
+    perror("calloc");
+    exit(errno);
+  }
+
+  for (i = 0, p = cd; i < count; i++){
+    if (p + 46 > cd + size || le32(p) != 0x02014b50 ||
+        p + 46 + le16(p + 28) + le16(p + 30) + le16(p + 32) > cd + size){
+      free(cd);
+      errno = EBADMSG;
+      return -1;
+    }
+    e = &ctx->entries[ctx->nentries++];
+    flags = le16(p + 8);
+    name_len = le16(p + 28);
+    extra_len = le16(p + 30);
+    attr = le32(p + 38);
+    e->method = le16(p + 10);
+    e->mtime = dos_time(le16(p + 14), le16(p + 12));
+    e->crc = le32(p + 16);
+    e->csize = le32(p + 20);
+    e->usize = le32(p + 24);
+    e->offset = le32(p + 42);
+    e->path = xstrndup((char *) p + 46, name_len);
+
+    // Unix modes are kept by zips made on Unix. Others get defaults.
+    if (p[5] == 3 && attr >> 16){
+      e->mode = attr >> 16;
+      if (!(e->mode & S_IFMT)) e->mode |= name_len && e->path[name_len - 1] == '/' ? S_IFDIR : S_IFREG;
+    } else if (name_len && e->path[name_len - 1] == '/'){
+      e->mode = S_IFDIR | 0777;
+    } else {
+      e->mode = S_IFREG | 0666;
+    }
+
+    // Zip64 sizes and offset, there only for the fields that overflowed
+    extra_end = p + 46 + name_len + extra_len;
+    for (x = p + 46 + name_len; x + 4 <= extra_end; x += 4 + le16(x + 2)){
+      if (le16(x) != 0x0001) continue;
+      v = x + 4;
+      if (e->usize == 0xffffffff && v + 8 <= extra_end){
+        e->usize = le64(v);
+        v += 8;
+      }
+      if (e->csize == 0xffffffff && v + 8 <= extra_end){
+        e->csize = le64(v);
+        v += 8;
+      }
+      if (e->offset == 0xffffffff && v + 8 <= extra_end) e->offset = le64(v);
+      break;
+    }
+    p = extra_end + le16(p + 32);
+
+    if (clean_path(e->path) || (flags & 1)){
+      progress_error(ctx->prog, e->path, (flags & 1) ? ENOTSUP : EPERM);
+      free(e->path);
+      e->path = NULL;
+      continue;
+    }
+    if (ctx->index){
+      index_add(ctx->index, e->path, e->mode, e->mtime, S_ISDIR(e->mode) ? 0 : e->usize, e->offset);
+      free(e->path);
+      e->path = NULL;
+      continue;
+    }
+    if (ctx->only){
+      if ((ret = pick_path(ctx, e->path, picked, sizeof(picked))) < 0) progress_error(ctx->prog, e->path, errno);
+      free(e->path);
+      e->path = ret > 0 ? xstrndup(picked, strlen(picked)) : NULL;
+      if (!e->path) continue;
+    }
+    if (S_ISDIR(e->mode)){
+      make_dir(ctx, e->path, e->mode, e->mtime);
+      free(e->path);
+      e->path = NULL;
+    }
+  }
+  free(cd);
+  return 0;
+}
+
+static int extract_zip(extract_ctx * ctx){
+  unsigned char * in, * out;
+  char target[PATH_MAX];
+  zip_entry * e;
+  int i, ret = 0;
+
+  if (zip_entries(ctx)){
+    ret = -1;
+  } else {
+    // Files are written in parallel. Symlinks come after them, as one
+    // may have the name of a directory that files went into.
+    pool_for(ctx->pool, ctx->nentries, 4, extract_zip_range, ctx);
+
+    in = xmalloc(ZIP_BUFLEN);
+    out = xmalloc(ZIP_BUFLEN);
+    for (i = 0; i < ctx->nentries && !ctx->prog->cancel; i++){
+      e = &ctx->entries[i];
+      if (!e->path || !S_ISLNK(e->mode)) continue;
+      target[0] = 0;
+      if (zip_read(ctx, e, in, out, sink_link, target)) progress_error(ctx->prog, e->path, errno);
+      else make_link(ctx, e->path, target, 0);
+    }
+    free(in);
+    free(out);
+  }
+
+  for (i = 0; i < ctx->nentries; i++){
+    free(ctx->entries[i].path);
+  }
+  free(ctx->entries);
+  return ret;
+}
+
+// Tells the format of an archive by its first bytes
+static int detect_format(int fd, archive_format * format){
+  unsigned char magic[6];
+
+  memset(magic, 0, sizeof(magic));
+  if (pread(fd, magic, sizeof(magic), 0) < 0) return -1;
+  if (magic[0] == 0x1f && magic[1] == 0x8b){
+    *format = FORMAT_GZIP;
+  } else if (!memcmp(magic, "\xfd" "7zXZ", 6)){
+    *format = FORMAT_XZ;
+  } else if (!memcmp(magic, "PK\3\4", 4) || !memcmp(magic, "PK\5\6", 4)){
+    *format = FORMAT_ZIP;
+  } else {
+    *format = FORMAT_TAR;
+  }
+  return 0;
+}
+
+// Extracts what ctx asks for from the archive at path into dest
+static int run_extract(extract_ctx * ctx, const char * path, const char * dest){
+  archive_format format;
+  int ret = -1;
+
+  ctx->archive = path;
+  ctx->umask = copy_umask();
+
+  if ((ctx->afd = open(path, O_RDONLY | O_CLOEXEC)) < 0){
+    progress_error(ctx->prog, path, errno);
+    return -1;
+  }
+  if ((ctx->dfd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0){
+    progress_error(ctx->prog, dest, errno);
+    close(ctx->afd);
+    return -1;
+  }
+
+  if (detect_format(ctx->afd, &format)){
+    progress_error(ctx->prog, path, errno);
+  } else {
+    ctx->buf = xmalloc(EXTRACT_BUFLEN);
+    ret = format == FORMAT_ZIP ? extract_zip(ctx) : extract_stream(ctx, format);
+    if (ret && !ctx->prog->cancel) progress_error(ctx->prog, path, errno);
+    set_dir_times(ctx);
+    free(ctx->buf);
+  }
+
+  close(ctx->afd);
+  close(ctx->dfd);
+  return ret;
+}
+
+// Extracts the archive at path into the directory dest, overwriting
+// files that are already there. Small files are written on pool.
+// Returns 0, or -1 if the archive couldn't be read to the end. Errors
+// on single entries are counted in prog and the rest is extracted.
+int extract_archive(const char * path, const char * dest, work_pool * pool, op_progress * prog){
+  extract_ctx ctx;
+
+  memset(&ctx, 0, sizeof(extract_ctx));
+  ctx.prog = prog;
+  ctx.pool = pool;
+  return run_extract(&ctx, path, dest);
+}
+
+static int pick_cmp(const void * a, const void * b){
+  return strcmp(((const archive_pick *) a)->member, ((const archive_pick *) b)->member);
+}
+
+// Extracts only the given members, with what is under them, into dest
+// under their new names. A tar stream is read no further than
+// stop_at, from archive_index_end(), when it is set.
+int extract_members(const char * path, archive_pick * picks, int count, uint64_t stop_at, const char * dest, work_pool * pool, op_progress * prog){
+  extract_ctx ctx;
+  int ret;
+
+  memset(&ctx, 0, sizeof(extract_ctx));
+  ctx.prog = prog;
+  ctx.pool = pool;
+  ctx.only = xmalloc(count * sizeof(archive_pick));
+  ctx.nonly = count;
+  ctx.stop_at = stop_at;
+  memcpy(ctx.only, picks, count * sizeof(archive_pick));
+  qsort(ctx.only, count, sizeof(archive_pick), pick_cmp);
+
+  ret = run_extract(&ctx, path, dest);
+  free(ctx.only);
+  return ret;
+}
+
+// Orders members by directory, then name. Dirs compare as a whole, so
+// "a/b" comes before "a.b/c" and each directory is one run.
+static int member_cmp(const char * a, int an, const char * b, int bn){
+  size_t al = an ? an - 1 : 0, bl = bn ? bn - 1 : 0;
+  int c = memcmp(a, b, al < bl ? al : bl);
+  if (c) return c;
+  if (al != bl) return al < bl ? -1 : 1;
+  return strcmp(a + an, b + bn);
+}
+
+// The same, with a later duplicate of a path after the earlier
+static int index_cmp(const void * a, const void * b){
+  const archive_member * ma = a, * mb = b;
+  int c = member_cmp(ma->path, ma->name, mb->path, mb->name);
+  if (c) return c;
+  return ma->pos < mb->pos ? -1 : ma->pos > mb->pos;
+}
+
+// Binary search of the first count members, which are sorted
+static archive_member * find_member(archive_member * members, int count, const char * path){
+  const char * slash = strrchr(path, '/');
+  int name = slash ? slash + 1 - path : 0;
+  int lo = 0, hi = count, mid, c;
+
+  while (lo < hi){
+    mid = (lo + hi) / 2;
+    c = member_cmp(members[mid].path, members[mid].name, path, name);
+    if (c == 0) return &members[mid];
+    if (c < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return NULL;
+}
+
+// Sorts the index, keeps the last of duplicate paths, as extracting
+// would, and adds the directories that are only implied. Each pass
+// adds one more level of missing parents.
+static void index_finish(archive_index * idx){
+  archive_member * m;
+  char * dir = NULL;
+  int i, n, count;
+
+  do {
+    qsort(idx->members, idx->count, sizeof(archive_member), index_cmp);
+    for (i = n = 0; i < idx->count; i++){
+      m = &idx->members[i];
+      if (n && !member_cmp(idx->members[n - 1].path, idx->members[n - 1].name, m->path, m->name)){
+        free(idx->members[--n].path);
+      }
+      idx->members[n++] = *m;
+    }
+    idx->count = count = n;
+
+    // Members of one directory are next to each other
+    for (i = 0; i < count; i++){
+      m = &idx->members[i];
+      if (!m->name || (dir && !strncmp(dir, m->path, m->name - 1) && !dir[m->name - 1])) continue;
+      free(dir);
+      dir = xstrndup(m->path, m->name - 1);
+      if (!find_member(idx->members, count, dir)) index_add(idx, dir, S_IFDIR | 0755, idx->members[i].mtime, 0, 0);
+    }
+    free(dir);
+    dir = NULL;
+  } while (idx->count != count);
+}
+
+// Lists the members of the archive at path without extracting them.
+// Returns NULL with errno set if it can't be read.
+archive_index * archive_index_load(const char * path){
+  archive_format format;
+  archive_index * idx;
+  op_progress prog;
+  work_pool serial;
+  extract_ctx ctx;
+  struct stat st;
+  int ret, err;
+
+  if ((idx = calloc(1, sizeof(archive_index))) == NULL){
+    perror("calloc");
+    exit(errno);
+  }
+  memset(&ctx, 0, sizeof(extract_ctx));
+  progress_init(&prog, NULL, NULL);
+  memset(&serial, 0, sizeof(work_pool));
+  ctx.archive = path;
+  ctx.prog = &prog;
+  ctx.pool = &serial;
+  ctx.index = idx;
+
+  if ((ctx.afd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(ctx.afd, &st) || detect_format(ctx.afd, &format)){
+    err = errno;
+    if (ctx.afd >= 0) close(ctx.afd);
+    free(idx);
+    errno = err;
+    return NULL;
+  }
+  idx->path = xstrndup(path, strlen(path));
+  idx->dev = st.st_dev;
+  idx->ino = st.st_ino;
+  idx->size = st.st_size;
+  idx->mtime = st.st_mtime;
+
+  ctx.buf = xmalloc(EXTRACT_BUFLEN);
+  ret = format == FORMAT_ZIP ? extract_zip(&ctx) : extract_stream(&ctx, format);
+  err = errno;
+  free(ctx.buf);
+  close(ctx.afd);
+  if (ret){
+    archive_index_free(idx);
+    errno = err;
+    return NULL;
+  }
+  index_finish(idx);
+  return idx;
+}
+
+// Tells whether the archive changed since its index was read
+int archive_index_stale(archive_index * idx){
+  struct stat st;
+  return stat(idx->path, &st) || st.st_dev != idx->dev || st.st_ino != idx->ino ||
+         st.st_size != idx->size || st.st_mtime != idx->mtime;
+}
+
+// Compares the directory part of a member with dir
+static int dir_cmp(archive_member * m, const char * dir, size_t len){
+  size_t mlen = m->name ? m->name - 1 : 0;
+  int c = memcmp(m->path, dir, mlen < len ? mlen : len);
+  if (c) return c;
+  return mlen < len ? -1 : mlen > len;
+}
+
+// Finds the run of members directly inside dir, "" being the top.
+// Returns how many there are and sets *begin to the first.
+int archive_index_dir(archive_index * idx, const char * dir, int * begin){
+  size_t len = strlen(dir);
+  int lo = 0, hi = idx->count, mid;
+
+  while (lo < hi){
+    mid = (lo + hi) / 2;
+    if (dir_cmp(&idx->members[mid], dir, len) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  *begin = lo;
+  while (hi < idx->count && !dir_cmp(&idx->members[hi], dir, len)) hi++;
+  return hi - lo;
+}
+
+archive_member * archive_index_find(archive_index * idx, const char * path){
+  return find_member(idx->members, idx->count, path);
+}
+
+static int str_cmp(const void * a, const void * b){
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Tells whether the first len bytes of path are one of the sorted paths
+static int has_path(char ** paths, int count, const char * path, size_t len){
+  int lo = 0, hi = count, mid, c;
+
+  while (lo < hi){
+    mid = (lo + hi) / 2;
+    if ((c = strncmp(paths[mid], path, len)) == 0) c = paths[mid][len] ? 1 : 0;
+    if (c == 0) return 1;
+    if (c < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return 0;
+}
+
+// Where a tar stream can stop when only the given members, and what
+// is under them, are extracted
+uint64_t archive_index_end(archive_index * idx, char ** paths, int count){
+  archive_member * m;
+  char ** sorted;
+  uint64_t end = 0;
+  size_t len;
+  int i;
+
+  sorted = xmalloc(count * sizeof(char *));
+  memcpy(sorted, paths, count * sizeof(char *));
+  qsort(sorted, count, sizeof(char *), str_cmp);
+
+  for (i = 0; i < idx->count; i++){
+    m = &idx->members[i];
+    if (m->pos <= end) continue;
+    for (len = strlen(m->path); len; len--){
+      if ((m->path[len] == '/' || !m->path[len]) && has_path(sorted, count, m->path, len)){
+        end = m->pos;
+        break;
+      }
+    }
+  }
+  free(sorted);
+  return end;
+}
+
+void archive_index_free(archive_index * idx){
+  int i;
+  if (idx == NULL) return;
+  for (i = 0; i < idx->count; i++){
+    free(idx->members[i].path);
+  }
+  free(idx->members);
+  free(idx->path);
+  free(idx);
+}
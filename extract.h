@@ -0,0 +1,51 @@
+// Gopher - In-process archive extraction
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pool.h"
+#include "progress.h"
+
+// One entry of an archive, as listed by archive_index_load()
+typedef struct {
+  char * path;            // cleaned, without a trailing slash
+  int name;               // offset of the last component in path
+  mode_t mode;            // with the file type bits
+  time_t mtime;
+  uint64_t size;
+  uint64_t pos;           // tar: end of its data in the tar stream,
+                          // zip: offset of its local header
+} archive_member;
+
+// The members of an archive, sorted by directory and then name, so
+// that each directory is one run of the array. Directories an archive
+// only implies by the paths under them are added.
+typedef struct {
+  char * path;
+  dev_t dev;              // the archive as it was when read
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  archive_member * members;
+  int count;
+  int cap;
+} archive_index;
+
+// A member to take out of an archive and the name to give it
+typedef struct {
+  const char * member;
+  const char * name;      // relative to the destination
+} archive_pick;
+
+int extract_archive(const char * path, const char * dest, work_pool * pool, op_progress * prog);
+int extract_members(const char * path, archive_pick * picks, int count, uint64_t stop_at, const char * dest, work_pool * pool, op_progress * prog);
+archive_index * archive_index_load(const char * path);
+int archive_index_stale(archive_index * idx);
+int archive_index_dir(archive_index * idx, const char * dir, int * begin);
+archive_member * archive_index_find(archive_index * idx, const char * path);
+uint64_t archive_index_end(archive_index * idx, char ** paths, int count);
+void archive_index_free(archive_index * idx);
+
+#endif
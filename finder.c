@@ -0,0 +1,712 @@
+// Gopher - Fuzzy file finder over a subtree
+//
+// The index is a flat array of relative paths, appended to by a walker
+// that reads the tree one level at a time, the directories of a level
+// in parallel. Each path carries a 64 bit mask of the characters in
+// it, so most paths are ruled out by one AND before a byte of them is
+// read. A query that extends the last one only looks again at what
+// the last one matched, and at paths added since.
+//
+// Opening the finder again on the same tree stats every directory and
+// reads again only those whose mtime changed. Paths they no longer
+// hold are marked dead, and so is everything below a dead directory.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "finder.h"
+#include "scan.h"
+
+#define FINDER_BUILD 1
+#define FINDER_REFRESH 2
+
+#define READ_CHUNK 16       // directories per pool task
+#define SEARCH_CHUNK 4096   // paths per pool task
+
+// One directory read by a walker task
+typedef struct {
+  int dir;
+  char * path;            // absolute
+  int check;              // only read it if its mtime changed
+  struct timespec mtime;  // the one it had, then the one it has
+  int ok;                 // 1 read, 0 unchanged, -1 unreadable
+  char * names;           // NUL separated
+  unsigned char * is_dir;
+  int count;
+} dir_read;
+
+typedef struct {
+  finder * f;
+  dir_read * reads;
+  dev_t dev;
+} read_job;
+
+static uint32_t hash_path(const char * path){
+  uint32_t h = 2166136261u;
+  while (*path){
+    h ^= (unsigned char) *path++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Bit of a character in a path mask. Letters and digits get one of
+// their own, case folded, and the rest share what is left.
+static int char_bit(unsigned char c){
+  c = tolower(c);
+  if (c >= 'a' && c <= 'z') return c - 'a';
+  if (c >= '0' && c <= '9') return 26 + c - '0';
+  return 36 + c % 28;
+}
+
+static uint64_t path_mask(const char * path){
+  uint64_t mask = 0;
+  while (*path) mask |= 1ULL << char_bit(*path++);
+  return mask;
+}
+
+static void * grow(void * array, int * cap, size_t size){
+  *cap = *cap ? *cap * 2 : 1024;
+  if ((array = realloc(array, *cap * size)) == NULL){
+    perror("realloc");
+    exit(errno);
+  }
+  return array;
+}
+
+static void slots_insert(finder * f, int id){
+  unsigned i = hash_path(f->entries[id].path) & (f->slots_cap - 1);
+  while (f->slots[i]) i = (i + 1) & (f->slots_cap - 1);
+  f->slots[i] = id + 1;
+}
+
+static void slots_grow(finder * f){
+  int i;
+
+  free(f->slots);
+  f->slots_cap = f->slots_cap ? f->slots_cap * 2 : 4096;
+  if ((f->slots = calloc(f->slots_cap, sizeof(unsigned))) == NULL){
+    perror("calloc");
+    exit(errno);
+  }
+  for (i = 0; i < f->count; i++){
+    slots_insert(f, i);
+  }
+}
+
+// Live entry of a relative path, -1 if there is none
+static int find_path(finder * f, const char * path){
+  unsigned i;
+  int id;
+
+  if (!f->slots_cap) return -1;
+  for (i = hash_path(path) & (f->slots_cap - 1); f->slots[i]; i = (i + 1) & (f->slots_cap - 1)){
+    id = f->slots[i] - 1;
+    if (!f->entries[id].dead && !strcmp(f->entries[id].path, path)) return id;
+  }
+  return -1;
+}
+
+static int add_entry(finder * f, int dir, const char * path, int len, int is_dir){
+  finder_entry * e;
+  const char * slash;
+  int i;
+
+  if (f->count == f->cap){
+    f->entries = grow(f->entries, &f->cap, sizeof(finder_entry));
+    if ((f->masks = realloc(f->masks, f->cap * sizeof(uint64_t))) == NULL){
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  if ((unsigned) (f->count + 1) * 2 > f->slots_cap) slots_grow(f);
+  e = &f->entries[f->count];
+  e->path = arena_strndup(&f->mem, path, len);
+  e->lower = e->path;
+  for (i = 0; i < len; i++){
+    if (isupper((unsigned char) path[i])) break;
+  }
+  if (i < len){
+    e->lower = arena_strndup(&f->mem, path, len);
+    for (; i < len; i++){
+      e->lower[i] = tolower((unsigned char) path[i]);
+    }
+  }
+  f->masks[f->count] = path_mask(path);
+  e->dir = dir;
+  e->seen = f->stamp;
+  e->len = len;
+  e->base = (slash = strrchr(path, '/')) ? slash - path + 1 : 0;
+  e->is_dir = is_dir;
+  e->dead = 0;
+  slots_insert(f, f->count);
+  return f->count++;
+}
+
+static int add_dir(finder * f, int entry){
+  finder_dir * d;
+
+  if (f->ndirs == f->dirs_cap) f->dirs = grow(f->dirs, &f->dirs_cap, sizeof(finder_dir));
+  d = &f->dirs[f->ndirs];
+  d->entry = entry;
+  d->mtime.tv_sec = d->mtime.tv_nsec = 0;
+  d->changed = 0;
+  return f->ndirs++;
+}
+
+// Empties the index for a walk of root. The lock must be held.
+static void clear_index(finder * f, const char * root){
+  snprintf(f->root, MAXLEN, "%s", root);
+  arena_reset(&f->mem);
+  f->count = f->dead = f->ndirs = 0;
+  if (f->slots) memset(f->slots, 0, f->slots_cap * sizeof(unsigned));
+  f->epoch++;
+  add_dir(f, -1);
+}
+
+static char * dir_path(finder * f, int dir){
+  char path[MAXLEN * 2];
+  char * copy;
+  int entry = f->dirs[dir].entry;
+
+  if (entry < 0){
+    snprintf(path, sizeof(path), "%s", f->root);
+  } else {
+    snprintf(path, sizeof(path), "%s/%s", strcmp(f->root, "/") ? f->root : "", f->entries[entry].path);
+  }
+  if ((copy = strdup(path)) == NULL){
+    perror("strdup");
+    exit(errno);
+  }
+  return copy;
+}
+
+// Reads directories, without touching the index
+static void read_range(int begin, int end, void * arg){
+  read_job * job = arg;
+  dir_scan scan;
+  scan_entry * e;
+  struct stat st;
+  dir_read * r;
+  size_t bytes, used;
+  int i, n, k;
+
+  scan_init(&scan);
+  for (i = begin; i < end && !job->f->cancel; i++){
+    r = &job->reads[i];
+    r->ok = -1;
+    if (r->check){
+      if (stat(r->path, &st)) continue;
+      if (st.st_mtim.tv_sec == r->mtime.tv_sec && st.st_mtim.tv_nsec == r->mtime.tv_nsec){
+	r->ok = 0;
+	continue;
+      }
+    }
+    if ((n = scan_dir(&scan, r->path)) < 0 || scan.dir_st.st_dev != job->dev) continue;
+    r->mtime = scan.dir_st.st_mtim;
+
+    bytes = 1;
+    for (k = 0; k < n; k++){
+      bytes += scan.entries[k].namelen + 1;
+    }
+    if ((r->names = malloc(bytes)) == NULL || (r->is_dir = malloc(n + 1)) == NULL){
+      perror("malloc");
+      exit(errno);
+    }
+    used = 0;
+    for (k = 0; k < n; k++){
+      e = &scan.entries[k];
+      if (!strcmp(e->name, ".") || !strcmp(e->name, "..")) continue;
+      if (e->d_type == DT_UNKNOWN){
+	r->is_dir[r->count] = !fstatat(scan.dirfd, e->name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+      } else {
+	r->is_dir[r->count] = e->d_type == DT_DIR;
+      }
+      memcpy(r->names + used, e->name, e->namelen + 1);
+      used += e->namelen + 1;
+      r->count++;
+    }
+    r->ok = 1;
+  }
+  scan_destroy(&scan);
+}
+
+// Adds what a directory holds to the index. On a refresh, paths
+// already there are only marked as seen. New subdirectories go on
+// next. The lock must be held.
+static void merge(finder * f, dir_read * r, int refresh, int ** next, int * nnext, int * next_cap){
+  char path[MAXLEN];
+  const char * parent, * name = r->names;
+  int i, id, len, entry;
+
+  if (r->ok <= 0) return;
+  f->dirs[r->dir].mtime = r->mtime;
+  if (refresh) f->dirs[r->dir].changed = f->stamp;
+  entry = f->dirs[r->dir].entry;
+  parent = entry < 0 ? NULL : f->entries[entry].path;
+
+  for (i = 0; i < r->count; name += strlen(name) + 1, i++){
+    len = parent ? snprintf(path, MAXLEN, "%s/%s", parent, name) : snprintf(path, MAXLEN, "%s", name);
+    if (len >= MAXLEN) continue;
+    if (refresh && (id = find_path(f, path)) >= 0){
+      if (f->entries[id].is_dir == r->is_dir[i]){
+	f->entries[id].seen = f->stamp;
+	continue;
+      }
+      // Replaced by something of the other kind
+      f->entries[id].dead = 1;
+      f->dead++;
+    }
+    id = add_entry(f, r->dir, path, len, r->is_dir[i]);
+    if (r->is_dir[i]){
+      if (*nnext == *next_cap) *next = grow(*next, next_cap, sizeof(int));
+      (*next)[(*nnext)++] = add_dir(f, id);
+    }
+  }
+}
+
+// Marks dead what the directories read by this refresh no longer hold,
+// and everything below a dead directory. Parents come before their
+// children in the index, so one pass does it. The lock must be held.
+static void sweep(finder * f){
+  finder_entry * e;
+  finder_dir * d;
+  int i;
+
+  for (i = 0; i < f->count; i++){
+    e = &f->entries[i];
+    if (e->dead) continue;
+    d = &f->dirs[e->dir];
+    if ((d->changed == f->stamp && e->seen != f->stamp) || (d->entry >= 0 && f->entries[d->entry].dead)){
+      e->dead = 1;
+      f->dead++;
+    }
+  }
+}
+
+// Walks the directories of level, then the new subdirectories they
+// hold, a level at a time. A refresh checks the first level's mtimes
+// before reading them.
+static void walk(finder * f, int * level, int n, int refresh){
+  int * next = NULL;
+  int nnext, next_cap = 0, i;
+  dir_read * reads;
+  read_job job;
+
+  while (n && !f->cancel){
+    if ((reads = calloc(n, sizeof(dir_read))) == NULL){
+      perror("calloc");
+      exit(errno);
+    }
+    pthread_mutex_lock(&f->lock);
+    if (f->cancel){
+      // The index was emptied, level means nothing now
+      pthread_mutex_unlock(&f->lock);
+      free(reads);
+      break;
+    }
+    for (i = 0; i < n; i++){
+      reads[i].dir = level[i];
+      reads[i].path = dir_path(f, level[i]);
+      reads[i].check = refresh;
+      reads[i].mtime = f->dirs[level[i]].mtime;
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    job.f = f;
+    job.reads = reads;
+    job.dev = f->dev;
+    pool_for(&f->pool, n, READ_CHUNK, read_range, &job);
+
+    // Merged a directory at a time, so searches get their turn
+    nnext = 0;
+    for (i = 0; i < n; i++){
+      pthread_mutex_lock(&f->lock);
+      if (!f->cancel) merge(f, &reads[i], refresh, &next, &nnext, &next_cap);
+      pthread_mutex_unlock(&f->lock);
+      free(reads[i].path);
+      free(reads[i].names);
+      free(reads[i].is_dir);
+    }
+    free(reads);
+    if (refresh){
+      pthread_mutex_lock(&f->lock);
+      if (!f->cancel) sweep(f);
+      pthread_mutex_unlock(&f->lock);
+      refresh = 0;
+    }
+
+    free(level);
+    level = next;
+    n = nnext;
+    next = NULL;
+    next_cap = 0;
+  }
+  free(level);
+  free(next);
+}
+
+// Takes requests one at a time, the latest only
+static void * finder_main(void * arg){
+  finder * f = arg;
+  char root[MAXLEN];
+  struct stat st;
+  int * level;
+  int request, n, i;
+
+  pthread_mutex_lock(&f->lock);
+  while (1){
+    while (!f->shutdown && !f->request){
+      pthread_cond_wait(&f->wake, &f->lock);
+    }
+    if (f->shutdown) break;
+    request = f->request;
+    f->request = 0;
+    f->cancel = 0;
+    f->busy = 1;
+
+    // A build starts from the root, a refresh from every live directory
+    if ((level = malloc(f->ndirs * sizeof(int))) == NULL){
+      perror("malloc");
+      exit(errno);
+    }
+    n = 0;
+    for (i = 0; i < f->ndirs; i++){
+      if (request == FINDER_BUILD && i) break;
+      if (f->dirs[i].entry >= 0 && f->entries[f->dirs[i].entry].dead) continue;
+      level[n++] = i;
+    }
+    if (request == FINDER_REFRESH) f->stamp++;
+    snprintf(root, MAXLEN, "%s", f->root);
+    pthread_mutex_unlock(&f->lock);
+
+    if (request == FINDER_BUILD){
+      if (stat(root, &st)){
+	n = 0;
+      } else {
+	f->dev = st.st_dev;
+      }
+    }
+
+    walk(f, level, n, request == FINDER_REFRESH);
+
+    pthread_mutex_lock(&f->lock);
+    f->busy = 0;
+  }
+  pthread_mutex_unlock(&f->lock);
+  return NULL;
+}
+
+int finder_init(finder * f, int pool_threads){
+  sigset_t all, old;
+  int ret = 0;
+
+  memset(f, 0, sizeof(finder));
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->wake, NULL);
+  arena_init(&f->mem);
+
+  // Signals must keep landing on the UI thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pool_init(&f->pool, pool_threads);
+  if (pthread_create(&f->thread, NULL, finder_main, f)){
+    fprintf(stderr, "finder: can't start the walker\n");
+    ret = -1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return ret;
+}
+
+// Gets the index ready for a search below dir. An index of dir or of a
+// directory above it is refreshed and kept, anything else is replaced.
+// prefix gets the path of dir inside the index, "" for its root.
+void finder_open(finder * f, const char * dir, char * prefix){
+  size_t len;
+
+  pthread_mutex_lock(&f->lock);
+  len = strcmp(f->root, "/") ? strlen(f->root) : 0;
+  if (f->ndirs && !strncmp(dir, f->root, len) && (dir[len] == '/' || !dir[len]) && f->dead <= f->count / 2){
+    snprintf(prefix, MAXLEN, "%s", dir[len] ? dir + len + 1 : "");
+    // A build still waiting reads everything anyway, and sets dev
+    if (f->request != FINDER_BUILD && (!f->busy || f->request)){
+      f->request = FINDER_REFRESH;
+      pthread_cond_signal(&f->wake);
+    }
+  } else {
+    // A running walk stops before it adds anything more
+    f->cancel = 1;
+    clear_index(f, dir);
+    prefix[0] = 0;
+    f->request = FINDER_BUILD;
+    pthread_cond_signal(&f->wake);
+  }
+  pthread_mutex_unlock(&f->lock);
+}
+
+// A search fanned out over a run of entries, either the ids in or
+// first and on
+typedef struct {
+  finder * f;
+  const char * query;
+  int qlen;
+  int fold;               // the query has no capitals
+  uint64_t qmask;
+  const char * prefix;
+  int plen;
+  int * in;
+  int first;
+  int * out;              // matches of a chunk, from its first slot
+  int * scores;
+  int * counts;           // matches of each chunk
+} search_job;
+
+// Characters after which a word starts
+static inline int is_break(char c){
+  return c == '/' || c == '_' || c == '-' || c == '.' || c == ' ';
+}
+
+// Scores the query as a subsequence of text from start on, -1 if it
+// isn't one. Matches that run on, or start a word, count the most.
+// memchr() skips to each next character of the query.
+static int match_from(const char * text, int start, int len, const char * q, int qlen){
+  const char * p;
+  int i = start, j, last = -1, score = 0, gap;
+
+  for (j = 0; j < qlen; j++){
+    if ((p = memchr(text + i, q[j], len - i)) == NULL) return -1;
+    i = p - text;
+    score += 1;
+    if (last >= 0){
+      if (i == last + 1){
+	score += 8;
+      } else {
+	gap = i - last - 1;
+	score -= gap < 8 ? gap : 8;
+      }
+    }
+    if (i == start || is_break(text[i - 1])) score += 12;
+    last = i++;
+  }
+  return score;
+}
+
+// A match inside the last component beats one spread over the path,
+// and shorter paths beat longer ones
+static int score_entry(search_job * job, finder_entry * e){
+  const char * text = job->fold ? e->lower : e->path;
+  int start = job->plen ? job->plen + 1 : 0, score;
+
+  if (e->base >= start && (score = match_from(text, e->base, e->len, job->query, job->qlen)) >= 0){
+    return score + 32 - e->len / 16;
+  }
+  if ((score = match_from(text, start, e->len, job->query, job->qlen)) < 0) return -1;
+  return score - e->len / 16;
+}
+
+static void search_range(int begin, int end, void * arg){
+  search_job * job = arg;
+  finder_entry * e;
+  int i, chunk, stop, id, score, k;
+
+  for (chunk = begin; chunk < end; chunk += SEARCH_CHUNK){
+    stop = chunk + SEARCH_CHUNK < end ? chunk + SEARCH_CHUNK : end;
+    k = chunk;
+    for (i = chunk; i < stop; i++){
+      id = job->in ? job->in[i] : job->first + i;
+      if (job->qmask & ~job->f->masks[id]) continue;
+      e = &job->f->entries[id];
+      if (e->dead) continue;
+      if (job->plen && (e->len <= job->plen || e->path[job->plen] != '/' || memcmp(e->path, job->prefix, job->plen))) continue;
+      if ((score = score_entry(job, e)) < 0) continue;
+      job->out[k] = id;
+      job->scores[k++] = score;
+    }
+    job->counts[chunk / SEARCH_CHUNK] = k - chunk;
+  }
+}
+
+// Runs a search over n entries and appends its matches to ids and
+// scores, which have room for them
+static int search_part(search_job * job, int n, int * ids, int * scores, work_pool * pool){
+  int nchunks = (n + SEARCH_CHUNK - 1) / SEARCH_CHUNK, c, k = 0;
+
+  if (!n) return 0;
+  job->out = ids;
+  job->scores = scores;
+  if ((job->counts = calloc(nchunks, sizeof(int))) == NULL){
+    perror("calloc");
+    exit(errno);
+  }
+  pool_for(pool, n, SEARCH_CHUNK, search_range, job);
+  for (c = 0; c < nchunks; c++){
+    memmove(ids + k, ids + c * SEARCH_CHUNK, job->counts[c] * sizeof(int));
+    memmove(scores + k, scores + c * SEARCH_CHUNK, job->counts[c] * sizeof(int));
+    k += job->counts[c];
+  }
+  free(job->counts);
+  return k;
+}
+
+static int better(finder_match * a, finder_match * b){
+  return a->score > b->score || (a->score == b->score && a->entry < b->entry);
+}
+
+static int match_cmp(const void * a, const void * b){
+  return better((finder_match *) a, (finder_match *) b) ? -1 : 1;
+}
+
+// Keeps the max best of the matches, in a heap with the worst on top,
+// then sorts them best first
+static void pick_top(finder_search * s, int * scores, int max){
+  finder_match m, t;
+  int i, j, c;
+
+  s->ntop = 0;
+  for (i = 0; i < s->count; i++){
+    m.entry = s->ids[i];
+    m.score = scores[i];
+    if (s->ntop == max){
+      if (!better(&m, &s->top[0])) continue;
+      // Replace the worst and sift it down
+      j = 0;
+      s->top[0] = m;
+      while ((c = 2 * j + 1) < s->ntop){
+	if (c + 1 < s->ntop && better(&s->top[c], &s->top[c + 1])) c++;
+	if (!better(&s->top[j], &s->top[c])) break;
+	t = s->top[j];
+	s->top[j] = s->top[c];
+	s->top[c] = t;
+	j = c;
+      }
+    } else {
+      j = s->ntop++;
+      s->top[j] = m;
+      while (j && better(&s->top[(j - 1) / 2], &s->top[j])){
+	t = s->top[j];
+	s->top[j] = s->top[(j - 1) / 2];
+	s->top[(j - 1) / 2] = t;
+	j = (j - 1) / 2;
+      }
+    }
+  }
+  qsort(s->top, s->ntop, sizeof(finder_match), match_cmp);
+}
+
+// Finds the paths below prefix that hold query as a subsequence, and
+// puts the max best in s->top. Capitals in the query make it case
+// sensitive. The entries stay valid until the next call.
+void finder_search_run(finder * f, finder_search * s, const char * prefix, const char * query, int max, work_pool * pool){
+  search_job job;
+  int * ids;
+  int narrow, n, k, i;
+  size_t last = strlen(s->query);
+
+  pthread_mutex_lock(&f->lock);
+  narrow = last && s->epoch == f->epoch && !strcmp(s->prefix, prefix) && !strncmp(query, s->query, last);
+  if (!narrow){
+    s->count = 0;
+    s->scanned = 0;
+  }
+  s->epoch = f->epoch;
+  snprintf(s->prefix, MAXLEN, "%s", prefix);
+  snprintf(s->query, MAXLEN, "%s", query);
+  s->ntop = 0;
+  if (!query[0]){
+    s->count = 0;
+    pthread_mutex_unlock(&f->lock);
+    return;
+  }
+
+  memset(&job, 0, sizeof(search_job));
+  job.f = f;
+  job.query = s->query;
+  job.qlen = strlen(s->query);
+  job.fold = 1;
+  for (i = 0; i < job.qlen; i++){
+    if (isupper((unsigned char) query[i])) job.fold = 0;
+  }
+  job.qmask = path_mask(query);
+  job.prefix = prefix;
+  job.plen = strlen(prefix);
+
+  // What the last query matched, then what was added since
+  // The buffers are kept between searches, fresh pages cost more
+  // than the search itself
+  n = s->count + f->count - s->scanned;
+  if (n + 1 > s->cap){
+    s->cap = n + 1 > s->cap * 2 ? n + 1 : s->cap * 2;
+    if ((s->ids = realloc(s->ids, s->cap * sizeof(int))) == NULL ||
+	(s->spare = realloc(s->spare, s->cap * sizeof(int))) == NULL ||
+	(s->scores = realloc(s->scores, s->cap * sizeof(int))) == NULL){
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  job.in = s->ids;
+  k = search_part(&job, s->count, s->spare, s->scores, pool);
+  job.in = NULL;
+  job.first = s->scanned;
+  k += search_part(&job, f->count - s->scanned, s->spare + k, s->scores + k, pool);
+  s->scanned = f->count;
+
+  ids = s->ids;
+  s->ids = s->spare;
+  s->spare = ids;
+  s->count = k;
+  if ((s->top = realloc(s->top, (max + 1) * sizeof(finder_match))) == NULL){
+    perror("realloc");
+    exit(errno);
+  }
+  pick_top(s, s->scores, max);
+  for (i = 0; i < s->ntop; i++){
+    s->top[i].path = f->entries[s->top[i].entry].path;
+    s->top[i].is_dir = f->entries[s->top[i].entry].is_dir;
+  }
+  pthread_mutex_unlock(&f->lock);
+}
+
+// Tells whether the walker is still adding paths, and how many live
+// ones the index holds
+int finder_busy(finder * f, int * paths){
+  int busy;
+
+  pthread_mutex_lock(&f->lock);
+  busy = f->busy || f->request;
+  *paths = f->count - f->dead;
+  pthread_mutex_unlock(&f->lock);
+  return busy;
+}
+
+void finder_search_free(finder_search * s){
+  free(s->ids);
+  free(s->spare);
+  free(s->scores);
+  free(s->top);
+  memset(s, 0, sizeof(finder_search));
+}
+
+void finder_destroy(finder * f){
+  pthread_mutex_lock(&f->lock);
+  f->cancel = 1;
+  f->shutdown = 1;
+  pthread_cond_signal(&f->wake);
+  pthread_mutex_unlock(&f->lock);
+  pthread_join(f->thread, NULL);
+
+  pool_destroy(&f->pool);
+  arena_destroy(&f->mem);
+  free(f->entries);
+  free(f->masks);
+  free(f->dirs);
+  free(f->slots);
+}
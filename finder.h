@@ -0,0 +1,95 @@
+// Gopher - Fuzzy file finder over a subtree
+#ifndef FINDER_H
+#define FINDER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "gopher.h"
+#include "arena.h"
+#include "pool.h"
+
+// One path under the root
+typedef struct {
+  char * path;            // relative to the root, in the index arena
+  char * lower;           // path in lower case, path itself if it is
+  int dir;                // the finder_dir it is in
+  unsigned seen;          // refresh that last found it
+  unsigned short len;
+  unsigned short base;    // offset of its last component
+  unsigned char is_dir;
+  unsigned char dead;     // gone since it was indexed
+} finder_entry;
+
+// A directory of the index, with the mtime it had when read
+typedef struct {
+  int entry;              // its finder_entry, -1 for the root
+  struct timespec mtime;
+  unsigned changed;       // refresh that read it again
+} finder_dir;
+
+typedef struct {
+  int entry;
+  int score;
+  const char * path;      // stays valid until the finder is opened again
+  int is_dir;
+} finder_match;
+
+// Indexes every path below root on a thread of its own. The paths are
+// searchable while the walk goes on. Opening the finder again only
+// rereads the directories whose mtime changed.
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;   // held by the walker while it adds paths
+  pthread_cond_t wake;
+  int shutdown;
+  int request;            // FINDER_ work waiting for the thread
+  volatile int cancel;
+  int busy;               // walking, so more paths may come
+
+  char root[MAXLEN];
+  dev_t dev;              // filesystem of the root, the walk stays on it
+  arena mem;
+  finder_entry * entries;
+  uint64_t * masks;       // characters each entry holds, to rule it out
+                          // early, kept apart so a scan reads little
+  int count;
+  int cap;
+  int dead;
+  finder_dir * dirs;
+  int ndirs;
+  int dirs_cap;
+  unsigned * slots;       // entries by path, as index + 1
+  unsigned slots_cap;
+  unsigned epoch;         // bumped whenever entries are renumbered
+  unsigned stamp;         // counts refreshes
+
+  work_pool pool;
+} finder;
+
+// A search and what it found, kept so that typing on narrows the last
+// matches instead of starting over
+typedef struct {
+  char query[MAXLEN];
+  char prefix[MAXLEN];    // only paths below it, relative to the root
+  unsigned epoch;
+  int scanned;            // entries looked at so far
+  int * ids;              // entries matching query, in index order
+  int count;
+  int * spare;            // where the next ids go, then swapped in
+  int * scores;           // of the next ids
+  int cap;                // room in each of the three
+  finder_match * top;     // best matches, best first
+  int ntop;
+} finder_search;
+
+int finder_init(finder * f, int pool_threads);
+void finder_open(finder * f, const char * dir, char * prefix);
+void finder_search_run(finder * f, finder_search * s, const char * prefix, const char * query, int max, work_pool * pool);
+void finder_search_free(finder_search * s);
+int finder_busy(finder * f, int * paths);
+void finder_destroy(finder * f);
+
+#endif
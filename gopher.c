@@ -17,10 +17,32 @@
 #include <time.h>
 #include <errno.h>
 #include <pwd.h>
+#include <poll.h>
+#include <locale.h>
+#include <fnmatch.h>
+
+#include "gopher.h"
+#include "scan.h"
+#include "arena.h"
+#include "listview.h"
+#include "pool.h"
+#include "uring.h"
+#include "cache.h"
+#include "watch.h"
+#include "nameidx.h"
+#include "du.h"
+#include "finder.h"
+#include "grep.h"
+#include "preview.h"
+#include "pager.h"
+#include "sort.h"
+#include "copy.h"
+#include "delete.h"
+#include "move.h"
+#include "jobs.h"
+#include "extract.h"
 
 
-#define MAXLEN 800
-#define MAXITEMS 50000
 #define MENUWIDTH_MAX 120
 
 #define MENUHEIGHT_MAX 40
@@ -34,43 +56,63 @@ int MENUWIDTH = 100;
 
 int ALLOW_INTERRUPT = 1;
 
+// Only stat entries when they are drawn or sorted on (-s turns this off)
+int LAZY_METADATA = 1;
+
+// Threads used to stat large listings (-j), -1 picks a default
+int STAT_THREADS = -1;
+#define STAT_POOL_MIN 256
+#define STAT_CHUNK 64
+
+// Memory for cached listings of other directories, in MB (-c)
+int CACHE_MB = 64;
+#define CACHE_MAX_DIRS 64
+
+// Show directories by the disk use of everything below them (-d, U)
+int DIR_SIZES = 0;
+
+// Show a preview of the highlighted entry beside the listing (-p, P)
+int PREVIEW = 0;
+
+// Keys typed this close together, in ms, add up to one name prefix
+#define TYPEAHEAD_MS 1000
+
+// Best matches the file finder keeps and shows
+#define FINDER_RESULTS 200
+
+// Indexes of recently browsed archives kept in memory
+#define ARCHIVE_CACHE 4
+
+// Previews kept for going back to entries seen before
+#define PREVIEW_CACHE 32
+
+// Bytes the pager searches between two looks at the keyboard
+#define PAGER_SEARCH_STEP (64 << 20)
+
+// Queue stats through io_uring when the kernel allows it (-u)
+int USE_URING = 0;
+#define URING_DEPTH 256
+
 // These aren't really necessary
 int USE_OPTIONS_MENU = 1;
 int IN_OPTIONS_MENU = 0;
 
-// Struct for the filelist
-typedef struct {
-  char * name;
-  char * name_short;
-  char * type;
-  mode_t st_mode;
-  
-  char * size;
-  size_t bytes;
-  char * description;
-  char * mod_date;
-  time_t mod_time;
-} file_info;
-
 enum compressors {ZIP = 2000,
                   UNZIP,
                   TAR,
-                  UNTAR};
+                  UNTAR,
+                  TARXZ};
 
 void print_in_middle(WINDOW *win, int starty, int startx, int width, char *string, chtype color);
-void sortfiles(file_info ** filelist, int count, int (*func)(const void * ptr1, const void * ptr2));
+void sortfiles(file_info ** filelist, int count, sort_order * order);
 //void refresh_menu(file_info ** filelist, ITEM** menu_items, int n_choices, MENU ** dir_menu, WINDOW ** dir_menu_win, char * dirbuff);
 void refresh_menu();
-int filecomp_size(const void * ptr1, const void * ptr2);
-int filecomp_name_desc(const void * ptr1, const void * ptr2);
-int filecomp_size_desc(const void * ptr1, const void * ptr2);
-int filecomp_name(const void * ptr1, const void * ptr2);
-int filecomp_date(const void * ptr1, const void * ptr2);
-int filecomp_date_desc(const void * ptr1, const void * ptr2);
-void destroy_filelist(file_info ** filelist);
-void clear_filelist(file_info ** filelist);
+void set_sort_key(sort_key key);
 ITEM * get_lettered_item(ITEM ** menu_items, ITEM * current, int num_items, char c);
-int build_filelist(file_info ** filelist, DIR * dfd);
+int is_typeahead_key(int c);
+static int index_of(file_info * fi);
+void type_ahead(int c);
+void draw_file_row(WINDOW * win, int row, int index, int highlight, void * data);
 void refresh_littlebox_color(char * msg, int color);
 
 int present_options(WINDOW ** dir_menu_win, MENU ** opt_menu, WINDOW ** opt_menu_win, ITEM ** opt_items, file_info * current_file_info, int item_no);
@@ -80,66 +122,196 @@ int new_dir();
 void file_touch();
 void open_terminal(char * dirbuff);
 void handle_winch(int sig);
+void resize_screen();
 void executecommand(char * msgbuff);
+void submit_extract(char * title, file_info * current_file_info, char * msgbuff);
 void unzip(file_info * current_file_info, char * msgbuff);
 void extract_tar(file_info * current_file_info, char * msgbuff);
 void zip(file_info * current_file_info, char * msgbuff);
 void compress_tar(file_info * current_file_info, char * msgbuff);
+void compress_xz(file_info * current_file_info, char * msgbuff);
 void refresh_filelist();
+mode_t dtype_to_mode(unsigned char d_type);
+void stat_entry(file_info * fi);
+void format_entry(file_info * fi);
+void ensure_metadata(file_info * fi);
+void load_all_metadata(file_info ** filelist, int count);
+void load_unknown_types(file_info ** filelist, int count);
+file_info * make_entry(const char * name, int namelen, unsigned char d_type);
+int get_key();
+int apply_dir_events();
+void update_listing();
+void save_listing(listing * list);
+void load_listing(listing * list);
+void show_cache_stats();
 void copy_to_clipboard();
 void move_to_clipboard();
+void fill_clipboard(int move);
+void clear_clipboard();
 void paste_from_clipboard();
+int paste_conflict(char * newname, int batch);
+int count_marked();
+void toggle_mark();
+void mark_matching(int mark);
+void invert_marks();
+void show_marked();
+void submit_archive(char * title, file_info * current_file_info, archive_type format, char * msgbuff);
+void refresh_jobs();
+void draw_job_status();
+void show_jobs();
+int quit_ok();
 void remove_file();
+void request_dir_sizes();
+void apply_dir_sizes();
+void toggle_dir_sizes();
+int find_file();
+int search_files();
+int list_width();
+void follow_preview();
+void apply_preview();
+void draw_preview();
+void toggle_preview();
+void view_file(file_info * fi);
+int find_in_pager(pager * p, WINDOW * win, const char * needle, int fold, int backward, size_t * top);
+void prompt_row(WINDOW * win, int row, const char * prompt, char * buf);
+void select_entry(const char * name);
+int is_archive(const char * name);
+int open_archive(const char * name);
+void archive_chdir(const char * name);
+void list_archive(int short_width);
+int archive_key(int c, int * changedir);
 
 #define refresh_littlebox(m) refresh_littlebox_color((char *)(m), 0)
 
 char  ** arg_parse (char *line, int *argcptr);
 
 
+// Files copied or cut with C or X, all from one directory
+typedef struct {
+  char dir[MAXLEN];
+  char ** names;
+  int count;
+  int cap;
+  int move;               // pasting moves them instead of copying
+  int archive;            // dir is an archive and names its members
+  uint64_t stop_at;       // how far its tar stream holds them
+} clip_set;
+
 // Structure for current state of program
 typedef struct {
   file_info ** filelist;
- 
+  int filelist_cap;       // room in filelist, including the NULL
+  arena filelist_arena;   // owns filelist and everything it points to
+  int sorted;             // filelist is in sorted_by order
+  sort_order sorted_by;
+  sorter sorter;          // scratch space of sortfiles()
+  name_index names;       // filelist by name, built on the first change
+  name_table by_name;     // filelist in name order, built on type-ahead
+  char typeahead[MAXLEN]; // name prefix typed so far
+  int typeahead_len;
+  struct timespec typeahead_at; // when its last key came
+  dir_watch watch;        // inotify watch on listing_dir
+  char listing_dir[MAXLEN]; // directory the filelist was scanned from
+  int dirfd;              // open fd of listing_dir, for fstatat()
+  int short_width;
+  struct stat dir_st;
+  time_t scanned;
+  dir_cache cache;
 
   char current_dir[MAXLEN];
   char previous_dir[MAXLEN];
   char home_dir[MAXLEN];
   char saved_dir[MAXLEN];
   char msgbuff[MAXLEN];
-  char clipboard[MAXLEN];
+  clip_set clipboard;
   char tempbuff[MAXLEN];
   int n_choices;
-  
-  char * copy_args[5];
-  char * del_args[5];
 
-  MENU * dir_menu;
-  ITEM ** menu_items;
+
   WINDOW * dir_menu_win;
+  listview view;          // rows of the filelist inside dir_menu_win
+  int name_width;         // widest name_short in the filelist
+
+  dir_scan scan;
+  work_pool stat_pool;
+  uring ring;
+  job_queue jobs;         // copies, moves, deletes and archives
+
+  archive_index * archive; // archive being browsed, NULL outside one
+  char archive_dir[MAXLEN]; // directory inside it, "" at its top
+  archive_index * archives[ARCHIVE_CACHE]; // recently browsed, newest first
+
+  du_engine du;           // sizes the directories of the listing
+  finder finder;          // paths below some directory, for find_file()
+  grep_engine grep;       // searches file contents, for search_files()
+  char select_name[MAXLEN]; // entry to put the cursor on once listed
+
+  WINDOW * preview_win;   // beside dir_menu_win while previews are on
+  preview_engine previews;
+  preview * preview_cache[PREVIEW_CACHE];
+  preview * preview_shown; // in the cache, NULL while loading
+  char preview_path[MAXLEN]; // entry the pane is for, "" for none
+  time_t preview_mod_time;
+  size_t preview_bytes;
+  unsigned preview_clock;
+
+  int resize_pipe[2];     // written by handle_winch, read by get_key
 
 
 } run_state_type;
 
 run_state_type run_state;
 
-// Function Pointer for current comparator.
+// Current sort order.
 // Kept global for use by handle_winch
-int (*comp_func)(const void *, const void *);
+sort_order sort_by;
 
 
-int main() {
+int main(int argc, char ** argv) {
 
   
 
-  //ITEM ** menu_items;
-  if ((run_state.menu_items = calloc(MAXITEMS, sizeof(ITEM *))) == NULL){
-    perror("calloc");
-    exit(errno);
-  } 
+  int c, opt_ret, i;
 
-  int c, opt_ret;
-  run_state.dir_menu = NULL;
-  int i;
+  while ((c = getopt(argc, argv, "sj:uc:dp")) != -1){
+    switch (c)
+      {
+      case 's':
+	LAZY_METADATA = 0;
+	break;
+      case 'j':
+	STAT_THREADS = atoi(optarg);
+	break;
+      case 'u':
+	USE_URING = 1;
+	break;
+      case 'c':
+	CACHE_MB = atoi(optarg);
+	break;
+      case 'd':
+	DIR_SIZES = 1;
+	break;
+      case 'p':
+	PREVIEW = 1;
+	break;
+      default:
+	fprintf(stderr, "usage: %s [-s] [-u] [-d] [-p] [-j threads] [-c cache MB]\n", argv[0]);
+	exit(1);
+      }
+  }
+  copy_save_umask();
+  pool_init(&run_state.stat_pool, STAT_THREADS < 0 ? pool_default_threads() : STAT_THREADS);
+  if (jobs_init(&run_state.jobs, pool_default_threads())) exit(1);
+  if (du_init(&run_state.du, pool_default_threads() - 1)) exit(1);
+  if (finder_init(&run_state.finder, pool_default_threads() - 1)) exit(1);
+  if (grep_init(&run_state.grep, pool_default_threads() - 1)) exit(1);
+  if (preview_init(&run_state.previews)) exit(1);
+  run_state.ring.fd = -1;
+  run_state.dirfd = -1;
+  run_state.listing_dir[0] = 0;
+  nameidx_init(&run_state.names);
+  cache_init(&run_state.cache, (size_t) CACHE_MB * 1024 * 1024, CACHE_MB > 0 ? CACHE_MAX_DIRS : 0);
+  run_state.dir_menu_win = NULL;
 
   //optionsmenu
   MENU * opt_menu = NULL;
@@ -150,9 +322,14 @@ int main() {
     exit(errno);
   }
   
-  //Current sort function pointer
-  //int (*comp_func)(const void *, const void *) = &filecomp_name;
-  comp_func = &filecomp_name;
+  //Current sort order
+  sort_by.key = SORT_NAME;
+  sort_by.desc = 0;
+  sort_by.dirs_first = 0;
+  sorter_init(&run_state.sorter);
+  run_state.sorter.pool = &run_state.stat_pool;
+  // Names sort in the user's collation order
+  setlocale(LC_COLLATE, "");
 
   initscr();
   start_color();
@@ -172,20 +349,11 @@ int main() {
 
   
 
-  run_state.filelist = calloc(1,sizeof(file_info *));
-  run_state.clipboard[0] = 0;
+  arena_init(&run_state.filelist_arena);
+  run_state.filelist = arena_calloc(&run_state.filelist_arena, sizeof(file_info *));
+  scan_init(&run_state.scan);
+  memset(&run_state.clipboard, 0, sizeof(clip_set));
 
-  //char * copy_args[5];
-  run_state.copy_args[0] = "cp";
-  run_state.copy_args[1] = "-r";
-  run_state.copy_args[2] = NULL;
-  run_state.copy_args[3] = NULL;
-  run_state.copy_args[4] = NULL;
-
-  //char * del_args[4];
-  run_state.del_args[0] = "rm";
-  run_state.del_args[1] = "-rf";
-  run_state.del_args[3] = NULL;
 
   int CHANGEDIR;
 
@@ -198,8 +366,25 @@ int main() {
   int log_fd = open(logdir, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
   dup2(log_fd, 2);
 
+  if (watch_init(&run_state.watch)){
+    fprintf(stderr, "inotify unavailable (%s), rescanning after changes\n", strerror(errno));
+  }
+
+  if (USE_URING && uring_init(&run_state.ring, URING_DEPTH)){
+    fprintf(stderr, "io_uring unavailable (%s), using the stat pool\n", strerror(errno));
+    USE_URING = 0;
+  }
+
 
   //Set up signal handler for resize
+  if (pipe(run_state.resize_pipe)){
+    perror("pipe");
+    exit(errno);
+  }
+  for (i = 0; i < 2; i++){
+    fcntl(run_state.resize_pipe[i], F_SETFL, O_NONBLOCK);
+    fcntl(run_state.resize_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
   struct sigaction sa;
   memset(&sa, 0, sizeof(struct sigaction));
   sa.sa_handler = handle_winch;
@@ -216,8 +401,11 @@ int main() {
     CHANGEDIR= 0;
 
     refresh_filelist();
-    sortfiles(run_state.filelist, run_state.n_choices, comp_func);
     refresh_menu();
+    if (run_state.select_name[0]){
+      select_entry(run_state.select_name);
+      run_state.select_name[0] = 0;
+    }
 
 
     // HANDLE KEYBOARD INPUT
@@ -229,50 +417,47 @@ int main() {
       //refresh_menu();
 
       opt_ret = -1;
-      if (c == -1) c = wgetch(run_state.dir_menu_win);
-      if (c == KEY_F(1)) break;
+      if (c == -1){
+	follow_preview();
+	c = get_key();
+      }
+      if (c == KEY_F(1) && quit_ok()) break;
       
       //fprintf(stderr, "KEY PRESS IS %d\n", c);
-      ITEM * curr;
       int abort = 0;
-      // a - z => go to next item starting with that letter
-      if (c >= 'a' && c <= 'z'){
-	      set_current_item(run_state.dir_menu, get_lettered_item(run_state.menu_items, current_item(run_state.dir_menu), run_state.n_choices, c));
-
+      if (!is_typeahead_key(c)) run_state.typeahead_len = 0;
+      // a - z, 0 - 9, '.' and '_' => go to the first name starting
+      // with what was typed
+      if (is_typeahead_key(c)){
+	type_ahead(c);
+      } else if (run_state.archive && archive_key(c, &CHANGEDIR)){
+	// Browsing an archive, which is read-only
+	if (CHANGEDIR) break;
       } else {
 	switch(c)
 	  {
 	  case KEY_DOWN:
-	    if (item_index(current_item(run_state.dir_menu)) == run_state.n_choices - 1){
-	      menu_driver(run_state.dir_menu, REQ_FIRST_ITEM);
-	    } else {
-	      menu_driver(run_state.dir_menu, REQ_DOWN_ITEM);
-	    }
-      strcpy(run_state.msgbuff, run_state.filelist[item_index(current_item(run_state.dir_menu))]->name);
+	    lv_move(&run_state.view, 1);
+      strcpy(run_state.msgbuff, run_state.filelist[run_state.view.cur]->name);
 	    refresh_littlebox(run_state.msgbuff);
 	    break;
 	  case KEY_UP:
-	    if (item_index(current_item(run_state.dir_menu)) == 0){
-	      menu_driver(run_state.dir_menu, REQ_LAST_ITEM);
-	    } else {
-	      menu_driver(run_state.dir_menu, REQ_UP_ITEM);
-	    }
-	    strcpy(run_state.msgbuff, run_state.filelist[item_index(current_item(run_state.dir_menu))]->name);
+	    lv_move(&run_state.view, -1);
+	    strcpy(run_state.msgbuff, run_state.filelist[run_state.view.cur]->name);
 	    refresh_littlebox(run_state.msgbuff);
 
 	    break;
 	  case KEY_NPAGE:
-	    menu_driver(run_state.dir_menu, REQ_SCR_DPAGE);
+	    lv_page(&run_state.view, 1);
 	    break;
 	  case KEY_PPAGE:
-	    menu_driver(run_state.dir_menu, REQ_SCR_UPAGE);
+	    lv_page(&run_state.view, -1);
 	    break;
 
 
 	    ////////////ENTER////////////////////////////////////////////////
 	  case 10:
-	    curr = current_item(run_state.dir_menu);
-	    item_no = item_index(curr);
+	    item_no = run_state.view.cur;
 	    if (item_no > 0){
      
 	      opt_ret = present_options(&run_state.dir_menu_win, &opt_menu, &opt_menu_win, opt_items, run_state.filelist[item_no], item_no);
@@ -294,13 +479,14 @@ int main() {
 	    /////////////////////////////////////////////////////////////////////////////
 
 	  case KEY_RIGHT:
-	    curr = current_item(run_state.dir_menu);
-	    item_no = item_index(curr);
+	    item_no = run_state.view.cur;
 	    if (S_ISDIR(run_state.filelist[item_no]->st_mode)){        
         getcwd(run_state.previous_dir, MAXLEN);
 		    chdir(run_state.filelist[item_no]->name);
 		    getcwd(run_state.current_dir, MAXLEN);
 		    CHANGEDIR = 1;
+	    } else if (S_ISREG(run_state.filelist[item_no]->st_mode) && is_archive(run_state.filelist[item_no]->name)){
+	      if (open_archive(run_state.filelist[item_no]->name) == 0) CHANGEDIR = 1;
 	    }
 	    break;
 	    
@@ -348,20 +534,69 @@ int main() {
       break;
 
 	  case 'S': //'=':
-	    comp_func = comp_func == &filecomp_size ? &filecomp_size_desc : &filecomp_size;
+	    set_sort_key(SORT_SIZE);
 	    refresh_menu();
 	    break;
 
 	  case 'A': //'-':
-	    comp_func = comp_func == &filecomp_name ? &filecomp_name_desc : &filecomp_name;
+	    set_sort_key(SORT_NAME);
 	    refresh_menu();
 	    break;
 
 	  case 'D':
-	    comp_func = comp_func == &filecomp_date ? &filecomp_date_desc : &filecomp_date;
+	    set_sort_key(SORT_DATE);
 	    refresh_menu();
 	    break;
 
+	  case 'F':
+	    sort_by.dirs_first = !sort_by.dirs_first;
+	    refresh_menu();
+	    break;
+
+	  case 'I':
+	    show_cache_stats();
+	    break;
+
+	  case 'J':
+	    show_jobs();
+	    break;
+
+	  case 'U':
+	    toggle_dir_sizes();
+	    break;
+
+	  case 'G':
+	    if (find_file()) CHANGEDIR = 1;
+	    break;
+
+	  case 'W':
+	    if (search_files()) CHANGEDIR = 1;
+	    break;
+
+	  case 'P':
+	    toggle_preview();
+	    break;
+
+	  case 'L':
+	    view_file(run_state.filelist[run_state.view.cur]);
+	    break;
+
+	  case ' ':
+	    toggle_mark();
+	    break;
+
+	  case '+':
+	    mark_matching(1);
+	    break;
+
+	  case '-':
+	    mark_matching(0);
+	    break;
+
+	  case '*':
+	    invert_marks();
+	    break;
+
 	  case 'C': //shift + c COPY
 	    copy_to_clipboard();
 	    break;
@@ -380,9 +615,8 @@ int main() {
 
 
 	  case 'R':
-	    rename_file(run_state.filelist[item_index(current_item(run_state.dir_menu))]);
-	    refresh_filelist();
-	    refresh_menu();
+	    rename_file(run_state.filelist[run_state.view.cur]);
+	    update_listing();
 	    break;
 
 
@@ -392,16 +626,14 @@ int main() {
 	    } else {
 	      strcpy(run_state.msgbuff, "Success");
 	    }
-	    refresh_filelist();
-	    refresh_menu();
+	    update_listing();
 	    refresh_littlebox(run_state.msgbuff);
 	    break;
 
 
 	  case 'N':
 	    file_touch();
-	    refresh_filelist();
-	    refresh_menu();
+	    update_listing();
 	    break;
 
 	  case 'T':
@@ -409,43 +641,50 @@ int main() {
 	    endwin();
 	    open_terminal(run_state.current_dir);
       ALLOW_INTERRUPT = 1;
-	    refresh_filelist();
+	    update_listing();
 	    refresh_menu();
 	    refresh();
 	    break;
 
 	  case 'E':
 	    executecommand(run_state.msgbuff);
-	    refresh_filelist();
+	    update_listing();
 	    refresh_menu();
       refresh_littlebox(run_state.msgbuff);
 	    break;
 
       case UNZIP:
       
-        unzip(run_state.filelist[item_index(current_item(run_state.dir_menu))], run_state.msgbuff);
-	      refresh_filelist();
+        unzip(run_state.filelist[run_state.view.cur], run_state.msgbuff);
+	      update_listing();
 	      refresh_menu();
         refresh_littlebox(run_state.msgbuff);
         break;
 
         case UNTAR:
-        extract_tar(run_state.filelist[item_index(current_item(run_state.dir_menu))], run_state.msgbuff);
-	      refresh_filelist();
+        extract_tar(run_state.filelist[run_state.view.cur], run_state.msgbuff);
+	      update_listing();
 	      refresh_menu();
         refresh_littlebox(run_state.msgbuff);
         break;
 
       case ZIP:
-        zip(run_state.filelist[item_index(current_item(run_state.dir_menu))], run_state.msgbuff);
-	      refresh_filelist();
+        zip(run_state.filelist[run_state.view.cur], run_state.msgbuff);
+	      update_listing();
 	      refresh_menu();
         refresh_littlebox(run_state.msgbuff);
         break;
 
       case TAR:
-        compress_tar(run_state.filelist[item_index(current_item(run_state.dir_menu))], run_state.msgbuff);
-	      refresh_filelist();
+        compress_tar(run_state.filelist[run_state.view.cur], run_state.msgbuff);
+	      update_listing();
+	      refresh_menu();
+        refresh_littlebox(run_state.msgbuff);
+        break;
+
+      case TARXZ:
+        compress_xz(run_state.filelist[run_state.view.cur], run_state.msgbuff);
+	      update_listing();
 	      refresh_menu();
         refresh_littlebox(run_state.msgbuff);
         break;
@@ -472,86 +711,61 @@ int main() {
 			 
   }
   //CLEANUP
-  unpost_menu(run_state.dir_menu);
-  free_menu(run_state.dir_menu);
-  run_state.dir_menu = NULL;
-  for(i = 0; i < MAXITEMS; i++){
-    free_item(run_state.menu_items[i]);
+  jobs_destroy(&run_state.jobs);
+  du_destroy(&run_state.du);
+  finder_destroy(&run_state.finder);
+  grep_destroy(&run_state.grep);
+  preview_destroy(&run_state.previews);
+  for (i = 0; i < PREVIEW_CACHE; i++){
+    preview_free(run_state.preview_cache[i]);
   }
-  free(run_state.menu_items);
   free(opt_items);
-  destroy_filelist(run_state.filelist);
-  if (run_state.copy_args[2]) free(run_state.copy_args[2]);
-  if (run_state.copy_args[3]) free(run_state.copy_args[3]);
+  arena_destroy(&run_state.filelist_arena);
+  if (run_state.dirfd >= 0) close(run_state.dirfd);
+  cache_destroy(&run_state.cache);
+  nameidx_clear(&run_state.names);
+  nametable_clear(&run_state.by_name);
+  watch_destroy(&run_state.watch);
+  scan_destroy(&run_state.scan);
+  sorter_destroy(&run_state.sorter);
+  pool_destroy(&run_state.stat_pool);
+  if (USE_URING) uring_destroy(&run_state.ring);
+  clear_clipboard();
+  free(run_state.clipboard.names);
+  for (i = 0; i < ARCHIVE_CACHE; i++){
+    archive_index_free(run_state.archives[i]);
+  }
   
   endwin();
   return 0;
 }
 
 
-// Comparator - Sort by filename ascending
-int filecomp_name(const void * ptr1, const void * ptr2){
-  char * A =  (*(file_info **) ptr1)->name;
-  char * B =  (*(file_info **) ptr2)->name;
-
-  char a;
-  char b;
-  
-  while(*A != 0 && *B != 0){
-    a = tolower(*A);
-    b = tolower(*B);
-
-    if (a > b) return 1;
-    if (a < b) return -1;
-    A++;
-    B++;
-  }
-  if (*A == *B){ //both null
-    return 0;
+// Sorts on key, ascending. Picking the current key again flips the
+// direction.
+void set_sort_key(sort_key key){
+  if (sort_by.key == key){
+    sort_by.desc = !sort_by.desc;
+  } else {
+    sort_by.key = key;
+    sort_by.desc = 0;
   }
-  if (*A == 0) return -1;
-  return 1;
-}
-
-// Comparator - Sort by date decending
-int filecomp_name_desc(const void * ptr1, const void * ptr2){
-  return filecomp_name(ptr1, ptr2) * -1;
-}
-
-// Comparator - Sort by size ascending
-int filecomp_size(const void * ptr1, const void * ptr2){
-  size_t A =  (*(file_info **) ptr1)->bytes;
-  size_t B =  (*(file_info **) ptr2)->bytes;
-
-  if (A > B) return 1;
-  if (A < B) return -1;
-  return 0;
-}
-
-// Comparator - Sort by size decending
-int filecomp_size_desc(const void * ptr1, const void * ptr2){
-  return filecomp_size(ptr1, ptr2) * -1;
 }
 
-// Comparator - Sort by date ascending
-int filecomp_date(const void * ptr1, const void * ptr2){
-  time_t A =  (*(file_info **) ptr1)->mod_time;
-  time_t B =  (*(file_info **) ptr2)->mod_time;
-  if (A > B) return 1;
-  if (A < B) return -1;
-  return 0;
-}
-
-// Comparator - Sort by date descending
-int filecomp_date_desc(const void * ptr1, const void * ptr2){
-  return filecomp_date(ptr1, ptr2) * -1;
-}
+// Puts the filelist in the given order, leaving ".." first. A listing
+// already sorted on the same key is only reversed. Size and date sorts
+// need every entry stat'ed first.
+void sortfiles(file_info ** filelist, int count, sort_order * order){
+  sort_order * prev = &run_state.sorted_by;
 
-// Sorts the filelist using qsort() and a given comparator.
-void sortfiles(file_info ** filelist, int count, int (*func)(const void * ptr1, const void * ptr2)){
-  filelist++;
-  count--;
-  qsort(filelist, count, sizeof(file_info *), func);
+  if (run_state.sorted && prev->key == order->key && prev->dirs_first == order->dirs_first){
+    if (prev->desc != order->desc) sort_reverse(filelist + 1, count - 1, order);
+  } else {
+    if (order->key != SORT_NAME) load_all_metadata(filelist, count);
+    sort_entries(&run_state.sorter, filelist + 1, count - 1, order);
+  }
+  run_state.sorted_by = *order;
+  run_state.sorted = 1;
 }
 
 // Presents and controls the dropdown options menu
@@ -571,6 +785,7 @@ int present_options(WINDOW ** dir_menu_win, MENU ** opt_menu, WINDOW ** opt_menu
   
   int n_choices;
   char * f_options[] = {"OPEN",
+		       "VIEW",
 		       "COPY",
 		       "MOVE",
 		       "DELETE",
@@ -581,26 +796,26 @@ int present_options(WINDOW ** dir_menu_win, MENU ** opt_menu, WINDOW ** opt_menu
 			"MAKE DIR",
 			"TERMINAL",
       "------------",
-      "compress as:", //11
+      "compress as:", //12
       "ZIP",
       "TAR.GZ",
+      "TAR.XZ",
       "------------",
-			"BACK", //15
+			"BACK", //17
 		       NULL,
            NULL};
-  n_choices = 16;
-  if (strstr(current_file_info->name, ".tar.gz") || strstr(current_file_info->name, ".tar.xz")){
-    f_options[11] = "EXTRACT HERE";
-    f_options[12] = f_options[14];
-    f_options[13] = f_options[15];
-    f_options[14] = NULL;
-    n_choices = 14;
-  } else if (strstr(current_file_info->name, ".zip")){
-    f_options[11] = "UNZIP HERE";
-    f_options[12] = f_options[14];
-    f_options[13] = f_options[15];
-    f_options[14] = NULL;
-    n_choices = 14;
+  n_choices = 18;
+  if (S_ISREG(current_file_info->st_mode) && is_archive(current_file_info->name)){
+    // is_archive() saw a suffix of at least four characters
+    if (!strcmp(current_file_info->name + strlen(current_file_info->name) - 4, ".zip")){
+      f_options[12] = "UNZIP HERE";
+    } else {
+      f_options[12] = "EXTRACT HERE";
+    }
+    f_options[13] = f_options[16];
+    f_options[14] = f_options[17];
+    f_options[15] = NULL;
+    n_choices = 15;
   }
   
 
@@ -692,7 +907,7 @@ int present_options(WINDOW ** dir_menu_win, MENU ** opt_menu, WINDOW ** opt_menu
 	if (!strcmp(item_name(curr), "BACK")){
 	  ret = -1;
 	} else if (!strcmp(item_name(curr), "OPEN")) {
-	  if (S_ISDIR(current_file_info->st_mode)){
+	  if (S_ISDIR(current_file_info->st_mode) || is_archive(current_file_info->name)){
 	    //ret = KEY_ENTER;
 	    ret = KEY_RIGHT;
 	    
@@ -714,6 +929,8 @@ int present_options(WINDOW ** dir_menu_win, MENU ** opt_menu, WINDOW ** opt_menu
 
 	    
 	  }
+	} else if (!strcmp(item_name(curr), "VIEW")) {
+	  ret = 'L';
 	} else if (!strcmp(item_name(curr), "COPY")) {
 	  ret = 'C';
 	} else if (!strcmp(item_name(curr), "MOVE")) {
@@ -738,6 +955,8 @@ int present_options(WINDOW ** dir_menu_win, MENU ** opt_menu, WINDOW ** opt_menu
     ret = UNTAR;
   } else if (!strcmp(item_name(curr), "TAR.GZ")) {
     ret = TAR;
+  } else if (!strcmp(item_name(curr), "TAR.XZ")) {
+    ret = TARXZ;
   } else {
 	  break;
 	}
@@ -764,59 +983,47 @@ int present_options(WINDOW ** dir_menu_win, MENU ** opt_menu, WINDOW ** opt_menu
 // Refreshes the main menu using the contents of filelist
 void refresh_menu(){
 
-  sortfiles(run_state.filelist, run_state.n_choices, comp_func);
-  int i = 0;
+  sortfiles(run_state.filelist, run_state.n_choices, &sort_by);
 
-  file_info ** filelist = run_state.filelist;
-  MENU ** dir_menu = &run_state.dir_menu;
-  ITEM ** menu_items = run_state.menu_items;
   WINDOW ** dir_menu_win = &run_state.dir_menu_win;
   char * dirbuff = run_state.current_dir;
-  int n_choices = run_state.n_choices;
-
+  char title[MAXLEN];
+  int width = list_width();
 
-  if(*dir_menu){
-    unpost_menu(*dir_menu);
-    free_menu(*dir_menu);
+  if (run_state.archive){
+    snprintf(title, MAXLEN, "%s%s%s", run_state.archive->path, run_state.archive_dir[0] ? "/" : "", run_state.archive_dir);
+    dirbuff = title;
   }
-  
-  while (menu_items[i] != NULL && i < MAXITEMS){
-    free_item(menu_items[i]);
-    menu_items[i] = NULL;
-    i++;
-  }
-
 
-  for(i = 0; i < n_choices; i++){
-    menu_items[i] = new_item(filelist[i]->name_short, filelist[i]->description);
+  if (*dir_menu_win){
+    delwin(run_state.view.win);
+    delwin(*dir_menu_win);
+  }
+  if (run_state.preview_win){
+    delwin(run_state.preview_win);
+    run_state.preview_win = NULL;
   }
-  menu_items[n_choices] = NULL;
 
-  // Create menu
-  *dir_menu = new_menu((ITEM **) menu_items);
-  
   // Create window
-  *dir_menu_win = newwin(MENUHEIGHT, MENUWIDTH, Y_OFFSET, X_OFFSET);
+  *dir_menu_win = newwin(MENUHEIGHT, width, Y_OFFSET, X_OFFSET);
   keypad(*dir_menu_win, TRUE);
-  
-  // Set main window and subwindow
-  set_menu_win(*dir_menu, *dir_menu_win);
-  set_menu_sub(*dir_menu, derwin(*dir_menu_win, MENUHEIGHT - 4, MENUWIDTH - 2, Y_OFFSET + 2, X_OFFSET - 3));
-  set_menu_format(*dir_menu, MENUHEIGHT - 4, 1);
+  if (PREVIEW) run_state.preview_win = newwin(MENUHEIGHT, MENUWIDTH - width, Y_OFFSET, X_OFFSET + width);
+
+  // Only the rows on screen are ever drawn, whatever the directory size
+  lv_init(&run_state.view, derwin(*dir_menu_win, MENUHEIGHT - 4, width - 2, Y_OFFSET + 2, X_OFFSET - 3), MENUHEIGHT - 4, draw_file_row, NULL);
+  lv_set_count(&run_state.view, run_state.n_choices);
 
-  set_menu_mark(*dir_menu, "-> ");
-  
   // border and title
   box(*dir_menu_win, 0,0 );
-  mvwprintw(*dir_menu_win, 1, 4, "%s", dirbuff);
-  mvwprintw(*dir_menu_win, 0, MENUWIDTH - 8, "Gopher");
+  mvwprintw(*dir_menu_win, 1, 4, "%.*s", width - 6, dirbuff);
+  mvwprintw(*dir_menu_win, 0, width - 8, "Gopher");
   
   clear();
   refresh();
   
   mvwaddch(*dir_menu_win, 2, 0, ACS_LTEE);
-  mvwhline(*dir_menu_win, 2, 1, ACS_HLINE, MENUWIDTH - 2);
-  mvwaddch(*dir_menu_win, 2, MENUWIDTH - 1, ACS_RTEE);
+  mvwhline(*dir_menu_win, 2, 1, ACS_HLINE, width - 2);
+  mvwaddch(*dir_menu_win, 2, width - 1, ACS_RTEE);
 
   // box for filename
   mvaddch(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET, ACS_VLINE);
@@ -828,41 +1035,30 @@ void refresh_menu(){
   mvaddch(MENUHEIGHT + Y_OFFSET , X_OFFSET + MENUWIDTH - 1, ACS_URCORNER);
   mvaddch(MENUHEIGHT + Y_OFFSET +2, X_OFFSET + MENUWIDTH - 1, ACS_LRCORNER);
   
-  //post menu
-  post_menu(*dir_menu);
+  lv_draw(&run_state.view);
   wrefresh(*dir_menu_win);
 
   refresh();
-  
-}
-
-// Frees the contents of a filelist (file **)
-void clear_filelist(file_info ** filelist){
-  while ((*filelist) != NULL){
-    
-    free((*filelist)->name);
-    (*filelist)->name = NULL;
-    free((*filelist)->name_short);
-    (*filelist)->name_short = NULL;
-    free((*filelist)->type);
-    (*filelist)->type = NULL;
-    free((*filelist)->size);
-    (*filelist)->size = NULL;
-    free((*filelist)->description);
-    (*filelist)->description = NULL;
-    free(*filelist);
-    *filelist = NULL;
-    filelist++;
-    
-  }
+  draw_preview();
 }
 
-// Frees the filelist (file_info **), and it's contents
-void destroy_filelist(file_info ** filelist){
-  file_info ** begin = filelist;
-  clear_filelist(filelist);
-  free(begin);
-
+// Draws one entry of the filelist as a row of the directory view
+void draw_file_row(WINDOW * win, int row, int index, int highlight, void * data){
+  file_info * fi = run_state.filelist[index];
+  char line[MAXLEN];
+  int width = getmaxx(win) - 3;
+
+  (void) data;
+  ensure_metadata(fi);
+
+  mvwaddstr(win, row, 0, highlight ? "->" : "  ");
+  waddch(win, fi->marked ? '*' : ' ');
+  snprintf(line, MAXLEN, "%-*s %s", run_state.name_width, fi->name_short, fi->description);
+  if (highlight) wattron(win, A_REVERSE);
+  if (fi->marked) wattron(win, COLOR_PAIR(3) | A_BOLD);
+  waddnstr(win, line, width);
+  if (fi->marked) wattroff(win, COLOR_PAIR(3) | A_BOLD);
+  if (highlight) wattroff(win, A_REVERSE);
 }
 
 // Get next item beginning with letter (char c)
@@ -883,197 +1079,693 @@ ITEM * get_lettered_item(ITEM ** menu_items, ITEM * current, int num_items, char
 
 }
 
+// Tells whether a key of the directory view is part of a name typed
+int is_typeahead_key(int c){
+  return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '.' || c == '_';
+}
+
+// Adds a key to the name prefix being typed and moves the cursor to
+// the first name, in name order, that starts with it. The prefix
+// starts over after a pause. Typing the same letter again goes on to
+// the next name starting with it.
+void type_ahead(int c){
+  struct timespec now;
+  file_info * fi;
+  long ms;
+  int pos;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms = (now.tv_sec - run_state.typeahead_at.tv_sec) * 1000 + (now.tv_nsec - run_state.typeahead_at.tv_nsec) / 1000000;
+  if (ms > TYPEAHEAD_MS) run_state.typeahead_len = 0;
+  run_state.typeahead_at = now;
+
+  if (!run_state.by_name.cap) nametable_build(&run_state.by_name, run_state.filelist, run_state.n_choices);
+  if (run_state.typeahead_len == 1 && run_state.typeahead[0] == c){
+    fi = nametable_prefix(&run_state.by_name, run_state.typeahead, run_state.filelist[run_state.view.cur]);
+  } else {
+    if (run_state.typeahead_len < MAXLEN - 1) run_state.typeahead[run_state.typeahead_len++] = c;
+    run_state.typeahead[run_state.typeahead_len] = 0;
+    fi = nametable_prefix(&run_state.by_name, run_state.typeahead, NULL);
+  }
+
+  if (fi && (pos = index_of(fi)) >= 0) lv_set_current(&run_state.view, pos);
+  snprintf(run_state.msgbuff, MAXLEN, "Find: %s%s", run_state.typeahead, fi ? "" : "  (no match)");
+  refresh_littlebox(run_state.msgbuff);
+}
+
 // Refreshes the filelist for given directory
 void refresh_filelist(){
-  struct dirent * dp;
-  struct stat stbuf;
+  scan_entry * dp;
   int file_count = 0;
-  DIR * dfd;
+  int n;
 
-  // Build array of file info and the menu
-  destroy_filelist(run_state.filelist);
+  listing list;
+  arena * mem = &run_state.filelist_arena;
   int item_no = 1;
   int last_item_no = 1;
   int i;
 
   int SHORTWIDTH = 21;
-  SHORTWIDTH = MENUWIDTH - 55;
+  SHORTWIDTH = list_width() - 55;
   SHORTWIDTH = SHORTWIDTH < 8 ? 8 : SHORTWIDTH;
   
-  
-  if (!(dfd = opendir(run_state.current_dir))){
-	      fprintf(stderr, "Can't open directory\n");
-  }
-  while (readdir(dfd)){
-    file_count++;
+  run_state.sorted = 0;
+  nameidx_clear(&run_state.names);
+  nametable_clear(&run_state.by_name);
+  run_state.typeahead_len = 0;
+
+  if (run_state.archive){
+    du_cancel(&run_state.du);
+    list_archive(SHORTWIDTH);
+    return;
   }
-  closedir(dfd);
 
-  run_state.filelist = calloc(file_count, sizeof(file_info *));
+  // The watch goes up before the scan, so no change is missed. Changes
+  // the scan already saw are applied again harmlessly.
+  if (strcmp(run_state.listing_dir, run_state.current_dir) || run_state.watch.wd < 0){
+    watch_dir(&run_state.watch, run_state.current_dir);
+  }
 
+  // Leaving a directory parks its listing in the cache. Coming back to
+  // one that hasn't changed skips the scan.
+  if (strcmp(run_state.listing_dir, run_state.current_dir)){
+    if (run_state.listing_dir[0]){
+      save_listing(&list);
+      cache_put(&run_state.cache, run_state.listing_dir, &list);
+      arena_init(mem);
+      run_state.dirfd = -1;
+    }
+    strcpy(run_state.listing_dir, run_state.current_dir);
+    if (cache_get(&run_state.cache, run_state.current_dir, SHORTWIDTH, &list)){
+      load_listing(&list);
+      // Entries may have changed without touching the directory
+      for (i = 0; i < run_state.n_choices; i++){
+        run_state.filelist[i]->has_meta = 0;
+        run_state.filelist[i]->formatted = 0;
+        if (!DIR_SIZES) run_state.filelist[i]->has_du = 0;
+      }
+      request_dir_sizes();
+      return;
+    }
+    if (!mem->head) cache_new_arena(&run_state.cache, mem);
+  }
 
-  if (!(dfd = opendir(run_state.current_dir))){
+  // Build array of file info and the menu.
+  // The previous listing is released in one go.
+  arena_reset(mem);
+  if (run_state.dirfd >= 0) close(run_state.dirfd);
+  run_state.dirfd = -1;
+  run_state.short_width = SHORTWIDTH;
+  run_state.scanned = time(NULL);
+  
+  // One pass over the directory. The entry count comes from the scan
+  // itself, and every stat is relative to the directory fd, which the
+  // listing keeps.
+  if ((file_count = scan_dir(&run_state.scan, run_state.current_dir)) < 0){
 	      fprintf(stderr, "Can't open directory\n");
+	      file_count = 0;
   }
-  while ((dp = readdir(dfd))) {
-    if (strcmp(dp->d_name, ".")){
-      if (!strcmp(dp->d_name, "..")){
+  run_state.dirfd = run_state.scan.dirfd;
+  run_state.scan.dirfd = -1;
+  run_state.dir_st = run_state.scan.dir_st;
+
+  run_state.filelist_cap = file_count + 2;
+  run_state.filelist = arena_calloc(mem, run_state.filelist_cap * sizeof(file_info *));
+  run_state.name_width = 0;
+
+  for (n = 0; n < file_count; n++) {
+    dp = &run_state.scan.entries[n];
+      if (!strcmp(dp->name, "..")){
 	last_item_no = item_no;
 	item_no = 0;
       }
       
-      stat(dp->d_name, &stbuf);
-      int namelen = strlen(dp->d_name);
-      if ((run_state.filelist[item_no] = calloc(1, sizeof(file_info))) == NULL){
-        perror("calloc");
-        exit(errno);
-      }
-      if ((run_state.filelist[item_no]->size = (char *) malloc(50)) == NULL){
-        perror("malloc");
-        exit(errno);
-      }
-      if ((run_state.filelist[item_no]->name = (char *) malloc(namelen + 1)) == NULL){
-        perror("malloc");
-        exit(errno);
-      }
-     
-      if ((run_state.filelist[item_no]->type = (char *) malloc(10))== NULL){
-        perror("malloc");
-        exit(errno);
-      }
-
-      if ((run_state.filelist[item_no]->description = (char *) calloc(100, 1)) == NULL){
-        perror("calloc");
-        exit(errno);
-      }
+      run_state.filelist[item_no] = make_entry(dp->name, dp->namelen, dp->d_type);
 
-      run_state.filelist[item_no]->mod_date = (ctime(&stbuf.st_mtim.tv_sec));
-      run_state.filelist[item_no]->mod_time = stbuf.st_mtim.tv_sec;
-      
-      memcpy(run_state.filelist[item_no]->name, dp->d_name, namelen + 1);
-      run_state.filelist[item_no]->name_short = strndup(dp->d_name, SHORTWIDTH);
-      
-      if(namelen > SHORTWIDTH - 1){
-	char * temp = &run_state.filelist[item_no]->name_short[SHORTWIDTH - 3];
-	
-	if (dp->d_name[namelen - 4] == '.') {
-	  char * extension = &dp->d_name[namelen -3];
-	  temp -= 1;
-	  for (i = 0; i < 4; i++){
-	    temp[i] = extension[i];
-	  }
-	  temp -= 3;
-	}
-	for (i = 0; i < 3; i++){
-	  temp[i] = '.';
-	}
-      }
-      
-      sprintf(run_state.filelist[item_no]->size, "%.1fkb", ((float) stbuf.st_size) / 1024);
-      run_state.filelist[item_no]->bytes = stbuf.st_size;
-      
-      run_state.filelist[item_no]->st_mode = stbuf.st_mode;
-      if (S_ISREG(stbuf.st_mode)) {
-	sprintf(run_state.filelist[item_no]->type, "FILE");
-      } else if (S_ISDIR(stbuf.st_mode)) {
-	sprintf(run_state.filelist[item_no]->type, " DIR");
-      }
-      
-      sprintf(run_state.filelist[item_no]->description, "   %s%14s   %s", run_state.filelist[item_no]->type, run_state.filelist[item_no]->size, run_state.filelist[item_no]->mod_date);
-      run_state.filelist[item_no]->description[strlen(run_state.filelist[item_no]->description) - 1] = 0;
-      
-      if (!strcmp(dp->d_name, "..")) item_no = last_item_no - 1;
+      if (!strcmp(dp->name, "..")) item_no = last_item_no - 1;
       item_no++;	
-    } 
   }
-  closedir(dfd);
+  // A directory that can't be read still gets a way back up
+  if (file_count == 0){
+    run_state.filelist[0] = make_entry("..", 2, DT_DIR);
+    item_no = 1;
+  }
   run_state.filelist[item_no] = NULL;
   run_state.n_choices = item_no;  
+
+  // d_type is enough to tell directories from files. Symlinks and
+  // filesystems that don't fill d_type still need a stat.
+  if (LAZY_METADATA) {
+    load_unknown_types(run_state.filelist, run_state.n_choices);
+  } else {
+    load_all_metadata(run_state.filelist, run_state.n_choices);
+  }
+  request_dir_sizes();
 }
 
-// Print test to the bottom box
-void refresh_littlebox_color(char * msg, int color){
-  move(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET + 4);
-  clrtoeol();
-  // box for filename
-  mvaddch(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET, ACS_VLINE);
-  mvaddch(MENUHEIGHT + Y_OFFSET , X_OFFSET, ACS_ULCORNER);
-  mvaddch(MENUHEIGHT + Y_OFFSET + 2, X_OFFSET, ACS_LLCORNER);
-  mvhline(MENUHEIGHT + Y_OFFSET + 2, X_OFFSET + 1, ACS_HLINE, MENUWIDTH - 2);
-  mvhline(MENUHEIGHT + Y_OFFSET , X_OFFSET + 1, ACS_HLINE, MENUWIDTH - 2);
-  mvaddch(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET + MENUWIDTH - 1, ACS_VLINE);
-  mvaddch(MENUHEIGHT + Y_OFFSET , X_OFFSET + MENUWIDTH - 1, ACS_URCORNER);
-  mvaddch(MENUHEIGHT + Y_OFFSET +2, X_OFFSET + MENUWIDTH - 1, ACS_LRCORNER);
-  if (color) attron(COLOR_PAIR(color));
-  mvprintw(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET + 4, "%s", msg);
-  if (color) attroff(COLOR_PAIR(color));
-  refresh();
+// Creates an entry for the current listing, in its arena
+file_info * make_entry(const char * name, int namelen, unsigned char d_type){
+  arena * mem = &run_state.filelist_arena;
+  int SHORTWIDTH = run_state.short_width;
+  file_info * fi;
+  int i, len;
+
+  fi = arena_calloc(mem, sizeof(file_info));
+  fi->name = arena_strndup(mem, name, namelen);
+  fi->name_short = arena_strndup(mem, name, SHORTWIDTH);
+
+  if(namelen > SHORTWIDTH - 1){
+    char * temp = &fi->name_short[SHORTWIDTH - 3];
+
+    if (name[namelen - 4] == '.') {
+      const char * extension = &name[namelen -3];
+      temp -= 1;
+      for (i = 0; i < 4; i++){
+	temp[i] = extension[i];
+      }
+      temp -= 3;
+    }
+    for (i = 0; i < 3; i++){
+      temp[i] = '.';
+    }
+  }
+
+  len = strlen(fi->name_short);
+  if (len > run_state.name_width) run_state.name_width = len;
+
+  fi->st_mode = dtype_to_mode(d_type);
+  return fi;
 }
 
-// Attempt to open file with a given program name
-void run_prog(file_info * current_file_info, char * prog_name){
-  int status;
-  pid_t cpid;
+// Maps a getdents d_type to the file type bits of st_mode.
+// Returns 0 when the type is unknown or a symlink.
+mode_t dtype_to_mode(unsigned char d_type){
+  switch (d_type)
+    {
+    case DT_DIR:  return S_IFDIR;
+    case DT_REG:  return S_IFREG;
+    case DT_FIFO: return S_IFIFO;
+    case DT_SOCK: return S_IFSOCK;
+    case DT_CHR:  return S_IFCHR;
+    case DT_BLK:  return S_IFBLK;
+    }
+  return 0;
+}
 
-  // first parse program name and possible flags.
-  // Then add file name at end.
-  int arg_count;
-  char ** args = arg_parse(prog_name, &arg_count);
-  args = realloc(args, sizeof(char *) * (arg_count + 2));
-  args[arg_count] = current_file_info->name;
-  args[arg_count + 1] = NULL;
-  
+// Fills st_mode, bytes and mod_time of an entry from fstatat().
+// Touches nothing but the entry itself.
+void stat_entry(file_info * fi){
+  struct stat stbuf;
 
+  if (fstatat(run_state.dirfd, fi->name, &stbuf, 0) == 0){
+    fi->st_mode = stbuf.st_mode;
+    if (!fi->has_du) fi->bytes = stbuf.st_size;
+    fi->mod_time = stbuf.st_mtim.tv_sec;
+  }
+  fi->has_meta = 1;
+}
 
+// Builds the size, type and description strings of a stat'ed entry.
+// An entry formatted before keeps its strings, which are rewritten.
+void format_entry(file_info * fi){
+  arena * mem = &run_state.filelist_arena;
 
-  
-  int fd[2];
-  int bufflen = 80;
-  char errorbuff[bufflen];
-  if (pipe(fd) < 0){
-    perror("pipe");
+  if (!fi->description){
+    fi->size = arena_alloc(mem, 50);
+    fi->type = arena_alloc(mem, 10);
+    fi->description = arena_alloc(mem, 100);
   }
-  
-  cpid = fork();
-  
-  if (cpid == 0){ //we are child
-    close(fd[0]); // close read end of pipe
-    execvp(args[0], args);
-    write(fd[1], strerror(errno), bufflen);
-    fclose(stdin);
-    exit(127);
+  fi->type[0] = 0;
+
+  fi->mod_date = (ctime(&fi->mod_time));
+  if (DIR_SIZES && !run_state.archive && S_ISDIR(fi->st_mode) && !fi->has_du && strcmp(fi->name, "..")){
+    sprintf(fi->size, "...");
+  } else {
+    sprintf(fi->size, "%s%.1fkb", fi->has_du && fi->du_partial ? ">" : "", ((float) fi->bytes) / 1024);
   }
   
-  while (waitpid(cpid, &status, 0) < 0){
-    perror("wait");
+  if (S_ISREG(fi->st_mode)) {
+    sprintf(fi->type, "FILE");
+  } else if (S_ISDIR(fi->st_mode)) {
+    sprintf(fi->type, " DIR");
   }
+      
+  sprintf(fi->description, "   %s%14s   %s", fi->type, fi->size, fi->mod_date);
+  fi->description[strlen(fi->description) - 1] = 0;
+  fi->formatted = 1;
+}
 
-  free(args);
-  //free(argstring);
-  write(fd[1], "Success", bufflen);
-  close(fd[1]);
-  read(fd[0], errorbuff, bufflen);
-  refresh_littlebox(errorbuff);
+// Makes sure an entry is stat'ed and its description built
+void ensure_metadata(file_info * fi){
+  if (!fi->has_meta) stat_entry(fi);
+  if (!fi->formatted) format_entry(fi);
 }
 
-// Rename selected file
-void rename_file(file_info * current_file_info){
+// A stat fan-out over part of the filelist
+typedef struct {
+  file_info ** filelist;
+  int unknown_only;   // only entries whose type d_type didn't give
+} stat_job;
 
-  char  new_name[80];
-  char * args[5];
-  pid_t cpid;
-  int status;
-  
-  int fd[2];
-  int bufflen = 80;
-  char errorbuff[bufflen];
-  if (pipe(fd) < 0){
-    perror("pipe");
+static void stat_range(int begin, int end, void * arg){
+  stat_job * job = arg;
+  file_info * fi;
+  int i;
+  for (i = begin; i < end; i++){
+    fi = job->filelist[i];
+    if (fi->has_meta || (job->unknown_only && fi->st_mode)) continue;
+    stat_entry(fi);
   }
-  
-  args[0] = "mv";
-  args[1] = "-f";
-  args[2] = current_file_info->name;
+}
+
+static const char * statx_name(int index, void * arg){
+  return ((file_info **) arg)[index]->name;
+}
+
+static void statx_done(int index, int res, struct statx * stx, void * arg){
+  file_info * fi = ((file_info **) arg)[index];
+  if (res == -EINVAL) return; // no IORING_OP_STATX, left for the fallback
+  if (res == 0){
+    fi->st_mode = stx->stx_mode;
+    if (!fi->has_du) fi->bytes = stx->stx_size;
+    fi->mod_time = stx->stx_mtime.tv_sec;
+  }
+  fi->has_meta = 1;
+}
+
+// Stats the entries of a stat_job through io_uring. Whatever doesn't
+// complete is left for stat_fan_out() to do synchronously.
+static void uring_fan_out(stat_job * job, int count){
+  file_info ** pending;
+  file_info * fi;
+  int i, n = 0;
+
+  if ((pending = malloc(count * sizeof(file_info *))) == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  for (i = 0; i < count; i++){
+    fi = job->filelist[i];
+    if (fi->has_meta || (job->unknown_only && fi->st_mode)) continue;
+    pending[n++] = fi;
+  }
+
+  if (n && uring_statx(&run_state.ring, run_state.dirfd, n, statx_name, statx_done, pending) < n){
+    fprintf(stderr, "io_uring failed, using the stat pool\n");
+    uring_destroy(&run_state.ring);
+    USE_URING = 0;
+  } else if (n && !pending[0]->has_meta){
+    fprintf(stderr, "io_uring has no statx, using the stat pool\n");
+    uring_destroy(&run_state.ring);
+    USE_URING = 0;
+  }
+  free(pending);
+}
+
+// Stats entries of the filelist, through io_uring or spread over the
+// stat pool when there are enough of them. Each worker writes only to
+// its own entries.
+static void stat_fan_out(file_info ** filelist, int count, int unknown_only){
+  stat_job job = {filelist, unknown_only};
+  if (USE_URING && count >= STAT_POOL_MIN) uring_fan_out(&job, count);
+  if (count < STAT_POOL_MIN) {
+    stat_range(0, count, &job);
+  } else {
+    pool_for(&run_state.stat_pool, count, STAT_CHUNK, stat_range, &job);
+  }
+}
+
+// Stats every entry that hasn't been yet
+void load_all_metadata(file_info ** filelist, int count){
+  stat_fan_out(filelist, count, 0);
+}
+
+// Stats the entries whose file type is still unknown
+void load_unknown_types(file_info ** filelist, int count){
+  stat_fan_out(filelist, count, 1);
+}
+
+#define LISTING_REDRAW 1
+#define LISTING_RESCAN 2
+
+// Index at which fi belongs in the sorted filelist. ".." stays first.
+static int insert_position(file_info * fi){
+  int lo = 1, hi = run_state.n_choices, mid;
+  if (!run_state.sorted) return run_state.n_choices;
+  while (lo < hi){
+    mid = lo + (hi - lo) / 2;
+    if (sort_compare(&run_state.sorted_by, run_state.filelist[mid], fi) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Index of fi in the filelist, -1 if it isn't there
+static int index_of(file_info * fi){
+  int i = insert_position(fi);
+  if (i < run_state.n_choices && run_state.filelist[i] == fi) return i;
+  for (i = 0; i < run_state.n_choices; i++){
+    if (run_state.filelist[i] == fi) return i;
+  }
+  return -1;
+}
+
+// Puts fi into the filelist where the current sort wants it
+static void insert_entry(file_info * fi){
+  file_info ** grown;
+  int pos;
+
+  if (run_state.n_choices + 2 > run_state.filelist_cap){
+    run_state.filelist_cap *= 2;
+    grown = arena_alloc(&run_state.filelist_arena, run_state.filelist_cap * sizeof(file_info *));
+    memcpy(grown, run_state.filelist, (run_state.n_choices + 1) * sizeof(file_info *));
+    run_state.filelist = grown;
+  }
+  pos = insert_position(fi);
+  memmove(&run_state.filelist[pos + 1], &run_state.filelist[pos], (run_state.n_choices - pos + 1) * sizeof(file_info *));
+  run_state.filelist[pos] = fi;
+  run_state.n_choices++;
+  nameidx_add(&run_state.names, fi);
+  nametable_add(&run_state.by_name, fi);
+  if (pos <= run_state.view.cur && run_state.view.cur > 0) run_state.view.cur++;
+}
+
+// Takes entry pos out of the filelist
+static void remove_entry(int pos){
+  nameidx_remove(&run_state.names, run_state.filelist[pos]);
+  nametable_remove(&run_state.by_name, run_state.filelist[pos]);
+  memmove(&run_state.filelist[pos], &run_state.filelist[pos + 1], (run_state.n_choices - pos) * sizeof(file_info *));
+  run_state.n_choices--;
+  if (pos < run_state.view.cur) run_state.view.cur--;
+}
+
+// Applies one inotify event to the current listing
+static void dir_event(unsigned mask, const char * name, void * arg){
+  int * changes = arg;
+  file_info * fi;
+  int pos;
+
+  // The listing is of an archive. Changes to the directory meanwhile
+  // are caught when its listing comes back from the cache.
+  if (run_state.archive) return;
+
+  if (mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)){
+    *changes |= LISTING_RESCAN;
+    return;
+  }
+  if (!name[0] || (*changes & LISTING_RESCAN)) return;
+
+  if (!run_state.names.cap) nameidx_build(&run_state.names, run_state.filelist, run_state.n_choices);
+  fi = nameidx_find(&run_state.names, name);
+
+  if (mask & (IN_DELETE | IN_MOVED_FROM)){
+    if (!fi || (pos = index_of(fi)) < 1) return;
+    remove_entry(pos);
+  } else {
+    // Created, moved in or changed: (re)stat it and put it where the
+    // current sort wants it
+    if (fi){
+      if ((pos = index_of(fi)) < 1) return;
+      remove_entry(pos);
+    } else {
+      fi = make_entry(name, strlen(name), DT_UNKNOWN);
+    }
+    fi->has_meta = 0;
+    fi->formatted = 0;
+    stat_entry(fi);
+    insert_entry(fi);
+  }
+  *changes |= LISTING_REDRAW;
+}
+
+// Applies the queued changes of the current directory to the listing
+// and redraws what they touched. Returns the LISTING_ flags.
+int apply_dir_events(){
+  int changes = 0;
+
+  watch_read(&run_state.watch, dir_event, &changes);
+  if (changes & LISTING_RESCAN){
+    refresh_filelist();
+    refresh_menu();
+  } else if (changes & LISTING_REDRAW){
+    lv_set_count(&run_state.view, run_state.n_choices);
+    lv_set_current(&run_state.view, run_state.view.cur);
+    // New directories need sizing. The others come from the cache.
+    request_dir_sizes();
+  }
+  return changes;
+}
+
+// Brings the listing up to date after a file operation. With a watch
+// on the directory only the changes are applied, otherwise it is
+// rescanned.
+void update_listing(){
+  if (run_state.watch.wd >= 0){
+    apply_dir_events();
+    return;
+  }
+  refresh_filelist();
+  refresh_menu();
+}
+
+// Waits for a key on the directory view. Changes to the directory made
+// meanwhile, by gopher or anyone else, are applied as they come in.
+int get_key(){
+  struct pollfd fds[6];
+  char buf[64];
+  int c, ret;
+
+  while (1){
+    // Keys ncurses already buffered don't show up in poll()
+    wtimeout(run_state.dir_menu_win, 0);
+    c = wgetch(run_state.dir_menu_win);
+    wtimeout(run_state.dir_menu_win, -1);
+    if (c != ERR) return c;
+
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = run_state.jobs.notify[0];
+    fds[1].events = POLLIN;
+    fds[2].fd = run_state.watch.fd;   // poll() skips it when -1
+    fds[2].events = POLLIN;
+    fds[3].fd = run_state.du.notify[0];
+    fds[3].events = POLLIN;
+    fds[4].fd = run_state.previews.notify[0];
+    fds[4].events = POLLIN;
+    fds[5].fd = run_state.resize_pipe[0];
+    fds[5].events = POLLIN;
+
+    // While jobs run, wake up now and then to show their progress
+    ret = poll(fds, 6, jobs_active(&run_state.jobs, NULL) ? 250 : -1);
+    if (ret < 0) continue;
+    if (fds[5].revents & POLLIN){
+      while (read(run_state.resize_pipe[0], buf, sizeof(buf)) > 0);
+      resize_screen();
+    }
+    if (fds[2].revents & POLLIN) apply_dir_events();
+    if (fds[3].revents & POLLIN) apply_dir_sizes();
+    if (fds[4].revents & POLLIN) apply_preview();
+    if (ret == 0 || (fds[1].revents & POLLIN)) refresh_jobs();
+  }
+}
+
+// Asks the du engine for the disk use of every directory in the
+// listing, in place of whatever it was working on
+void request_dir_sizes(){
+  char ** names;
+  int i, count = 0;
+
+  if (!DIR_SIZES || run_state.archive) return;
+  if ((names = malloc((run_state.n_choices + 1) * sizeof(char *))) == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  for (i = 1; i < run_state.n_choices; i++){
+    if (S_ISDIR(run_state.filelist[i]->st_mode)) names[count++] = run_state.filelist[i]->name;
+  }
+  du_request(&run_state.du, run_state.current_dir, names, count);
+  free(names);
+}
+
+// Puts the directory sizes found so far into the listing. Sorted by
+// size, the directories move to their place.
+void apply_dir_sizes(){
+  du_result * results;
+  file_info * fi;
+  int i, pos, count, moved = 0;
+
+  count = du_results(&run_state.du, &results);
+  if (!count || run_state.archive){
+    du_free_results(results, count);
+    return;
+  }
+  if (!run_state.names.cap) nameidx_build(&run_state.names, run_state.filelist, run_state.n_choices);
+  for (i = 0; i < count; i++){
+    if ((fi = nameidx_find(&run_state.names, results[i].name)) == NULL) continue;
+    // Found before the entry moves, since the sort looks at bytes
+    pos = index_of(fi);
+    fi->bytes = results[i].bytes;
+    fi->has_du = 1;
+    fi->du_partial = results[i].partial;
+    fi->formatted = 0;
+    if (pos > 0 && run_state.sorted && run_state.sorted_by.key == SORT_SIZE){
+      remove_entry(pos);
+      insert_entry(fi);
+      moved = 1;
+    }
+  }
+  du_free_results(results, count);
+  if (moved) lv_set_count(&run_state.view, run_state.n_choices);
+  lv_set_current(&run_state.view, run_state.view.cur);
+}
+
+// Switches the size of directories between their own and that of
+// everything below them
+void toggle_dir_sizes(){
+  int i;
+
+  DIR_SIZES = !DIR_SIZES;
+  if (DIR_SIZES){
+    // Turning it on is also the way to get rid of stale totals
+    du_forget(&run_state.du);
+    request_dir_sizes();
+  } else {
+    du_cancel(&run_state.du);
+    for (i = 0; i < run_state.n_choices; i++){
+      if (!run_state.filelist[i]->has_du) continue;
+      run_state.filelist[i]->has_du = 0;
+      run_state.filelist[i]->has_meta = 0;
+    }
+  }
+  for (i = 0; i < run_state.n_choices; i++){
+    run_state.filelist[i]->formatted = 0;
+  }
+  run_state.sorted = 0;
+  refresh_menu();
+  refresh_littlebox(DIR_SIZES ? "Directory sizes: everything below" : "Directory sizes: own");
+}
+
+// Moves the current listing out of run_state
+void save_listing(listing * list){
+  list->filelist = run_state.filelist;
+  list->filelist_cap = run_state.filelist_cap;
+  list->n_choices = run_state.n_choices;
+  list->name_width = run_state.name_width;
+  list->short_width = run_state.short_width;
+  list->dirfd = run_state.dirfd;
+  list->dir_st = run_state.dir_st;
+  list->scanned = run_state.scanned;
+  list->mem = run_state.filelist_arena;
+}
+
+// Makes list the current listing. The current one must have been saved.
+void load_listing(listing * list){
+  run_state.filelist = list->filelist;
+  run_state.filelist_cap = list->filelist_cap;
+  run_state.n_choices = list->n_choices;
+  run_state.name_width = list->name_width;
+  run_state.short_width = list->short_width;
+  run_state.dirfd = list->dirfd;
+  run_state.dir_st = list->dir_st;
+  run_state.scanned = list->scanned;
+  arena_destroy(&run_state.filelist_arena);
+  run_state.filelist_arena = list->mem;
+}
+
+// Shows what the listing cache holds and how often it was used
+void show_cache_stats(){
+  snprintf(run_state.msgbuff, MAXLEN, "Cache: %d dirs, %.1fMB, %lu hits, %lu misses",
+	   run_state.cache.count, (float) run_state.cache.bytes / (1024 * 1024),
+	   run_state.cache.hits, run_state.cache.misses);
+  refresh_littlebox(run_state.msgbuff);
+}
+
+// Print test to the bottom box
+void refresh_littlebox_color(char * msg, int color){
+  move(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET + 4);
+  clrtoeol();
+  // box for filename
+  mvaddch(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET, ACS_VLINE);
+  mvaddch(MENUHEIGHT + Y_OFFSET , X_OFFSET, ACS_ULCORNER);
+  mvaddch(MENUHEIGHT + Y_OFFSET + 2, X_OFFSET, ACS_LLCORNER);
+  mvhline(MENUHEIGHT + Y_OFFSET + 2, X_OFFSET + 1, ACS_HLINE, MENUWIDTH - 2);
+  mvhline(MENUHEIGHT + Y_OFFSET , X_OFFSET + 1, ACS_HLINE, MENUWIDTH - 2);
+  mvaddch(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET + MENUWIDTH - 1, ACS_VLINE);
+  mvaddch(MENUHEIGHT + Y_OFFSET , X_OFFSET + MENUWIDTH - 1, ACS_URCORNER);
+  mvaddch(MENUHEIGHT + Y_OFFSET +2, X_OFFSET + MENUWIDTH - 1, ACS_LRCORNER);
+  if (color) attron(COLOR_PAIR(color));
+  mvprintw(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET + 4, "%s", msg);
+  if (color) attroff(COLOR_PAIR(color));
+  refresh();
+}
+
+// Attempt to open file with a given program name
+void run_prog(file_info * current_file_info, char * prog_name){
+  int status;
+  pid_t cpid;
+
+  // first parse program name and possible flags.
+  // Then add file name at end.
+  int arg_count;
+  char ** args = arg_parse(prog_name, &arg_count);
+  args = realloc(args, sizeof(char *) * (arg_count + 2));
+  args[arg_count] = current_file_info->name;
+  args[arg_count + 1] = NULL;
+  
+
+
+
+  
+  int fd[2];
+  int bufflen = 80;
+  char errorbuff[bufflen];
+  if (pipe(fd) < 0){
+    perror("pipe");
+  }
+  
+  cpid = fork();
+  
+  if (cpid == 0){ //we are child
+    close(fd[0]); // close read end of pipe
+    execvp(args[0], args);
+    write(fd[1], strerror(errno), bufflen);
+    fclose(stdin);
+    exit(127);
+  }
+  
+  while (waitpid(cpid, &status, 0) < 0){
+    perror("wait");
+  }
+
+  free(args);
+  //free(argstring);
+  write(fd[1], "Success", bufflen);
+  close(fd[1]);
+  read(fd[0], errorbuff, bufflen);
+  refresh_littlebox(errorbuff);
+}
+
+// Rename selected file
+void rename_file(file_info * current_file_info){
+
+  char  new_name[80];
+  char * args[5];
+  pid_t cpid;
+  int status;
+  
+  int fd[2];
+  int bufflen = 80;
+  char errorbuff[bufflen];
+  if (pipe(fd) < 0){
+    perror("pipe");
+  }
+  
+  args[0] = "mv";
+  args[1] = "-f";
+  args[2] = current_file_info->name;
   args[4] = NULL;
   refresh_littlebox("New Name: ");
   echo();
@@ -1198,20 +1890,29 @@ void open_terminal(char * dirbuff){
   refresh_littlebox(errorbuff);
 }
 
-// Signal handler for screen resize
+// Signal handler for screen resize. Drawing isn't safe in a signal
+// handler, so it only wakes get_key(), which redraws.
 void handle_winch(int sig){
+  int err = errno;
+  (void) sig;
+  // A full pipe already has a wakeup in it
+  while (write(run_state.resize_pipe[1], "w", 1) < 0 && errno == EINTR);
+  errno = err;
+}
+
+// Lays the screen out again for its new size
+void resize_screen(){
+  endwin();
+  refresh();
   MENUHEIGHT = LINES - 6;
   MENUWIDTH = COLS - 6;
   MENUWIDTH = MENUWIDTH > MENUWIDTH_MAX ? MENUWIDTH_MAX : MENUWIDTH;
-  
   MENUHEIGHT = MENUHEIGHT > MENUHEIGHT_MAX ? MENUHEIGHT_MAX : MENUHEIGHT;
-  if (!ALLOW_INTERRUPT) return;
 
-  endwin();
-  refresh();
   refresh_filelist();
   refresh_menu();
   refresh_littlebox(run_state.msgbuff);
+  draw_job_status();
 }
 
 // Exec a given command
@@ -1286,299 +1987,341 @@ void executecommand(char * msgbuff){
 
 }
 
+// Writes the current entry into name.zip, name.tar.gz or name.tar.xz
+// next to it, as a background job
+void submit_archive(char * title, file_info * current_file_info, archive_type format, char * msgbuff){
+  char path[MAXLEN], archive_name[MAXLEN];
+  job * j;
+
+  if (snprintf(path, MAXLEN, "%s/%s", run_state.current_dir, current_file_info->name) >= MAXLEN ||
+      snprintf(archive_name, MAXLEN, "%s%s", path, archive_suffix(format)) >= MAXLEN){
+    sprintf(msgbuff, "Filename too long");
+    return;
+  }
+  j = job_new(JOB_ARCHIVE, title);
+  j->format = format;
+  job_add(j, path, archive_name, 0);
+  jobs_submit(&run_state.jobs, j);
+  snprintf(msgbuff, MSGWIDTH - 2, "Queued: %s", title);
+  draw_job_status();
+}
+
 void zip(file_info * current_file_info, char * msgbuff){
-  pid_t cpid;
-  int status;
-  int fd[2];
+  snprintf(run_state.tempbuff, MAXLEN, "Zip %s", current_file_info->name);
+  submit_archive(run_state.tempbuff, current_file_info, ARCHIVE_ZIP, msgbuff);
+}
 
-  int bufflen = MSGWIDTH - 2;
+// Extracts an archive into the current directory as a background job.
+// The format is told from the contents, not the name.
+void submit_extract(char * title, file_info * current_file_info, char * msgbuff){
+  char path[MAXLEN];
+  job * j;
 
-  char archive_name[200];
-  if (snprintf(archive_name, 200, "%s.zip", current_file_info->name) >= 200){
+  if (snprintf(path, MAXLEN, "%s/%s", run_state.current_dir, current_file_info->name) >= MAXLEN){
     sprintf(msgbuff, "Filename too long");
     return;
   }
+  j = job_new(JOB_EXTRACT, title);
+  job_add(j, path, run_state.current_dir, 0);
+  jobs_submit(&run_state.jobs, j);
+  snprintf(msgbuff, MSGWIDTH - 2, "Queued: %s", title);
+  draw_job_status();
+}
 
-  if (pipe(fd) < 0){
-    perror("pipe");
-  }
-  ALLOW_INTERRUPT = 0;
-  endwin();
-  cpid = fork();
-  if (cpid == 0){ //we are child
-    close(fd[0]);
-    execlp("zip", "zip", "-r", archive_name, current_file_info->name, NULL);
-    write(fd[1], strerror(errno), bufflen);
-    fclose(stdin);
-    exit(127);
-  }
+void unzip(file_info * current_file_info, char * msgbuff){
+  snprintf(run_state.tempbuff, MAXLEN, "Unzip %s", current_file_info->name);
+  submit_extract(run_state.tempbuff, current_file_info, msgbuff);
+}
 
-  while (waitpid(cpid, &status, 0) < 0){
-    perror("wait");
-  }
-  ALLOW_INTERRUPT = 1;
-  refresh();
-  write(fd[1], "Success", bufflen);
-  close(fd[1]);
-  read(fd[0], msgbuff, bufflen);
+void compress_tar(file_info * current_file_info, char * msgbuff){
+  snprintf(run_state.tempbuff, MAXLEN, "Tar %s", current_file_info->name);
+  submit_archive(run_state.tempbuff, current_file_info, ARCHIVE_TAR_GZ, msgbuff);
+}
 
+void compress_xz(file_info * current_file_info, char * msgbuff){
+  snprintf(run_state.tempbuff, MAXLEN, "Tar.xz %s", current_file_info->name);
+  submit_archive(run_state.tempbuff, current_file_info, ARCHIVE_TAR_XZ, msgbuff);
 }
 
-void unzip(file_info * current_file_info, char * msgbuff){
-  pid_t cpid;
-  int status;
-  int fd[2];
+void extract_tar(file_info * current_file_info, char * msgbuff){
+  snprintf(run_state.tempbuff, MAXLEN, "Untar %s", current_file_info->name);
+  submit_extract(run_state.tempbuff, current_file_info, msgbuff);
+}
 
-  int bufflen = MSGWIDTH - 2;
+void copy_to_clipboard(){
+  fill_clipboard(0);
+}
 
-  if (pipe(fd) < 0){
-    perror("pipe");
+void move_to_clipboard() {
+  fill_clipboard(1);
+}
+
+// Drops the names on the clipboard
+void clear_clipboard(){
+  int i;
+  for (i = 0; i < run_state.clipboard.count; i++){
+    free(run_state.clipboard.names[i]);
   }
-  ALLOW_INTERRUPT = 0;
-  endwin();
-  cpid = fork();
-  if (cpid == 0){ //we are child
-    close(fd[0]);
-    execlp("unzip", "unzip", "-u", current_file_info->name, NULL);
-    write(fd[1], strerror(errno), bufflen);
-    fclose(stdin);
-    exit(127);
+  run_state.clipboard.count = 0;
+}
+
+// Puts the marked entries, or else the current one, on the clipboard.
+// The marks are dropped once they are on it. Inside an archive the
+// clipboard holds the archive and the paths of its members.
+void fill_clipboard(int move){
+  clip_set * clip = &run_state.clipboard;
+  char member[MAXLEN];
+  file_info * fi;
+  int i, marked = count_marked();
+
+  if (!marked && run_state.view.cur == 0) return;
+  clear_clipboard();
+  strcpy(clip->dir, run_state.archive ? run_state.archive->path : run_state.current_dir);
+  clip->move = move;
+  clip->archive = run_state.archive != NULL;
+  for (i = 1; i < run_state.n_choices; i++){
+    fi = run_state.filelist[i];
+    if (marked ? !fi->marked : i != run_state.view.cur) continue;
+    if (clip->count == clip->cap){
+      clip->cap = clip->cap ? clip->cap * 2 : 16;
+      if ((clip->names = realloc(clip->names, clip->cap * sizeof(char *))) == NULL){
+	perror("realloc");
+	exit(errno);
+      }
+    }
+    snprintf(member, MAXLEN, "%s%s%s", clip->archive ? run_state.archive_dir : "",
+	     clip->archive && run_state.archive_dir[0] ? "/" : "", fi->name);
+    if ((clip->names[clip->count++] = strdup(member)) == NULL){
+      perror("strdup");
+      exit(errno);
+    }
+    fi->marked = 0;
   }
+  lv_draw(&run_state.view);
+  if (clip->archive) clip->stop_at = archive_index_end(run_state.archive, clip->names, clip->count);
 
-  while (waitpid(cpid, &status, 0) < 0){
-    perror("wait");
+  if (clip->count == 1){
+    snprintf(run_state.msgbuff, MSGWIDTH - 2, "%s to Clipboard: %s/%s", move ? "Moved" : "Copied", clip->dir, clip->names[0]);
+    if (strlen(run_state.msgbuff) >= (size_t) (MSGWIDTH - 3)) sprintf(&run_state.msgbuff[MSGWIDTH -6], "...");
+  } else {
+    snprintf(run_state.msgbuff, MSGWIDTH - 2, "%s %d files to Clipboard", move ? "Moved" : "Copied", clip->count);
   }
-  
-  refresh();
-  write(fd[1], "Success", bufflen);
-  close(fd[1]);
-  read(fd[0], msgbuff, bufflen);
-  ALLOW_INTERRUPT = 1;
+  refresh_littlebox(run_state.msgbuff);
 }
 
-void compress_tar(file_info * current_file_info, char * msgbuff){
-  pid_t cpid;
-  int status;
-  int fd[2];
-
-  int bufflen = MSGWIDTH - 2;
+// Asks what to do about a paste whose name is taken. newname comes in
+// holding that name. Returns 'r' with the new name in newname, 'o' to
+// overwrite or 'a' to abort. A batch may also be answered with 's' to
+// skip the file, or 'O' and 'S' to overwrite or skip all the rest.
+int paste_conflict(char * newname, int batch){
+  char prompt[MAXLEN];
+  int c;
 
-  char archive_name[200];
-  if (snprintf(archive_name, 200, "%s.tar.gz", current_file_info->name) >= 200){
-    sprintf(msgbuff, "Filename too long");
-    return;
+  if (batch){
+    snprintf(prompt, MSGWIDTH - 2, "%s exists. (r)ename, (o)verwrite, (s)kip, (O)verwrite all, (S)kip all, (a)bort", newname);
+  } else {
+    snprintf(prompt, MSGWIDTH - 2, "Filename already exists. (r)ename, (o)verwrite, or (a)bort...");
   }
-
-  if (pipe(fd) < 0){
-    perror("pipe");
+  while (1){
+    refresh_littlebox_color(prompt, 1);
+    c = getch();
+    if (c == 'r'){
+      refresh_littlebox("New Name: ");
+      echo();
+      curs_set(1);
+      if (getstr(newname) == ERR || !newname[0]){
+        curs_set(0);
+        noecho();
+        refresh_littlebox("Whoops! Did not paste file");
+        return 'a';
+      }
+      curs_set(0);
+      noecho();
+      return 'r';
+    } else if (c == 'a'){
+      refresh_littlebox("Did not paste file");
+      return 'a';
+    } else if (c == 'o'){
+      return 'o';
+    } else if (batch && (c == 's' || c == 'O' || c == 'S')){
+      return c;
+    }
   }
+}
+
+// Pastes one clipboard entry as name in the current directory. Returns
+// like move_rename(). Copies always go to the job, as moves across
+// filesystems do.
+int paste_one(char * src, char * name, int replace, op_progress * prog){
+  struct stat st;
+  if (run_state.clipboard.move) return move_rename(src, name, replace, prog);
+  if (!replace && lstat(name, &st) == 0) return MOVE_TAKEN;
+  return MOVE_ACROSS;
+}
+
+// Pastes the whole clipboard into the current directory. Every taken
+// name is settled first, in one pass, and everything that needs
+// copying then goes as one job. Moves within a filesystem are renames
+// and are done on the spot. Members of an archive are extracted, in
+// one pass over it.
+void paste_from_clipboard(){
+  clip_set * clip = &run_state.clipboard;
+  char src[MAXLEN], dst[MAXLEN], name[MAXLEN];
+  op_progress prog;
+  job * j;
+  int i, c, ret, replace;
+  int all = 0, moved = 0, skipped = 0;
+
+  if (!clip->count) return;
+  j = job_new(clip->archive ? JOB_EXTRACT : clip->move ? JOB_MOVE : JOB_COPY, "");
+  j->stop_at = clip->stop_at;
+  progress_init(&prog, NULL, NULL);
   ALLOW_INTERRUPT = 0;
-  endwin();
-  cpid = fork();
-  if (cpid == 0){ //we are child
-    close(fd[0]);
-    execlp("tar", "tar", "-czvf", archive_name, current_file_info->name, NULL);
-    write(fd[1], strerror(errno), bufflen);
-    //perror("exec");
-    fclose(stdin);
-    exit(127);
-  }
 
-  while (waitpid(cpid, &status, 0) < 0){
-    perror("wait");
+  for (i = 0; i < clip->count; i++){
+    if (clip->archive){
+      snprintf(src, MAXLEN, "%s", clip->dir);
+      snprintf(name, MAXLEN, "%s", strrchr(clip->names[i], '/') ? strrchr(clip->names[i], '/') + 1 : clip->names[i]);
+    } else {
+      snprintf(src, MAXLEN, "%s/%s", clip->dir, clip->names[i]);
+      snprintf(name, MAXLEN, "%s", clip->names[i]);
+    }
+    replace = all == 'O';
+
+    // Moves find out about a taken name from the rename itself, so
+    // nothing can slip in between the check and the move
+    while ((ret = paste_one(src, name, replace, &prog)) == MOVE_TAKEN){
+      c = all == 'S' ? 's' : paste_conflict(name, clip->count > 1);
+      if (c == 'a'){
+	job_free(j);
+	if (moved) update_listing();
+	ALLOW_INTERRUPT = 1;
+	return;
+      }
+      if (c == 's' || c == 'S'){
+	if (c == 'S') all = 'S';
+	break;
+      }
+      if (c == 'o' || c == 'O'){
+	if (c == 'O') all = 'O';
+	replace = 1;
+      }
+    }
+
+    if (ret == MOVE_TAKEN){
+      skipped++;
+    } else if (ret == 0){
+      moved++;
+    } else if (ret == MOVE_ACROSS){
+      if (snprintf(dst, MAXLEN, "%s/%s", run_state.current_dir, name) >= MAXLEN){
+	progress_error(&prog, name, ENAMETOOLONG);
+      } else if (clip->archive){
+	job_add_member(j, src, clip->names[i], dst);
+      } else {
+	job_add(j, src, dst, replace);
+      }
+    }
   }
-  
-  refresh();
-  write(fd[1], "Success", bufflen);
-  close(fd[1]);
-  read(fd[0], msgbuff, bufflen);
+  update_listing();
   ALLOW_INTERRUPT = 1;
-}
-
-void extract_tar(file_info * current_file_info, char * msgbuff){
-  pid_t cpid;
-  int status;
-  int fd[2];
 
-  int bufflen = MSGWIDTH - 2;
+  if (j->nitems == 1){
+    snprintf(j->title, MAXLEN, "%s %s", clip->move ? "Move" : "Copy", strrchr(clip->archive ? j->items[0].dst : j->items[0].src, '/') + 1);
+  } else {
+    snprintf(j->title, MAXLEN, "%s %d files", clip->move ? "Move" : "Copy", j->nitems);
+  }
 
-  if (pipe(fd) < 0){
-    perror("pipe");
+  if (prog.errors){
+    snprintf(run_state.msgbuff, MSGWIDTH - 2, "%d errors, %s", prog.errors, prog.first_error);
+  } else if (j->nitems){
+    snprintf(run_state.msgbuff, MSGWIDTH - 2, "Queued: %s", j->title);
+  } else if (moved == 1 && !skipped){
+    snprintf(run_state.msgbuff, MSGWIDTH - 2, "File moved");
+  } else {
+    snprintf(run_state.msgbuff, MSGWIDTH - 2, "Moved %d files", moved);
   }
-  ALLOW_INTERRUPT = 0;
-  endwin();
-  cpid = fork();
-  if (cpid == 0){ //we are child
-    close(fd[0]);
-    //execlp("tar", "tar", "-xzvf", current_file_info->name, NULL);
-    execlp("tar", "tar", "-xf", current_file_info->name, NULL);
-    write(fd[1], strerror(errno), bufflen);
-    fclose(stdin);
-    exit(127);
+  if (skipped){
+    snprintf(run_state.tempbuff, MAXLEN, "%s, %d skipped", run_state.msgbuff, skipped);
+    snprintf(run_state.msgbuff, MSGWIDTH - 2, "%s", run_state.tempbuff);
   }
+  refresh_littlebox_color(run_state.msgbuff, prog.errors ? 1 : 0);
 
-  while (waitpid(cpid, &status, 0) < 0){
-    perror("wait");
+  if (j->nitems){
+    jobs_submit(&run_state.jobs, j);
+    draw_job_status();
+  } else {
+    job_free(j);
   }
-  
-  refresh();
-  write(fd[1], "Success", bufflen);
-  close(fd[1]);
-  read(fd[0], msgbuff, bufflen);
-  ALLOW_INTERRUPT = 1;
+  if (clip->move && !prog.errors) clear_clipboard();
 }
 
-void copy_to_clipboard(){
-  int item_no = item_index(current_item(run_state.dir_menu));
-	if (item_no == 0) return;
-	if (strlen(run_state.current_dir) + strlen(run_state.filelist[item_no]->name) + 2 < MAXLEN){
-	      
-	  if (snprintf(run_state.clipboard, MAXLEN, "%s/%s", run_state.current_dir, run_state.filelist[item_no]->name) >= MAXLEN){
-		refresh_littlebox("Unable to copy file...");
-		run_state.clipboard[0] = 0;
-		return;
-	  }
-	  run_state.copy_args[0] = "cp";
-	  run_state.copy_args[1] = "-rf";
-	  if (run_state.copy_args[2]) free(run_state.copy_args[2]);
-	  if (run_state.copy_args[3]) free(run_state.copy_args[3]);
-	  run_state.copy_args[2] = strdup(run_state.clipboard);
-	      
-	  if (snprintf(run_state.msgbuff, MSGWIDTH - 2, "Copied to Clipboard: %s", run_state.clipboard) > MSGWIDTH -2){
-		  // Do nothing
-	  }
-	      
-	  if (strlen(run_state.msgbuff) >= MSGWIDTH - 3) sprintf(&run_state.msgbuff[MSGWIDTH -6], "...");  
-	    refresh_littlebox(run_state.msgbuff);
-	}
+// Number of marked entries in the listing
+int count_marked(){
+  int i, count = 0;
+  for (i = 1; i < run_state.n_choices; i++){
+    if (run_state.filelist[i]->marked) count++;
+  }
+  return count;
 }
 
-void move_to_clipboard() {
-  int item_no = item_index(current_item(run_state.dir_menu));
-	if (item_no == 0) return;
-	if (strlen(run_state.current_dir) + strlen(run_state.filelist[item_no]->name) + 2 < MAXLEN){
-	      
-	  if (snprintf(run_state.clipboard, MAXLEN, "%s/%s", run_state.current_dir, run_state.filelist[item_no]->name) >= MAXLEN){
-		  refresh_littlebox("Unable to move file...");
-		  run_state.clipboard[0] = 0;
-		  return;
-	  }
-	  run_state.copy_args[0] = "mv";
-	  run_state.copy_args[1] = "-f";
-	  if (run_state.copy_args[2]) free(run_state.copy_args[2]);
-	  if (run_state.copy_args[3]) free(run_state.copy_args[3]);
-	  run_state.copy_args[2] = strdup(run_state.clipboard);
-	      
-	  if (snprintf(run_state.msgbuff, MSGWIDTH - 2, "Moved to Clipboard: %s", run_state.clipboard) > MSGWIDTH -2){
-		  // Do nothing
-	  }
-	      
-	  if (strlen(run_state.msgbuff) >= MSGWIDTH - 3) sprintf(&run_state.msgbuff[MSGWIDTH -6], "...");    
-	  refresh_littlebox(run_state.msgbuff);
-  }
+// Says how many entries are marked
+void show_marked(){
+  snprintf(run_state.msgbuff, MSGWIDTH - 2, "%d marked", count_marked());
+  refresh_littlebox(run_state.msgbuff);
 }
 
-void paste_from_clipboard(){
-  if (run_state.clipboard[0] == 0) return;
+// Marks or unmarks the current entry and moves on to the next
+void toggle_mark(){
+  file_info * fi = run_state.filelist[run_state.view.cur];
+  if (run_state.view.cur == 0) return;
+  fi->marked = !fi->marked;
+  lv_move(&run_state.view, 1);
+  lv_draw(&run_state.view);
+  show_marked();
+}
 
-	//find filename of file to be copied
-	int i = strlen(run_state.clipboard) - 1;
-  int abort = 0;
-  int item_no;
-	while (run_state.clipboard[i] != '/'){
-	  i--;
-	}
-	i++;
-	fprintf(stderr, "name to copy is: %s\n", &run_state.clipboard[i]);
+// Marks, or unmarks, every entry whose name matches a glob pattern
+void mark_matching(int mark){
+  char pattern[MAXLEN];
+  int i;
 
-	run_state.copy_args[3] = strdup(run_state.current_dir); // directory to copy/move to
-	for (item_no = 0; item_no < run_state.n_choices; item_no++){
-	  if (!strcmp(&run_state.clipboard[i], run_state.filelist[item_no]->name)){
-      ALLOW_INTERRUPT = 0;
-          
-		  while (1){
-        refresh_littlebox_color("Filename already exists. (r)ename, (o)verwrite, or (a)bort...", 1);
-		    int c = getch();
-		    if (c == 'r'){
-		      refresh_littlebox("New Name: ");
-		      echo();
-		      curs_set(1);
-		      if (getstr(run_state.msgbuff) == ERR){
-            curs_set(0);
-		        noecho();
-            abort = 1;
-            refresh_littlebox("Whoops! Did not copy file");
-          
-          }
-		      curs_set(0);
-		      noecho();
-		      free(run_state.copy_args[3]);
-		      for (item_no = 0; item_no < run_state.n_choices; item_no++){
-		        if (!strcmp(run_state.msgbuff, run_state.filelist[item_no]->name)) {
-			        refresh_littlebox("That name already exists. Failed to write file");
-			        abort = 1;
-			        break;
-		        }
-		      }
-		      run_state.copy_args[3] = strdup(run_state.msgbuff);
-		      break;
-		    } else if (c == 'a'){
-		      refresh_littlebox("Did not copy file");
-		    
-		      abort = 1;
-		      break;
-		    } else if (c == 'o'){
-		      break;
-		    }
-      
-		  }
-		
-		  break;
-	  }
-	}
-	if (abort) {
-	  free(run_state.copy_args[3]);
-	  run_state.copy_args[3] = NULL;
-	  return;
-	}
-	    
-	pid_t cpid = fork();
-  int status;
-      
-	if (cpid == 0){ //we are child
-	
-	  execvp(run_state.copy_args[0], run_state.copy_args);
-	  perror("exec");
-	  fclose(stdin);
-	  exit(127);
-	}
-	if (run_state.copy_args[0][0] == 'c')
-	  refresh_littlebox("Copying...");
-	else
-	  refresh_littlebox("Moving...");
-	    
-	while (waitpid(cpid, &status, 0) < 0){
-	  perror("wait");
-	}
-	    
-	    
-  refresh_filelist();
-	refresh_menu();
-	    
-	if (run_state.copy_args[0][0] == 'c') {
-	  refresh_littlebox("File copied");
-	} else {
-	  refresh_littlebox("File moved");
-	  run_state.clipboard[0] = 0;
-	}
+  ALLOW_INTERRUPT = 0;
+  refresh_littlebox(mark ? "Mark matching: " : "Unmark matching: ");
+  echo();
+  curs_set(1);
+  if (getnstr(pattern, MAXLEN - 1) == ERR) pattern[0] = 0;
+  curs_set(0);
+  noecho();
   ALLOW_INTERRUPT = 1;
+  if (!pattern[0]){
+    refresh_littlebox("");
+    return;
+  }
+
+  for (i = 1; i < run_state.n_choices; i++){
+    if (!fnmatch(pattern, run_state.filelist[i]->name, FNM_PERIOD)) run_state.filelist[i]->marked = mark;
+  }
+  lv_draw(&run_state.view);
+  show_marked();
+}
+
+// Marks what isn't marked and unmarks what is
+void invert_marks(){
+  int i;
+  for (i = 1; i < run_state.n_choices; i++){
+    run_state.filelist[i]->marked = !run_state.filelist[i]->marked;
+  }
+  lv_draw(&run_state.view);
+  show_marked();
 }
 
 void remove_file(){
   
-	int item_no = item_index(current_item(run_state.dir_menu));
+	int item_no = run_state.view.cur;
+	int marked = count_marked();
+	int i;
 	    
-	if (!strcmp(run_state.filelist[item_no]->name, "..")){
+	if (!marked && !strcmp(run_state.filelist[item_no]->name, "..")){
 	  move(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET + 4);
 	  clrtoeol();
 	  mvaddch(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET + MENUWIDTH - 1, ACS_VLINE);
@@ -1600,7 +2343,11 @@ void remove_file(){
 	mvaddch(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET + MENUWIDTH - 1, ACS_VLINE);
 	attron(COLOR_PAIR(1));
   ALLOW_INTERRUPT = 0;
-	mvprintw(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET + 4, "Are you SURE you wish to delete this file? (y/n)");
+	if (marked){
+	  mvprintw(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET + 4, "Are you SURE you wish to delete %d marked files? (y/n)", marked);
+	} else {
+	  mvprintw(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET + 4, "Are you SURE you wish to delete this file? (y/n)");
+	}
 	attroff(COLOR_PAIR(1));
   int c;
   do {
@@ -1619,24 +2366,826 @@ void remove_file(){
 	mvaddch(MENUHEIGHT + Y_OFFSET + 1, X_OFFSET + MENUWIDTH - 1, ACS_VLINE);
 	refresh();
 	    
-	run_state.del_args[2] = strdup(run_state.filelist[item_no]->name);
-	    
-  int status;
-	pid_t cpid = fork();
-      
-	if (cpid == 0){ //we are child
-	  execvp(run_state.del_args[0], run_state.del_args);
-    perror("exec");
-	  fclose(stdin);
-	  exit(127);
+	// The marked entries, or else the current one, go as one job
+	if (marked){
+	  snprintf(run_state.tempbuff, MAXLEN, "Delete %d files", marked);
+	} else {
+	  snprintf(run_state.tempbuff, MAXLEN, "Delete %s", run_state.filelist[item_no]->name);
+	}
+	job * j = job_new(JOB_DELETE, run_state.tempbuff);
+	for (i = 1; i < run_state.n_choices; i++){
+	  if (marked ? !run_state.filelist[i]->marked : i != item_no) continue;
+	  run_state.filelist[i]->marked = 0;
+	  if (snprintf(run_state.tempbuff, MAXLEN, "%s/%s", run_state.current_dir, run_state.filelist[i]->name) >= MAXLEN){
+	    job_free(j);
+	    refresh_littlebox("Filename too long");
+	    return;
+	  }
+	  job_add(j, run_state.tempbuff, NULL, 0);
+	}
+	lv_draw(&run_state.view);
+	jobs_submit(&run_state.jobs, j);
+	snprintf(run_state.msgbuff, MSGWIDTH - 2, "Queued: %s", j->title);
+	refresh_littlebox(run_state.msgbuff);
+	draw_job_status();
+}
+
+// Reports the jobs that ended and redraws the job status line
+void refresh_jobs(){
+  job * j;
+  int ended = 0;
+
+  jobs_drain_notify(&run_state.jobs);
+  while ((j = jobs_next_ended(&run_state.jobs)) != NULL){
+    if (!ended) update_listing();
+    ended = 1;
+    snprintf(run_state.msgbuff, MSGWIDTH - 2, "%s: %s", j->title, j->result);
+    refresh_littlebox_color(run_state.msgbuff, j->state == JOB_FAILED);
   }
-	  
-	if (waitpid(cpid, &status, 0) < 0){
-	  perror("wait");
+  draw_job_status();
+}
+
+// One line under the littlebox on what the jobs are doing. Redrawn a
+// few times a second while jobs run.
+void draw_job_status(){
+  char progress[MAXLEN];
+  job * running;
+  int active = jobs_active(&run_state.jobs, &running);
+
+  move(MENUHEIGHT + Y_OFFSET + 3, X_OFFSET);
+  clrtoeol();
+  if (active){
+    if (running){
+      progress_sample(&running->prog);
+      progress_format(&running->prog, progress, MAXLEN);
+      if (active > 1){
+	snprintf(run_state.tempbuff, MSGWIDTH, "%s: %s | %d more queued", running->title, progress, active - 1);
+      } else {
+	snprintf(run_state.tempbuff, MSGWIDTH, "%s: %s", running->title, progress);
+      }
+    } else {
+      snprintf(run_state.tempbuff, MSGWIDTH, "Jobs: %d queued (SHIFT + J for jobs)", active);
+    }
+    attron(COLOR_PAIR(2));
+    mvprintw(MENUHEIGHT + Y_OFFSET + 3, X_OFFSET + 1, "%s", run_state.tempbuff);
+    attroff(COLOR_PAIR(2));
+  }
+  refresh();
+}
+
+// Lists the jobs. UP and DOWN pick one, c cancels it, and J, q or ESC
+// closes the list.
+void show_jobs(){
+  static char * states[] = {"queued", "running", "done", "failed", "cancelled"};
+  char progress[MAXLEN];
+  WINDOW * win;
+  job_state state;
+  job * j;
+  int height = MENUHEIGHT - 2;
+  int width = MENUWIDTH - 4;
+  int rows = height - 4;
+  int sel = 0, top = 0, count, i, c = 0;
+
+  ALLOW_INTERRUPT = 0;
+  win = newwin(height, width, Y_OFFSET + 1, X_OFFSET + 2);
+  keypad(win, TRUE);
+  wtimeout(win, 250);
+  while (c != 'J' && c != 'q' && c != 27){
+    count = jobs_count(&run_state.jobs);
+    if (c == KEY_DOWN && sel < count - 1) sel++;
+    if (c == KEY_UP && sel > 0) sel--;
+    if (sel >= count) sel = count ? count - 1 : 0;
+    if (c == 'c' && (j = jobs_get(&run_state.jobs, sel, NULL)) != NULL) jobs_cancel(&run_state.jobs, j);
+    if (sel < top) top = sel;
+    if (sel >= top + rows) top = sel - rows + 1;
+
+    werase(win);
+    box(win, 0, 0);
+    mvwprintw(win, 0, 2, " Jobs ");
+    mvwprintw(win, height - 2, 2, "UP/DOWN select, c cancel, q close");
+    if (!count) mvwprintw(win, 2, 2, "No jobs");
+    for (i = top; i < count && i < top + rows; i++){
+      if ((j = jobs_get(&run_state.jobs, i, &state)) == NULL) break;
+      if (state >= JOB_DONE){
+	snprintf(run_state.tempbuff, MAXLEN, "%3d %-9s %s: %s", j->id, states[state], j->title, j->result);
+      } else if (state == JOB_RUNNING){
+	progress_sample(&j->prog);
+	progress_format(&j->prog, progress, MAXLEN);
+	snprintf(run_state.tempbuff, MAXLEN, "%3d %-9s %s: %s", j->id, states[state], j->title, progress);
+      } else {
+	snprintf(run_state.tempbuff, MAXLEN, "%3d %-9s %s", j->id, states[state], j->title);
+      }
+      run_state.tempbuff[width - 4 < MAXLEN ? width - 4 : MAXLEN - 1] = 0;
+      if (i == sel) wattron(win, A_REVERSE);
+      mvwprintw(win, i - top + 1, 2, "%s", run_state.tempbuff);
+      if (i == sel) wattroff(win, A_REVERSE);
+    }
+    wrefresh(win);
+    c = wgetch(win);
+  }
+  delwin(win);
+  touchwin(stdscr);
+  refresh();
+  refresh_menu();
+  refresh_jobs();
+  ALLOW_INTERRUPT = 1;
+}
+
+// Puts the cursor on the entry called name, if the listing has one
+void select_entry(const char * name){
+  file_info * fi;
+  int pos;
+
+  if (!run_state.names.cap) nameidx_build(&run_state.names, run_state.filelist, run_state.n_choices);
+  if ((fi = nameidx_find(&run_state.names, name)) != NULL && (pos = index_of(fi)) >= 0){
+    lv_set_current(&run_state.view, pos);
+  }
+}
+
+// Fuzzy search over every path below the current directory. The
+// matches are updated as the query is typed, and as the index grows
+// while it is still being built. ENTER goes to the directory of the
+// match picked and selects it there. Returns 1 if it did.
+int find_file(){
+  finder_search search;
+  struct timespec t0, t1;
+  char prefix[MAXLEN], query[MAXLEN], dir[MAXLEN * 2];
+  const char * path, * slash;
+  WINDOW * win;
+  int height = MENUHEIGHT - 2;
+  int width = MENUWIDTH - 4;
+  int rows = height - 5;
+  int len = 0, sel = 0, top = 0, c = 0, i, busy, paths, dirty = 1, changed = 0;
+  double ms = 0;
+
+  if (run_state.archive){
+    refresh_littlebox_color("Leave the archive to find files", 1);
+    return 0;
+  }
+  finder_open(&run_state.finder, run_state.current_dir, prefix);
+  memset(&search, 0, sizeof(finder_search));
+  query[0] = 0;
+
+  ALLOW_INTERRUPT = 0;
+  win = newwin(height, width, Y_OFFSET + 1, X_OFFSET + 2);
+  keypad(win, TRUE);
+  while (1){
+    busy = finder_busy(&run_state.finder, &paths);
+    if (dirty){
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      finder_search_run(&run_state.finder, &search, prefix, query, FINDER_RESULTS, &run_state.stat_pool);
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+      dirty = 0;
+    }
+    if (sel >= search.ntop) sel = search.ntop ? search.ntop - 1 : 0;
+    if (sel < top) top = sel;
+    if (sel >= top + rows) top = sel - rows + 1;
+
+    werase(win);
+    box(win, 0, 0);
+    mvwprintw(win, 0, 2, " Find ");
+    mvwprintw(win, 1, 2, "> %s", query);
+    for (i = top; i < search.ntop && i < top + rows; i++){
+      path = search.top[i].path + (prefix[0] ? strlen(prefix) + 1 : 0);
+      snprintf(run_state.tempbuff, MAXLEN, "%s%s", path, search.top[i].is_dir ? "/" : "");
+      run_state.tempbuff[width - 4 < MAXLEN ? width - 4 : MAXLEN - 1] = 0;
+      if (i == sel) wattron(win, A_REVERSE);
+      mvwprintw(win, i - top + 3, 2, "%s", run_state.tempbuff);
+      if (i == sel) wattroff(win, A_REVERSE);
+    }
+    mvwprintw(win, height - 2, 2, "%d matches in %.1fms, %d paths%s. UP/DOWN select, ENTER go, ESC close",
+	      search.count, ms, paths, busy ? " so far" : "");
+    wrefresh(win);
+
+    // While the index grows, look again now and then
+    wtimeout(win, busy ? 200 : -1);
+    c = wgetch(win);
+    if (c == ERR){
+      dirty = 1;
+    } else if (c == 27 || c == KEY_F(1)){
+      break;
+    } else if (c == 10 || c == KEY_ENTER){
+      if (sel >= search.ntop) break;
+      path = search.top[sel].path;
+      slash = strrchr(path, '/');
+      snprintf(dir, sizeof(dir), "%s/%.*s", strcmp(run_state.finder.root, "/") ? run_state.finder.root : "",
+	       slash ? (int) (slash - path) : 0, path);
+      snprintf(run_state.select_name, MAXLEN, "%s", slash ? slash + 1 : path);
+      getcwd(run_state.previous_dir, MAXLEN);
+      if (chdir(dir)){
+	run_state.select_name[0] = 0;
+      } else {
+	getcwd(run_state.current_dir, MAXLEN);
+	changed = 1;
+      }
+      break;
+    } else if (c == KEY_DOWN){
+      sel++;
+    } else if (c == KEY_UP){
+      if (sel > 0) sel--;
+    } else if (c == KEY_BACKSPACE || c == 127 || c == 8){
+      if (len) query[--len] = 0;
+      sel = top = 0;
+      dirty = 1;
+    } else if (c >= 32 && c < 127 && len < MAXLEN - 1){
+      query[len++] = c;
+      query[len] = 0;
+      sel = top = 0;
+      dirty = 1;
+    }
+  }
+  delwin(win);
+  finder_search_free(&search);
+  touchwin(stdscr);
+  refresh();
+  if (!changed) refresh_menu();
+  ALLOW_INTERRUPT = 1;
+  return changed;
+}
+
+// Width of the directory view, less the preview pane beside it
+int list_width(){
+  return PREVIEW ? MENUWIDTH - MENUWIDTH * 2 / 5 : MENUWIDTH;
+}
+
+// Points the preview pane at the highlighted entry. A preview seen
+// recently, of the entry as it is now, shows at once. Otherwise one is
+// requested and shows when it is loaded.
+void follow_preview(){
+  char path[MAXLEN * 2];
+  file_info * fi;
+  preview * pv;
+  size_t bytes;
+  int i;
+
+  if (!PREVIEW || !run_state.n_choices) return;
+  fi = run_state.filelist[run_state.view.cur];
+  if (run_state.archive){
+    path[0] = 0;
+  } else {
+    snprintf(path, sizeof(path), "%s/%s", strcmp(run_state.current_dir, "/") ? run_state.current_dir : "", fi->name);
+  }
+  ensure_metadata(fi);
+  // Sizes of directories come and go with the du engine
+  bytes = S_ISDIR(fi->st_mode) ? 0 : fi->bytes;
+  if (!strncmp(path, run_state.preview_path, MAXLEN) && fi->mod_time == run_state.preview_mod_time && bytes == run_state.preview_bytes) return;
+
+  snprintf(run_state.preview_path, MAXLEN, "%s", path);
+  run_state.preview_mod_time = fi->mod_time;
+  run_state.preview_bytes = bytes;
+  run_state.preview_shown = NULL;
+  for (i = 0; i < PREVIEW_CACHE && (pv = run_state.preview_cache[i]) != NULL; i++){
+    if (!strcmp(pv->path, run_state.preview_path) && pv->mod_time == fi->mod_time && pv->bytes == bytes){
+      pv->used = ++run_state.preview_clock;
+      run_state.preview_shown = pv;
+      break;
+    }
+  }
+  if (run_state.preview_shown || !path[0]){
+    preview_cancel(&run_state.previews);
+  } else {
+    preview_request(&run_state.previews, run_state.preview_path, fi->mod_time, bytes);
+  }
+  draw_preview();
+}
+
+// Shows a preview that was loaded, and keeps it in the cache in place
+// of an older one of the same entry, or else of the least recently
+// shown. The cache fills from the start, so lookups stop at the first
+// free slot.
+void apply_preview(){
+  preview * pv;
+  int i, slot = 0;
+
+  if ((pv = preview_take(&run_state.previews)) == NULL) return;
+  if (strcmp(pv->path, run_state.preview_path) || pv->mod_time != run_state.preview_mod_time || pv->bytes != run_state.preview_bytes){
+    preview_free(pv);
+    return;
+  }
+  for (i = 0; i < PREVIEW_CACHE; i++){
+    if (!run_state.preview_cache[i] || !strcmp(run_state.preview_cache[i]->path, pv->path)){
+      slot = i;
+      break;
+    }
+    if (run_state.preview_cache[i]->used < run_state.preview_cache[slot]->used) slot = i;
+  }
+  preview_free(run_state.preview_cache[slot]);
+  run_state.preview_cache[slot] = pv;
+  pv->used = ++run_state.preview_clock;
+  run_state.preview_shown = pv;
+  draw_preview();
+}
+
+// Draws the preview pane, if it is on
+void draw_preview(){
+  WINDOW * win = run_state.preview_win;
+  preview * pv = run_state.preview_shown;
+  const char * line;
+  int height, width, i;
+
+  if (!win) return;
+  height = getmaxy(win);
+  width = getmaxx(win) - 4;
+  werase(win);
+  box(win, 0, 0);
+  mvwprintw(win, 0, 2, " Preview ");
+  mvwaddch(win, 2, 0, ACS_LTEE);
+  mvwhline(win, 2, 1, ACS_HLINE, width + 2);
+  mvwaddch(win, 2, width + 3, ACS_RTEE);
+  if (run_state.archive){
+    mvwaddnstr(win, 1, 2, "No previews inside archives", width);
+  } else if (!pv){
+    if (run_state.preview_path[0]) mvwaddnstr(win, 1, 2, "...", width);
+  } else {
+    mvwaddnstr(win, 1, 2, pv->info, width);
+    line = pv->text;
+    for (i = 0; i < pv->nlines && i < height - 4; i++){
+      mvwaddnstr(win, i + 3, 2, line, width);
+      line += strlen(line) + 1;
+    }
+  }
+  wrefresh(win);
+}
+
+// Shows or hides the preview pane beside the listing
+void toggle_preview(){
+  PREVIEW = !PREVIEW;
+  run_state.preview_path[0] = 0;
+  run_state.preview_shown = NULL;
+  if (!PREVIEW) preview_cancel(&run_state.previews);
+  // Names are cut to fit the narrower listing
+  refresh_filelist();
+  refresh_menu();
+}
+
+// Reads a line typed on one row of a window
+void prompt_row(WINDOW * win, int row, const char * prompt, char * buf){
+  wmove(win, row, 0);
+  wclrtoeol(win);
+  waddstr(win, prompt);
+  wtimeout(win, -1);
+  echo();
+  curs_set(1);
+  if (wgetnstr(win, buf, MAXLEN - 1) == ERR) buf[0] = 0;
+  curs_set(0);
+  noecho();
+}
+
+// Searches the pager from the line after top, or before top going
+// backward, and moves top to the line of the match. A long search
+// shows how far it got and stops at a key. Returns 1 if it found a
+// match, 0 if there is none and -1 if it was stopped.
+int find_in_pager(pager * p, WINDOW * win, const char * needle, int fold, int backward, size_t * top){
+  size_t at = backward ? *top : pager_next_line(p, *top);
+  int ret;
+
+  while ((ret = pager_find(p, needle, fold, backward, &at, PAGER_SEARCH_STEP)) == 0){
+    mvwprintw(win, getmaxy(win) - 1, 0, "Searching... %d%% (any key stops)", (int) (p->size ? at * 100 / p->size : 100));
+    wclrtoeol(win);
+    wrefresh(win);
+    wtimeout(win, 0);
+    if (wgetch(win) != ERR) return -1;
+  }
+  if (ret < 0) return 0;
+  *top = pager_line_start(p, at);
+  return 1;
+}
+
+// Shows a file in the built-in pager. Lines are numbered once the
+// index built in the background gets to them. UP, DOWN, PGUP, PGDN,
+// HOME and END move, LEFT and RIGHT scroll sideways, : goes to a line,
+// a percentage or a byte offset, / and ? search forward and backward,
+// n and N search again, F follows data appended to the file, and q or
+// ESC closes it.
+void view_file(file_info * fi){
+  char path[MAXLEN * 2], line[MAXLEN], input[MAXLEN], needle[MAXLEN] = "", msg[MAXLEN] = "", status[MAXLEN];
+  struct pollfd fds[2];
+  unsigned long lines, n;
+  size_t top = 0, off, indexed;
+  WINDOW * win;
+  pager p;
+  long num;
+  int rows, width, skip = 0, follow = 0, fold = 0, backward = 0, c, i, ret;
+  double pct;
+
+  if (run_state.archive){
+    refresh_littlebox_color("Leave the archive to view files", 1);
+    return;
+  }
+  if (S_ISDIR(fi->st_mode)){
+    refresh_littlebox_color("Pick a file to view", 1);
+    return;
+  }
+  snprintf(path, sizeof(path), "%s/%s", strcmp(run_state.current_dir, "/") ? run_state.current_dir : "", fi->name);
+  if (pager_open(&p, path)){
+    refresh_littlebox_color(strerror(errno), 1);
+    return;
+  }
+
+  ALLOW_INTERRUPT = 0;
+  win = newwin(0, 0, 0, 0);
+  keypad(win, TRUE);
+  while (1){
+    rows = getmaxy(win) - 1;
+    width = getmaxx(win) < MAXLEN ? getmaxx(win) : MAXLEN - 1;
+    werase(win);
+    off = top;
+    for (i = 0; i < rows; i++){
+      if (pager_line(&p, off, skip, line, width)){
+	mvwaddch(win, i, 0, '~');
+      } else {
+	mvwaddstr(win, i, 0, line);
+	off = pager_next_line(&p, off);
+      }
+    }
+
+    pager_progress(&p, &indexed, &lines);
+    num = pager_line_of(&p, top);
+    if (num >= 0){
+      snprintf(input, MAXLEN, "%ld", num + 1);
+    } else {
+      snprintf(input, MAXLEN, "?");
+    }
+    snprintf(status, MAXLEN, "%s  line %s of %lu%s  %d%%%s  %s", fi->name, input, lines,
+	     indexed < p.size ? "+" : "", (int) (p.size ? off * 100 / p.size : 100), follow ? "  [following]" : "", msg);
+    wattron(win, A_REVERSE);
+    mvwprintw(win, rows, 0, "%-*.*s", width, width, status);
+    wattroff(win, A_REVERSE);
+    wrefresh(win);
+    msg[0] = 0;
+
+    // Keys ncurses already buffered don't show up in poll()
+    wtimeout(win, 0);
+    if ((c = wgetch(win)) == ERR){
+      fds[0].fd = STDIN_FILENO;
+      fds[0].events = POLLIN;
+      fds[1].fd = p.inotify;      // poll() skips it when -1
+      fds[1].events = POLLIN;
+      // Redraw now and then while indexing, to number the lines, and
+      // without inotify look for new data now and then
+      if (poll(fds, 2, indexed < p.size ? 250 : p.inotify < 0 ? 1000 : -1) <= 0 && p.inotify >= 0) continue;
+      if (fds[0].revents & POLLIN) continue;
+      ret = pager_update(&p);
+      if (ret == PAGER_SHRANK){
+	if (top > p.size) top = pager_line_start(&p, p.size);
+	snprintf(msg, MAXLEN, "File was cut short");
+      } else if (ret == PAGER_GONE){
+	snprintf(msg, MAXLEN, "File was moved or deleted");
+      }
+      if (follow && ret != PAGER_SAME){
+	for (top = p.size, i = 0; i < rows; i++) top = pager_prev_line(&p, top);
+      }
+      continue;
+    }
+
+    if (c == 'q' || c == 27 || c == KEY_F(1)) break;
+    if (c != 'F') follow = 0;
+    if (c == KEY_DOWN || c == 'j' || c == 10){
+      if (pager_next_line(&p, top) < p.size) top = pager_next_line(&p, top);
+    } else if (c == KEY_UP || c == 'k'){
+      top = pager_prev_line(&p, top);
+    } else if (c == KEY_NPAGE || c == ' '){
+      for (i = 0; i < rows - 1 && pager_next_line(&p, top) < p.size; i++) top = pager_next_line(&p, top);
+    } else if (c == KEY_PPAGE || c == 'b'){
+      for (i = 0; i < rows - 1; i++) top = pager_prev_line(&p, top);
+    } else if (c == KEY_HOME || c == 'g'){
+      top = 0;
+    } else if (c == KEY_END || c == 'G' || c == 'F'){
+      if (c == 'F' && (follow = !follow)) pager_update(&p);
+      if (c != 'F' || follow){
+	for (top = p.size, i = 0; i < rows; i++) top = pager_prev_line(&p, top);
+      }
+    } else if (c == KEY_RIGHT){
+      skip += width / 2;
+    } else if (c == KEY_LEFT){
+      skip = skip > width / 2 ? skip - width / 2 : 0;
+    } else if (c == ':'){
+      prompt_row(win, rows, "Go to line, N% or @offset: ", input);
+      if (input[0] == '@'){
+	top = pager_line_start(&p, strtoull(input + 1, NULL, 0));
+      } else if (input[0] && input[strlen(input) - 1] == '%'){
+	pct = atof(input);
+	pct = pct < 0 ? 0 : pct > 100 ? 100 : pct;
+	top = pager_line_start(&p, (size_t) (p.size * pct / 100));
+      } else if ((n = strtoul(input, NULL, 10)) > 0){
+	if (pager_line_offset(&p, n - 1, &top)){
+	  pager_progress(&p, &indexed, &lines);
+	  if (indexed < p.size){
+	    snprintf(msg, MAXLEN, "Line %lu isn't indexed yet, %lu lines so far", n, lines);
+	  } else {
+	    snprintf(msg, MAXLEN, "There are only %lu lines", lines);
+	  }
 	}
-	free(run_state.del_args[2]);
-	    
-	refresh_filelist();
-	refresh_menu();
-	set_current_item(run_state.dir_menu, run_state.menu_items[item_no]);
+      }
+    } else if (c == '/' || c == '?'){
+      prompt_row(win, rows, c == '/' ? "/" : "?", input);
+      if (input[0]){
+	// Without capitals, any case matches
+	snprintf(needle, MAXLEN, "%s", input);
+	fold = 1;
+	for (i = 0; needle[i]; i++){
+	  if (isupper((unsigned char) needle[i])) fold = 0;
+	}
+	for (i = 0; fold && needle[i]; i++){
+	  needle[i] = tolower((unsigned char) needle[i]);
+	}
+	backward = c == '?';
+	c = 'n';
+      }
+    }
+    if ((c == 'n' || c == 'N') && needle[0]){
+      ret = find_in_pager(&p, win, needle, fold, c == 'N' ? !backward : backward, &top);
+      if (ret == 0) snprintf(msg, MAXLEN, "Pattern not found");
+      if (ret < 0) snprintf(msg, MAXLEN, "Search stopped");
+    }
+  }
+  delwin(win);
+  pager_close(&p);
+  touchwin(stdscr);
+  refresh();
+  refresh_menu();
+  ALLOW_INTERRUPT = 1;
+}
+
+// Searches the contents of every file below the current directory.
+// Matching lines show up as they are found. ENTER goes to the
+// directory of the file picked and selects it there. Returns 1 if it
+// did.
+int search_files(){
+  char pattern[MAXLEN], root[MAXLEN], dir[MAXLEN * 2];
+  const char * slash;
+  grep_hit * hits = NULL, * more;
+  WINDOW * win;
+  unsigned long files = 0, skipped = 0;
+  int height = MENUHEIGHT - 2;
+  int width = MENUWIDTH - 4;
+  int rows = height - 4;
+  int count = 0, cap = 0, n, sel = 0, top = 0, c = 0, i, running = 1, changed = 0;
+
+  if (run_state.archive){
+    refresh_littlebox_color("Leave the archive to search files", 1);
+    return 0;
+  }
+  ALLOW_INTERRUPT = 0;
+  refresh_littlebox("Search in files: ");
+  echo();
+  curs_set(1);
+  if (getnstr(pattern, MAXLEN - 1) == ERR) pattern[0] = 0;
+  curs_set(0);
+  noecho();
+  refresh_littlebox("");
+  if (!pattern[0]){
+    ALLOW_INTERRUPT = 1;
+    return 0;
+  }
+  snprintf(root, MAXLEN, "%s", run_state.current_dir);
+  grep_start(&run_state.grep, root, pattern);
+
+  win = newwin(height, width, Y_OFFSET + 1, X_OFFSET + 2);
+  keypad(win, TRUE);
+  while (1){
+    if (running){
+      n = grep_take(&run_state.grep, &more, &running, &files, &skipped);
+      if (count + n > cap){
+	cap = count + n > cap * 2 ? count + n : cap * 2;
+	if ((hits = realloc(hits, cap * sizeof(grep_hit))) == NULL){
+	  perror("realloc");
+	  exit(errno);
+	}
+      }
+      if (n) memcpy(hits + count, more, n * sizeof(grep_hit));
+      count += n;
+      free(more);
+    }
+    if (sel >= count) sel = count ? count - 1 : 0;
+    if (sel < top) top = sel;
+    if (sel >= top + rows) top = sel - rows + 1;
+
+    werase(win);
+    box(win, 0, 0);
+    mvwprintw(win, 0, 2, " Search: %.*s ", width - 14, pattern);
+    if (!count && !running) mvwprintw(win, 2, 2, "No matches");
+    for (i = top; i < count && i < top + rows; i++){
+      snprintf(run_state.tempbuff, MAXLEN, "%s:%lu: %s", hits[i].path, hits[i].line, hits[i].text);
+      run_state.tempbuff[width - 4 < MAXLEN ? width - 4 : MAXLEN - 1] = 0;
+      if (i == sel) wattron(win, A_REVERSE);
+      mvwprintw(win, i - top + 1, 2, "%s", run_state.tempbuff);
+      if (i == sel) wattroff(win, A_REVERSE);
+    }
+    mvwprintw(win, height - 2, 2, "%d lines in %lu files (%lu skipped)%s. ENTER go, ESC close",
+	      count, files, skipped, running ? ", searching" : count >= GREP_MAX_HITS ? ", stopped" : "");
+    wrefresh(win);
+
+    // While the search runs, take what it found now and then
+    wtimeout(win, running ? 200 : -1);
+    c = wgetch(win);
+    if (c == ERR){
+      continue;
+    } else if (c == 27 || c == 'q' || c == KEY_F(1)){
+      break;
+    } else if (c == 10 || c == KEY_ENTER){
+      if (sel >= count) break;
+      slash = strrchr(hits[sel].path, '/');
+      snprintf(dir, sizeof(dir), "%s/%.*s", strcmp(root, "/") ? root : "",
+	       slash ? (int) (slash - hits[sel].path) : 0, hits[sel].path);
+      snprintf(run_state.select_name, MAXLEN, "%s", slash ? slash + 1 : hits[sel].path);
+      getcwd(run_state.previous_dir, MAXLEN);
+      if (chdir(dir)){
+	run_state.select_name[0] = 0;
+      } else {
+	getcwd(run_state.current_dir, MAXLEN);
+	changed = 1;
+      }
+      break;
+    } else if (c == KEY_DOWN){
+      sel++;
+    } else if (c == KEY_UP){
+      if (sel > 0) sel--;
+    } else if (c == KEY_NPAGE){
+      sel += rows;
+    } else if (c == KEY_PPAGE){
+      sel = sel > rows ? sel - rows : 0;
+    } else if (c == KEY_HOME){
+      sel = 0;
+    } else if (c == KEY_END){
+      sel = count ? count - 1 : 0;
+    }
+  }
+  grep_cancel(&run_state.grep);
+  grep_free_hits(hits, count);
+  delwin(win);
+  touchwin(stdscr);
+  refresh();
+  if (!changed) refresh_menu();
+  ALLOW_INTERRUPT = 1;
+  return changed;
+}
+
+// Asks before quitting cancels running jobs. Returns 1 to quit.
+int quit_ok(){
+  int c;
+  if (!jobs_active(&run_state.jobs, NULL)) return 1;
+  refresh_littlebox_color("Jobs still running. Quit and cancel them? (y/n)", 1);
+  do {
+    c = getch();
+  } while (c != 'y' && c != 'n');
+  refresh_littlebox("");
+  return c == 'y';
+}
+
+// Tells whether a file name is an archive that can be browsed
+int is_archive(const char * name){
+  static const char * suffixes[] = {".zip", ".tar", ".tar.gz", ".tgz", ".tar.xz", ".txz", NULL};
+  size_t len = strlen(name), slen;
+  int i;
+
+  for (i = 0; suffixes[i]; i++){
+    slen = strlen(suffixes[i]);
+    if (len > slen && !strcmp(name + len - slen, suffixes[i])) return 1;
+  }
+  return 0;
+}
+
+// Opens the archive name in the current directory as a read-only
+// directory. The indexes of the last few archives are kept, and read
+// again only if the archive changed.
+int open_archive(const char * name){
+  char path[MAXLEN];
+  archive_index * idx = NULL;
+  int i;
+
+  if (snprintf(path, MAXLEN, "%s/%s", strcmp(run_state.current_dir, "/") ? run_state.current_dir : "", name) >= MAXLEN){
+    refresh_littlebox_color("Filename too long", 1);
+    return -1;
+  }
+  for (i = 0; i < ARCHIVE_CACHE && run_state.archives[i]; i++){
+    if (strcmp(run_state.archives[i]->path, path)) continue;
+    idx = run_state.archives[i];
+    memmove(&run_state.archives[i], &run_state.archives[i + 1], (ARCHIVE_CACHE - 1 - i) * sizeof(archive_index *));
+    run_state.archives[ARCHIVE_CACHE - 1] = NULL;
+    if (archive_index_stale(idx)){
+      archive_index_free(idx);
+      idx = NULL;
+    }
+    break;
+  }
+
+  if (idx == NULL){
+    refresh_littlebox("Reading archive...");
+    if ((idx = archive_index_load(path)) == NULL){
+      snprintf(run_state.msgbuff, MSGWIDTH - 2, "Can't read %s: %s", name, strerror(errno));
+      refresh_littlebox_color(run_state.msgbuff, 1);
+      return -1;
+    }
+  }
+  archive_index_free(run_state.archives[ARCHIVE_CACHE - 1]);
+  memmove(&run_state.archives[1], &run_state.archives[0], (ARCHIVE_CACHE - 1) * sizeof(archive_index *));
+  run_state.archives[0] = idx;
+  run_state.archive = idx;
+  run_state.archive_dir[0] = 0;
+  return 0;
+}
+
+// Goes into a directory of the browsed archive, or up with "..". Going
+// up from its top leaves the archive.
+void archive_chdir(const char * name){
+  char * dir = run_state.archive_dir, * slash;
+  size_t len = strlen(dir);
+
+  if (strcmp(name, "..")){
+    snprintf(dir + len, MAXLEN - len, "%s%s", len ? "/" : "", name);
+  } else if (!len){
+    run_state.archive = NULL;
+  } else if ((slash = strrchr(dir, '/')) != NULL){
+    *slash = 0;
+  } else {
+    dir[0] = 0;
+  }
+}
+
+// Lists the current directory of the browsed archive from its index.
+// Nothing is stat'ed. The listing of the real directory is parked in
+// the cache meanwhile, as when leaving it.
+void list_archive(int short_width){
+  archive_index * idx = run_state.archive;
+  arena * mem = &run_state.filelist_arena;
+  archive_member * m;
+  file_info * fi;
+  listing list;
+  int begin, count, i;
+
+  if (run_state.listing_dir[0]){
+    save_listing(&list);
+    cache_put(&run_state.cache, run_state.listing_dir, &list);
+    arena_init(mem);
+    run_state.dirfd = -1;
+    run_state.listing_dir[0] = 0;
+  }
+  if (!mem->head) cache_new_arena(&run_state.cache, mem);
+  arena_reset(mem);
+  run_state.short_width = short_width;
+  run_state.name_width = 0;
+
+  count = archive_index_dir(idx, run_state.archive_dir, &begin);
+  run_state.filelist_cap = count + 2;
+  run_state.filelist = arena_calloc(mem, run_state.filelist_cap * sizeof(file_info *));
+
+  run_state.filelist[0] = fi = make_entry("..", 2, DT_DIR);
+  fi->mod_time = idx->mtime;
+  fi->has_meta = 1;
+  for (i = 0; i < count; i++){
+    m = &idx->members[begin + i];
+    fi = make_entry(m->path + m->name, strlen(m->path + m->name), DT_UNKNOWN);
+    fi->st_mode = m->mode;
+    fi->bytes = m->size;
+    fi->mod_time = m->mtime;
+    fi->has_meta = 1;
+    run_state.filelist[i + 1] = fi;
+  }
+  run_state.filelist[count + 1] = NULL;
+  run_state.n_choices = count + 1;
+}
+
+// Handles the keys that work differently inside an archive. Returns 0
+// for the ones that work as usual.
+int archive_key(int c, int * changedir){
+  file_info * fi = run_state.filelist[run_state.view.cur];
+
+  switch (c)
+    {
+    case 10:
+    case KEY_RIGHT:
+      if (S_ISDIR(fi->st_mode)){
+        archive_chdir(fi->name);
+        *changedir = 1;
+      } else if (c == 10){
+        refresh_littlebox("The archive is read-only. Copy files out with C, then V.");
+      }
+      return 1;
+    case KEY_LEFT:
+      archive_chdir("..");
+      *changedir = 1;
+      return 1;
+    case '~':
+    case '`':
+    case '/':
+      // Jumps leave the archive
+      run_state.archive = NULL;
+      return 0;
+    case 'X':
+    case 'V':
+    case KEY_DC:
+    case 'R':
+    case 'M':
+    case 'N':
+    case ZIP:
+    case UNZIP:
+    case TAR:
+    case UNTAR:
+    case TARXZ:
+      refresh_littlebox_color("The archive is read-only", 1);
+      return 1;
+    }
+  return 0;
 }
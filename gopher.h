@@ -0,0 +1,47 @@
+// Gopher - Types shared between the listing modules
+#ifndef GOPHER_H
+#define GOPHER_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "arena.h"
+
+#define MAXLEN 800
+
+// Struct for the filelist
+typedef struct {
+  char * name;
+  char * name_short;
+  char * type;
+  mode_t st_mode;
+
+  char * size;
+  size_t bytes;
+  char * description;
+  char * mod_date;
+  time_t mod_time;
+
+  int has_meta;   // st_mode, bytes and mod_time come from a stat
+  int has_du;     // bytes is the disk use of the whole directory
+  int du_partial; // and parts of it couldn't be read
+  int marked;     // part of the selection
+  int formatted;  // size, type and description are up to date
+} file_info;
+
+// A scanned directory: its entries, the arena they live in and the fd
+// used to stat them
+typedef struct {
+  file_info ** filelist;
+  int filelist_cap;
+  int n_choices;
+  int name_width;
+  int short_width;
+  int dirfd;
+  struct stat dir_st;     // the directory itself, taken before the scan
+  time_t scanned;         // when the scan started
+  arena mem;
+} listing;
+
+#endif
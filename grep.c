@@ -0,0 +1,403 @@
+// Gopher - Parallel content search over a subtree
+//
+// Every directory is a task of the walk in walk.c. Files are searched
+// by the worker that finds them, read a block at a time and scanned by
+// the kernels of bytes.c. Files with a NUL near the start count as
+// binary and are skipped, and so are files over GREP_MAX_SIZE. Like
+// the other walks, it stays on the filesystem it starts on and follows
+// no symlinks.
+//
+// A pattern without capitals matches in any case.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "grep.h"
+#include "bytes.h"
+#include "walk.h"
+
+#define GREP_BLOCK (256 * 1024)     // read at a time
+
+// Where a worker reads files, kept from one file to the next
+typedef struct {
+  char * data;
+  size_t cap;
+} grep_buf;
+
+typedef struct {
+  grep_engine * g;
+  unsigned generation;    // of the search being run
+  char root[MAXLEN];
+  int rootfd;
+  char pattern[MAXLEN];   // lower cased when folding
+  size_t plen;
+  int fold;
+  dev_t dev;
+  walker walk;
+  grep_buf bufs[WALK_MAX_WORKERS];
+} grep_walk;
+
+static char * xstrdup(const char * s){
+  char * copy = strdup(s);
+  if (copy == NULL){
+    perror("strdup");
+    exit(errno);
+  }
+  return copy;
+}
+
+// Hands a matching line to the UI, unless the search went stale.
+// Returns 0 once the search has all the lines it may have.
+static int add_hit(grep_walk * w, const char * path, unsigned long line, const char * text, size_t len){
+  grep_engine * g = w->g;
+  grep_hit * hit;
+  size_t i;
+  int more;
+
+  pthread_mutex_lock(&g->lock);
+  if (w->generation != g->generation || g->total >= GREP_MAX_HITS){
+    pthread_mutex_unlock(&g->lock);
+    return 0;
+  }
+  if (g->nhits == g->hits_cap){
+    g->hits_cap = g->hits_cap ? g->hits_cap * 2 : 256;
+    if ((g->hits = realloc(g->hits, g->hits_cap * sizeof(grep_hit))) == NULL){
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  hit = &g->hits[g->nhits++];
+  hit->path = xstrdup(path);
+  hit->line = line;
+  if (len > GREP_LINE_MAX) len = GREP_LINE_MAX;
+  if ((hit->text = malloc(len + 1)) == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  for (i = 0; i < len; i++){
+    hit->text[i] = iscntrl((unsigned char) text[i]) ? ' ' : text[i];
+  }
+  hit->text[len] = 0;
+  more = ++g->total < GREP_MAX_HITS;
+  pthread_mutex_unlock(&g->lock);
+  return more;
+}
+
+static void count_file(grep_walk * w, int skipped){
+  if (skipped){
+    __atomic_add_fetch(&w->g->skipped, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_add_fetch(&w->g->files, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Reports every line of a file that holds the pattern, once per line.
+// The file is read a block at a time into the worker's buffer, whole
+// lines are scanned and the part of a line left over moves to the
+// front. A file that shrinks meanwhile just ends early, where a
+// mapping would fault.
+static void grep_file(grep_walk * w, int worker, int dirfd, const char * name, const char * path){
+  grep_buf * b = &w->bufs[worker];
+  const char * hit, * start, * end, * stop;
+  struct stat st;
+  size_t have = 0, pos, counted, upto;
+  unsigned long line = 1;
+  ssize_t n;
+  int fd, first = 1, more = 1;
+
+  if ((fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC)) < 0) return;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size){
+    close(fd);
+    return;
+  }
+  if (st.st_size > GREP_MAX_SIZE){
+    close(fd);
+    count_file(w, 1);
+    return;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  while (more && !w->g->cancel){
+    // Only a line longer than the buffer makes it grow
+    if (have == b->cap){
+      b->cap = b->cap ? b->cap * 2 : GREP_BLOCK;
+      if ((b->data = realloc(b->data, b->cap)) == NULL){
+        perror("realloc");
+        exit(errno);
+      }
+    }
+    if ((n = read(fd, b->data + have, b->cap - have)) < 0){
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (first){
+      if (bytes_binary(b->data, n)){
+        count_file(w, 1);
+        break;
+      }
+      count_file(w, 0);
+      first = 0;
+    }
+    have += n;
+
+    // Whole lines only, unless the file ended
+    if (n == 0){
+      upto = have;
+      more = 0;
+    } else if ((end = memrchr(b->data, '\n', have)) != NULL){
+      upto = end - b->data + 1;
+    } else {
+      continue;
+    }
+    stop = b->data + upto;
+    pos = counted = 0;
+    while (more >= 0 && (hit = bytes_find(b->data + pos, upto - pos, w->pattern, w->plen, w->fold)) != NULL){
+      line += bytes_count(b->data + counted, hit - b->data - counted, '\n');
+      counted = hit - b->data;
+      start = memrchr(b->data, '\n', hit - b->data);
+      start = start ? start + 1 : b->data;
+      if ((end = memchr(hit, '\n', stop - hit)) == NULL) end = stop;
+      if (!add_hit(w, path, line, start, end - start)) more = -1;
+      pos = end - b->data;
+      if (w->g->cancel) more = -1;
+    }
+    if (more < 0) break;
+    line += bytes_count(b->data + counted, upto - counted, '\n');
+    memmove(b->data, b->data + upto, have - upto);
+    have -= upto;
+  }
+  close(fd);
+}
+
+static char * join(const char * dir, const char * name){
+  char * path;
+  size_t len = strlen(dir);
+
+  if ((path = malloc(len + strlen(name) + 2)) == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  if (len){
+    sprintf(path, "%s/%s", dir, name);
+  } else {
+    strcpy(path, name);
+  }
+  return path;
+}
+
+// Searches the files of one directory and queues its subdirectories.
+// The directory is opened by its path from the root and closed once
+// read, so a deep tree runs out of no fds.
+static void read_dir(grep_walk * w, int worker, const char * dir){
+  struct dirent * de;
+  struct stat st;
+  DIR * d;
+  char * path;
+  int fd, is_dir;
+
+  if ((fd = walk_open(w->rootfd, dir)) < 0) return;
+  if ((d = fdopendir(fd)) == NULL){
+    close(fd);
+    return;
+  }
+
+  while ((de = readdir(d)) != NULL && !w->g->cancel){
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+    is_dir = de->d_type == DT_DIR;
+    if (de->d_type == DT_DIR || de->d_type == DT_UNKNOWN){
+      if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) continue;
+      is_dir = S_ISDIR(st.st_mode);
+      if (is_dir && st.st_dev != w->dev) continue;
+    } else if (de->d_type != DT_REG){
+      continue;
+    }
+    path = join(dir, de->d_name);
+    if (is_dir){
+      walk_push(&w->walk, worker, path);
+    } else {
+      grep_file(w, worker, fd, de->d_name, path);
+      free(path);
+    }
+  }
+  closedir(d);
+}
+
+static void grep_task(walker * walk, int worker, void * task){
+  grep_walk * w = walk->arg;
+  if (!w->g->cancel) read_dir(w, worker, task);
+  free(task);
+}
+
+static void run_search(grep_engine * g, grep_walk * w){
+  struct stat st;
+  size_t i;
+  int k;
+
+  if ((w->rootfd = open(w->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) return;
+  if (fstat(w->rootfd, &st)){
+    close(w->rootfd);
+    return;
+  }
+  w->dev = st.st_dev;
+  w->plen = strlen(w->pattern);
+  w->fold = 1;
+  for (i = 0; i < w->plen; i++){
+    if (isupper((unsigned char) w->pattern[i])) w->fold = 0;
+  }
+  w->g = g;
+
+  walk_init(&w->walk, &g->pool, grep_task, NULL, w);
+  walk_push(&w->walk, 0, xstrdup(""));
+  walk_run(&w->walk, &g->pool);
+  walk_destroy(&w->walk);
+
+  for (k = 0; k < WALK_MAX_WORKERS; k++){
+    free(w->bufs[k].data);
+  }
+  close(w->rootfd);
+}
+
+// Takes searches one at a time, the latest only
+static void * grep_main(void * arg){
+  grep_engine * g = arg;
+  grep_walk * w;
+
+  if ((w = malloc(sizeof(grep_walk))) == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  pthread_mutex_lock(&g->lock);
+  while (1){
+    while (!g->shutdown && !g->requested){
+      pthread_cond_wait(&g->wake, &g->lock);
+    }
+    if (g->shutdown) break;
+    memset(w, 0, sizeof(grep_walk));
+    strcpy(w->root, g->root);
+    strcpy(w->pattern, g->pattern);
+    w->generation = g->generation;
+    g->requested = 0;
+    g->cancel = 0;
+    g->running = 1;
+    pthread_mutex_unlock(&g->lock);
+
+    run_search(g, w);
+
+    pthread_mutex_lock(&g->lock);
+    if (!g->requested) g->running = 0;
+  }
+  pthread_mutex_unlock(&g->lock);
+  free(w);
+  return NULL;
+}
+
+int grep_init(grep_engine * g, int pool_threads){
+  sigset_t all, old;
+  int ret = 0;
+
+  memset(g, 0, sizeof(grep_engine));
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->wake, NULL);
+
+  // Signals must keep landing on the UI thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pool_init(&g->pool, pool_threads);
+  if (pthread_create(&g->thread, NULL, grep_main, g)){
+    fprintf(stderr, "grep: can't start the searcher\n");
+    ret = -1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return ret;
+}
+
+// Stops the running search and drops what it found. The lock must be
+// held.
+static void drop_search(grep_engine * g){
+  g->requested = 0;
+  g->generation++;
+  g->cancel = 1;
+  grep_free_hits(g->hits, g->nhits);
+  g->hits = NULL;
+  g->nhits = g->hits_cap = 0;
+  g->total = 0;
+  g->files = g->skipped = 0;
+}
+
+// Searches the files below root for pattern, in place of whatever
+// search was running
+void grep_start(grep_engine * g, const char * root, const char * pattern){
+  size_t i;
+
+  pthread_mutex_lock(&g->lock);
+  drop_search(g);
+  snprintf(g->root, MAXLEN, "%s", root);
+  snprintf(g->pattern, MAXLEN, "%s", pattern);
+  for (i = 0; g->pattern[i]; i++){
+    if (isupper((unsigned char) g->pattern[i])) break;
+  }
+  if (!g->pattern[i]){
+    for (i = 0; g->pattern[i]; i++){
+      g->pattern[i] = tolower((unsigned char) g->pattern[i]);
+    }
+  }
+  g->requested = 1;
+  g->running = 1;
+  pthread_cond_signal(&g->wake);
+  pthread_mutex_unlock(&g->lock);
+}
+
+void grep_cancel(grep_engine * g){
+  pthread_mutex_lock(&g->lock);
+  drop_search(g);
+  pthread_mutex_unlock(&g->lock);
+}
+
+// Takes the lines found since the last call, and tells whether the
+// search is still running and how many files it looked at. Returns
+// how many lines there are. The caller frees them with
+// grep_free_hits().
+int grep_take(grep_engine * g, grep_hit ** hits, int * running, unsigned long * files, unsigned long * skipped){
+  int count;
+
+  pthread_mutex_lock(&g->lock);
+  *hits = g->hits;
+  count = g->nhits;
+  g->hits = NULL;
+  g->nhits = g->hits_cap = 0;
+  *running = g->running;
+  *files = g->files;
+  *skipped = g->skipped;
+  pthread_mutex_unlock(&g->lock);
+  return count;
+}
+
+void grep_free_hits(grep_hit * hits, int count){
+  int i;
+  for (i = 0; i < count; i++){
+    free(hits[i].path);
+    free(hits[i].text);
+  }
+  free(hits);
+}
+
+void grep_destroy(grep_engine * g){
+  pthread_mutex_lock(&g->lock);
+  drop_search(g);
+  g->shutdown = 1;
+  pthread_cond_signal(&g->wake);
+  pthread_mutex_unlock(&g->lock);
+  pthread_join(g->thread, NULL);
+
+  grep_free_hits(g->hits, g->nhits);
+  pool_destroy(&g->pool);
+}
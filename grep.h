@@ -0,0 +1,57 @@
+// Gopher - Parallel content search over a subtree
+#ifndef GREP_H
+#define GREP_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "gopher.h"
+#include "pool.h"
+
+// Files bigger than this are skipped
+#define GREP_MAX_SIZE (64 << 20)
+// A search stops after this many matching lines
+#define GREP_MAX_HITS 10000
+// Longest part of a matching line kept
+#define GREP_LINE_MAX 200
+
+// One matching line
+typedef struct {
+  char * path;            // relative to the search root
+  unsigned long line;     // counted from 1
+  char * text;            // the line, cut short, tabs and such as spaces
+} grep_hit;
+
+// Runs one search at a time on a thread of its own. Starting another
+// stops it. Matching lines stream in while the tree is walked.
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int shutdown;
+
+  char root[MAXLEN];      // the request
+  char pattern[MAXLEN];
+  int requested;
+  unsigned generation;    // bumped by every start and cancel
+  volatile int cancel;    // the running search is stale
+  int running;
+
+  grep_hit * hits;        // found and not yet taken
+  int nhits;
+  int hits_cap;
+  int total;              // lines found by the current search
+  unsigned long files;    // files it searched
+  unsigned long skipped;  // binary or too big
+
+  work_pool pool;
+} grep_engine;
+
+int grep_init(grep_engine * g, int pool_threads);
+void grep_start(grep_engine * g, const char * root, const char * pattern);
+void grep_cancel(grep_engine * g);
+int grep_take(grep_engine * g, grep_hit ** hits, int * running, unsigned long * files, unsigned long * skipped);
+void grep_free_hits(grep_hit * hits, int count);
+void grep_destroy(grep_engine * g);
+
+#endif
@@ -0,0 +1,376 @@
+// Gopher - Background jobs
+//
+// File operations are queued here instead of running in the key
+// handler. A runner thread takes them one at a time, so two big copies
+// don't fight over the disk, and runs them through the copy, move and
+// delete engines. The UI polls the progress counters and is told
+// through a pipe when a job ends. Only the UI thread frees jobs.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "jobs.h"
+#include "copy.h"
+#include "move.h"
+#include "delete.h"
+#include "extract.h"
+
+// Ended jobs kept around for the panel
+#define JOBS_KEEP 20
+
+// Does one item of a batch
+static void run_item(job_queue * q, job * j, job_item * it){
+  switch (j->kind){
+  case JOB_COPY:
+    // The name was free when the copy was queued
+    copy_as(it->src, AT_FDCWD, it->dst, it->replace, &j->prog);
+    break;
+  case JOB_MOVE:
+    // The name was free when the move was queued
+    if (move_across(it->src, it->dst, it->replace, &q->pool, &j->prog) == MOVE_TAKEN){
+      progress_error(&j->prog, it->dst, EEXIST);
+    }
+    break;
+  case JOB_EXTRACT:
+    extract_archive(it->src, it->dst, &q->pool, &j->prog);
+    break;
+  case JOB_ARCHIVE:
+    create_archive(it->src, it->dst, j->format, &q->pool, &j->prog);
+    break;
+  default:
+    delete_path(it->src, &q->pool, &j->prog);
+    break;
+  }
+}
+
+// Sets the result line of a job that ran, and returns its state
+static job_state finish_job(job * j){
+  if (j->prog.cancel){
+    snprintf(j->result, MAXLEN, "Cancelled after %lld files", j->prog.entries);
+    return JOB_CANCELLED;
+  }
+  if (j->prog.errors){
+    // The first error is cut to leave room for the count
+    snprintf(j->result, MAXLEN, "%d errors, %.*s", j->prog.errors, MAXLEN - 32, j->prog.first_error);
+    return JOB_FAILED;
+  }
+  progress_summary(&j->prog, j->result, MAXLEN);
+  return JOB_DONE;
+}
+
+// Takes the members of an archive out in one pass. They all come
+// from the same archive and go into the same directory.
+static void run_members(job_queue * q, job * j){
+  archive_pick * picks;
+  char dest[MAXLEN], * slash;
+  int i;
+
+  if ((picks = malloc(j->nitems * sizeof(archive_pick))) == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  snprintf(dest, MAXLEN, "%s", j->items[0].dst);
+  if ((slash = strrchr(dest, '/')) != NULL) *slash = 0;
+  for (i = 0; i < j->nitems; i++){
+    picks[i].member = j->items[i].member;
+    slash = strrchr(j->items[i].dst, '/');
+    picks[i].name = slash ? slash + 1 : j->items[i].dst;
+  }
+  extract_members(j->items[0].src, picks, j->nitems, j->stop_at, dest[0] ? dest : "/", &q->pool, &j->prog);
+  free(picks);
+}
+
+static job_state run_job(job_queue * q, job * j){
+  struct stat st;
+  long long before;
+  int i;
+
+  if (j->kind == JOB_EXTRACT && j->nitems && j->items[0].member){
+    // How much of the archive that takes isn't known up front
+    progress_start(&j->prog);
+    run_members(q, j);
+    return finish_job(j);
+  }
+
+  // Size the whole batch first so progress can show how much is left
+  j->prog.planning = 1;
+  for (i = 0; i < j->nitems && !j->prog.cancel; i++){
+    if (j->kind == JOB_EXTRACT){
+      // Only the archive size is known before reading it through
+      if (!stat(j->items[i].src, &st)) j->prog.total_bytes += st.st_size;
+    } else if (j->kind == JOB_MOVE){
+      // Every entry is counted once copied and again once deleted from
+      // the source, and a replaced dst is deleted first
+      before = j->prog.total_entries;
+      progress_plan(&j->prog, j->items[i].src, 1);
+      j->prog.total_entries += j->prog.total_entries - before;
+      if (j->items[i].replace) progress_plan(&j->prog, j->items[i].dst, 0);
+    } else {
+      progress_plan(&j->prog, j->items[i].src, j->kind != JOB_DELETE);
+    }
+  }
+  progress_start(&j->prog);
+
+  for (i = 0; i < j->nitems && !j->prog.cancel; i++){
+    run_item(q, j, &j->items[i]);
+  }
+  return finish_job(j);
+}
+
+static job * first_queued(job_queue * q){
+  job * j;
+  for (j = q->head; j; j = j->next){
+    if (j->state == JOB_QUEUED) return j;
+  }
+  return NULL;
+}
+
+static void notify(job_queue * q){
+  if (write(q->notify[1], "j", 1) < 0 && errno != EAGAIN) perror("jobs: write");
+}
+
+static void * runner(void * arg){
+  job_queue * q = arg;
+  job_state state;
+  job * j;
+
+  pthread_mutex_lock(&q->lock);
+  while (1){
+    while (!q->shutdown && (j = first_queued(q)) == NULL){
+      pthread_cond_wait(&q->wake, &q->lock);
+    }
+    if (q->shutdown) break;
+    j->state = JOB_RUNNING;
+    j->prog.started = progress_now();
+    pthread_mutex_unlock(&q->lock);
+
+    state = run_job(q, j);
+
+    pthread_mutex_lock(&q->lock);
+    j->state = state;
+    notify(q);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+// Starts the runner. pool_threads workers help with deletes.
+// Returns -1 if the runner can't be started.
+int jobs_init(job_queue * q, int pool_threads){
+  sigset_t all, old;
+  int ret = 0;
+
+  memset(q, 0, sizeof(job_queue));
+  q->next_id = 1;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->wake, NULL);
+  if (pipe2(q->notify, O_NONBLOCK | O_CLOEXEC)){
+    perror("pipe");
+    exit(errno);
+  }
+
+  // Signals such as SIGWINCH redraw the screen, so they must land on
+  // the UI thread and never on a job thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pool_init(&q->pool, pool_threads);
+  if (pthread_create(&q->thread, NULL, runner, q)){
+    fprintf(stderr, "jobs: can't start the runner\n");
+    ret = -1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return ret;
+}
+
+job * job_new(job_kind kind, const char * title){
+  job * j = calloc(1, sizeof(job));
+  if (j == NULL){
+    perror("calloc");
+    exit(errno);
+  }
+  j->kind = kind;
+  snprintf(j->title, MAXLEN, "%s", title);
+  progress_init(&j->prog, NULL, NULL);
+  return j;
+}
+
+static char * dup_path(const char * path){
+  char * s;
+  if (path == NULL) return NULL;
+  if ((s = strdup(path)) == NULL){
+    perror("strdup");
+    exit(errno);
+  }
+  return s;
+}
+
+// Adds a path to the batch of a copy, move or delete
+void job_add(job * j, const char * src, const char * dst, int replace){
+  job_item * it;
+
+  if (j->nitems == j->items_cap){
+    j->items_cap = j->items_cap ? j->items_cap * 2 : 4;
+    if ((j->items = realloc(j->items, j->items_cap * sizeof(job_item))) == NULL){
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  it = &j->items[j->nitems++];
+  it->src = dup_path(src);
+  it->dst = dup_path(dst);
+  it->replace = replace;
+  it->member = NULL;
+}
+
+// Adds a member of an archive to a JOB_EXTRACT, to be written to dst
+void job_add_member(job * j, const char * archive, const char * member, const char * dst){
+  job_add(j, archive, dst, 1);
+  j->items[j->nitems - 1].member = dup_path(member);
+}
+
+void job_free(job * j){
+  int i;
+  for (i = 0; i < j->nitems; i++){
+    free(j->items[i].src);
+    free(j->items[i].dst);
+    free(j->items[i].member);
+  }
+  free(j->items);
+  free(j);
+}
+
+// Queues a job. The queue owns it from here on.
+void jobs_submit(job_queue * q, job * j){
+  job ** tail;
+
+  pthread_mutex_lock(&q->lock);
+  j->id = q->next_id++;
+  j->state = JOB_QUEUED;
+  for (tail = &q->head; *tail; tail = &(*tail)->next);
+  *tail = j;
+  q->count++;
+  pthread_cond_signal(&q->wake);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Stops a job, with the queue locked
+static void cancel_locked(job_queue * q, job * j){
+  if (j->state == JOB_QUEUED){
+    j->state = JOB_CANCELLED;
+    snprintf(j->result, MAXLEN, "Cancelled");
+    notify(q);
+  } else if (j->state == JOB_RUNNING){
+    j->prog.cancel = 1;
+  }
+}
+
+// Stops a job. A queued one never starts, a running one stops at the
+// next file.
+void jobs_cancel(job_queue * q, job * j){
+  pthread_mutex_lock(&q->lock);
+  cancel_locked(q, j);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Drops the oldest ended jobs that were already reported
+static void prune(job_queue * q){
+  job ** link = &q->head;
+  job * j;
+
+  while (q->count > JOBS_KEEP && *link){
+    j = *link;
+    if (j->state >= JOB_DONE && j->reported){
+      *link = j->next;
+      job_free(j);
+      q->count--;
+    } else {
+      link = &j->next;
+    }
+  }
+}
+
+// Returns the next job that ended since the last call, or NULL
+job * jobs_next_ended(job_queue * q){
+  job * j;
+
+  pthread_mutex_lock(&q->lock);
+  prune(q);
+  for (j = q->head; j; j = j->next){
+    if (j->state >= JOB_DONE && !j->reported){
+      j->reported = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&q->lock);
+  return j;
+}
+
+// Number of jobs queued or running. The running one goes to *running.
+int jobs_active(job_queue * q, job ** running){
+  job * j;
+  int count = 0;
+
+  if (running) *running = NULL;
+  pthread_mutex_lock(&q->lock);
+  for (j = q->head; j; j = j->next){
+    if (j->state == JOB_RUNNING && running) *running = j;
+    if (j->state <= JOB_RUNNING) count++;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return count;
+}
+
+// Number of jobs kept, ended ones included
+int jobs_count(job_queue * q){
+  int count;
+  pthread_mutex_lock(&q->lock);
+  count = q->count;
+  pthread_mutex_unlock(&q->lock);
+  return count;
+}
+
+// The index'th job, oldest first. Its state as of now goes to *state,
+// and once that says it ended, its result is final.
+job * jobs_get(job_queue * q, int index, job_state * state){
+  job * j;
+  pthread_mutex_lock(&q->lock);
+  for (j = q->head; j && index > 0; j = j->next, index--);
+  if (j && state) *state = j->state;
+  pthread_mutex_unlock(&q->lock);
+  return j;
+}
+
+void jobs_drain_notify(job_queue * q){
+  char buf[64];
+  while (read(q->notify[0], buf, sizeof(buf)) > 0);
+}
+
+// Cancels everything and stops the runner
+void jobs_destroy(job_queue * q){
+  job * j, * next;
+
+  pthread_mutex_lock(&q->lock);
+  for (j = q->head; j; j = j->next){
+    cancel_locked(q, j);
+  }
+  q->shutdown = 1;
+  pthread_cond_signal(&q->wake);
+  pthread_mutex_unlock(&q->lock);
+  pthread_join(q->thread, NULL);
+
+  for (j = q->head; j; j = next){
+    next = j->next;
+    job_free(j);
+  }
+  q->head = NULL;
+  pool_destroy(&q->pool);
+  close(q->notify[0]);
+  close(q->notify[1]);
+}
@@ -0,0 +1,86 @@
+// Gopher - Background jobs
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "gopher.h"
+#include "pool.h"
+#include "progress.h"
+#include "archive.h"
+
+typedef enum {
+  JOB_COPY,       // copy each src to exactly dst
+  JOB_MOVE,       // copy each src to dst, then delete src
+  JOB_DELETE,     // delete each src
+  JOB_EXTRACT,    // extract archive src into directory dst, or only
+                  // its member to the path dst
+  JOB_ARCHIVE     // write the tree at src into archive dst
+} job_kind;
+
+typedef enum {
+  JOB_QUEUED,
+  JOB_RUNNING,
+  JOB_DONE,
+  JOB_FAILED,
+  JOB_CANCELLED
+} job_state;
+
+// One path a job works on. Batches of files are one job.
+typedef struct {
+  char * src;
+  char * dst;             // NULL for deletes
+  int replace;            // a move may replace an existing dst
+  char * member;          // path inside the archive src, for extracts
+} job_item;
+
+typedef struct job {
+  struct job * next;
+  int id;
+  job_kind kind;
+  job_state state;        // changed under the queue lock
+  char title[MAXLEN];     // what the user asked for, for the panel
+
+  job_item * items;
+  int nitems;
+  int items_cap;
+  archive_type format;    // of a JOB_ARCHIVE
+  uint64_t stop_at;       // where an extract of members can stop reading
+
+  op_progress prog;
+  char result[MAXLEN];    // set when the job ends
+  int reported;           // result was shown to the user
+} job;
+
+// Jobs run one at a time, oldest first, on a thread of their own.
+// Finished jobs are kept for the panel until there are too many.
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int shutdown;
+
+  job * head;             // oldest first
+  int count;
+  int next_id;
+
+  int notify[2];          // readable whenever a job ended
+  work_pool pool;         // for parallel deletes
+} job_queue;
+
+int jobs_init(job_queue * q, int pool_threads);
+job * job_new(job_kind kind, const char * title);
+void job_add(job * j, const char * src, const char * dst, int replace);
+void job_add_member(job * j, const char * archive, const char * member, const char * dst);
+void job_free(job * j);
+void jobs_submit(job_queue * q, job * j);
+void jobs_cancel(job_queue * q, job * j);
+job * jobs_next_ended(job_queue * q);
+int jobs_active(job_queue * q, job ** running);
+int jobs_count(job_queue * q);
+job * jobs_get(job_queue * q, int index, job_state * state);
+void jobs_drain_notify(job_queue * q);
+void jobs_destroy(job_queue * q);
+
+#endif
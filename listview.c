@@ -0,0 +1,81 @@
+// Gopher - Virtualized list widget
+//
+// Keeps a cursor and a scroll offset over count entries and calls back
+// to draw only the rows currently on screen. Moving, paging and
+// jumping are O(1), drawing is O(height).
+
+#include <ncurses.h>
+
+#include "listview.h"
+
+void lv_init(listview * lv, WINDOW * win, int height, lv_draw_func draw_row, void * data){
+  lv->win = win;
+  lv->height = height < 1 ? 1 : height;
+  lv->count = 0;
+  lv->top = 0;
+  lv->cur = 0;
+  lv->draw_row = draw_row;
+  lv->data = data;
+}
+
+// Keeps the cursor inside the list and the visible rows around it
+static void clamp(listview * lv){
+  if (lv->cur >= lv->count) lv->cur = lv->count - 1;
+  if (lv->cur < 0) lv->cur = 0;
+  if (lv->cur < lv->top) lv->top = lv->cur;
+  if (lv->cur >= lv->top + lv->height) lv->top = lv->cur - lv->height + 1;
+  if (lv->top > lv->count - lv->height) lv->top = lv->count - lv->height;
+  if (lv->top < 0) lv->top = 0;
+}
+
+void lv_set_count(listview * lv, int count){
+  lv->count = count;
+  clamp(lv);
+}
+
+// Highlights entry index, scrolling only if it is off screen
+void lv_set_current(listview * lv, int index){
+  lv->cur = index;
+  clamp(lv);
+  lv_draw(lv);
+}
+
+// Moves the highlight by delta rows, wrapping around at either end
+void lv_move(listview * lv, int delta){
+  if (lv->count == 0) return;
+  if (lv->cur + delta >= lv->count) {
+    lv->cur = 0;
+  } else if (lv->cur + delta < 0) {
+    lv->cur = lv->count - 1;
+  } else {
+    lv->cur += delta;
+  }
+  clamp(lv);
+  lv_draw(lv);
+}
+
+// Scrolls by whole pages, keeping the highlight on the same screen row
+void lv_page(listview * lv, int pages){
+  int row = lv->cur - lv->top;
+  lv->top += pages * lv->height;
+  if (lv->top > lv->count - lv->height) lv->top = lv->count - lv->height;
+  if (lv->top < 0) lv->top = 0;
+  lv->cur = lv->top + row;
+  clamp(lv);
+  lv_draw(lv);
+}
+
+// Draws the visible rows and leaves the cursor on the highlighted one
+void lv_draw(listview * lv){
+  int row;
+  for (row = 0; row < lv->height; row++){
+    wmove(lv->win, row, 0);
+    wclrtoeol(lv->win);
+    if (lv->top + row < lv->count){
+      lv->draw_row(lv->win, row, lv->top + row, lv->top + row == lv->cur, lv->data);
+    }
+  }
+  wmove(lv->win, lv->cur - lv->top, 0);
+  wcursyncup(lv->win);
+  wrefresh(lv->win);
+}
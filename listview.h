@@ -0,0 +1,29 @@
+// Gopher - Virtualized list widget
+#ifndef LISTVIEW_H
+#define LISTVIEW_H
+
+#include <ncurses.h>
+
+// Draws entry index on the given row of win
+typedef void (*lv_draw_func)(WINDOW * win, int row, int index, int highlight, void * data);
+
+// A scrolling list that only draws the rows inside its window.
+// Nothing is allocated per entry, so count has no upper limit.
+typedef struct {
+  WINDOW * win;
+  int height;
+  int count;
+  int top;       // index of first visible row
+  int cur;       // index of highlighted row
+  lv_draw_func draw_row;
+  void * data;
+} listview;
+
+void lv_init(listview * lv, WINDOW * win, int height, lv_draw_func draw_row, void * data);
+void lv_set_count(listview * lv, int count);
+void lv_set_current(listview * lv, int index);
+void lv_move(listview * lv, int delta);
+void lv_page(listview * lv, int pages);
+void lv_draw(listview * lv);
+
+#endif
@@ -0,0 +1,61 @@
+// Gopher - Moving files, by rename where possible
+//
+// Within a filesystem a move is one renameat2() call, however big the
+// tree. RENAME_NOREPLACE makes the check for a taken name and the move
+// one atomic step. Only across filesystems is the tree copied and the
+// source deleted afterwards.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "move.h"
+#include "copy.h"
+#include "delete.h"
+
+// Returns 1 if dst exists
+static int taken(const char * dst){
+  struct stat st;
+  return lstat(dst, &st) == 0;
+}
+
+// Renames src to exactly dst. Unless replace is set an existing dst is
+// left alone. Returns 0 when moved, MOVE_TAKEN when dst is taken,
+// MOVE_ACROSS when dst is on another filesystem and -1 when the move
+// failed, with the errors counted in prog.
+int move_rename(const char * src, const char * dst, int replace, op_progress * prog){
+  if (renameat2(AT_FDCWD, src, AT_FDCWD, dst, replace ? 0 : RENAME_NOREPLACE) == 0){
+    progress_add(prog, 1, 0);
+    return 0;
+  }
+  if (errno == EEXIST && !replace) return MOVE_TAKEN;
+
+  // Filesystems without RENAME_NOREPLACE get a plain check first
+  if (errno == EINVAL && !replace){
+    if (taken(dst)) return MOVE_TAKEN;
+    if (rename(src, dst) == 0){
+      progress_add(prog, 1, 0);
+      return 0;
+    }
+  }
+  if (errno == EXDEV) return MOVE_ACROSS;
+  progress_error(prog, src, errno);
+  return -1;
+}
+
+// Moves src to dst on another filesystem: copies, and deletes the
+// source only if all of it got across. Slow, so it runs as a job. With
+// replace, an existing dst is removed first, so that a directory is
+// replaced and not merged into.
+int move_across(const char * src, const char * dst, int replace, work_pool * pool, op_progress * prog){
+  if (taken(dst)){
+    if (!replace) return MOVE_TAKEN;
+    if (delete_path(dst, pool, prog) || prog->cancel) return -1;
+  }
+  if (copy_as(src, AT_FDCWD, dst, replace, prog) || prog->cancel) return -1;
+  return delete_path(src, pool, prog);
+}
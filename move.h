@@ -0,0 +1,14 @@
+// Gopher - Moving files, by rename where possible
+#ifndef MOVE_H
+#define MOVE_H
+
+#include "pool.h"
+#include "progress.h"
+
+#define MOVE_TAKEN 1    // dst exists and replace was not set
+#define MOVE_ACROSS 2   // dst is on another filesystem
+
+int move_rename(const char * src, const char * dst, int replace, op_progress * prog);
+int move_across(const char * src, const char * dst, int replace, work_pool * pool, op_progress * prog);
+
+#endif
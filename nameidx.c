@@ -0,0 +1,216 @@
+// Gopher - Indexes of a listing by file name
+//
+// Open addressing with linear probing over file_info pointers. Lets
+// directory change events find their entry without walking the list.
+//
+// Next to it, the listing sorted by name ignoring case, whatever order
+// it is shown in, so type-ahead finds a prefix by binary search.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "nameidx.h"
+
+// Marks a removed slot so probing continues past it
+static file_info tombstone;
+#define TOMBSTONE (&tombstone)
+
+static uint32_t hash_name(const char * name){
+  uint32_t h = 2166136261u;
+  while (*name){
+    h ^= (unsigned char) *name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+void nameidx_init(name_index * idx){
+  idx->slots = NULL;
+  idx->cap = 0;
+  idx->used = 0;
+  idx->filled = 0;
+}
+
+static void insert(name_index * idx, file_info * fi){
+  unsigned i = hash_name(fi->name) & (idx->cap - 1);
+  while (idx->slots[i] && idx->slots[i] != TOMBSTONE){
+    i = (i + 1) & (idx->cap - 1);
+  }
+  if (!idx->slots[i]) idx->filled++;
+  idx->slots[i] = fi;
+  idx->used++;
+}
+
+// Rehashes into a table that keeps the load under one half
+static void resize(name_index * idx, unsigned min_entries){
+  file_info ** old = idx->slots;
+  unsigned oldcap = idx->cap;
+  unsigned i;
+
+  idx->cap = 16;
+  while (idx->cap < min_entries * 2) idx->cap *= 2;
+  if ((idx->slots = calloc(idx->cap, sizeof(file_info *))) == NULL){
+    perror("calloc");
+    exit(errno);
+  }
+  idx->used = 0;
+  idx->filled = 0;
+  for (i = 0; i < oldcap; i++){
+    if (old[i] && old[i] != TOMBSTONE) insert(idx, old[i]);
+  }
+  free(old);
+}
+
+// Indexes a whole filelist
+void nameidx_build(name_index * idx, file_info ** filelist, int count){
+  int i;
+  nameidx_clear(idx);
+  resize(idx, count + 1);
+  for (i = 0; i < count; i++){
+    insert(idx, filelist[i]);
+  }
+}
+
+file_info * nameidx_find(name_index * idx, const char * name){
+  unsigned i;
+  if (!idx->cap) return NULL;
+  i = hash_name(name) & (idx->cap - 1);
+  while (idx->slots[i]){
+    if (idx->slots[i] != TOMBSTONE && !strcmp(idx->slots[i]->name, name)) return idx->slots[i];
+    i = (i + 1) & (idx->cap - 1);
+  }
+  return NULL;
+}
+
+void nameidx_add(name_index * idx, file_info * fi){
+  if (!idx->cap) return;
+  if ((idx->filled + 1) * 2 > idx->cap) resize(idx, idx->used + 1);
+  insert(idx, fi);
+}
+
+void nameidx_remove(name_index * idx, file_info * fi){
+  unsigned i;
+  if (!idx->cap) return;
+  i = hash_name(fi->name) & (idx->cap - 1);
+  while (idx->slots[i]){
+    if (idx->slots[i] == fi){
+      idx->slots[i] = TOMBSTONE;
+      idx->used--;
+      return;
+    }
+    i = (i + 1) & (idx->cap - 1);
+  }
+}
+
+// Drops the index. It is rebuilt by the next nameidx_build().
+void nameidx_clear(name_index * idx){
+  free(idx->slots);
+  nameidx_init(idx);
+}
+
+// Case-insensitive order, with ties broken so every name has one place
+static int name_cmp(const char * a, const char * b){
+  int ret = strcasecmp(a, b);
+  return ret ? ret : strcmp(a, b);
+}
+
+static int entry_cmp(const void * a, const void * b){
+  return name_cmp((*(file_info **) a)->name, (*(file_info **) b)->name);
+}
+
+// First position whose name is not before name
+static int lower_bound(name_table * t, const char * name){
+  int lo = 0, hi = t->count, mid;
+  while (lo < hi){
+    mid = lo + (hi - lo) / 2;
+    if (name_cmp(t->entries[mid]->name, name) < 0){
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// First position whose name is not before prefix, ignoring case only.
+// The tie-break of name_cmp would put "Makefile" before "makefile".
+static int prefix_bound(name_table * t, const char * prefix){
+  int lo = 0, hi = t->count, mid;
+  while (lo < hi){
+    mid = lo + (hi - lo) / 2;
+    if (strcasecmp(t->entries[mid]->name, prefix) < 0){
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Sorts a whole filelist by name, leaving out ".."
+void nametable_build(name_table * t, file_info ** filelist, int count){
+  int i;
+  nametable_clear(t);
+  t->cap = count + 16;
+  if ((t->entries = malloc(t->cap * sizeof(file_info *))) == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  for (i = 0; i < count; i++){
+    if (strcmp(filelist[i]->name, "..")) t->entries[t->count++] = filelist[i];
+  }
+  qsort(t->entries, t->count, sizeof(file_info *), entry_cmp);
+}
+
+// Finds the first name starting with prefix, ignoring case. Given
+// after, finds the one following it instead, going round to the first
+// after the last. NULL if no name starts with prefix.
+file_info * nametable_prefix(name_table * t, const char * prefix, file_info * after){
+  size_t len = strlen(prefix);
+  int first = prefix_bound(t, prefix), pos;
+
+  if (first == t->count || strncasecmp(t->entries[first]->name, prefix, len)) return NULL;
+  if (after && !strncasecmp(after->name, prefix, len)){
+    pos = lower_bound(t, after->name) + 1;
+    if (pos < t->count && !strncasecmp(t->entries[pos]->name, prefix, len)) return t->entries[pos];
+  }
+  return t->entries[first];
+}
+
+void nametable_add(name_table * t, file_info * fi){
+  int pos;
+  if (!t->cap) return;
+  if (t->count == t->cap){
+    t->cap *= 2;
+    if ((t->entries = realloc(t->entries, t->cap * sizeof(file_info *))) == NULL){
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  pos = lower_bound(t, fi->name);
+  memmove(&t->entries[pos + 1], &t->entries[pos], (t->count - pos) * sizeof(file_info *));
+  t->entries[pos] = fi;
+  t->count++;
+}
+
+void nametable_remove(name_table * t, file_info * fi){
+  int pos;
+  if (!t->cap) return;
+  pos = lower_bound(t, fi->name);
+  if (pos < t->count && t->entries[pos] == fi){
+    memmove(&t->entries[pos], &t->entries[pos + 1], (t->count - pos - 1) * sizeof(file_info *));
+    t->count--;
+  }
+}
+
+// Drops the table. It is rebuilt by the next nametable_build().
+void nametable_clear(name_table * t){
+  free(t->entries);
+  t->entries = NULL;
+  t->count = 0;
+  t->cap = 0;
+}
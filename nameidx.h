@@ -0,0 +1,34 @@
+// Gopher - Indexes of a listing by file name
+#ifndef NAMEIDX_H
+#define NAMEIDX_H
+
+#include "gopher.h"
+
+typedef struct {
+  file_info ** slots;
+  unsigned cap;       // power of two, 0 while not built
+  unsigned used;      // live entries
+  unsigned filled;    // live entries and tombstones
+} name_index;
+
+void nameidx_init(name_index * idx);
+void nameidx_build(name_index * idx, file_info ** filelist, int count);
+file_info * nameidx_find(name_index * idx, const char * name);
+void nameidx_add(name_index * idx, file_info * fi);
+void nameidx_remove(name_index * idx, file_info * fi);
+void nameidx_clear(name_index * idx);
+
+// The listing in case-insensitive name order, for prefix lookups
+typedef struct {
+  file_info ** entries;
+  int count;
+  int cap;            // 0 while not built
+} name_table;
+
+void nametable_build(name_table * t, file_info ** filelist, int count);
+file_info * nametable_prefix(name_table * t, const char * prefix, file_info * after);
+void nametable_add(name_table * t, file_info * fi);
+void nametable_remove(name_table * t, file_info * fi);
+void nametable_clear(name_table * t);
+
+#endif
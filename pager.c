@@ -0,0 +1,468 @@
+// Gopher - Built-in pager for files of any size
+//
+// The file is mapped, never read, so opening a big one costs nothing
+// and only the pages shown or searched are ever brought in. A thread
+// counts its newlines, a megabyte at a time with bytes_count(), and
+// remembers where every PAGER_LINE_STEP-th line starts. Any line
+// indexed is then found from the mark before it with a short scan.
+// The index stays a few hundred kilobytes even for a file of several
+// gigabytes.
+//
+// The file is watched with inotify while it is open. Data appended to
+// it is mapped in with mremap() and indexed from where the index left
+// off. A file cut short, as a log rotated in place, starts the index
+// over. Reading a mapping past the end of a file that shrank raises
+// SIGBUS, which is caught and taken as the end of the file. The file
+// was then cut short whatever its size is by the next look, so the
+// index starts over then too.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pager.h"
+#include "bytes.h"
+
+#define INDEX_BLOCK (1 << 20)   // bytes indexed between two commits
+#define TAB_WIDTH 8
+
+// Where a thread reading a mapping goes when the file shrank under it
+static __thread sigjmp_buf * bus_jump;
+static struct sigaction old_sigbus;
+static int pagers_open;
+
+// Runs the code that follows on the mapping. A SIGBUS comes back to it
+// with a non zero value, and is taken as the end of the file. Locals
+// that change after it don't survive the jump, so the guarded work is
+// kept in functions of its own.
+#define GUARD(jump) (bus_jump = &(jump), sigsetjmp(jump, 0))
+#define UNGUARD() (bus_jump = NULL)
+
+static void on_sigbus(int sig){
+  if (bus_jump) siglongjmp(*bus_jump, 1);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+// Maps size bytes of fd in place of the mapping at map, of mapped
+// bytes. Returns NULL for an empty file or when it can't.
+static const char * remap(int fd, const char * map, size_t mapped, size_t size){
+  void * to;
+
+  if (map && size){
+    if ((to = mremap((void *) map, mapped, size, MREMAP_MAYMOVE)) == MAP_FAILED) munmap((void *) map, mapped);
+  } else {
+    if (map) munmap((void *) map, mapped);
+    to = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  }
+  return to == MAP_FAILED ? NULL : to;
+}
+
+static void add_mark(pager * p, size_t off){
+  if (p->nmarks == p->marks_cap){
+    p->marks_cap = p->marks_cap ? p->marks_cap * 2 : 256;
+    if ((p->marks = realloc(p->marks, p->marks_cap * sizeof(size_t))) == NULL){
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  p->marks[p->nmarks++] = off;
+}
+
+// Counts the newlines in len bytes of map from from, and notes where
+// each line that gets a mark starts. Returns -1 if the file shrank
+// under it.
+static int index_block(const char * map, size_t from, size_t len, unsigned long lines,
+		       size_t * found, int * nfound, unsigned long * count){
+  sigjmp_buf jump;
+  const char * pos, * end;
+  unsigned long n;
+
+  *nfound = 0;
+  if (GUARD(jump)){
+    UNGUARD();
+    return -1;
+  }
+  n = bytes_count(map + from, len, '\n');
+  // Only blocks that reach a new mark are walked line by line
+  if (lines % PAGER_LINE_STEP + n >= PAGER_LINE_STEP){
+    pos = map + from;
+    end = pos + len;
+    for (n = 0; (pos = memchr(pos, '\n', end - pos)) != NULL; n++){
+      pos++;
+      if ((lines + n + 1) % PAGER_LINE_STEP == 0) found[(*nfound)++] = pos - map;
+    }
+  }
+  UNGUARD();
+  *count = n;
+  return 0;
+}
+
+// Indexes the file a block at a time, and waits for it to grow once
+// it is done. Its mapping is its own, so the UI can remap the file at
+// any time.
+static void * pager_main(void * arg){
+  pager * p = arg;
+  sigset_t bus;
+  size_t mapped = 0, size, from, len, found[INDEX_BLOCK / PAGER_LINE_STEP + 1];
+  const char * map = NULL;
+  unsigned long lines, n;
+  unsigned reset;
+  int nfound, i;
+
+  // SIGBUS must reach the handler here, not kill the process
+  sigemptyset(&bus);
+  sigaddset(&bus, SIGBUS);
+  pthread_sigmask(SIG_UNBLOCK, &bus, NULL);
+
+  pthread_mutex_lock(&p->lock);
+  while (1){
+    while (!p->shutdown && (p->indexed == p->file_size || p->faulted)){
+      pthread_cond_wait(&p->wake, &p->lock);
+    }
+    if (p->shutdown) break;
+    size = p->file_size;
+    from = p->indexed;
+    lines = p->lines;
+    reset = p->reset;
+    pthread_mutex_unlock(&p->lock);
+
+    if (size != mapped){
+      map = remap(p->fd, map, mapped, size);
+      mapped = map ? size : 0;
+    }
+    len = size - from < INDEX_BLOCK ? size - from : INDEX_BLOCK;
+    if (!map || index_block(map, from, len, lines, found, &nfound, &n)){
+      // The file shrank, or can't be mapped. Wait for the UI to see
+      // what became of it.
+      pthread_mutex_lock(&p->lock);
+      if (reset == p->reset) p->faulted = 1;
+      continue;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (reset != p->reset) continue;
+    for (i = 0; i < nfound; i++){
+      add_mark(p, found[i]);
+    }
+    p->lines += n;
+    p->indexed = from + len;
+  }
+  pthread_mutex_unlock(&p->lock);
+  if (map) munmap((void *) map, mapped);
+  return NULL;
+}
+
+// Opens path in the pager and starts indexing it. Returns -1 and sets
+// errno if it can't.
+int pager_open(pager * p, const char * path){
+  struct sigaction sa;
+  struct stat st;
+  sigset_t all, old;
+  int err;
+
+  memset(p, 0, sizeof(pager));
+  snprintf(p->path, MAXLEN, "%s", path);
+  if ((p->fd = open(path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC)) < 0) return -1;
+  if (fstat(p->fd, &st) || !S_ISREG(st.st_mode)){
+    err = errno;
+    if (!err) err = EINVAL;
+    close(p->fd);
+    errno = err;
+    return -1;
+  }
+  p->size = st.st_size;
+  if (p->size && (p->map = remap(p->fd, NULL, 0, p->size)) == NULL){
+    err = errno;
+    close(p->fd);
+    errno = err;
+    return -1;
+  }
+
+  if ((p->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0 &&
+      inotify_add_watch(p->inotify, path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) < 0){
+    close(p->inotify);
+    p->inotify = -1;
+  }
+
+  if (!pagers_open++){
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = on_sigbus;
+    sa.sa_flags = SA_NODEFER;
+    sigaction(SIGBUS, &sa, &old_sigbus);
+  }
+
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  p->file_size = p->size;
+  add_mark(p, 0);
+
+  // Signals must keep landing on the UI thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  if (pthread_create(&p->thread, NULL, pager_main, p)){
+    fprintf(stderr, "pager: can't start the indexer\n");
+    p->thread = 0;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return 0;
+}
+
+// Looks for changes to the file: data appended is mapped and indexed,
+// a file cut short is indexed over again. Call it when p->inotify is
+// readable, or now and then without inotify.
+int pager_update(pager * p){
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event * ev;
+  struct stat st;
+  ssize_t len, i;
+  int ret = PAGER_SAME, faulted;
+
+  while (p->inotify >= 0 && (len = read(p->inotify, buf, sizeof(buf))) > 0){
+    for (i = 0; i < len; i += sizeof(struct inotify_event) + ev->len){
+      ev = (struct inotify_event *) (buf + i);
+      if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) p->gone = 1;
+    }
+  }
+  pthread_mutex_lock(&p->lock);
+  faulted = p->faulted;
+  pthread_mutex_unlock(&p->lock);
+  if (fstat(p->fd, &st) || ((size_t) st.st_size == p->size && !faulted)) return p->gone ? PAGER_GONE : PAGER_SAME;
+
+  // After a fault the file was cut short, even if it grew back since
+  ret = (size_t) st.st_size > p->size && !faulted ? PAGER_GREW : PAGER_SHRANK;
+  p->map = remap(p->fd, p->map, p->size, st.st_size);
+  p->size = p->map ? st.st_size : 0;
+
+  pthread_mutex_lock(&p->lock);
+  p->file_size = p->size;
+  if (ret == PAGER_SHRANK){
+    p->reset++;
+    p->indexed = 0;
+    p->lines = 0;
+    p->nmarks = 1;
+    p->faulted = 0;
+  }
+  pthread_cond_signal(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+  return ret;
+}
+
+// Tells how far the index got, in bytes and in newlines
+void pager_progress(pager * p, size_t * indexed, unsigned long * lines){
+  pthread_mutex_lock(&p->lock);
+  *indexed = p->indexed;
+  *lines = p->lines;
+  pthread_mutex_unlock(&p->lock);
+}
+
+// Counts newlines before off, from the mark before it
+static int count_from_mark(pager * p, size_t mark, size_t off, unsigned long * n){
+  sigjmp_buf jump;
+  if (GUARD(jump)){
+    UNGUARD();
+    return -1;
+  }
+  *n = bytes_count(p->map + mark, off - mark, '\n');
+  UNGUARD();
+  return 0;
+}
+
+// Number, from 0, of the line holding off. -1 while the index hasn't
+// got there.
+long pager_line_of(pager * p, size_t off){
+  size_t lo, hi, mid, mark;
+  unsigned long n;
+
+  pthread_mutex_lock(&p->lock);
+  if (off > p->indexed || off > p->size){
+    pthread_mutex_unlock(&p->lock);
+    return -1;
+  }
+  lo = 0;
+  hi = p->nmarks;
+  while (hi - lo > 1){
+    mid = (lo + hi) / 2;
+    if (p->marks[mid] <= off) lo = mid; else hi = mid;
+  }
+  mark = p->marks[lo];
+  pthread_mutex_unlock(&p->lock);
+
+  if (count_from_mark(p, mark, off, &n)) return -1;
+  return lo * PAGER_LINE_STEP + n;
+}
+
+// Finds where line, from 0, starts. Returns -1 while the index hasn't
+// got there.
+int pager_line_offset(pager * p, unsigned long line, size_t * off){
+  size_t k, pos, i;
+
+  pthread_mutex_lock(&p->lock);
+  k = line / PAGER_LINE_STEP;
+  if (line > p->lines || k >= p->nmarks){
+    pthread_mutex_unlock(&p->lock);
+    return -1;
+  }
+  pos = p->marks[k];
+  pthread_mutex_unlock(&p->lock);
+
+  for (i = 0; i < line % PAGER_LINE_STEP; i++){
+    pos = pager_next_line(p, pos);
+  }
+  *off = pos;
+  return 0;
+}
+
+// Start of the line holding off
+size_t pager_line_start(pager * p, size_t off){
+  sigjmp_buf jump;
+  const char * nl;
+
+  if (off > p->size) off = p->size;
+  if (!off || GUARD(jump)){
+    UNGUARD();
+    return 0;
+  }
+  nl = memrchr(p->map, '\n', off);
+  UNGUARD();
+  return nl ? nl + 1 - p->map : 0;
+}
+
+// Start of the line after the one holding off, or the end of the file
+size_t pager_next_line(pager * p, size_t off){
+  sigjmp_buf jump;
+  const char * nl;
+
+  if (off >= p->size) return p->size;
+  if (GUARD(jump)){
+    UNGUARD();
+    return p->size;
+  }
+  nl = memchr(p->map + off, '\n', p->size - off);
+  UNGUARD();
+  return nl ? (size_t) (nl + 1 - p->map) : p->size;
+}
+
+// Start of the line before the one starting at off
+size_t pager_prev_line(pager * p, size_t off){
+  return off ? pager_line_start(p, off - 1) : 0;
+}
+
+// Does the work of pager_line(), on the mapping. Returns the length.
+// Kept apart, so that its loop isn't live across the guard.
+static __attribute__ ((noinline)) int render_line(pager * p, size_t off, int skip, char * out, int width){
+  size_t i;
+  int col = 0, n = 0;
+  unsigned char c;
+
+  for (i = off; i < p->size && n < width; i++){
+    c = p->map[i];
+    if (c == '\n' || (c == '\r' && (i + 1 == p->size || p->map[i + 1] == '\n'))) break;
+    if (c == '\t'){
+      do {
+	if (col++ >= skip && n < width) out[n++] = ' ';
+      } while (col % TAB_WIDTH);
+    } else {
+      if (col++ >= skip) out[n++] = c < 32 || c == 127 ? '.' : c;
+    }
+  }
+  return n;
+}
+
+// Copies the line starting at off into out, as it shows on screen:
+// tabs expanded, other control characters as dots, the first skip
+// columns left out and at most width kept. Returns -1 past the end of
+// the file.
+int pager_line(pager * p, size_t off, int skip, char * out, int width){
+  sigjmp_buf jump;
+  int n;
+
+  out[0] = 0;
+  if (off >= p->size) return -1;
+  if (GUARD(jump)){
+    UNGUARD();
+    out[0] = 0;
+    return -1;
+  }
+  n = render_line(p, off, skip, out, width);
+  UNGUARD();
+  out[n] = 0;
+  return 0;
+}
+
+// Finds the first match of needle between from and to, or the last
+// one going backward, as *last. Returns -1 if the file shrank under it.
+static int find_between(pager * p, const char * needle, size_t nlen, int fold, int backward,
+			size_t from, size_t to, const char ** last){
+  sigjmp_buf jump;
+  const char * hit;
+
+  *last = NULL;
+  if (GUARD(jump)){
+    UNGUARD();
+    return -1;
+  }
+  if (backward){
+    // The last match in the stretch is the one wanted
+    for (hit = p->map + from; (hit = bytes_find(hit, p->map + to - hit, needle, nlen, fold)) != NULL; hit++){
+      *last = hit;
+    }
+  } else {
+    *last = bytes_find(p->map + from, to - from, needle, nlen, fold);
+  }
+  UNGUARD();
+  return 0;
+}
+
+// Looks for needle from *at on, or before it when going backward,
+// through at most limit bytes. Folding, the needle must be lower case.
+// Returns 1 with *at on the match, 0 with *at where to go on, and -1
+// once the whole file was looked at.
+int pager_find(pager * p, const char * needle, int fold, int backward, size_t * at, size_t limit){
+  size_t nlen = strlen(needle), from, to;
+  const char * last;
+
+  if (*at > p->size) *at = p->size;
+  if (backward){
+    from = *at > limit ? *at - limit : 0;
+    to = *at + nlen - 1 < p->size ? *at + nlen - 1 : p->size;
+  } else {
+    from = *at;
+    to = limit < p->size - from ? from + limit + nlen - 1 : p->size;
+    if (to > p->size) to = p->size;
+  }
+  if (find_between(p, needle, nlen, fold, backward, from, to, &last)) return -1;
+  if (last){
+    *at = last - p->map;
+    return 1;
+  }
+  if (backward ? from == 0 : to == p->size) return -1;
+  *at = backward ? from : from + limit;
+  return 0;
+}
+
+void pager_close(pager * p){
+  if (p->thread){
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = 1;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->wake);
+  free(p->marks);
+  if (p->map) munmap((void *) p->map, p->size);
+  if (p->inotify >= 0) close(p->inotify);
+  close(p->fd);
+  if (!--pagers_open) sigaction(SIGBUS, &old_sigbus, NULL);
+}
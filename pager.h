@@ -0,0 +1,56 @@
+// Gopher - Built-in pager for files of any size
+#ifndef PAGER_H
+#define PAGER_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "gopher.h"
+
+// Every this many lines the line index remembers where one starts
+#define PAGER_LINE_STEP 1024
+
+// What pager_update() found
+#define PAGER_SAME 0
+#define PAGER_GREW 1
+#define PAGER_SHRANK 2
+#define PAGER_GONE 3            // moved or deleted, what is left shows
+
+// A file mapped whole, and an index of its lines built on a thread of
+// its own. Lines and offsets of the part indexed so far are known
+// exactly, the rest is still there to read.
+typedef struct {
+  char path[MAXLEN];
+  int fd;
+  const char * map;       // the UI's mapping of the file
+  size_t size;
+  int inotify;            // -1 without inotify
+  int gone;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int shutdown;
+  size_t file_size;       // for the indexer, latest size known
+  unsigned reset;         // bumped when the file shrank, indexing restarts
+  int faulted;            // the indexer ran past the end, waits for a reset
+  size_t indexed;         // bytes indexed
+  unsigned long lines;    // newlines in them
+  size_t * marks;         // where line k * PAGER_LINE_STEP starts
+  size_t nmarks;
+  size_t marks_cap;
+} pager;
+
+int pager_open(pager * p, const char * path);
+int pager_update(pager * p);
+void pager_progress(pager * p, size_t * indexed, unsigned long * lines);
+long pager_line_of(pager * p, size_t off);
+int pager_line_offset(pager * p, unsigned long line, size_t * off);
+size_t pager_line_start(pager * p, size_t off);
+size_t pager_next_line(pager * p, size_t off);
+size_t pager_prev_line(pager * p, size_t off);
+int pager_line(pager * p, size_t off, int skip, char * out, int width);
+int pager_find(pager * p, const char * needle, int fold, int backward, size_t * at, size_t limit);
+void pager_close(pager * p);
+
+#endif
@@ -0,0 +1,135 @@
+// Gopher - Fixed size worker pool
+//
+// The threads are started once and sleep between calls. pool_for()
+// hands out chunks of an index range to the workers and to the calling
+// thread, and returns when the whole range is done.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+// Claims and runs chunks until the range is exhausted
+static void run_chunks(work_pool * pool){
+  int begin, end;
+  while ((begin = __atomic_fetch_add(&pool->next, pool->chunk, __ATOMIC_RELAXED)) < pool->count){
+    end = begin + pool->chunk;
+    if (end > pool->count) end = pool->count;
+    pool->func(begin, end, pool->arg);
+  }
+}
+
+static void * worker(void * arg){
+  work_pool * pool = arg;
+  int seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  while (1){
+    while (!pool->shutdown && pool->generation == seen){
+      pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    if (pool->shutdown) break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    run_chunks(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->busy == 0) pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+// Starts nthreads workers. With 0 threads pool_for() runs inline.
+// Returns the number of threads started.
+int pool_init(work_pool * pool, int nthreads){
+  int i;
+
+  pool->nthreads = 0;
+  pool->generation = 0;
+  pool->busy = 0;
+  pool->shutdown = 0;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  if (nthreads < 1){
+    pool->threads = NULL;
+    return 0;
+  }
+  if ((pool->threads = calloc(nthreads, sizeof(pthread_t))) == NULL){
+    perror("calloc");
+    exit(errno);
+  }
+  for (i = 0; i < nthreads; i++){
+    if (pthread_create(&pool->threads[i], NULL, worker, pool)){
+      fprintf(stderr, "pool: started %d of %d threads\n", i, nthreads);
+      break;
+    }
+  }
+  pool->nthreads = i;
+  return i;
+}
+
+// Runs func over [0, count) in chunks of chunk entries, spread over the
+// workers and the calling thread. Blocks until every chunk is done.
+void pool_for(work_pool * pool, int count, int chunk, pool_func func, void * arg){
+  if (count <= 0) return;
+  if (chunk < 1) chunk = 1;
+  if (pool->nthreads == 0 || count <= chunk){
+    func(0, count, arg);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->func = func;
+  pool->arg = arg;
+  pool->count = count;
+  pool->chunk = chunk;
+  pool->next = 0;
+  pool->busy = pool->nthreads;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  run_chunks(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy > 0){
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Stops and joins the workers
+void pool_destroy(work_pool * pool){
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->nthreads; i++){
+    pthread_join(pool->threads[i], NULL);
+  }
+  free(pool->threads);
+  pool->threads = NULL;
+  pool->nthreads = 0;
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->done);
+}
+
+// Number of workers to use when none is configured. Stats mostly wait
+// on the filesystem, so this is twice the number of cores, up to 16.
+int pool_default_threads(){
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu < 1) ncpu = 1;
+  ncpu *= 2;
+  return ncpu > 16 ? 16 : ncpu;
+}
@@ -0,0 +1,33 @@
+// Gopher - Fixed size worker pool
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+// Processes entries [begin, end) of whatever arg points to
+typedef void (*pool_func)(int begin, int end, void * arg);
+
+typedef struct {
+  pthread_t * threads;
+  int nthreads;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  int generation;   // bumped for every pool_for() call
+  int busy;         // workers still on the current call
+  int shutdown;
+
+  pool_func func;
+  void * arg;
+  int count;
+  int chunk;
+  int next;         // next unclaimed index, taken atomically
+} work_pool;
+
+int pool_init(work_pool * pool, int nthreads);
+void pool_for(work_pool * pool, int count, int chunk, pool_func func, void * arg);
+void pool_destroy(work_pool * pool);
+int pool_default_threads();
+
+#endif
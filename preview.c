@@ -0,0 +1,331 @@
+// Gopher - Background previews of the highlighted entry
+//
+// A file is previewed from its first PREVIEW_WINDOW bytes only, read
+// into a buffer kept by the loader, so a big file costs no more than a
+// small one. Text shows as lines, binary files as a hex dump. A
+// directory shows how many entries of each kind it has, counted from
+// the types readdir() gives without a stat each. Holding a key down
+// requests a preview per entry passed, and every request stops the
+// load before it.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "preview.h"
+#include "bytes.h"
+
+#define HEX_ROW 8               // bytes per line of a hex dump
+#define TAB_WIDTH 8
+#define DIR_COUNT_MAX 200000    // entries counted before giving up
+
+typedef struct {
+  char * text;
+  size_t len;
+  size_t cap;
+} line_buf;
+
+static void add_bytes(line_buf * b, const char * s, size_t len){
+  if (b->len + len + 1 > b->cap){
+    b->cap = b->len + len + 1 > b->cap * 2 ? b->len + len + 1 : b->cap * 2;
+    if ((b->text = realloc(b->text, b->cap)) == NULL){
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  memcpy(b->text + b->len, s, len);
+  b->len += len;
+}
+
+// Adds one line, tabs expanded and other control characters as dots
+static void add_line(preview * pv, line_buf * b, const char * s, size_t len){
+  char line[PREVIEW_COLS + TAB_WIDTH];
+  size_t i, n = 0;
+
+  for (i = 0; i < len && n < PREVIEW_COLS; i++){
+    if (s[i] == '\t'){
+      do line[n++] = ' '; while (n % TAB_WIDTH);
+    } else if (s[i] == '\r' && i == len - 1){
+      break;
+    } else {
+      line[n++] = (unsigned char) s[i] < 32 || s[i] == 127 ? '.' : s[i];
+    }
+  }
+  if (n > PREVIEW_COLS) n = PREVIEW_COLS;
+  add_bytes(b, line, n);
+  add_bytes(b, "", 1);
+  pv->nlines++;
+}
+
+static void text_lines(preview_engine * p, preview * pv, line_buf * b, const char * buf, size_t len){
+  const char * pos = buf, * end = buf + len, * nl;
+
+  while (pos < end && pv->nlines < PREVIEW_LINES && !p->cancel){
+    if ((nl = memchr(pos, '\n', end - pos)) == NULL) nl = end;
+    add_line(pv, b, pos, nl - pos);
+    pos = nl + 1;
+  }
+}
+
+static void hex_lines(preview_engine * p, preview * pv, line_buf * b, const char * buf, size_t len){
+  char line[PREVIEW_COLS];
+  size_t off, i;
+  int n;
+
+  for (off = 0; off < len && pv->nlines < PREVIEW_LINES && !p->cancel; off += HEX_ROW){
+    n = sprintf(line, "%06zx ", off);
+    for (i = 0; i < HEX_ROW; i++){
+      if (off + i < len){
+	n += sprintf(line + n, " %02x", (unsigned char) buf[off + i]);
+      } else {
+	n += sprintf(line + n, "   ");
+      }
+    }
+    n += sprintf(line + n, "  ");
+    for (i = 0; i < HEX_ROW && off + i < len; i++){
+      line[n++] = buf[off + i] >= 32 && buf[off + i] < 127 ? buf[off + i] : '.';
+    }
+    add_line(pv, b, line, n);
+  }
+}
+
+static void load_file(preview_engine * p, preview * pv, line_buf * b, const char * path){
+  struct stat st;
+  ssize_t len;
+  int fd, binary;
+
+  if ((fd = open(path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC)) < 0 || fstat(fd, &st)){
+    snprintf(pv->info, MAXLEN, "%s", strerror(errno));
+    if (fd >= 0) close(fd);
+    return;
+  }
+  if (!S_ISREG(st.st_mode) || !st.st_size){
+    snprintf(pv->info, MAXLEN, "empty");
+    close(fd);
+    return;
+  }
+  // A file cut short meanwhile just reads less
+  while ((len = pread(fd, p->window, PREVIEW_WINDOW, 0)) < 0 && errno == EINTR);
+  close(fd);
+  if (len < 0){
+    snprintf(pv->info, MAXLEN, "%s", strerror(errno));
+    return;
+  }
+
+  binary = bytes_binary(p->window, len);
+  snprintf(pv->info, MAXLEN, "%s, %.1fkb", binary ? "binary" : "text", ((float) st.st_size) / 1024);
+  if (binary){
+    hex_lines(p, pv, b, p->window, len);
+  } else {
+    text_lines(p, pv, b, p->window, len);
+  }
+}
+
+static void load_dir(preview_engine * p, preview * pv, line_buf * b, const char * path){
+  static const char * kinds[] = {"directories", "files", "links", "other"};
+  unsigned long counts[4] = {0, 0, 0, 0}, total = 0;
+  struct dirent * de;
+  struct stat st;
+  char line[MAXLEN];
+  DIR * d;
+  int i, kind, type;
+
+  if ((d = opendir(path)) == NULL){
+    snprintf(pv->info, MAXLEN, "%s", strerror(errno));
+    return;
+  }
+  while (total < DIR_COUNT_MAX && !p->cancel && (de = readdir(d)) != NULL){
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+    type = de->d_type;
+    if (type == DT_UNKNOWN && !fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW)){
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+    }
+    kind = type == DT_DIR ? 0 : type == DT_REG ? 1 : type == DT_LNK ? 2 : 3;
+    counts[kind]++;
+    total++;
+  }
+  closedir(d);
+
+  snprintf(pv->info, MAXLEN, "%lu%s entries", total, total == DIR_COUNT_MAX ? "+" : "");
+  for (i = 0; i < 4; i++){
+    if (!counts[i]) continue;
+    snprintf(line, MAXLEN, "%8lu %s", counts[i], kinds[i]);
+    add_line(pv, b, line, strlen(line));
+  }
+}
+
+// Builds the preview of path. A symbolic link shows its target and the
+// preview of what it points to.
+static preview * load(preview_engine * p, const char * path, time_t mod_time, size_t bytes){
+  char target[MAXLEN - 3];    // room for "-> " in front of it
+  line_buf b = {NULL, 0, 0};
+  struct stat st;
+  preview * pv;
+  ssize_t len;
+
+  if ((pv = calloc(1, sizeof(preview))) == NULL){
+    perror("calloc");
+    exit(errno);
+  }
+  snprintf(pv->path, MAXLEN, "%s", path);
+  pv->mod_time = mod_time;
+  pv->bytes = bytes;
+
+  if (lstat(path, &st)){
+    snprintf(pv->info, MAXLEN, "%s", strerror(errno));
+  } else {
+    if (S_ISLNK(st.st_mode)){
+      len = readlink(path, target, sizeof(target) - 1);
+      target[len < 0 ? 0 : len] = 0;
+      snprintf(pv->info, MAXLEN, "-> %s", target);
+      add_line(pv, &b, pv->info, strlen(pv->info));
+      if (stat(path, &st)) st.st_mode = 0;
+    }
+    if (S_ISDIR(st.st_mode)){
+      load_dir(p, pv, &b, path);
+    } else if (S_ISREG(st.st_mode)){
+      load_file(p, pv, &b, path);
+    } else if (!S_ISLNK(st.st_mode) && st.st_mode){
+      snprintf(pv->info, MAXLEN, "%s", S_ISFIFO(st.st_mode) ? "fifo" : S_ISSOCK(st.st_mode) ? "socket" :
+	       S_ISCHR(st.st_mode) ? "character device" : S_ISBLK(st.st_mode) ? "block device" : "special file");
+    }
+  }
+  if (!b.text) add_bytes(&b, "", 0);
+  pv->text = b.text;
+  return pv;
+}
+
+// Takes requests one at a time, the latest only
+static void * preview_main(void * arg){
+  preview_engine * p = arg;
+  char path[MAXLEN];
+  unsigned generation;
+  time_t mod_time;
+  size_t bytes;
+  preview * pv;
+
+  pthread_mutex_lock(&p->lock);
+  while (1){
+    while (!p->shutdown && !p->requested){
+      pthread_cond_wait(&p->wake, &p->lock);
+    }
+    if (p->shutdown) break;
+    strcpy(path, p->path);
+    mod_time = p->mod_time;
+    bytes = p->bytes;
+    generation = p->generation;
+    p->requested = 0;
+    p->cancel = 0;
+    pthread_mutex_unlock(&p->lock);
+
+    pv = load(p, path, mod_time, bytes);
+
+    pthread_mutex_lock(&p->lock);
+    if (generation == p->generation){
+      preview_free(p->ready);
+      p->ready = pv;
+      if (write(p->notify[1], "p", 1) < 0 && errno != EAGAIN) perror("preview: write");
+    } else {
+      preview_free(pv);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+int preview_init(preview_engine * p){
+  sigset_t all, old;
+  int ret = 0;
+
+  memset(p, 0, sizeof(preview_engine));
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  if ((p->window = malloc(PREVIEW_WINDOW)) == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  if (pipe2(p->notify, O_NONBLOCK | O_CLOEXEC)){
+    perror("pipe");
+    exit(errno);
+  }
+
+  // Signals must keep landing on the UI thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  if (pthread_create(&p->thread, NULL, preview_main, p)){
+    fprintf(stderr, "preview: can't start the loader\n");
+    ret = -1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return ret;
+}
+
+// Stops the running load and drops a preview not yet taken. The lock
+// must be held.
+static void drop_request(preview_engine * p){
+  p->requested = 0;
+  p->generation++;
+  p->cancel = 1;
+  preview_free(p->ready);
+  p->ready = NULL;
+}
+
+// Previews path, in place of whatever was being loaded. mod_time and
+// bytes are what the listing knows of it, kept with the preview to
+// tell later whether it is still current.
+void preview_request(preview_engine * p, const char * path, time_t mod_time, size_t bytes){
+  pthread_mutex_lock(&p->lock);
+  drop_request(p);
+  snprintf(p->path, MAXLEN, "%s", path);
+  p->mod_time = mod_time;
+  p->bytes = bytes;
+  p->requested = 1;
+  pthread_cond_signal(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+}
+
+void preview_cancel(preview_engine * p){
+  pthread_mutex_lock(&p->lock);
+  drop_request(p);
+  pthread_mutex_unlock(&p->lock);
+}
+
+// Takes the preview of the last request, NULL if it isn't ready. The
+// caller frees it with preview_free().
+preview * preview_take(preview_engine * p){
+  char buf[64];
+  preview * pv;
+
+  while (read(p->notify[0], buf, sizeof(buf)) > 0);
+  pthread_mutex_lock(&p->lock);
+  pv = p->ready;
+  p->ready = NULL;
+  pthread_mutex_unlock(&p->lock);
+  return pv;
+}
+
+void preview_free(preview * pv){
+  if (!pv) return;
+  free(pv->text);
+  free(pv);
+}
+
+void preview_destroy(preview_engine * p){
+  pthread_mutex_lock(&p->lock);
+  drop_request(p);
+  p->shutdown = 1;
+  pthread_cond_signal(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+  pthread_join(p->thread, NULL);
+
+  close(p->notify[0]);
+  close(p->notify[1]);
+  free(p->window);
+}
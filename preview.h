@@ -0,0 +1,55 @@
+// Gopher - Background previews of the highlighted entry
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "gopher.h"
+
+// Most of a file that is read to preview it
+#define PREVIEW_WINDOW (64 << 10)
+// Lines kept of a preview, and characters of a line
+#define PREVIEW_LINES 100
+#define PREVIEW_COLS 160
+
+// What an entry looked like, the lines shown for it and what it was
+// made from
+typedef struct {
+  char path[MAXLEN];
+  time_t mod_time;        // of the entry when it was requested
+  size_t bytes;
+  char info[MAXLEN];      // what it is, as one line
+  char * text;            // the lines, each ended by a NUL
+  int nlines;
+  unsigned used;          // when it was last shown, for the cache
+} preview;
+
+// Loads one preview at a time on a thread of its own. A new request
+// replaces the one before, which stops early.
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int shutdown;
+
+  char path[MAXLEN];      // the request
+  time_t mod_time;
+  size_t bytes;
+  int requested;
+  unsigned generation;    // bumped by every request and cancel
+  volatile int cancel;    // the running load is stale
+
+  char * window;          // PREVIEW_WINDOW bytes the loader reads into
+  preview * ready;        // loaded and not yet taken
+  int notify[2];          // readable whenever a preview is ready
+} preview_engine;
+
+int preview_init(preview_engine * p);
+void preview_request(preview_engine * p, const char * path, time_t mod_time, size_t bytes);
+void preview_cancel(preview_engine * p);
+preview * preview_take(preview_engine * p);
+void preview_free(preview * pv);
+void preview_destroy(preview_engine * p);
+
+#endif
@@ -0,0 +1,244 @@
+// Gopher - Progress of long running file operations
+//
+// Engines count what they have done and call progress_tick() often.
+// The report function only runs every REPORT_INTERVAL seconds, so the
+// ticks are cheap. A plan walked before the operation gives the totals
+// that percentages and the ETA are measured against.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "progress.h"
+
+#define REPORT_INTERVAL 0.1
+
+// Rates are resampled at most this often, and each sample counts for
+// RATE_WEIGHT of the smoothed rate
+#define SAMPLE_INTERVAL 0.5
+#define RATE_WEIGHT 0.3
+
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns a monotonic timestamp in seconds
+double progress_now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void progress_init(op_progress * prog, progress_func report, void * arg){
+  memset(prog, 0, sizeof(op_progress));
+  prog->report = report;
+  prog->arg = arg;
+  prog->started = progress_now();
+  prog->last_report = prog->started;
+}
+
+void progress_add(op_progress * prog, long long entries, long long bytes){
+  if (entries) __atomic_fetch_add(&prog->entries, entries, __ATOMIC_RELAXED);
+  if (bytes) __atomic_fetch_add(&prog->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// Logs a failure on path. The first one is kept for the user.
+void progress_error(op_progress * prog, const char * path, int err){
+  fprintf(stderr, "%s: %s\n", path, strerror(err));
+  pthread_mutex_lock(&error_lock);
+  if (prog->errors++ == 0){
+    snprintf(prog->first_error, MAXLEN, "%s: %s", path, strerror(err));
+  }
+  pthread_mutex_unlock(&error_lock);
+}
+
+// Calls the report function if it is due. Only the thread that started
+// the operation may tick.
+void progress_tick(op_progress * prog){
+  double t;
+  if (!prog->report) return;
+  t = progress_now();
+  if (t - prog->last_report < REPORT_INTERVAL) return;
+  prog->last_report = t;
+  prog->report(prog);
+}
+
+// Counts the entries below the directory dfd, and their bytes
+static void plan_dir(op_progress * prog, int dfd, int with_bytes){
+  struct dirent * ent;
+  struct stat st;
+  DIR * dir;
+  int fd;
+
+  if ((dir = fdopendir(dfd)) == NULL){
+    close(dfd);
+    return;
+  }
+  while ((ent = readdir(dir)) != NULL && !prog->cancel){
+    if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+    prog->total_entries++;
+    if (ent->d_type == DT_UNKNOWN || (with_bytes && ent->d_type == DT_REG)){
+      if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW)) continue;
+      if (S_ISREG(st.st_mode) && with_bytes) prog->total_bytes += st.st_size;
+      if (!S_ISDIR(st.st_mode)) continue;
+    } else if (ent->d_type != DT_DIR){
+      continue;
+    }
+    fd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0) plan_dir(prog, fd, with_bytes);
+  }
+  closedir(dir);
+}
+
+// Adds the tree at path to the totals of an operation. Entries are
+// counted the way the engines count them. Bytes of regular files are
+// added up only if with_bytes is set. The totals grow as the walk goes,
+// so they can be shown meanwhile, with planning set by the caller.
+void progress_plan(op_progress * prog, const char * path, int with_bytes){
+  struct stat st;
+  int fd;
+
+  if (lstat(path, &st)) return;
+  prog->total_entries++;
+  if (S_ISREG(st.st_mode) && with_bytes) prog->total_bytes += st.st_size;
+  if (S_ISDIR(st.st_mode) && (fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) >= 0){
+    plan_dir(prog, fd, with_bytes);
+  }
+}
+
+// Ends planning. Rates are measured from here.
+void progress_start(op_progress * prog){
+  prog->planning = 0;
+  prog->started = progress_now();
+}
+
+// Updates the smoothed rates. Called by whoever shows the progress, as
+// often as it likes.
+void progress_sample(op_progress * prog){
+  double t = progress_now();
+  double dt, entry_rate, byte_rate;
+  long long entries = prog->entries;
+  long long bytes = prog->bytes;
+
+  if (prog->planning) return;
+  if (prog->sampled_at == 0){
+    prog->sampled_at = prog->started;
+  }
+  dt = t - prog->sampled_at;
+  if (dt < SAMPLE_INTERVAL) return;
+
+  entry_rate = (entries - prog->sampled_entries) / dt;
+  byte_rate = (bytes - prog->sampled_bytes) / dt;
+  if (!prog->rated){
+    prog->entry_rate = entry_rate;
+    prog->byte_rate = byte_rate;
+    prog->rated = 1;
+  } else {
+    prog->entry_rate += RATE_WEIGHT * (entry_rate - prog->entry_rate);
+    prog->byte_rate += RATE_WEIGHT * (byte_rate - prog->byte_rate);
+  }
+  prog->sampled_at = t;
+  prog->sampled_entries = entries;
+  prog->sampled_bytes = bytes;
+}
+
+// Time to finish what is left of total at rate. -1 if unknown.
+static double time_left(long long done, long long total, double rate){
+  if (done >= total) return 0;
+  if (rate <= 0) return -1;
+  return (total - done) / rate;
+}
+
+// Seconds left at the current rates, or -1 if there is no telling.
+// Data and entries are timed apart and the slower one wins, so a tree
+// of small files after one big file isn't reported done too early.
+double progress_eta(op_progress * prog){
+  double bytes_left = 0, entries_left = 0;
+
+  if (prog->planning || !prog->rated) return -1;
+  if (prog->total_entries <= 0 && prog->total_bytes <= 0) return -1;
+  if (prog->total_bytes > 0){
+    bytes_left = time_left(prog->bytes, prog->total_bytes, prog->byte_rate);
+  }
+  // An archive being extracted only knows its size up front
+  if (prog->total_entries > 0){
+    entries_left = time_left(prog->entries, prog->total_entries, prog->entry_rate);
+  }
+  if (bytes_left < 0 || entries_left < 0) return -1;
+  return bytes_left > entries_left ? bytes_left : entries_left;
+}
+
+static void format_bytes(double bytes, char * buf, size_t len){
+  if (bytes >= 1024.0 * 1024 * 1024){
+    snprintf(buf, len, "%.1fGB", bytes / (1024.0 * 1024 * 1024));
+  } else if (bytes >= 1024 * 1024){
+    snprintf(buf, len, "%.1fMB", bytes / (1024 * 1024));
+  } else {
+    snprintf(buf, len, "%.0fKB", bytes / 1024);
+  }
+}
+
+// Describes the progress in one line: done against planned, the rates
+// and the ETA
+void progress_format(op_progress * prog, char * buf, size_t len){
+  char done[32], total[32], rate[32], eta[32] = "";
+  double left, percent;
+  size_t n;
+
+  if (prog->planning){
+    format_bytes(prog->total_bytes, total, sizeof(total));
+    if (prog->total_bytes > 0){
+      snprintf(buf, len, "sizing... %lld files, %s", prog->total_entries, total);
+    } else {
+      snprintf(buf, len, "sizing... %lld files", prog->total_entries);
+    }
+    return;
+  }
+
+  if ((left = progress_eta(prog)) >= 0){
+    snprintf(eta, sizeof(eta), ", ETA %d:%02d", (int) left / 60, (int) left % 60);
+  }
+  if (prog->total_bytes > 0){
+    format_bytes(prog->bytes, done, sizeof(done));
+    format_bytes(prog->total_bytes, total, sizeof(total));
+    percent = 100.0 * prog->bytes / prog->total_bytes;
+    if (prog->total_entries > 0){
+      n = snprintf(buf, len, "%s of %s (%.0f%%), %lld of %lld files", done, total,
+                   percent > 100 ? 100 : percent, prog->entries, prog->total_entries);
+    } else {
+      n = snprintf(buf, len, "%s of %s (%.0f%%), %lld files", done, total,
+                   percent > 100 ? 100 : percent, prog->entries);
+    }
+    if (prog->rated && n < len){
+      format_bytes(prog->byte_rate, rate, sizeof(rate));
+      snprintf(buf + n, len - n, ", %s/s, %.0f files/s%s", rate, prog->entry_rate, eta);
+    }
+  } else if (prog->total_entries > 0){
+    percent = 100.0 * prog->entries / prog->total_entries;
+    n = snprintf(buf, len, "%lld of %lld files (%.0f%%)", prog->entries, prog->total_entries,
+                 percent > 100 ? 100 : percent);
+    if (prog->rated && n < len) snprintf(buf + n, len - n, ", %.0f files/s%s", prog->entry_rate, eta);
+  } else {
+    format_bytes(prog->bytes, done, sizeof(done));
+    snprintf(buf, len, "%lld files, %s", prog->entries, done);
+  }
+}
+
+// Describes a finished operation: how much, how long and how fast
+void progress_summary(op_progress * prog, char * buf, size_t len){
+  char done[32], rate[32];
+  double elapsed = progress_now() - prog->started;
+
+  if (elapsed < 0.001) elapsed = 0.001;
+  if (prog->bytes > 0){
+    format_bytes(prog->bytes, done, sizeof(done));
+    format_bytes(prog->bytes / elapsed, rate, sizeof(rate));
+    snprintf(buf, len, "Done, %lld files, %s in %.1fs (%s/s)", prog->entries, done, elapsed, rate);
+  } else {
+    snprintf(buf, len, "Done, %lld files in %.1fs (%.0f files/s)", prog->entries, elapsed, prog->entries / elapsed);
+  }
+}
@@ -0,0 +1,51 @@
+// Gopher - Progress of long running file operations
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include "gopher.h"
+
+struct op_progress;
+typedef void (*progress_func)(struct op_progress * prog);
+
+// Shared by the engine doing the work and whoever shows it. Counters
+// are updated atomically so worker threads can add to them.
+typedef struct op_progress {
+  long long entries;      // files, directories and links done
+  long long bytes;        // file data written
+  int errors;
+  char first_error[MAXLEN];
+  volatile int cancel;    // set to stop the operation early
+
+  // What the operation will do, from progress_plan(). Zero while
+  // unknown. total_bytes stays zero for operations that move no data.
+  long long total_entries;
+  long long total_bytes;
+  volatile int planning;
+
+  progress_func report;   // called now and then from the engine
+  void * arg;
+  double started;
+  double last_report;
+
+  // Smoothed rates, kept by whoever shows the progress
+  double sampled_at;
+  long long sampled_entries;
+  long long sampled_bytes;
+  double entry_rate;
+  double byte_rate;
+  int rated;              // the rates were measured at least once
+} op_progress;
+
+void progress_init(op_progress * prog, progress_func report, void * arg);
+void progress_add(op_progress * prog, long long entries, long long bytes);
+void progress_error(op_progress * prog, const char * path, int err);
+void progress_tick(op_progress * prog);
+void progress_plan(op_progress * prog, const char * path, int with_bytes);
+void progress_start(op_progress * prog);
+void progress_sample(op_progress * prog);
+double progress_eta(op_progress * prog);
+void progress_format(op_progress * prog, char * buf, size_t len);
+void progress_summary(op_progress * prog, char * buf, size_t len);
+double progress_now();
+
+#endif
@@ -0,0 +1,115 @@
+// Gopher - Single pass directory scanner
+//
+// Reads a whole directory with getdents64 into one growable buffer
+// through a directory fd. The fd is kept open so entries can be
+// stat'ed with fstatat() independent of the process cwd.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+
+#include "scan.h"
+
+#define SCAN_CHUNK (64 * 1024)
+
+// Layout of the records returned by getdents64
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+void scan_init(dir_scan * scan){
+  memset(scan, 0, sizeof(dir_scan));
+  scan->dirfd = -1;
+}
+
+// Reads every record of the directory into scan->buf.
+// Returns 0 on success, -1 on error.
+static int read_records(dir_scan * scan){
+  long nread;
+
+  scan->buflen = 0;
+  while (1){
+    if (scan->bufcap - scan->buflen < SCAN_CHUNK){
+      size_t newcap = scan->bufcap ? scan->bufcap * 2 : SCAN_CHUNK * 2;
+      char * newbuf = realloc(scan->buf, newcap);
+      if (newbuf == NULL){
+        perror("realloc");
+        exit(errno);
+      }
+      scan->buf = newbuf;
+      scan->bufcap = newcap;
+    }
+    nread = syscall(SYS_getdents64, scan->dirfd, scan->buf + scan->buflen, scan->bufcap - scan->buflen);
+    if (nread < 0) return -1;
+    if (nread == 0) return 0;
+    scan->buflen += nread;
+  }
+}
+
+// Builds the entry table from the raw records, skipping "."
+static void index_records(dir_scan * scan){
+  size_t pos = 0;
+  struct linux_dirent64 * d;
+
+  scan->count = 0;
+  while (pos < scan->buflen){
+    d = (struct linux_dirent64 *) (scan->buf + pos);
+    pos += d->d_reclen;
+    if (d->d_name[0] == '.' && d->d_name[1] == 0) continue;
+
+    if (scan->count == scan->cap){
+      int newcap = scan->cap ? scan->cap * 2 : 256;
+      scan_entry * newentries = realloc(scan->entries, newcap * sizeof(scan_entry));
+      if (newentries == NULL){
+        perror("realloc");
+        exit(errno);
+      }
+      scan->entries = newentries;
+      scan->cap = newcap;
+    }
+    scan->entries[scan->count].name = d->d_name;
+    scan->entries[scan->count].namelen = strlen(d->d_name);
+    scan->entries[scan->count].d_type = d->d_type;
+    scan->entries[scan->count].ino = d->d_ino;
+    scan->count++;
+  }
+}
+
+// Scans a directory in a single pass.
+// Returns the number of entries (excluding "."), or -1 on error.
+int scan_dir(dir_scan * scan, const char * path){
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0){
+    return -1;
+  }
+  if (scan->dirfd >= 0) close(scan->dirfd);
+  scan->dirfd = fd;
+  scan->count = 0;
+  fstat(fd, &scan->dir_st);
+
+  if (read_records(scan) < 0){
+    return -1;
+  }
+  index_records(scan);
+  return scan->count;
+}
+
+// Closes the directory and frees the scan buffers
+void scan_destroy(dir_scan * scan){
+  if (scan->dirfd >= 0) close(scan->dirfd);
+  free(scan->buf);
+  free(scan->entries);
+  scan_init(scan);
+}
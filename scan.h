@@ -0,0 +1,34 @@
+// Gopher - Single pass directory scanner
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// One entry of a scanned directory. name points into the scan buffer.
+typedef struct {
+  char * name;
+  unsigned short namelen;
+  unsigned char d_type;
+  ino_t ino;
+} scan_entry;
+
+// A scanned directory. The buffers are kept between scans and only grow.
+typedef struct {
+  int dirfd;           // fd of the scanned directory, for fstatat()
+  struct stat dir_st;  // the directory itself, taken before reading it
+
+  char * buf;          // raw getdents64 records
+  size_t buflen;
+  size_t bufcap;
+
+  scan_entry * entries;
+  int count;
+  int cap;
+} dir_scan;
+
+void scan_init(dir_scan * scan);
+int scan_dir(dir_scan * scan, const char * path);
+void scan_destroy(dir_scan * scan);
+
+#endif
@@ -0,0 +1,429 @@
+// Gopher - Listing sort engine
+//
+// Keys are pulled out of the entries once instead of being chased
+// through file_info pointers on every comparison. Names are turned
+// into strxfrm() collation keys of their lower cased form, so they
+// compare with strcmp(), and mostly on an 8 byte prefix alone. Names
+// are merge sorted. Sizes and dates are radix sorted, and runs of
+// equal ones are then put in name order. Long listings are sorted in
+// parts on the worker pool and merged.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "sort.h"
+
+// Runs shorter than this are insertion sorted before merging
+#define SORT_RUN 16
+
+typedef int (*rec_cmp)(const sort_rec * a, const sort_rec * b);
+
+// A piece of a merge: two sorted runs of src into dst at out
+typedef struct {
+  int a, a_end;
+  int b, b_end;
+  int out;
+} merge_task;
+
+// State of one sort_entries() call shared with the workers
+typedef struct {
+  sorter * s;
+  file_info ** list;
+  int count;
+  int parts;
+  const sort_order * order;
+
+  rec_cmp cmp;
+  sort_rec * src;
+  sort_rec * dst;
+  merge_task tasks[2 * SORT_MAX_PARTS];
+} sort_job;
+
+void sorter_init(sorter * s){
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  memset(s, 0, sizeof(sorter));
+  s->parallel_min = SORT_PARALLEL_MIN;
+  s->max_parts = ncpu < 1 ? 1 : ncpu > SORT_MAX_PARTS ? SORT_MAX_PARTS : ncpu;
+}
+
+// Lower cases name into buf, as the name sort has always compared them
+static void fold_name(char * buf, const char * name){
+  int i;
+  for (i = 0; name[i] && i < NAME_MAX; i++){
+    buf[i] = tolower((unsigned char) name[i]);
+  }
+  buf[i] = 0;
+}
+
+// Appends the collation key of name to keys. Returns its offset.
+static size_t add_name_key(sort_keys * keys, const char * name){
+  char folded[NAME_MAX + 1];
+  size_t len, off = keys->len;
+
+  fold_name(folded, name);
+  while (1){
+    len = strxfrm(keys->buf + off, folded, keys->cap - off);
+    if (len < keys->cap - off) break;
+    keys->cap = keys->cap ? keys->cap * 2 : 64 * 1024;
+    if (keys->cap - off <= len) keys->cap = off + len + 1;
+    if ((keys->buf = realloc(keys->buf, keys->cap)) == NULL){
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  keys->len = off + len + 1;
+  return off;
+}
+
+// Packs the first 8 bytes of a key so that comparing the numbers
+// compares the bytes like strcmp() would
+static uint64_t key_prefix(const char * key){
+  uint64_t prefix = 0;
+  int i;
+  for (i = 0; i < 8; i++){
+    prefix <<= 8;
+    if (*key) prefix |= (unsigned char) *key++;
+  }
+  return prefix;
+}
+
+static int rec_name_cmp(const sort_rec * a, const sort_rec * b){
+  int ret;
+  if (a->prefix != b->prefix) return a->prefix < b->prefix ? -1 : 1;
+  if ((ret = strcmp(a->name, b->name))) return ret;
+  return strcmp(a->fi->name, b->fi->name);
+}
+
+// Orders by size or date, then by name
+static int rec_key_cmp(const sort_rec * a, const sort_rec * b){
+  if (a->key != b->key) return a->key < b->key ? -1 : 1;
+  return rec_name_cmp(a, b);
+}
+
+// Bottom up merge sort of src[0, count) by name, using dst as scratch.
+// Returns the buffer that ends up sorted.
+static sort_rec * merge_sort_names(sort_rec * src, sort_rec * dst, int count){
+  sort_rec * swap;
+  sort_rec rec;
+  int width, lo, mid, hi, i, j, k;
+
+  for (lo = 0; lo < count; lo += SORT_RUN){
+    hi = lo + SORT_RUN < count ? lo + SORT_RUN : count;
+    for (i = lo + 1; i < hi; i++){
+      rec = src[i];
+      for (j = i; j > lo && rec_name_cmp(&rec, &src[j - 1]) < 0; j--){
+        src[j] = src[j - 1];
+      }
+      src[j] = rec;
+    }
+  }
+
+  for (width = SORT_RUN; width < count; width *= 2){
+    for (lo = 0; lo < count; lo += 2 * width){
+      mid = lo + width < count ? lo + width : count;
+      hi = lo + 2 * width < count ? lo + 2 * width : count;
+      i = lo;
+      j = mid;
+      k = lo;
+      while (i < mid && j < hi){
+        dst[k++] = rec_name_cmp(&src[j], &src[i]) < 0 ? src[j++] : src[i++];
+      }
+      while (i < mid) dst[k++] = src[i++];
+      while (j < hi) dst[k++] = src[j++];
+    }
+    swap = src;
+    src = dst;
+    dst = swap;
+  }
+  return src;
+}
+
+// Stable LSD radix sort of src[0, count) on key, one byte per pass,
+// using dst as scratch. Bytes that are the same for every entry are
+// skipped. Returns the buffer that ends up sorted.
+static sort_rec * radix_sort_keys(sort_rec * src, sort_rec * dst, int count){
+  size_t hist[8][256];
+  sort_rec * swap;
+  size_t pos, n;
+  int pass, i, b;
+
+  memset(hist, 0, sizeof(hist));
+  for (i = 0; i < count; i++){
+    for (pass = 0; pass < 8; pass++){
+      hist[pass][(src[i].key >> (pass * 8)) & 0xff]++;
+    }
+  }
+
+  for (pass = 0; pass < 8; pass++){
+    if (hist[pass][(src[0].key >> (pass * 8)) & 0xff] == (size_t) count) continue;
+    pos = 0;
+    for (b = 0; b < 256; b++){
+      n = hist[pass][b];
+      hist[pass][b] = pos;
+      pos += n;
+    }
+    for (i = 0; i < count; i++){
+      dst[hist[pass][(src[i].key >> (pass * 8)) & 0xff]++] = src[i];
+    }
+    swap = src;
+    src = dst;
+    dst = swap;
+  }
+  return src;
+}
+
+// First entry of part p
+static int part_start(sort_job * job, int p){
+  return (int) ((long long) job->count * p / job->parts);
+}
+
+// Sorts src[0, count) by name, leaving the result in src
+static void sort_names(sort_rec * src, sort_rec * tmp, int count){
+  sort_rec * sorted = merge_sort_names(src, tmp, count);
+  if (sorted != src) memcpy(src, sorted, count * sizeof(sort_rec));
+}
+
+// Pulls the keys out of a part of the listing and sorts it. Sizes and
+// dates are radix sorted, then runs of equal ones are put in name order.
+static void sort_part(int begin, int end, void * arg){
+  sort_job * job = arg;
+  sort_keys * keys;
+  sort_rec * recs, * tmp, * sorted;
+  file_info * fi;
+  int p, lo, n, i, j;
+
+  for (p = begin; p < end; p++){
+    lo = part_start(job, p);
+    n = part_start(job, p + 1) - lo;
+    recs = job->s->recs + lo;
+    tmp = job->s->tmp + lo;
+    keys = &job->s->keys[p];
+
+    keys->len = 0;
+    for (i = 0; i < n; i++){
+      recs[i].fi = job->list[lo + i];
+      recs[i].key = add_name_key(keys, recs[i].fi->name);
+    }
+    // The key buffer is final now, so the records can point into it
+    for (i = 0; i < n; i++){
+      recs[i].name = keys->buf + recs[i].key;
+      recs[i].prefix = key_prefix(recs[i].name);
+    }
+
+    if (job->order->key == SORT_NAME){
+      sort_names(recs, tmp, n);
+      continue;
+    }
+
+    for (i = 0; i < n; i++){
+      fi = recs[i].fi;
+      if (job->order->key == SORT_SIZE){
+        recs[i].key = fi->bytes;
+      } else {
+        // Flipping the sign bit orders signed times as unsigned
+        recs[i].key = (uint64_t) fi->mod_time ^ (1ULL << 63);
+      }
+    }
+    sorted = radix_sort_keys(recs, tmp, n);
+    if (sorted != recs) memcpy(recs, sorted, n * sizeof(sort_rec));
+    for (i = 0; i < n; i = j){
+      for (j = i + 1; j < n && recs[j].key == recs[i].key; j++);
+      if (j - i > 1) sort_names(recs + i, tmp + i, j - i);
+    }
+  }
+}
+
+static void merge_range(int begin, int end, void * arg){
+  sort_job * job = arg;
+  merge_task * t;
+  sort_rec * src = job->src, * dst = job->dst;
+  int i, j, k, n;
+
+  for (n = begin; n < end; n++){
+    t = &job->tasks[n];
+    i = t->a;
+    j = t->b;
+    k = t->out;
+    while (i < t->a_end && j < t->b_end){
+      dst[k++] = job->cmp(&src[j], &src[i]) < 0 ? src[j++] : src[i++];
+    }
+    while (i < t->a_end) dst[k++] = src[i++];
+    while (j < t->b_end) dst[k++] = src[j++];
+  }
+}
+
+// Number of entries of run a that come among the first k entries of
+// the merge of runs a and b
+static int co_rank(rec_cmp cmp, sort_rec * a, int m, sort_rec * b, int n, int k){
+  int lo = k > n ? k - n : 0;
+  int hi = k < m ? k : m;
+  int i;
+
+  while (lo < hi){
+    i = lo + (hi - lo) / 2;
+    if (cmp(&a[i], &b[k - i - 1]) <= 0){
+      lo = i + 1;
+    } else {
+      hi = i;
+    }
+  }
+  return lo;
+}
+
+// Merges the sorted parts of s->recs pairwise until one run is left.
+// Every merge is cut into independent pieces at co-ranks so that all
+// workers stay busy down to the last one.
+static void merge_parts(sort_job * job, rec_cmp cmp){
+  sorter * s = job->s;
+  sort_rec * swap;
+  int width, p, lo, mid, hi, pieces, piece, k, k_end, i, i_end, ntasks;
+
+  job->cmp = cmp;
+  for (width = 1; width < job->parts; width *= 2){
+    job->src = s->recs;
+    job->dst = s->tmp;
+    ntasks = 0;
+    pieces = 2 * width;
+    for (p = 0; p < job->parts; p += 2 * width){
+      lo = part_start(job, p);
+      mid = part_start(job, p + width < job->parts ? p + width : job->parts);
+      hi = part_start(job, p + 2 * width < job->parts ? p + 2 * width : job->parts);
+      for (piece = 0; piece < pieces; piece++){
+        k = (int) ((long long) (hi - lo) * piece / pieces);
+        k_end = (int) ((long long) (hi - lo) * (piece + 1) / pieces);
+        i = co_rank(cmp, s->recs + lo, mid - lo, s->recs + mid, hi - mid, k);
+        i_end = co_rank(cmp, s->recs + lo, mid - lo, s->recs + mid, hi - mid, k_end);
+        job->tasks[ntasks].a = lo + i;
+        job->tasks[ntasks].a_end = lo + i_end;
+        job->tasks[ntasks].b = mid + k - i;
+        job->tasks[ntasks].b_end = mid + k_end - i_end;
+        job->tasks[ntasks].out = lo + k;
+        ntasks++;
+      }
+    }
+    pool_for(s->pool, ntasks, 1, merge_range, job);
+    swap = s->recs;
+    s->recs = s->tmp;
+    s->tmp = swap;
+  }
+}
+
+// Moves directories ahead of files, keeping the order within each
+static void dirs_first(sorter * s, int count){
+  sort_rec * swap;
+  int i, k = 0;
+
+  for (i = 0; i < count; i++){
+    if (S_ISDIR(s->recs[i].fi->st_mode)) s->tmp[k++] = s->recs[i];
+  }
+  for (i = 0; i < count; i++){
+    if (!S_ISDIR(s->recs[i].fi->st_mode)) s->tmp[k++] = s->recs[i];
+  }
+  swap = s->recs;
+  s->recs = s->tmp;
+  s->tmp = swap;
+}
+
+// Sorts list in place. Sizes and dates have to be loaded already.
+// Long listings are cut into one part per core. The parts are sorted
+// on the pool, then merged, which gives the same order as sorting the
+// whole list at once.
+void sort_entries(sorter * s, file_info ** list, int count, const sort_order * order){
+  sort_job job;
+  int i;
+
+  if (count < 2) return;
+  if (count > s->cap){
+    free(s->recs);
+    free(s->tmp);
+    s->cap = count;
+    if ((s->recs = malloc(count * sizeof(sort_rec))) == NULL ||
+        (s->tmp = malloc(count * sizeof(sort_rec))) == NULL){
+      perror("malloc");
+      exit(errno);
+    }
+  }
+
+  job.s = s;
+  job.list = list;
+  job.count = count;
+  job.order = order;
+  job.parts = 1;
+  if (s->pool && s->pool->nthreads > 0 && count >= s->parallel_min){
+    job.parts = s->pool->nthreads + 1;
+    if (job.parts > s->max_parts) job.parts = s->max_parts;
+  }
+
+  if (job.parts > 1){
+    pool_for(s->pool, job.parts, 1, sort_part, &job);
+    merge_parts(&job, order->key == SORT_NAME ? rec_name_cmp : rec_key_cmp);
+  } else {
+    sort_part(0, 1, &job);
+  }
+
+  if (order->dirs_first) dirs_first(s, count);
+
+  for (i = 0; i < count; i++){
+    list[i] = s->recs[i].fi;
+  }
+  if (order->desc) sort_reverse(list, count, order);
+}
+
+static void reverse(file_info ** list, int count){
+  file_info * swap;
+  int i;
+  for (i = 0; i < count / 2; i++){
+    swap = list[i];
+    list[i] = list[count - 1 - i];
+    list[count - 1 - i] = swap;
+  }
+}
+
+// Turns a list sorted one way into the other way without comparing
+// anything. Directories stay ahead of files.
+void sort_reverse(file_info ** list, int count, const sort_order * order){
+  int dirs = 0;
+
+  if (order->dirs_first){
+    while (dirs < count && S_ISDIR(list[dirs]->st_mode)) dirs++;
+    reverse(list, dirs);
+  }
+  reverse(list + dirs, count - dirs);
+}
+
+// Compares two entries the way sort_entries() orders them, for
+// placing single entries in a sorted list
+int sort_compare(const sort_order * order, file_info * a, file_info * b){
+  char fa[NAME_MAX + 1], fb[NAME_MAX + 1];
+  int ret = 0;
+
+  if (order->dirs_first && S_ISDIR(a->st_mode) != S_ISDIR(b->st_mode)){
+    return S_ISDIR(a->st_mode) ? -1 : 1;
+  }
+  if (order->key == SORT_SIZE && a->bytes != b->bytes){
+    ret = a->bytes < b->bytes ? -1 : 1;
+  } else if (order->key == SORT_DATE && a->mod_time != b->mod_time){
+    ret = a->mod_time < b->mod_time ? -1 : 1;
+  } else {
+    // strcoll() orders like strcmp() on strxfrm() keys
+    fold_name(fa, a->name);
+    fold_name(fb, b->name);
+    if (!(ret = strcoll(fa, fb))) ret = strcmp(a->name, b->name);
+  }
+  return order->desc ? -ret : ret;
+}
+
+void sorter_destroy(sorter * s){
+  int p;
+  free(s->recs);
+  free(s->tmp);
+  for (p = 0; p < SORT_MAX_PARTS; p++){
+    free(s->keys[p].buf);
+  }
+  sorter_init(s);
+}
@@ -0,0 +1,63 @@
+// Gopher - Listing sort engine
+#ifndef SORT_H
+#define SORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "gopher.h"
+#include "pool.h"
+
+// Listings at least this long are sorted on the worker pool
+#define SORT_PARALLEL_MIN 65536
+#define SORT_MAX_PARTS 32
+
+typedef enum {
+  SORT_NAME,
+  SORT_SIZE,
+  SORT_DATE
+} sort_key;
+
+// How a listing is ordered. Ties on size or date fall back to the
+// name, and names that collate the same to strcmp(), so every entry
+// has exactly one place.
+typedef struct {
+  sort_key key;
+  int desc;
+  int dirs_first;
+} sort_order;
+
+// One entry with its keys pulled out of file_info
+typedef struct {
+  uint64_t key;       // size or date, ordered as unsigned
+  uint64_t prefix;    // first bytes of the collation key, big endian
+  const char * name;  // collation key of the name
+  file_info * fi;
+} sort_rec;
+
+// Collation keys of one part of the listing
+typedef struct {
+  char * buf;
+  size_t len;
+  size_t cap;
+} sort_keys;
+
+// Scratch space of the sort. Only grows, and is kept between sorts.
+typedef struct {
+  sort_rec * recs;
+  sort_rec * tmp;
+  int cap;
+  sort_keys keys[SORT_MAX_PARTS];
+
+  work_pool * pool;   // sorts long listings in parallel if set
+  int parallel_min;   // shortest listing sorted in parallel
+  int max_parts;      // most pieces to sort at once, one per core
+} sorter;
+
+void sorter_init(sorter * s);
+void sort_entries(sorter * s, file_info ** list, int count, const sort_order * order);
+void sort_reverse(file_info ** list, int count, const sort_order * order);
+int sort_compare(const sort_order * order, file_info * a, file_info * b);
+void sorter_destroy(sorter * s);
+
+#endif
@@ -0,0 +1,197 @@
+// Gopher - Batched statx through io_uring
+//
+// Queues IORING_OP_STATX for a whole listing and reaps completions in
+// batches, so a directory costs a handful of syscalls instead of one
+// per entry. Talks to the kernel directly, no liburing needed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params * p){
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Sets up a ring with depth slots. Returns -1 when the kernel has no
+// io_uring (or it is blocked), in which case the ring must not be used.
+int uring_init(uring * ring, unsigned depth){
+  struct io_uring_params p;
+  unsigned i;
+
+  memset(ring, 0, sizeof(uring));
+  memset(&p, 0, sizeof(p));
+  ring->fd = -1;
+
+  if ((ring->fd = sys_io_uring_setup(depth, &p)) < 0){
+    ring->fd = -1;
+    return -1;
+  }
+  ring->depth = p.sq_entries;
+
+  ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP){
+    if (ring->cq_map_len > ring->sq_map_len) ring->sq_map_len = ring->cq_map_len;
+    ring->cq_map_len = 0;
+  }
+
+  ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED) goto fail;
+  if (ring->cq_map_len){
+    ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED) goto fail;
+  } else {
+    ring->cq_map = ring->sq_map;
+  }
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) goto fail;
+
+  ring->sq_head = (unsigned *) ((char *) ring->sq_map + p.sq_off.head);
+  ring->sq_tail = (unsigned *) ((char *) ring->sq_map + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) ((char *) ring->sq_map + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) ((char *) ring->sq_map + p.sq_off.array);
+  ring->cq_head = (unsigned *) ((char *) ring->cq_map + p.cq_off.head);
+  ring->cq_tail = (unsigned *) ((char *) ring->cq_map + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) ((char *) ring->cq_map + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_map + p.cq_off.cqes);
+
+  ring->bufs = calloc(ring->depth, sizeof(struct statx));
+  ring->slot_index = calloc(ring->depth, sizeof(int));
+  ring->free_slots = calloc(ring->depth, sizeof(int));
+  if (!ring->bufs || !ring->slot_index || !ring->free_slots){
+    perror("calloc");
+    exit(errno);
+  }
+  for (i = 0; i < ring->depth; i++){
+    ring->free_slots[i] = i;
+  }
+  ring->n_free = ring->depth;
+  return 0;
+
+ fail:
+  if (ring->sq_map == MAP_FAILED) ring->sq_map = NULL;
+  if (ring->cq_map == MAP_FAILED) ring->cq_map = NULL;
+  if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+  uring_destroy(ring);
+  return -1;
+}
+
+// Queues a statx of name for entry index in a free slot
+static void queue_statx(uring * ring, int dirfd, const char * name, int index){
+  unsigned tail = *ring->sq_tail;
+  unsigned pos = tail & *ring->sq_mask;
+  int slot = ring->free_slots[--ring->n_free];
+  struct io_uring_sqe * sqe = &ring->sqes[pos];
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = dirfd;
+  sqe->addr = (unsigned long) name;
+  sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+  sqe->off = (unsigned long) &ring->bufs[slot];
+  sqe->statx_flags = 0;
+  sqe->user_data = slot;
+
+  ring->slot_index[slot] = index;
+  ring->sq_array[pos] = pos;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Hands every available completion to done and frees its slot.
+// Returns the number reaped.
+static int reap(uring * ring, uring_statx_done done, void * arg){
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  struct io_uring_cqe * cqe;
+  int slot, n = 0;
+
+  while (head != tail){
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    slot = cqe->user_data;
+    done(ring->slot_index[slot], cqe->res, &ring->bufs[slot], arg);
+    ring->free_slots[ring->n_free++] = slot;
+    head++;
+    n++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+// Takes back the last count requests queued, which the kernel hasn't
+// seen, and frees their slots
+static void unqueue(uring * ring, unsigned count){
+  unsigned tail = *ring->sq_tail;
+
+  while (count-- > 0){
+    tail--;
+    ring->free_slots[ring->n_free++] = ring->sqes[tail & *ring->sq_mask].user_data;
+  }
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+}
+
+// Stats count entries relative to dirfd, keeping up to depth requests
+// in flight. done is called once per entry as results arrive.
+// Returns the number of entries completed, which is less than count
+// only if io_uring stopped working part way.
+int uring_statx(uring * ring, int dirfd, int count, uring_statx_name name, uring_statx_done done, void * arg){
+  int next = 0, completed = 0, ret, n;
+  unsigned inflight = 0, unsubmitted = 0;
+
+  while (completed < count){
+    while (next < count && ring->n_free > 0){
+      queue_statx(ring, dirfd, name(next, arg), next);
+      next++;
+      unsubmitted++;
+    }
+
+    // Only what the kernel took is in flight. After an interrupted
+    // call, the requests it didn't take are offered again.
+    ret = sys_io_uring_enter(ring->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+    if (ret < 0 && errno != EINTR){
+      fprintf(stderr, "io_uring_enter: %s\n", strerror(errno));
+      unqueue(ring, unsubmitted);
+      break;
+    }
+    if (ret > 0){
+      unsubmitted -= ret;
+      inflight += ret;
+    }
+    n = reap(ring, done, arg);
+    inflight -= n;
+    completed += n;
+  }
+
+  // Drain anything still in flight so the slots stay consistent
+  while (inflight > 0){
+    if (sys_io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) break;
+    n = reap(ring, done, arg);
+    inflight -= n;
+    completed += n;
+  }
+  return completed;
+}
+
+// Unmaps and closes the ring
+void uring_destroy(uring * ring){
+  if (ring->sqes) munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_map && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_len);
+  if (ring->sq_map) munmap(ring->sq_map, ring->sq_map_len);
+  if (ring->fd >= 0) close(ring->fd);
+  free(ring->bufs);
+  free(ring->slot_index);
+  free(ring->free_slots);
+  memset(ring, 0, sizeof(uring));
+  ring->fd = -1;
+}
@@ -0,0 +1,44 @@
+// Gopher - Batched statx through io_uring
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <linux/stat.h>
+#include <linux/io_uring.h>
+
+// Called as each statx completes. res is 0 or a negative errno.
+typedef void (*uring_statx_done)(int index, int res, struct statx * stx, void * arg);
+// Returns the name to stat for entry index
+typedef const char * (*uring_statx_name)(int index, void * arg);
+
+typedef struct {
+  int fd;
+  unsigned depth;
+
+  void * sq_map;
+  size_t sq_map_len;
+  void * cq_map;
+  size_t cq_map_len;
+  struct io_uring_sqe * sqes;
+  size_t sqes_len;
+
+  unsigned * sq_head;
+  unsigned * sq_tail;
+  unsigned * sq_mask;
+  unsigned * sq_array;
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned * cq_mask;
+  struct io_uring_cqe * cqes;
+
+  struct statx * bufs;   // one per slot in flight
+  int * slot_index;      // entry each slot is working on
+  int * free_slots;
+  int n_free;
+} uring;
+
+int uring_init(uring * ring, unsigned depth);
+int uring_statx(uring * ring, int dirfd, int count, uring_statx_name name, uring_statx_done done, void * arg);
+void uring_destroy(uring * ring);
+
+#endif
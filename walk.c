@@ -0,0 +1,260 @@
+// Gopher - Parallel tree walks with work stealing
+//
+// The walk behind the parallel delete, directory sizes and content
+// search. Every directory is a task on a worker's deque. A task queues
+// the subdirectories it finds on its own worker, and the walk is over
+// when no task is queued or running anywhere.
+//
+// Directories are opened by path, from the nearest directory above
+// them kept open, and closed as soon as they are read. A deep tree
+// then needs no more fds than there are workers.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "walk.h"
+
+#define IDLE_TICK_NSEC 100000000L    // how often a waiting worker calls idle
+
+static int no_openat2;
+
+void walk_init(walker * w, work_pool * pool, walk_task_func run, walk_idle_func idle, void * arg){
+  int i;
+
+  memset(w, 0, sizeof(walker));
+  w->nqueues = !pool ? 1 : pool->nthreads + 1 < WALK_MAX_WORKERS ? pool->nthreads + 1 : WALK_MAX_WORKERS;
+  for (i = 0; i < w->nqueues; i++){
+    pthread_mutex_init(&w->queues[i].lock, NULL);
+  }
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->wake, NULL);
+  w->run = run;
+  w->idle = idle;
+  w->arg = arg;
+}
+
+// Queues a task on a worker, and wakes a worker waiting for one
+void walk_push(walker * w, int worker, void * task){
+  walk_queue * q = &w->queues[worker];
+
+  // Counted first, so that the walk can't look over while it is queued
+  __atomic_add_fetch(&w->outstanding, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&q->lock);
+  if (q->tail == q->cap){
+    // Slide the live tasks to the start, and grow if that isn't enough
+    memmove(q->tasks, q->tasks + q->head, (q->tail - q->head) * sizeof(void *));
+    q->tail -= q->head;
+    q->head = 0;
+    if (q->tail == q->cap){
+      q->cap = q->cap ? q->cap * 2 : 64;
+      if ((q->tasks = realloc(q->tasks, q->cap * sizeof(void *))) == NULL){
+        perror("realloc");
+        exit(errno);
+      }
+    }
+  }
+  q->tasks[q->tail++] = task;
+  pthread_mutex_unlock(&q->lock);
+
+  __atomic_add_fetch(&w->pushed, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&w->sleepers, __ATOMIC_SEQ_CST)){
+    pthread_mutex_lock(&w->lock);
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+static void * pop_back(walk_queue * q){
+  void * task = NULL;
+  pthread_mutex_lock(&q->lock);
+  if (q->tail > q->head) task = q->tasks[--q->tail];
+  pthread_mutex_unlock(&q->lock);
+  return task;
+}
+
+static void * pop_front(walk_queue * q){
+  void * task = NULL;
+  pthread_mutex_lock(&q->lock);
+  if (q->tail > q->head) task = q->tasks[q->head++];
+  pthread_mutex_unlock(&q->lock);
+  return task;
+}
+
+// Sleeps until a task is queued after the count seen, or the walk is
+// over. With an idle function, wakes up now and then to call it.
+static void wait_for_task(walker * w, int worker, unsigned seen){
+  struct timespec until;
+
+  if (w->idle) w->idle(w, worker);
+  pthread_mutex_lock(&w->lock);
+  __atomic_add_fetch(&w->sleepers, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&w->pushed, __ATOMIC_SEQ_CST) == seen && __atomic_load_n(&w->outstanding, __ATOMIC_ACQUIRE) > 0){
+    if (w->idle){
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += IDLE_TICK_NSEC;
+      if (until.tv_nsec >= 1000000000L){
+	until.tv_sec++;
+	until.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&w->wake, &w->lock, &until);
+    } else {
+      pthread_cond_wait(&w->wake, &w->lock);
+    }
+  }
+  __atomic_sub_fetch(&w->sleepers, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&w->lock);
+}
+
+// Runs tasks, its own or stolen, until none are left anywhere
+static void walk_worker(int begin, int end, void * arg){
+  walker * w = arg;
+  walk_queue * own = &w->queues[begin];
+  unsigned seen;
+  void * task;
+  int i;
+
+  (void) end;
+  while (__atomic_load_n(&w->outstanding, __ATOMIC_ACQUIRE) > 0){
+    seen = __atomic_load_n(&w->pushed, __ATOMIC_SEQ_CST);
+    task = pop_back(own);
+    for (i = 1; !task && i < w->nqueues; i++){
+      task = pop_front(&w->queues[(begin + i) % w->nqueues]);
+    }
+    if (!task){
+      wait_for_task(w, begin, seen);
+      continue;
+    }
+    w->run(w, begin, task);
+    if (__atomic_sub_fetch(&w->outstanding, 1, __ATOMIC_ACQ_REL) == 0){
+      pthread_mutex_lock(&w->lock);
+      pthread_cond_broadcast(&w->wake);
+      pthread_mutex_unlock(&w->lock);
+    }
+  }
+}
+
+// Runs the tasks queued, and all they queue in turn, one worker per
+// queue on the pool. Without a pool, on the calling thread.
+void walk_run(walker * w, work_pool * pool){
+  if (pool){
+    pool_for(pool, w->nqueues, 1, walk_worker, w);
+  } else {
+    walk_worker(0, 1, w);
+  }
+}
+
+void walk_destroy(walker * w){
+  int i;
+  for (i = 0; i < w->nqueues; i++){
+    free(w->queues[i].tasks);
+    pthread_mutex_destroy(&w->queues[i].lock);
+  }
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->wake);
+}
+
+// Opens a directory below dirfd through no symbolic link
+static int open_below(int dirfd, const char * path){
+  struct open_how how;
+  char part[NAME_MAX + 1];
+  const char * slash;
+  int fd, next;
+  long ret;
+
+  if (!no_openat2){
+    memset(&how, 0, sizeof(struct open_how));
+    how.flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    how.resolve = RESOLVE_NO_SYMLINKS;
+    if ((ret = syscall(SYS_openat2, dirfd, path, &how, sizeof(struct open_how))) >= 0 || errno != ENOSYS) return ret;
+    no_openat2 = 1;
+  }
+
+  // Before Linux 5.6, one name at a time
+  fd = dirfd;
+  while (1){
+    slash = strchr(path, '/');
+    snprintf(part, sizeof(part), "%.*s", slash ? (int) (slash - path) : (int) strlen(path), path);
+    next = openat(fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd != dirfd) close(fd);
+    if (next < 0 || !slash) return next;
+    fd = next;
+    path = slash + 1;
+  }
+}
+
+// Opens the directory at path below dirfd, following no symbolic link
+// on the way. A path longer than the kernel takes is opened a piece at
+// a time.
+int walk_open(int dirfd, const char * path){
+  char piece[PATH_MAX];
+  const char * cut;
+  int fd = dirfd, next;
+
+  if (!path[0]) return openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  while (strlen(path) >= PATH_MAX){
+    cut = memrchr(path, '/', PATH_MAX - 1);
+    if (cut == NULL || cut == path){
+      if (fd != dirfd) close(fd);
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    memcpy(piece, path, cut - path);
+    piece[cut - path] = 0;
+    next = open_below(fd, piece);
+    if (fd != dirfd) close(fd);
+    if (next < 0) return -1;
+    fd = next;
+    path = cut + 1;
+  }
+  next = open_below(fd, path);
+  if (fd != dirfd) close(fd);
+  return next;
+}
+
+// Opens a directory of the walk, from the nearest one above it that is
+// kept open. Returns a new fd, -1 with errno set if it can't.
+int walk_dir_open(walk_dir * d){
+  walk_dir * top;
+  size_t len = 0, at;
+  char * path;
+  int fd;
+
+  for (top = d; top && top->fd < 0; top = top->parent){
+    len += strlen(top->name) + 1;
+  }
+  if (!top){
+    errno = EBADF;
+    return -1;
+  }
+  if (top == d) return walk_open(d->fd, "");
+
+  if ((path = malloc(len)) == NULL){
+    perror("malloc");
+    exit(errno);
+  }
+  at = len - 1;
+  path[at] = 0;
+  for (; d != top; d = d->parent){
+    at -= strlen(d->name);
+    memcpy(path + at, d->name, strlen(d->name));
+    if (at) path[--at] = '/';
+  }
+  fd = walk_open(top->fd, path);
+  free(path);
+  return fd;
+}
+
+// Counts one thing of a directory as done: its reading or one of its
+// subdirectories. Returns 1 when that was the last.
+int walk_dir_done(walk_dir * d){
+  return __atomic_sub_fetch(&d->pending, 1, __ATOMIC_ACQ_REL) == 0;
+}
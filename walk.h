@@ -0,0 +1,62 @@
+// Gopher - Parallel tree walks with work stealing
+#ifndef WALK_H
+#define WALK_H
+
+#include <pthread.h>
+
+#include "pool.h"
+
+#define WALK_MAX_WORKERS 64
+
+typedef struct walker walker;
+
+// Runs one task on a worker. New tasks go to the same worker.
+typedef void (*walk_task_func)(walker * w, int worker, void * task);
+// Called now and then by a worker waiting for tasks
+typedef void (*walk_idle_func)(walker * w, int worker);
+
+// Tasks of one worker. The owner works at the back, thieves at the front.
+typedef struct {
+  pthread_mutex_t lock;
+  void ** tasks;
+  int head;
+  int tail;
+  int cap;
+} walk_queue;
+
+// Workers take their newest task first, which keeps the walk depth
+// first, and steal the oldest task of another worker when they run
+// dry. One with nothing to steal sleeps until a task is queued.
+struct walker {
+  walk_queue queues[WALK_MAX_WORKERS];
+  int nqueues;
+  int outstanding;        // tasks queued or running
+  unsigned pushed;        // counts tasks queued, to miss no wakeup
+  int sleepers;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  walk_task_func run;
+  walk_idle_func idle;    // may be NULL
+  void * arg;             // for run and idle
+};
+
+// A directory of a walk, put first in the walker's own node. Its path
+// is its names up to the nearest directory kept open, so a directory
+// needs an fd only while it is read.
+typedef struct walk_dir {
+  struct walk_dir * parent;
+  int fd;                 // open on a top directory, -1 below one
+  int pending;            // subdirectories left, plus one while reading
+  const char * name;      // in the parent
+} walk_dir;
+
+void walk_init(walker * w, work_pool * pool, walk_task_func run, walk_idle_func idle, void * arg);
+void walk_push(walker * w, int worker, void * task);
+void walk_run(walker * w, work_pool * pool);
+void walk_destroy(walker * w);
+
+int walk_open(int dirfd, const char * path);
+int walk_dir_open(walk_dir * d);
+int walk_dir_done(walk_dir * d);
+
+#endif
@@ -0,0 +1,65 @@
+// Gopher - inotify watch on the current directory
+//
+// One watch at a time. Moving it to another directory drops the old
+// one, and events still queued for the old directory are skipped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/inotify.h>
+
+#include "watch.h"
+
+#define WATCH_BUFLEN (64 * 1024)
+
+// Returns -1 if inotify is unavailable. The watch is then a no-op.
+int watch_init(dir_watch * watch){
+  watch->wd = -1;
+  watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  return watch->fd < 0 ? -1 : 0;
+}
+
+// Watches path instead of the previous directory
+int watch_dir(dir_watch * watch, const char * path){
+  if (watch->fd < 0) return -1;
+  if (watch->wd >= 0) inotify_rm_watch(watch->fd, watch->wd);
+  watch->wd = inotify_add_watch(watch->fd, path, WATCH_EVENTS | IN_ONLYDIR);
+  if (watch->wd < 0) fprintf(stderr, "inotify_add_watch: %s\n", strerror(errno));
+  return watch->wd < 0 ? -1 : 0;
+}
+
+// Passes every queued event of the current watch to func without
+// blocking. IN_Q_OVERFLOW is passed on too. Returns the number of
+// events handed over.
+int watch_read(dir_watch * watch, watch_func func, void * arg){
+  char buf[WATCH_BUFLEN] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event * ev;
+  ssize_t len;
+  char * ptr;
+  int count = 0;
+
+  if (watch->fd < 0) return 0;
+  while ((len = read(watch->fd, buf, WATCH_BUFLEN)) > 0){
+    for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ev->len){
+      ev = (struct inotify_event *) ptr;
+      if (ev->mask & IN_Q_OVERFLOW){
+        func(IN_Q_OVERFLOW, "", arg);
+      } else if (ev->wd == watch->wd && watch->wd >= 0){
+        if (ev->mask & IN_IGNORED) watch->wd = -1;
+        func(ev->mask, ev->len ? ev->name : "", arg);
+      } else {
+        continue;
+      }
+      count++;
+    }
+  }
+  return count;
+}
+
+void watch_destroy(dir_watch * watch){
+  if (watch->fd >= 0) close(watch->fd);
+  watch->fd = -1;
+  watch->wd = -1;
+}
@@ -0,0 +1,23 @@
+// Gopher - inotify watch on the current directory
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <sys/inotify.h>
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | \
+		      IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Called for each event. name is empty for events on the directory itself.
+typedef void (*watch_func)(unsigned mask, const char * name, void * arg);
+
+typedef struct {
+  int fd;       // inotify instance, -1 if unavailable
+  int wd;       // watch on the current directory, -1 if none
+} dir_watch;
+
+int watch_init(dir_watch * watch);
+int watch_dir(dir_watch * watch, const char * path);
+int watch_read(dir_watch * watch, watch_func func, void * arg);
+void watch_destroy(dir_watch * watch);
+
+#endif